@@ -0,0 +1,138 @@
+// Headless benchmark for the CPU fountain particles. This needs no GPU or
+// OpenGL: it spawns the particles, runs the parallel update and reports the
+// update rate, the memory bandwidth and the respawns per step.
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include "particles.hxx"
+
+struct options_t {
+  int num_particles = 10000000;
+  int steps = 100;
+  int num_threads = std::thread::hardware_concurrency();
+  float dt = 1.f / 60;
+  uint64_t seed = 0;
+
+  // Also write the interleaved positions, as geom does for its VBO.
+  bool vertices = true;
+};
+
+inline void print_usage() {
+  printf(
+    "usage: geom-bench [options]\n"
+    "  -n, --particles N  number of particles (10000000)\n"
+    "  -s, --steps N      number of updates (100)\n"
+    "  -j, --threads N    worker threads (all cores)\n"
+    "  --dt DT            time step (1/60)\n"
+    "  --seed N           Philox key (0)\n"
+    "  --vertices 0|1     write interleaved positions each update (1)\n"
+  );
+}
+
+// Return 0 to run, 1 on error, and -1 to exit cleanly.
+inline int parse_options(int argc, char** argv, options_t& options) {
+  for(int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    auto is = [&](const char* a, const char* b = nullptr) {
+      return !strcmp(arg, a) || (b && !strcmp(arg, b));
+    };
+
+    if(is("-h", "--help")) {
+      print_usage();
+      return -1;
+    }
+
+    if(i + 1 == argc) {
+      fprintf(stderr, "missing value for %s\n", arg);
+      return 1;
+    }
+    const char* value = argv[++i];
+
+    if(is("-n", "--particles"))
+      options.num_particles = atoi(value);
+    else if(is("-s", "--steps"))
+      options.steps = atoi(value);
+    else if(is("-j", "--threads"))
+      options.num_threads = atoi(value);
+    else if(is("--dt"))
+      options.dt = atof(value);
+    else if(is("--seed"))
+      options.seed = strtoull(value, nullptr, 0);
+    else if(is("--vertices"))
+      options.vertices = atoi(value);
+    else {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return 1;
+    }
+  }
+
+  if(options.num_particles <= 0 || options.steps <= 0 ||
+    options.num_threads <= 0) {
+    fprintf(stderr, "invalid particles, steps or threads\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  options_t options;
+  if(int result = parse_options(argc, argv, options)) {
+    if(result > 0)
+      print_usage();
+    return std::max(result, 0);
+  }
+
+  block_pool_t pool(options.num_threads);
+  particles_t particles(options.seed);
+
+  std::vector<vec3> vertices;
+  if(options.vertices)
+    vertices.resize(options.num_particles);
+
+  // Emit the particles over one lifetime in coarse steps, as geom emits
+  // them over time, so the timed steps respawn at the steady-state rate.
+  float v = particles.speed, g = particles.gravity;
+  float lifetime = (v + sqrt(v * v + 2 * g *
+    (particles.origin.y - particles.floor_height))) / g;
+
+  const int warmup = 64;
+  double spawn_seconds = 0;
+  for(int step = 1; step <= warmup; ++step) {
+    auto t0 = std::chrono::high_resolution_clock::now();
+    particles.resize(pool, (int64_t)options.num_particles * step / warmup);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    spawn_seconds += std::chrono::duration<double>(t1 - t0).count();
+
+    particles.update(pool, lifetime / warmup);
+  }
+
+  int64_t respawned = 0;
+  auto t2 = std::chrono::high_resolution_clock::now();
+  for(int step = 0; step < options.steps; ++step) {
+    particles.update(pool, options.dt,
+      options.vertices ? vertices.data() : nullptr);
+    respawned += particles.respawned;
+  }
+  auto t3 = std::chrono::high_resolution_clock::now();
+
+  double seconds = std::chrono::duration<double>(t3 - t2).count();
+  double updates = (double)options.num_particles * options.steps;
+
+  // Each update reads and writes six floats, and writes a vec3 vertex.
+  double bytes = updates * (2 * 6 * sizeof(float) +
+    (options.vertices ? sizeof(vec3) : 0));
+
+  printf("%d particles on %d threads\n", options.num_particles,
+    options.num_threads);
+  printf("  spawn     %9.3f ms\n", 1000 * spawn_seconds);
+  printf("  update    %9.3f ms/step  %.1f Mparticles/s  %.1f GB/s\n",
+    1000 * seconds / options.steps, updates / seconds / 1.0e6,
+    bytes / seconds / 1.0e9);
+  printf("  respawned %.0f/step (%.3f%%)\n", (double)respawned / options.steps,
+    100.0 * respawned / updates);
+
+  return 0;
+}
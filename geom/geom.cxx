@@ -6,6 +6,7 @@
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "texture.hxx"
+#include "particles.hxx"
 #include <random>
 
 enum typename vattrib_t {
@@ -92,70 +93,8 @@ void frag_main() {
 ////////////////////////////////////////////////////////////////////////////////
 // Host code.
 
-std::random_device rd;
-std::mt19937 mt19937(rd());
-
-vec3 new_random_vel(float speed, float angle) {
-  std::uniform_real_distribution<float> dist(0, 1);
-  float theta = dist(mt19937) * (2 * M_PI);
-  float phi = dist(mt19937) * angle;
-
-  float x = speed * sin(phi) * cos(theta);
-  float y = speed * cos(phi);
-  float z = speed * sin(phi) * sin(theta);
-
-  return vec3(x, y, z);
-}
-
-struct particles_t {
-  std::vector<vec3> positions;
-  std::vector<vec3> velocities;
-
-  float speed = 4;
-  float angle = radians(30.f);
-  float gravity = 1.f;
-
-  void init_particle(size_t index) noexcept;
-  void update(size_t index, float elapsed) noexcept;
-  void push_particle();
-
-  size_t num_particles() const noexcept {
-    return positions.size();
-  }
-
-  void reset();
-};
-
-void particles_t::init_particle(size_t index) noexcept {
-  positions[index] = vec3(0, -5, 0);
-  velocities[index] = new_random_vel(speed, angle);
-}
-
-void particles_t::update(size_t index, float elapsed) noexcept {
-  vec3& pos = positions[index];
-  vec3& vel = velocities[index];
-
-  if(pos.y < -10)
-    init_particle(index);
-
-  vel.y -= gravity * elapsed;
-  pos += elapsed * vel;
-}
-
-void particles_t::push_particle() {
-  size_t index = num_particles();
-  positions.push_back(vec3(0, 0, 0));
-  velocities.push_back(vec3(0, 0, 0));
-  init_particle(index);
-}
-
-void particles_t::reset() {
-  positions.clear();
-  velocities.clear();
-}
-
 struct myapp_t : app_t {
-  myapp_t();
+  myapp_t(int max_particles);
   void display() override;
   void key_callback(int key, int scancode, int action, int mods) override;
 
@@ -164,13 +103,17 @@ struct myapp_t : app_t {
   GLuint vbo;       // Update with new positions each frame.
   GLuint vao;       // A buffer of positions only.
 
+  block_pool_t pool;
   particles_t particles;
-  size_t max_particles = 500;
+  int max_particles;
   double start_time = 0;
   double prev_time = 0;
 };
 
-myapp_t::myapp_t() : app_t("Geometry shader demo") {
+myapp_t::myapp_t(int max_particles) : app_t("Geometry shader demo"),
+  pool(std::thread::hardware_concurrency()),
+  particles(std::random_device()()), max_particles(max_particles) {
+
   camera.distance = 4;
   camera.yaw = radians(125.f);
   camera.pitch = radians(25.f);
@@ -179,8 +122,9 @@ myapp_t::myapp_t() : app_t("Geometry shader demo") {
 
   // Create a VBO.
   glCreateBuffers(1, &vbo);
-  glNamedBufferStorage(vbo, max_particles * sizeof(vec3), nullptr, 
-    GL_DYNAMIC_STORAGE_BIT);
+  glNamedBufferStorage(vbo, max_particles * sizeof(vec3), nullptr,
+    GL_MAP_WRITE_BIT);
+  particles.reserve(max_particles);
 
   // Create a VAO.
   glCreateVertexArrays(1, &vao);
@@ -218,27 +162,27 @@ void myapp_t::display() {
   glClearBufferfv(GL_COLOR, 0, bg);
   glClear(GL_DEPTH_BUFFER_BIT);
 
-  // Add 10 particles per second until we hit max_particles.
+  // Fill up to max_particles over 50 seconds.
   double cur_time = glfwGetTime() - start_time;
-  size_t num_particles = std::min(max_particles, (size_t)(10 * cur_time));
+  int num_particles = std::min<double>(max_particles,
+    std::max(10, max_particles / 50) * cur_time);
 
-  float elapsed = cur_time - prev_time;
-  for(size_t i = 0; i < particles.num_particles(); ++i) {
-    // Integrate all existing particles.
-    particles.update(i, elapsed);
-  }
+  // Inject new particles.
+  if(num_particles > particles.num_particles())
+    particles.resize(pool, num_particles);
 
-  for(size_t i = particles.num_particles(); i < num_particles; ++i) {
-    // Inject new particles.
-    particles.push_particle();
+  // Integrate all particles straight into the VBO.
+  float elapsed = cur_time - prev_time;
+  if(num_particles) {
+    vec3* out = (vec3*)glMapNamedBufferRange(vbo, 0,
+      num_particles * sizeof(vec3),
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    particles.update(pool, elapsed, out);
+    glUnmapNamedBuffer(vbo);
   }
 
   prev_time = cur_time;
 
-  // Update the VBO with all particle positions.
-  glNamedBufferSubData(vbo, 0, num_particles * sizeof(vec3),
-    particles.positions.data());
-
   // Setup the device.
   glUseProgram(program);
 
@@ -269,13 +213,21 @@ void myapp_t::key_callback(int key, int scancode, int action, int mods) {
   if(GLFW_PRESS == action && GLFW_KEY_SPACE == key) {
     particles.reset();
     start_time = glfwGetTime();
+    prev_time = 0;
   }
 }
 
-int main() {
+int main(int argc, char** argv) {
+  // The particle count may be given on the command line.
+  int max_particles = argc > 1 ? atoi(argv[1]) : 500;
+  if(max_particles <= 0) {
+    fprintf(stderr, "usage: geom [max particles]\n");
+    return 1;
+  }
+
   glfwInit();
   gl3wInit();
-  myapp_t myapp;
+  myapp_t myapp(max_particles);
   myapp.loop();
 
   return 0;
@@ -0,0 +1,181 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+#include "parallel.hxx"
+#include "aligned.hxx"
+
+////////////////////////////////////////////////////////////////////////////////
+// Fountain particles on the CPU.
+//
+// The particles are stored as structure-of-arrays floats and updated in
+// parallel ranges. Each range runs three loops:
+//  1. Integrate every particle. This loop has no branches, so it vectorizes.
+//  2. Compact the indices of the particles that fell through the floor.
+//  3. Respawn the compacted particles at the fountain.
+// The range is still in cache for the second and third loops, and the cost
+// of the trig in the respawn is only paid by the particles that need it.
+//
+// Random numbers come from Philox4x32-10 (Salmon et al., "Parallel random
+// numbers: as easy as 1, 2, 3"). It is a pure function of a counter and a
+// key, so a respawn draws from the counter (index, generation) with no
+// generator state shared between threads, and the results don't depend on
+// the thread count.
+
+// Philox4x32-10. Scrambles the counter in place.
+inline void philox4x32(uint32_t (&counter)[4], uint32_t key0,
+  uint32_t key1) {
+
+  for(int round = 0; round < 10; ++round) {
+    uint64_t p0 = 0xd2511f53ull * counter[0];
+    uint64_t p1 = 0xcd9e8d57ull * counter[2];
+    uint32_t c0 = (uint32_t)(p1>> 32) ^ counter[1] ^ key0;
+    uint32_t c2 = (uint32_t)(p0>> 32) ^ counter[3] ^ key1;
+    counter[0] = c0;
+    counter[1] = (uint32_t)p1;
+    counter[2] = c2;
+    counter[3] = (uint32_t)p0;
+
+    key0 += 0x9e3779b9;
+    key1 += 0xbb67ae85;
+  }
+}
+
+// Map the top 24 bits to [0, 1).
+inline float philox_float(uint32_t x) {
+  return (x>> 8) * (1.f / 16777216);
+}
+
+struct particles_t {
+  particles_t(uint64_t seed = 0) : seed(seed) { }
+
+  // Grow or shrink to count particles. New particles spawn at the fountain.
+  void resize(block_pool_t& pool, int count);
+  void reserve(int count);
+  void reset() { resize_arrays(0); }
+
+  // Advance every particle by elapsed and respawn the ones below the floor.
+  // When out is set, the positions are also written there interleaved, for
+  // a vertex buffer.
+  void update(block_pool_t& pool, float elapsed, vec3* out = nullptr);
+
+  int num_particles() const { return (int)x.size(); }
+
+  float speed = 4;
+  float angle = radians(30.f);
+  float gravity = 1.f;
+  float floor_height = -10;
+  vec3 origin = vec3(0, -5, 0);
+  uint64_t seed;
+
+  aligned_vector_t<float> x, y, z;
+  aligned_vector_t<float> vx, vy, vz;
+
+  // Particles respawned by the last update.
+  int64_t respawned = 0;
+
+private:
+  enum { grain = 16384 };
+
+  void resize_arrays(int count);
+  void spawn(int index, vec3* out);
+
+  // Counts the updates, so each one draws from new counters.
+  uint64_t generation = 0;
+
+  // Each range compacts its dead particles into its own span.
+  std::vector<int> dead;
+  std::vector<int> dead_counts;
+};
+
+inline void particles_t::resize_arrays(int count) {
+  for(aligned_vector_t<float>* v : { &x, &y, &z, &vx, &vy, &vz })
+    v->resize(count);
+  dead.resize(count);
+}
+
+inline void particles_t::reserve(int count) {
+  for(aligned_vector_t<float>* v : { &x, &y, &z, &vx, &vy, &vz })
+    v->reserve(count);
+  dead.reserve(count);
+}
+
+inline void particles_t::spawn(int index, vec3* out) {
+  uint32_t counter[4] {
+    (uint32_t)index, (uint32_t)generation, (uint32_t)(generation>> 32), 0
+  };
+  philox4x32(counter, (uint32_t)seed, (uint32_t)(seed>> 32));
+
+  float theta = philox_float(counter[0]) * (2 * (float)M_PI);
+  float phi = philox_float(counter[1]) * angle;
+
+  x[index] = origin.x;
+  y[index] = origin.y;
+  z[index] = origin.z;
+  vx[index] = speed * sin(phi) * cos(theta);
+  vy[index] = speed * cos(phi);
+  vz[index] = speed * sin(phi) * sin(theta);
+
+  if(out)
+    out[index] = origin;
+}
+
+inline void particles_t::resize(block_pool_t& pool, int count) {
+  int old_count = num_particles();
+  resize_arrays(count);
+  if(count <= old_count)
+    return;
+
+  // Spawn the new particles in bulk.
+  ++generation;
+  for_each_range(pool, [&](int item, int begin, int end) {
+    for(int i = begin; i < end; ++i)
+      spawn(old_count + i, nullptr);
+  }, count - old_count, grain);
+}
+
+inline void particles_t::update(block_pool_t& pool, float elapsed,
+  vec3* out) {
+
+  ++generation;
+  int count = num_particles();
+  int num_items = (count + grain - 1) / grain;
+  dead_counts.resize(num_items);
+
+  for_each_range(pool, [&](int item, int begin, int end) {
+    float* x2 = x.data();
+    float* y2 = y.data();
+    float* z2 = z.data();
+    float* vx2 = vx.data();
+    float* vy2 = vy.data();
+    float* vz2 = vz.data();
+
+    for(int i = begin; i < end; ++i) {
+      vy2[i] -= gravity * elapsed;
+      x2[i] += elapsed * vx2[i];
+      y2[i] += elapsed * vy2[i];
+      z2[i] += elapsed * vz2[i];
+    }
+
+    if(out) {
+      for(int i = begin; i < end; ++i)
+        out[i] = vec3(x2[i], y2[i], z2[i]);
+    }
+
+    // Compact without a branch: always store the index, and only advance
+    // past it when the particle is dead.
+    int* dead2 = dead.data() + begin;
+    int num_dead = 0;
+    for(int i = begin; i < end; ++i) {
+      dead2[num_dead] = i;
+      num_dead += y2[i] < floor_height;
+    }
+
+    for(int k = 0; k < num_dead; ++k)
+      spawn(dead2[k], out);
+    dead_counts[item] = num_dead;
+  }, count, grain);
+
+  respawned = 0;
+  for(int num_dead : dead_counts)
+    respawned += num_dead;
+}
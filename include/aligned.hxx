@@ -0,0 +1,38 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// An allocator for vectors that start on a cache line, so SIMD loops can
+// use aligned loads.
+template<typename type_t, size_t align = 64>
+struct aligned_allocator_t {
+  typedef type_t value_type;
+
+  template<typename type2_t>
+  struct rebind { typedef aligned_allocator_t<type2_t, align> other; };
+
+  aligned_allocator_t() = default;
+  template<typename type2_t>
+  aligned_allocator_t(const aligned_allocator_t<type2_t, align>&) { }
+
+  type_t* allocate(size_t count) {
+    return (type_t*)::operator new(sizeof(type_t) * count,
+      std::align_val_t(align));
+  }
+  void deallocate(type_t* p, size_t count) {
+    ::operator delete(p, std::align_val_t(align));
+  }
+
+  template<typename type2_t>
+  bool operator==(const aligned_allocator_t<type2_t, align>&) const {
+    return true;
+  }
+  template<typename type2_t>
+  bool operator!=(const aligned_allocator_t<type2_t, align>&) const {
+    return false;
+  }
+};
+
+template<typename type_t>
+using aligned_vector_t = std::vector<type_t, aligned_allocator_t<type_t>>;
@@ -0,0 +1,260 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <cassert>
+
+// A persistent pool of worker threads that execute adam7 block work items.
+// The threads are created once and sleep between jobs, so restarting a frame
+// after a setting changes doesn't pay for thread creation and destruction.
+//
+// Each worker owns a deque of (level, block) items. A worker pops from the
+// front of its own deque. When it runs dry it steals from the back of the
+// other workers' deques, so that expensive regions of the image get more
+// than one core working on them.
+//
+// The deques only hold one level at a time. The next level is queued once
+// every item of the current level has finished, so a block's levels never
+// run out of order or concurrently. Level 0 writes the whole block, and
+// would otherwise wipe out pixels a thief already refined.
+struct block_pool_t {
+  struct item_t {
+    int level;
+    int block;
+  };
+
+  // Return false to cancel the job.
+  typedef std::function<bool(int tid, int level, int block)> func_t;
+
+  block_pool_t(int num_threads);
+  ~block_pool_t();
+
+  int num_threads() const { return (int)threads.size(); }
+
+  // Start a job. Block i in the list is initially assigned to worker
+  // i * num_threads / num_blocks, so each worker starts on a contiguous run
+  // of the list. Every block runs at level 0, then every block at level 1,
+  // and so on.
+  void execute(const std::vector<int>& blocks, int num_levels, func_t func);
+
+  // Stop handing out items. Each worker finishes the item it's currently on.
+  void cancel();
+
+  // Block until all workers are idle.
+  void wait();
+
+  bool is_complete() const { return !running; }
+
+private:
+  struct alignas(64) queue_t {
+    std::mutex mutex;
+    std::deque<item_t> items;
+  };
+
+  void fill(int level);
+  void next_level();
+  bool pop(int tid, item_t& item);
+  bool steal(int tid, item_t& item);
+  void thread_execute(int tid);
+  static void thread_entry(block_pool_t* pool, int tid);
+
+  std::vector<std::thread> threads;
+  std::unique_ptr<queue_t[]> queues;
+
+  std::mutex mutex;
+  std::condition_variable cv_start;
+  std::condition_variable cv_done;
+  std::condition_variable cv_level;
+  int generation = 0;
+  bool quit = false;
+
+  func_t func;
+  std::vector<int> blocks;
+  int num_levels = 0;
+
+  // The level in the deques. It's only advanced under mutex.
+  std::atomic<int> level;
+
+  // Items of the current level that haven't finished.
+  std::atomic<int> remaining;
+
+  std::atomic<int> running;
+  std::atomic<bool> canceled;
+};
+
+inline block_pool_t::block_pool_t(int num_threads) {
+  level = 0;
+  remaining = 0;
+  running = 0;
+  canceled = false;
+  queues = std::make_unique<queue_t[]>(num_threads);
+
+  threads.resize(num_threads);
+  for(int tid = 0; tid < num_threads; ++tid)
+    threads[tid] = std::thread(thread_entry, this, tid);
+}
+
+inline block_pool_t::~block_pool_t() {
+  cancel();
+  wait();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  cv_start.notify_all();
+
+  for(std::thread& t : threads)
+    t.join();
+}
+
+inline void block_pool_t::execute(const std::vector<int>& blocks2,
+  int num_levels2, func_t func2) {
+
+  // Finish any job in flight before replacing the work items.
+  wait();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    func = std::move(func2);
+    blocks = blocks2;
+    num_levels = blocks.size() ? num_levels2 : 0;
+    level = 0;
+    remaining = blocks.size();
+    fill(0);
+
+    canceled = false;
+    running = threads.size();
+    ++generation;
+  }
+  cv_start.notify_all();
+}
+
+inline void block_pool_t::cancel() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    canceled = true;
+  }
+  cv_level.notify_all();
+}
+
+// Deal the blocks out at one level. Called with mutex held.
+inline void block_pool_t::fill(int level2) {
+  int num_threads = threads.size();
+  int num_blocks = blocks.size();
+  for(int tid = 0; tid < num_threads; ++tid) {
+    int begin = (int64_t)num_blocks * tid / num_threads;
+    int end = (int64_t)num_blocks * (tid + 1) / num_threads;
+
+    std::lock_guard<std::mutex> lock(queues[tid].mutex);
+    std::deque<item_t>& items = queues[tid].items;
+    items.clear();
+    for(int i = begin; i < end; ++i)
+      items.push_back({ level2, blocks[i] });
+  }
+}
+
+// Called by the worker that finishes the last item of a level.
+inline void block_pool_t::next_level() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(canceled)
+      return;
+
+    if(level + 1 < num_levels) {
+      remaining = blocks.size();
+      fill(level + 1);
+    }
+    ++level;
+  }
+  cv_level.notify_all();
+}
+
+inline void block_pool_t::wait() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv_done.wait(lock, [&] { return !running; });
+}
+
+inline bool block_pool_t::pop(int tid, item_t& item) {
+  queue_t& q = queues[tid];
+  std::lock_guard<std::mutex> lock(q.mutex);
+  if(q.items.empty())
+    return false;
+
+  item = q.items.front();
+  q.items.pop_front();
+  return true;
+}
+
+inline bool block_pool_t::steal(int tid, item_t& item) {
+  // Visit the other workers round-robin, starting with our neighbor, so that
+  // the thieves spread out over the victims.
+  int num_threads = threads.size();
+  for(int i = 1; i < num_threads; ++i) {
+    queue_t& q = queues[(tid + i) % num_threads];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if(q.items.size()) {
+      item = q.items.back();
+      q.items.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+inline void block_pool_t::thread_execute(int tid) {
+  int seen = 0;
+  while(true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv_start.wait(lock, [&] { return quit || generation != seen; });
+      if(quit)
+        break;
+      seen = generation;
+    }
+
+    // Check the cancel flag between every item. An item is one 8x8 block at
+    // one level, so a cancel takes effect within one block.
+    while(!canceled) {
+      // Read the level before looking for items, so a level that's queued
+      // after we find the deques empty still wakes us.
+      int current = level;
+      if(current >= num_levels)
+        break;
+
+      item_t item;
+      if(pop(tid, item) || steal(tid, item)) {
+        if(!func(tid, item.level, item.block))
+          cancel();
+        else if(!--remaining)
+          next_level();
+
+      } else {
+        // The rest of this level is running on other workers.
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_level.wait(lock, [&] { return canceled || current != level; });
+      }
+    }
+
+    if(canceled) {
+      // Discard our remaining items.
+      std::lock_guard<std::mutex> lock(queues[tid].mutex);
+      queues[tid].items.clear();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(!--running)
+        cv_done.notify_all();
+    }
+  }
+}
+
+inline void block_pool_t::thread_entry(block_pool_t* pool, int tid) {
+  pool->thread_execute(tid);
+}
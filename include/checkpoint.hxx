@@ -0,0 +1,414 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+////////////////////////////////////////////////////////////////////////////////
+// Simulation checkpoints.
+//
+// A checkpoint file is a fixed header, the simulation parameters as raw
+// bytes, then the positions and velocities as vec4 arrays. Each section
+// starts on a 64-byte boundary, so a mapped file can be uploaded or handed
+// to the CPU solvers without another copy. The parameters are stored with
+// their size and restore refuses a mismatch, so bump checkpoint_version
+// when a params struct changes layout without changing size.
+//
+// checkpoint_writer_t writes on a background thread and owns two buffers.
+// The simulation fills one while the thread writes the other, so the step
+// loop only pays for the copy. If both are still in flight the checkpoint
+// is dropped rather than stalling the loop.
+
+enum class checkpoint_format_t {
+  checkpoint,
+  tipsy,
+};
+
+enum {
+  checkpoint_version = 1,
+  checkpoint_align = 64,
+};
+
+struct checkpoint_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t params_size;
+
+  int64_t step;
+  double time;
+  int64_t count;
+
+  // Byte offsets of each section and the total file size.
+  uint64_t params_offset;
+  uint64_t pos_offset;
+  uint64_t vel_offset;
+  uint64_t size;
+};
+
+const char checkpoint_magic[8] { 'C', 'K', 'P', 'T', 'v', 'e', 'c', '4' };
+
+// The state of a simulation at one step.
+struct checkpoint_t {
+  template<typename params_t>
+  void set_params(const params_t& params2) {
+    params.resize(sizeof(params_t));
+    memcpy(params.data(), &params2, sizeof(params_t));
+  }
+
+  void resize(int count) {
+    positions.resize(count);
+    velocities.resize(count);
+  }
+
+  int64_t step = 0;
+  double time = 0;
+  std::vector<char> params;
+  std::vector<vec4> positions;
+  std::vector<vec4> velocities;
+};
+
+inline uint64_t checkpoint_round_up(uint64_t x) {
+  return (x + checkpoint_align - 1) & ~(uint64_t)(checkpoint_align - 1);
+}
+
+// Write to a temporary file and rename it over path, so an interrupted
+// write never replaces the previous checkpoint.
+template<typename func_t>
+bool write_checkpoint_file(const char* path, func_t func) {
+  std::string temp = std::string(path) + ".tmp";
+  FILE* f = fopen(temp.c_str(), "wb");
+  if(!f) {
+    fprintf(stderr, "cannot open file %s\n", temp.c_str());
+    return false;
+  }
+
+  bool okay = func(f);
+  okay &= !fclose(f);
+  if(okay)
+    okay = !rename(temp.c_str(), path);
+
+  if(!okay) {
+    fprintf(stderr, "cannot write file %s\n", path);
+    remove(temp.c_str());
+  }
+  return okay;
+}
+
+inline bool write_checkpoint(const char* path,
+  const checkpoint_t& checkpoint) {
+
+  int64_t count = checkpoint.positions.size();
+  checkpoint_header_t header { };
+  memcpy(header.magic, checkpoint_magic, 8);
+  header.version = checkpoint_version;
+  header.params_size = checkpoint.params.size();
+  header.step = checkpoint.step;
+  header.time = checkpoint.time;
+  header.count = count;
+  header.params_offset = checkpoint_round_up(sizeof(checkpoint_header_t));
+  header.pos_offset = checkpoint_round_up(header.params_offset +
+    header.params_size);
+  header.vel_offset = checkpoint_round_up(header.pos_offset +
+    sizeof(vec4) * count);
+  header.size = header.vel_offset + sizeof(vec4) * count;
+
+  return write_checkpoint_file(path, [&](FILE* f) {
+    // Zero-fill up to each section.
+    auto section = [&](uint64_t offset, const void* data, size_t size) {
+      char zeros[checkpoint_align] { };
+      size_t pad = offset - ftell(f);
+      return pad == fwrite(zeros, 1, pad, f) &&
+        size == fwrite(data, 1, size, f);
+    };
+
+    return section(0, &header, sizeof(header)) &&
+      section(header.params_offset, checkpoint.params.data(),
+        header.params_size) &&
+      section(header.pos_offset, checkpoint.positions.data(),
+        sizeof(vec4) * count) &&
+      section(header.vel_offset, checkpoint.velocities.data(),
+        sizeof(vec4) * count);
+  });
+}
+
+// Write the bodies as tipsy dark matter particles, in the native-endian
+// layout read_tipsy_file reads. pos.w is the mass, vel.w the softening and
+// the index is stored as the id.
+inline bool write_tipsy(const char* path, const checkpoint_t& checkpoint) {
+  struct header_t {
+    double time;
+    int nbodies, ndim, nsph, ndark, nstar, pad;
+  };
+  struct dark_t {
+    float mass, pos[3], vel[3], eps;
+    int id;
+  };
+  static_assert(32 == sizeof(header_t) && 36 == sizeof(dark_t));
+
+  int count = checkpoint.positions.size();
+  return write_checkpoint_file(path, [&](FILE* f) {
+    header_t header { checkpoint.time, count, 3, 0, count, 0, 0 };
+    if(1 != fwrite(&header, sizeof(header), 1, f))
+      return false;
+
+    // Convert through a small buffer to keep the writes large.
+    dark_t records[1024];
+    for(int i = 0; i < count; i += 1024) {
+      int n = std::min(1024, count - i);
+      for(int j = 0; j < n; ++j) {
+        vec4 pos = checkpoint.positions[i + j];
+        vec4 vel = checkpoint.velocities[i + j];
+        records[j] = { pos.w, pos.x, pos.y, pos.z, vel.x, vel.y, vel.z,
+          vel.w, i + j };
+      }
+      if(n != fwrite(records, sizeof(dark_t), n, f))
+        return false;
+    }
+    return true;
+  });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct checkpoint_writer_t {
+  checkpoint_writer_t();
+  ~checkpoint_writer_t();
+
+  // Return a buffer to fill, or null if both buffers are still in flight.
+  checkpoint_t* acquire();
+
+  // Queue the buffer from acquire to be written to path.
+  void submit(checkpoint_t* checkpoint, std::string path,
+    checkpoint_format_t format);
+
+  // Block until every queued checkpoint is written.
+  void wait();
+
+  // Statistics for the UI.
+  std::atomic<int> written { 0 };
+  std::atomic<int> dropped { 0 };
+  std::atomic<int> failed { 0 };
+  std::atomic<double> last_seconds { 0 };
+
+private:
+  enum state_t {
+    state_free,
+    state_filling,
+    state_queued,
+  };
+
+  struct slot_t {
+    checkpoint_t checkpoint;
+    std::string path;
+    checkpoint_format_t format;
+    state_t state = state_free;
+  };
+
+  void thread_execute();
+
+  slot_t slots[2];
+  std::deque<int> queue;
+  std::mutex mutex;
+  std::condition_variable cv_queue;
+  std::condition_variable cv_done;
+  bool quit = false;
+  std::thread thread;
+};
+
+inline checkpoint_writer_t::checkpoint_writer_t() {
+  thread = std::thread([this] { thread_execute(); });
+}
+
+inline checkpoint_writer_t::~checkpoint_writer_t() {
+  wait();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  cv_queue.notify_one();
+  thread.join();
+}
+
+inline checkpoint_t* checkpoint_writer_t::acquire() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for(slot_t& slot : slots) {
+    if(state_free == slot.state) {
+      slot.state = state_filling;
+      return &slot.checkpoint;
+    }
+  }
+
+  ++dropped;
+  return nullptr;
+}
+
+inline void checkpoint_writer_t::submit(checkpoint_t* checkpoint,
+  std::string path, checkpoint_format_t format) {
+
+  int index = checkpoint == &slots[0].checkpoint ? 0 : 1;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    slot_t& slot = slots[index];
+    assert(state_filling == slot.state);
+    slot.path = std::move(path);
+    slot.format = format;
+    slot.state = state_queued;
+    queue.push_back(index);
+  }
+  cv_queue.notify_one();
+}
+
+inline void checkpoint_writer_t::wait() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv_done.wait(lock, [&] {
+    return state_queued != slots[0].state && state_queued != slots[1].state;
+  });
+}
+
+inline void checkpoint_writer_t::thread_execute() {
+  while(true) {
+    int index;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv_queue.wait(lock, [&] { return quit || queue.size(); });
+      if(queue.empty())
+        break;
+      index = queue.front();
+      queue.pop_front();
+    }
+
+    // The slot is queued, so the simulation won't touch it.
+    slot_t& slot = slots[index];
+    auto begin = std::chrono::high_resolution_clock::now();
+    bool okay = checkpoint_format_t::tipsy == slot.format ?
+      write_tipsy(slot.path.c_str(), slot.checkpoint) :
+      write_checkpoint(slot.path.c_str(), slot.checkpoint);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    last_seconds = std::chrono::duration<double>(end - begin).count();
+    if(okay)
+      ++written;
+    else
+      ++failed;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      slot.state = state_free;
+    }
+    cv_done.notify_all();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// A checkpoint mapped for restore. The arrays point into the mapping and
+// stay valid until close.
+struct checkpoint_file_t {
+  checkpoint_file_t() { }
+  ~checkpoint_file_t() { close(); }
+
+  checkpoint_file_t(const checkpoint_file_t&) = delete;
+  checkpoint_file_t& operator=(const checkpoint_file_t&) = delete;
+
+  // Map the file and validate the header. Prints the reason and returns
+  // false on failure.
+  bool open(const char* path);
+  void close();
+
+  int count() const { return header.count; }
+  const vec4* positions() const {
+    return (const vec4*)(data + header.pos_offset);
+  }
+  const vec4* velocities() const {
+    return (const vec4*)(data + header.vel_offset);
+  }
+
+  // Return false if the stored parameters have a different size.
+  template<typename params_t>
+  bool get_params(params_t& params) const {
+    if(sizeof(params_t) != header.params_size)
+      return false;
+    memcpy(&params, data + header.params_offset, sizeof(params_t));
+    return true;
+  }
+
+  checkpoint_header_t header { };
+  size_t size = 0;
+
+private:
+  const char* data = nullptr;
+};
+
+inline bool checkpoint_file_t::open(const char* path) {
+  close();
+
+  int fd = ::open(path, O_RDONLY);
+  if(-1 == fd) {
+    fprintf(stderr, "cannot open file %s\n", path);
+    return false;
+  }
+
+  struct stat statbuf;
+  if(-1 == fstat(fd, &statbuf) ||
+    statbuf.st_size < (off_t)sizeof(checkpoint_header_t)) {
+    fprintf(stderr, "file %s is too small to be a checkpoint\n", path);
+    ::close(fd);
+    return false;
+  }
+
+  size = statbuf.st_size;
+  void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if(MAP_FAILED == p) {
+    fprintf(stderr, "cannot map file %s\n", path);
+    size = 0;
+    return false;
+  }
+  data = (const char*)p;
+  memcpy(&header, data, sizeof(header));
+
+  const char* error = nullptr;
+  uint64_t bytes = sizeof(vec4) * (uint64_t)header.count;
+  if(memcmp(header.magic, checkpoint_magic, 8))
+    error = "not a checkpoint file";
+  else if(checkpoint_version != header.version)
+    error = "unsupported checkpoint version";
+  else if(header.count <= 0 || header.count > INT32_MAX)
+    error = "the checkpoint holds no bodies";
+  else if(header.size != size ||
+    header.params_offset < sizeof(checkpoint_header_t) ||
+    header.params_offset + header.params_size > header.pos_offset ||
+    header.pos_offset + bytes > header.vel_offset ||
+    header.vel_offset + bytes > header.size ||
+    (header.pos_offset | header.vel_offset) % alignof(vec4))
+    error = "the sections do not match the file size";
+
+  if(error) {
+    fprintf(stderr, "%s: %s\n", path, error);
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+inline void checkpoint_file_t::close() {
+  if(data)
+    munmap((void*)data, size);
+  data = nullptr;
+  size = 0;
+  header = { };
+}
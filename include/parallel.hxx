@@ -0,0 +1,22 @@
+#pragma once
+#include <vector>
+#include <numeric>
+#include "block_pool.hxx"
+
+// Call func(item, begin, end) for each run of grain indices in [0, count)
+// on the pool, and wait for them to finish.
+template<typename func_t>
+void for_each_range(block_pool_t& pool, const func_t& func, int count,
+  int grain) {
+
+  std::vector<int> items((count + grain - 1) / grain);
+  std::iota(items.begin(), items.end(), 0);
+
+  pool.execute(items, 1, [&](int tid, int level, int item) {
+    int begin = grain * item;
+    int end = std::min(begin + grain, count);
+    func(item, begin, end);
+    return true;
+  });
+  pool.wait();
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+// Packet types for evaluating a shader over several pixels at once. Each
+// lane holds one pixel. The operators are loops over fixed-size arrays, which
+// the compiler emits as AVX2 or AVX-512 instructions when the target allows.
+//
+// Divergent control flow is expressed with masks. A lane that has left a
+// loop keeps executing with its siblings, but select() discards its results.
+// The loop exits when no lanes are active.
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX512F__)
+constexpr int packet_width = 16;
+#elif defined(__AVX__)
+constexpr int packet_width = 8;
+#else
+constexpr int packet_width = 4;
+#endif
+
+template<typename type_t>
+struct alignas(sizeof(type_t) * packet_width) lanes_t {
+  typedef type_t value_type;
+  type_t x[packet_width];
+
+  lanes_t() = default;
+  lanes_t(type_t a) {
+    for(int i = 0; i < packet_width; ++i)
+      x[i] = a;
+  }
+
+  type_t& operator[](int i) { return x[i]; }
+  type_t operator[](int i) const { return x[i]; }
+};
+
+typedef lanes_t<float> pfloat;
+typedef lanes_t<int>   pint;
+
+// Masks hold 0 or -1 in each lane, like the result of a SIMD comparison.
+typedef lanes_t<int>   pmask;
+
+#define PACKET_BINARY_OP(op)                                                   \
+template<typename type_t>                                                      \
+inline lanes_t<type_t> operator op(lanes_t<type_t> a, lanes_t<type_t> b) {     \
+  lanes_t<type_t> c;                                                           \
+  for(int i = 0; i < packet_width; ++i)                                        \
+    c[i] = a[i] op b[i];                                                       \
+  return c;                                                                    \
+}                                                                              \
+template<typename type_t>                                                      \
+inline lanes_t<type_t> operator op(lanes_t<type_t> a,                         \
+  typename lanes_t<type_t>::value_type b) {                                    \
+  return a op lanes_t<type_t>(b);                                              \
+}                                                                              \
+template<typename type_t>                                                      \
+inline lanes_t<type_t> operator op(typename lanes_t<type_t>::value_type a,     \
+  lanes_t<type_t> b) {                                                         \
+  return lanes_t<type_t>(a) op b;                                              \
+}
+
+PACKET_BINARY_OP(+)
+PACKET_BINARY_OP(-)
+PACKET_BINARY_OP(*)
+PACKET_BINARY_OP(/)
+PACKET_BINARY_OP(&)
+PACKET_BINARY_OP(|)
+
+#undef PACKET_BINARY_OP
+
+#define PACKET_COMPARE_OP(op)                                                  \
+inline pmask operator op(pfloat a, pfloat b) {                                 \
+  pmask c;                                                                     \
+  for(int i = 0; i < packet_width; ++i)                                        \
+    c[i] = a[i] op b[i] ? -1 : 0;                                              \
+  return c;                                                                    \
+}                                                                              \
+inline pmask operator op(pfloat a, float b) { return a op pfloat(b); }         \
+inline pmask operator op(float a, pfloat b) { return pfloat(a) op b; }
+
+PACKET_COMPARE_OP(<)
+PACKET_COMPARE_OP(<=)
+PACKET_COMPARE_OP(>)
+PACKET_COMPARE_OP(>=)
+
+#undef PACKET_COMPARE_OP
+
+template<typename type_t>
+inline lanes_t<type_t>& operator+=(lanes_t<type_t>& a, lanes_t<type_t> b) {
+  return a = a + b;
+}
+
+inline pmask operator~(pmask a) {
+  pmask c;
+  for(int i = 0; i < packet_width; ++i)
+    c[i] = ~a[i];
+  return c;
+}
+
+inline bool any(pmask m) {
+  int x = 0;
+  for(int i = 0; i < packet_width; ++i)
+    x |= m[i];
+  return 0 != x;
+}
+
+inline bool all(pmask m) {
+  int x = -1;
+  for(int i = 0; i < packet_width; ++i)
+    x &= m[i];
+  return 0 != x;
+}
+
+template<typename type_t>
+inline lanes_t<type_t> select(pmask m, lanes_t<type_t> a, lanes_t<type_t> b) {
+  lanes_t<type_t> c;
+  for(int i = 0; i < packet_width; ++i)
+    c[i] = m[i] ? a[i] : b[i];
+  return c;
+}
+
+#define PACKET_UNARY_FUNC(f)                                                   \
+inline pfloat f(pfloat a) {                                                    \
+  pfloat c;                                                                    \
+  for(int i = 0; i < packet_width; ++i)                                        \
+    c[i] = f(a[i]);                                                            \
+  return c;                                                                    \
+}
+
+PACKET_UNARY_FUNC(abs)
+PACKET_UNARY_FUNC(sqrt)
+PACKET_UNARY_FUNC(saturate)
+
+#undef PACKET_UNARY_FUNC
+
+#define PACKET_BINARY_FUNC(f)                                                  \
+inline pfloat f(pfloat a, pfloat b) {                                          \
+  pfloat c;                                                                    \
+  for(int i = 0; i < packet_width; ++i)                                        \
+    c[i] = f(a[i], b[i]);                                                      \
+  return c;                                                                    \
+}                                                                              \
+inline pfloat f(pfloat a, float b) { return f(a, pfloat(b)); }                 \
+inline pfloat f(float a, pfloat b) { return f(pfloat(a), b); }
+
+PACKET_BINARY_FUNC(min)
+PACKET_BINARY_FUNC(max)
+
+#undef PACKET_BINARY_FUNC
+
+inline pfloat clamp(pfloat a, float lo, float hi) {
+  return min(max(a, lo), hi);
+}
+
+// The hardware reciprocal square root estimate with one Newton-Raphson
+// step, good to about 22 bits. Without SSE this is the exact 1 / sqrt.
+inline pfloat rsqrt(pfloat a) {
+  pfloat y;
+#if defined(__AVX512F__)
+  _mm512_store_ps(y.x, _mm512_rsqrt14_ps(_mm512_load_ps(a.x)));
+#elif defined(__AVX__)
+  _mm256_store_ps(y.x, _mm256_rsqrt_ps(_mm256_load_ps(a.x)));
+#elif defined(__SSE__)
+  _mm_store_ps(y.x, _mm_rsqrt_ps(_mm_load_ps(a.x)));
+#else
+  for(int i = 0; i < packet_width; ++i)
+    y[i] = 1 / sqrt(a[i]);
+  return y;
+#endif
+  return y * (1.5f - .5f * a * y * y);
+}
+
+inline pint to_int(pfloat a) {
+  pint c;
+  for(int i = 0; i < packet_width; ++i)
+    c[i] = (int)a[i];
+  return c;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A vec3 per lane, stored as three pfloats.
+
+struct pvec3 {
+  pfloat x, y, z;
+
+  pvec3() = default;
+  pvec3(pfloat x, pfloat y, pfloat z) : x(x), y(y), z(z) { }
+  pvec3(vec3 a) : x(a.x), y(a.y), z(a.z) { }
+
+  vec3 get(int lane) const {
+    return vec3(x[lane], y[lane], z[lane]);
+  }
+  void set(int lane, vec3 a) {
+    x[lane] = a.x;
+    y[lane] = a.y;
+    z[lane] = a.z;
+  }
+};
+
+inline pvec3 operator+(pvec3 a, pvec3 b) {
+  return pvec3(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+inline pvec3 operator-(pvec3 a, pvec3 b) {
+  return pvec3(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+inline pvec3 operator*(pfloat a, pvec3 b) {
+  return pvec3(a * b.x, a * b.y, a * b.z);
+}
+inline pvec3 operator*(pvec3 a, pfloat b) {
+  return b * a;
+}
+
+inline pfloat dot(pvec3 a, pvec3 b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline pfloat length(pvec3 a) {
+  return sqrt(dot(a, a));
+}
@@ -0,0 +1,588 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+// CPU emulation of subgroup and quad operations. subgroup_t::run executes a
+// scalar function for up to 32 lanes, each on its own fiber. A lane runs
+// until it reaches a subgroup operation, where it parks its argument and
+// switches back to the scheduler. Once every lane has either parked or
+// returned, the lanes parked at the same call site execute the operation
+// together and resume. This is lockstep execution at the granularity of the
+// operations, which is all a shader can observe.
+//
+// A call site is the source line of the call and the operation. Every
+// wrapper takes __builtin_LINE() as a default argument, which is evaluated
+// in the caller, so the site doesn't depend on the wrapper being inlined or
+// on where the optimizer puts the code. Lanes at different operations are
+// never combined, but two calls of one operation on a line are one site.
+//
+// When lanes diverge, the site on the lowest line runs first. The body of a
+// branch or loop comes before the code where it rejoins, so this lets the
+// lanes that took the branch catch up before the others execute the next
+// operation, like reconvergence on a GPU. This is a heuristic: it only
+// holds across calls if a helper that uses subgroup operations in divergent
+// code is defined above its callers, and nothing checks that it is.
+//
+// This is for correctness, not speed. A fiber switch per operation and per
+// lane costs more than the lockstep saves, and on the benchmark (--compare
+// in shadertoy-bench) subgroup evaluation is slower than scalar. Use it for
+// shaders that need subgroup or quad operations, and leave it off otherwise.
+//
+// Lanes are numbered like the quads of a fragment shader: lane ^ 1 is the
+// horizontal neighbor and lane ^ 2 the vertical neighbor in a 2x2 quad.
+//
+// Each wrapper below calls the SPIR-V builtin in shader builds and the
+// emulation on the CPU. Called outside of subgroup_t::run, the CPU versions
+// behave like a subgroup with one lane and no derivatives.
+
+////////////////////////////////////////////////////////////////////////////////
+// Fibers. On x86-64 the switch saves only the stack and frame pointers; the
+// clobber list has the compiler spill everything else around it. That's
+// about two orders of magnitude faster than swapcontext, which makes a
+// system call to save the signal mask.
+
+struct fiber_t {
+#if defined(__x86_64__)
+  void* sp;
+#else
+  ucontext_t context;
+#endif
+};
+
+inline void fiber_init(fiber_t& fiber, char* stack, size_t size,
+  void(*entry)()) {
+#if defined(__x86_64__)
+  // Returning into entry leaves the stack aligned like a call would.
+  void** sp = (void**)(stack + (size & ~(size_t)15));
+  *--sp = nullptr;
+  *--sp = (void*)entry;
+  fiber.sp = sp;
+
+#else
+  getcontext(&fiber.context);
+  fiber.context.uc_stack.ss_sp = stack;
+  fiber.context.uc_stack.ss_size = size;
+  fiber.context.uc_link = nullptr;
+  makecontext(&fiber.context, entry, 0);
+#endif
+}
+
+inline void fiber_switch(fiber_t& from, fiber_t& to) {
+#if defined(__x86_64__)
+  void** save = &from.sp;
+  void* load = to.sp;
+  asm volatile(
+    // Step over the red zone before pushing.
+    "subq $128, %%rsp\n\t"
+    "pushq %%rbp\n\t"
+    "leaq 1f(%%rip), %%rax\n\t"
+    "pushq %%rax\n\t"
+    "movq %%rsp, (%0)\n\t"
+    "movq %1, %%rsp\n\t"
+    "retq\n"
+    "1:\n\t"
+    "popq %%rbp\n\t"
+    "addq $128, %%rsp\n\t"
+    : "+D"(save), "+S"(load)
+    :
+    : "rax", "rbx", "rcx", "rdx", "r8", "r9", "r10", "r11", "r12", "r13",
+      "r14", "r15", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6",
+      "xmm7", "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14",
+      "xmm15",
+#if defined(__AVX512F__)
+      "xmm16", "xmm17", "xmm18", "xmm19", "xmm20", "xmm21", "xmm22",
+      "xmm23", "xmm24", "xmm25", "xmm26", "xmm27", "xmm28", "xmm29",
+      "xmm30", "xmm31", "k0", "k1", "k2", "k3", "k4", "k5", "k6", "k7",
+#endif
+      "memory", "cc"
+  );
+
+#else
+  swapcontext(&from.context, &to.context);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct subgroup_t {
+  enum {
+    max_lanes = 32,
+
+    // Largest argument or result of an operation.
+    slot_size = 32,
+
+    // Shaders don't recurse, but unoptimized builds have large frames.
+    // Untouched pages are never committed.
+    stack_size = 256 * 1024,
+  };
+
+  // Run func(lane) on num_lanes lanes in lockstep.
+  template<typename func_t>
+  void run(int num_lanes, const func_t& func);
+
+  // Park x in the calling lane's slot and wait for the lanes running op_t
+  // on the same line.
+  template<typename op_t, typename out_t, typename in_t>
+  static out_t exchange(in_t x, uint line);
+
+  // The subgroup running on this thread, or null outside of run.
+  static inline thread_local subgroup_t* active = nullptr;
+
+  // Each worker thread keeps its own lanes and stacks.
+  static subgroup_t& local() {
+    static thread_local subgroup_t subgroup;
+    return subgroup;
+  }
+
+  int num_lanes = 0;
+  int current = 0;
+
+private:
+  typedef void(*op_func_t)(subgroup_t& subgroup, uint32_t mask);
+
+  template<typename op_t, typename in_t, typename out_t>
+  static void run_op(subgroup_t& subgroup, uint32_t mask);
+
+  static void lane_entry();
+
+  struct lane_t {
+    fiber_t fiber;
+
+    // The operation the lane is parked on and its line.
+    op_func_t op;
+    uint line;
+    bool done;
+
+    // The argument going in and the result coming out.
+    alignas(16) char slot[slot_size];
+  };
+
+  lane_t lanes[max_lanes];
+  fiber_t scheduler;
+  std::unique_ptr<char[]> stacks;
+
+  void(*lane_func)(const void* data, int lane);
+  const void* lane_data;
+};
+
+template<typename func_t>
+void subgroup_t::run(int count, const func_t& func) {
+  if(!stacks)
+    stacks.reset(new char[max_lanes * stack_size]);
+
+  num_lanes = count;
+  lane_func = [](const void* data, int lane) {
+    (*(const func_t*)data)(lane);
+  };
+  lane_data = &func;
+
+  for(int lane = 0; lane < count; ++lane) {
+    lanes[lane].done = false;
+    fiber_init(lanes[lane].fiber, stacks.get() + lane * stack_size,
+      stack_size, &lane_entry);
+  }
+
+  subgroup_t* prev = active;
+  active = this;
+
+  uint32_t remaining = count < 32 ? (1u<< count) - 1 : ~0u;
+  uint32_t parked = 0;
+  while(remaining) {
+    // Run each lane until it parks on an operation or returns.
+    for(uint32_t ready = remaining & ~parked; ready; ready &= ready - 1) {
+      current = __builtin_ctz(ready);
+      fiber_switch(scheduler, lanes[current].fiber);
+      if(lanes[current].done)
+        remaining &= ~(1u<< current);
+      else
+        parked |= 1u<< current;
+    }
+
+    if(!parked)
+      break;
+
+    // Execute the earliest site on every lane parked there. Those are the
+    // active lanes of that operation. When several operations on one line
+    // are waiting, take the first lane's.
+    const lane_t* first = nullptr;
+    for(uint32_t p = parked; p; p &= p - 1) {
+      const lane_t& lane = lanes[__builtin_ctz(p)];
+      if(!first || lane.line < first->line)
+        first = &lane;
+    }
+
+    uint32_t mask = 0;
+    for(uint32_t p = parked; p; p &= p - 1) {
+      int lane = __builtin_ctz(p);
+      if(first->line == lanes[lane].line && first->op == lanes[lane].op)
+        mask |= 1u<< lane;
+    }
+
+    first->op(*this, mask);
+    parked &= ~mask;
+  }
+
+  active = prev;
+}
+
+inline void subgroup_t::lane_entry() {
+  subgroup_t& subgroup = *active;
+  int lane = subgroup.current;
+  subgroup.lane_func(subgroup.lane_data, lane);
+
+  // Hand control back for good.
+  subgroup.lanes[lane].done = true;
+  fiber_switch(subgroup.lanes[lane].fiber, subgroup.scheduler);
+  __builtin_unreachable();
+}
+
+template<typename op_t, typename out_t, typename in_t>
+inline out_t subgroup_t::exchange(in_t x, uint line) {
+  static_assert(sizeof(in_t) <= slot_size && sizeof(out_t) <= slot_size);
+
+  subgroup_t* subgroup = active;
+  if(!subgroup) {
+    // Run the operation on a subgroup of one lane.
+    in_t in[max_lanes];
+    out_t out[max_lanes];
+    in[0] = x;
+    op_t::apply(in, out, 1);
+    return out[0];
+  }
+
+  lane_t& lane = subgroup->lanes[subgroup->current];
+  memcpy(lane.slot, &x, sizeof(in_t));
+  lane.op = &run_op<op_t, in_t, out_t>;
+  lane.line = line;
+  fiber_switch(lane.fiber, subgroup->scheduler);
+
+  out_t y;
+  memcpy(&y, lane.slot, sizeof(out_t));
+  return y;
+}
+
+template<typename op_t, typename in_t, typename out_t>
+void subgroup_t::run_op(subgroup_t& subgroup, uint32_t mask) {
+  in_t in[max_lanes];
+  out_t out[max_lanes];
+  for(uint32_t m = mask; m; m &= m - 1) {
+    int lane = __builtin_ctz(m);
+    memcpy(&in[lane], subgroup.lanes[lane].slot, sizeof(in_t));
+  }
+
+  op_t::apply(in, out, mask);
+
+  for(uint32_t m = mask; m; m &= m - 1) {
+    int lane = __builtin_ctz(m);
+    memcpy(subgroup.lanes[lane].slot, &out[lane], sizeof(out_t));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Operations. apply reads in and writes out for the lanes set in mask.
+
+#define SUBGROUP_FOR_EACH_LANE(lane, mask)                                     \
+  for(uint32_t m_ = mask, lane; m_ && (lane = __builtin_ctz(m_), true);        \
+    m_ &= m_ - 1)
+
+struct subgroup_add_t {
+  template<typename in_t, typename out_t>
+  static void apply(const in_t* in, out_t* out, uint32_t mask) {
+    out_t sum { };
+    SUBGROUP_FOR_EACH_LANE(lane, mask)
+      sum += in[lane];
+    SUBGROUP_FOR_EACH_LANE(lane, mask)
+      out[lane] = sum;
+  }
+};
+
+struct subgroup_exclusive_add_t {
+  template<typename in_t, typename out_t>
+  static void apply(const in_t* in, out_t* out, uint32_t mask) {
+    out_t sum { };
+    SUBGROUP_FOR_EACH_LANE(lane, mask) {
+      out[lane] = sum;
+      sum += in[lane];
+    }
+  }
+};
+
+struct subgroup_max_t {
+  template<typename in_t, typename out_t>
+  static void apply(const in_t* in, out_t* out, uint32_t mask) {
+    out_t x = in[__builtin_ctz(mask)];
+    SUBGROUP_FOR_EACH_LANE(lane, mask)
+      x = max(x, in[lane]);
+    SUBGROUP_FOR_EACH_LANE(lane, mask)
+      out[lane] = x;
+  }
+};
+
+struct subgroup_ballot_t {
+  template<typename in_t, typename out_t>
+  static void apply(const in_t* in, out_t* out, uint32_t mask) {
+    uint bits = 0;
+    SUBGROUP_FOR_EACH_LANE(lane, mask)
+      bits |= (uint)(bool)in[lane]<< lane;
+    SUBGROUP_FOR_EACH_LANE(lane, mask)
+      out[lane] = uvec4(bits, 0, 0, 0);
+  }
+};
+
+struct subgroup_elect_t {
+  template<typename in_t, typename out_t>
+  static void apply(const in_t* in, out_t* out, uint32_t mask) {
+    SUBGROUP_FOR_EACH_LANE(lane, mask)
+      out[lane] = lane == __builtin_ctz(mask);
+  }
+};
+
+struct subgroup_broadcast_first_t {
+  template<typename in_t, typename out_t>
+  static void apply(const in_t* in, out_t* out, uint32_t mask) {
+    out_t x = in[__builtin_ctz(mask)];
+    SUBGROUP_FOR_EACH_LANE(lane, mask)
+      out[lane] = x;
+  }
+};
+
+// The argument is the value and the lane to read it from.
+template<typename type_t>
+struct subgroup_broadcast_arg_t {
+  type_t x;
+  uint id;
+};
+
+struct subgroup_broadcast_t {
+  template<typename in_t, typename out_t>
+  static void apply(const in_t* in, out_t* out, uint32_t mask) {
+    // The id is uniform. Reading an inactive lane is undefined, so return
+    // the caller's own value.
+    uint id = in[__builtin_ctz(mask)].id;
+    SUBGROUP_FOR_EACH_LANE(lane, mask)
+      out[lane] = (mask & (1u<< id)) ? in[id].x : in[lane].x;
+  }
+};
+
+// Exchange values with lane ^ flip in each quad.
+template<int flip>
+struct subgroup_quad_swap_t {
+  template<typename in_t, typename out_t>
+  static void apply(const in_t* in, out_t* out, uint32_t mask) {
+    SUBGROUP_FOR_EACH_LANE(lane, mask)
+      out[lane] = (mask & (1u<< (lane ^ flip))) ? in[lane ^ flip] : in[lane];
+  }
+};
+
+// Fine derivatives: the difference across the lane's row or column of its
+// quad. The derivative is zero when the other lane isn't running.
+template<int axis>
+struct quad_derivative_t {
+  template<typename in_t, typename out_t>
+  static void apply(const in_t* in, out_t* out, uint32_t mask) {
+    SUBGROUP_FOR_EACH_LANE(lane, mask) {
+      uint lo = lane & ~axis, hi = lane | axis;
+      out[lane] = (mask>> lo & 1) && (mask>> hi & 1) ?
+        in[hi] - in[lo] : out_t { };
+    }
+  }
+};
+
+struct quad_fwidth_t {
+  template<typename in_t, typename out_t>
+  static void apply(const in_t* in, out_t* out, uint32_t mask) {
+    out_t dx[subgroup_t::max_lanes], dy[subgroup_t::max_lanes];
+    quad_derivative_t<1>::apply(in, dx, mask);
+    quad_derivative_t<2>::apply(in, dy, mask);
+    SUBGROUP_FOR_EACH_LANE(lane, mask)
+      out[lane] = abs(dx[lane]) + abs(dy[lane]);
+  }
+};
+
+#undef SUBGROUP_FOR_EACH_LANE
+
+////////////////////////////////////////////////////////////////////////////////
+// Portable wrappers for shader code.
+
+// True when subgroup operations see other lanes. That's always the case in
+// shaders and on the CPU inside subgroup_t::run.
+[[gnu::always_inline]] inline bool has_subgroups() {
+  bool result;
+  if codegen(__is_spirv_target)
+    result = true;
+  else
+    result = subgroup_t::active;
+  return result;
+}
+
+// Derivatives are only defined in fragment shaders.
+[[gnu::always_inline]] inline bool has_derivatives() {
+  return has_subgroups();
+}
+
+[[gnu::always_inline]] inline uint subgroup_invocation_id() {
+  uint id;
+  if codegen(__is_spirv_target)
+    id = gl_SubgroupInvocationID;
+  else
+    id = subgroup_t::active ? subgroup_t::active->current : 0;
+  return id;
+}
+
+[[gnu::always_inline]] inline uint subgroup_size() {
+  uint size;
+  if codegen(__is_spirv_target)
+    size = gl_SubgroupSize;
+  else
+    size = subgroup_t::active ? subgroup_t::active->num_lanes : 1;
+  return size;
+}
+
+[[gnu::always_inline]] inline bool subgroup_elect(
+  uint line = __builtin_LINE()) {
+  bool result;
+  if codegen(__is_spirv_target)
+    result = gl_subgroupElect();
+  else
+    result = subgroup_t::exchange<subgroup_elect_t, bool>(true, line);
+  return result;
+}
+
+[[gnu::always_inline]] inline uvec4 subgroup_ballot(bool x,
+  uint line = __builtin_LINE()) {
+  uvec4 result;
+  if codegen(__is_spirv_target)
+    result = gl_subgroupBallot(x);
+  else
+    result = subgroup_t::exchange<subgroup_ballot_t, uvec4>(x, line);
+  return result;
+}
+
+template<typename type_t>
+[[gnu::always_inline]] inline type_t subgroup_add(type_t x,
+  uint line = __builtin_LINE()) {
+  type_t result;
+  if codegen(__is_spirv_target)
+    result = gl_subgroupAdd(x);
+  else
+    result = subgroup_t::exchange<subgroup_add_t, type_t>(x, line);
+  return result;
+}
+
+template<typename type_t>
+[[gnu::always_inline]] inline type_t subgroup_exclusive_add(type_t x,
+  uint line = __builtin_LINE()) {
+  type_t result;
+  if codegen(__is_spirv_target)
+    result = gl_subgroupExclusiveAdd(x);
+  else
+    result = subgroup_t::exchange<subgroup_exclusive_add_t, type_t>(x, line);
+  return result;
+}
+
+template<typename type_t>
+[[gnu::always_inline]] inline type_t subgroup_max(type_t x,
+  uint line = __builtin_LINE()) {
+  type_t result;
+  if codegen(__is_spirv_target)
+    result = gl_subgroupMax(x);
+  else
+    result = subgroup_t::exchange<subgroup_max_t, type_t>(x, line);
+  return result;
+}
+
+template<typename type_t>
+[[gnu::always_inline]] inline type_t subgroup_broadcast_first(type_t x,
+  uint line = __builtin_LINE()) {
+  type_t result;
+  if codegen(__is_spirv_target)
+    result = gl_subgroupBroadcastFirst(x);
+  else
+    result = subgroup_t::exchange<subgroup_broadcast_first_t, type_t>(x, line);
+  return result;
+}
+
+// SPIR-V requires id to be a constant.
+template<typename type_t>
+[[gnu::always_inline]] inline type_t subgroup_broadcast(type_t x, uint id,
+  uint line = __builtin_LINE()) {
+  type_t result;
+  if codegen(__is_spirv_target)
+    result = gl_subgroupBroadcast(x, id);
+  else
+    result = subgroup_t::exchange<subgroup_broadcast_t, type_t>(
+      subgroup_broadcast_arg_t<type_t> { x, id }, line);
+  return result;
+}
+
+template<typename type_t>
+[[gnu::always_inline]] inline type_t subgroup_quad_swap_horizontal(type_t x,
+  uint line = __builtin_LINE()) {
+  type_t result;
+  if codegen(__is_spirv_target)
+    result = gl_subgroupQuadSwapHorizontal(x);
+  else
+    result = subgroup_t::exchange<subgroup_quad_swap_t<1>, type_t>(x, line);
+  return result;
+}
+
+template<typename type_t>
+[[gnu::always_inline]] inline type_t subgroup_quad_swap_vertical(type_t x,
+  uint line = __builtin_LINE()) {
+  type_t result;
+  if codegen(__is_spirv_target)
+    result = gl_subgroupQuadSwapVertical(x);
+  else
+    result = subgroup_t::exchange<subgroup_quad_swap_t<2>, type_t>(x, line);
+  return result;
+}
+
+template<typename type_t>
+[[gnu::always_inline]] inline type_t subgroup_quad_swap_diagonal(type_t x,
+  uint line = __builtin_LINE()) {
+  type_t result;
+  if codegen(__is_spirv_target)
+    result = gl_subgroupQuadSwapDiagonal(x);
+  else
+    result = subgroup_t::exchange<subgroup_quad_swap_t<3>, type_t>(x, line);
+  return result;
+}
+
+template<typename type_t>
+[[gnu::always_inline]] inline type_t quad_dfdx(type_t x,
+  uint line = __builtin_LINE()) {
+  type_t result;
+  if codegen(__is_spirv_target)
+    result = glfrag_dFdx(x);
+  else
+    result = subgroup_t::exchange<quad_derivative_t<1>, type_t>(x, line);
+  return result;
+}
+
+template<typename type_t>
+[[gnu::always_inline]] inline type_t quad_dfdy(type_t x,
+  uint line = __builtin_LINE()) {
+  type_t result;
+  if codegen(__is_spirv_target)
+    result = glfrag_dFdy(x);
+  else
+    result = subgroup_t::exchange<quad_derivative_t<2>, type_t>(x, line);
+  return result;
+}
+
+template<typename type_t>
+[[gnu::always_inline]] inline type_t quad_fwidth(type_t x,
+  uint line = __builtin_LINE()) {
+  type_t result;
+  if codegen(__is_spirv_target)
+    result = glfrag_fwidth(x);
+  else
+    result = subgroup_t::exchange<quad_fwidth_t, type_t>(x, line);
+  return result;
+}
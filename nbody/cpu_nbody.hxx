@@ -0,0 +1,521 @@
+#pragma once
+#include <chrono>
+#include "octree.hxx"
+#include "direct_kernel.hxx"
+
+////////////////////////////////////////////////////////////////////////////////
+// CPU n-body solvers. The direct solver sums every pair like
+// integrate_shader. The SIMD solver sums every pair with the tiled SoA
+// kernel in direct_kernel.hxx. The Barnes-Hut solver rebuilds an octree
+// every step and approximates distant cells by their monopole, which brings
+// the force computation down from O(N^2) to O(N log N).
+//
+// Positions hold the mass in .w, as in the GPU buffers. The Barnes-Hut
+// solver builds its tree over a copy of the bodies sorted in Morton order,
+// so the bodies keep their order.
+//
+// The integrators:
+//  euler     Kick and drift every body with the same dt, like
+//            integrate_shader. This is the only one that applies damping.
+//  leapfrog  Kick-drift-kick with hierarchical block timesteps.
+//  hermite   Fourth-order Hermite predictor-corrector with block timesteps.
+//            This needs the jerk, so it always sums every pair directly.
+//
+// With block timesteps each body sits on a level l and steps by
+// dt / 2^l. One call to step advances every body by dt in 2^(levels - 1)
+// substeps of the finest level, and only computes the forces on the bodies
+// whose steps end at each substep. A body picks its level from its own
+// timestep criterion when its step ends, and may only move to a coarser
+// level when that level's steps line up with the current substep.
+
+enum class solver_t {
+  direct,
+  direct_simd,
+  barnes_hut,
+};
+
+enum class integrator_t {
+  euler,
+  leapfrog,
+  hermite,
+};
+
+struct force_error_t {
+  // Relative error of the acceleration against the direct sum.
+  double rms, max;
+
+  // Time to sum the sampled bodies directly, extrapolated to all of them.
+  double direct_seconds;
+};
+
+struct momentum_t {
+  vec3 total;
+
+  // The sum of the magnitudes of every body's momentum, to normalize the
+  // drift of the total.
+  double scale;
+};
+
+struct cpu_nbody_t {
+  cpu_nbody_t(int num_threads) : pool(num_threads) { }
+
+  void set_bodies(const vec4* pos, const vec4* vel, int count);
+
+  // Compute acc and phi on every body for the current positions with the
+  // solver.
+  void compute_forces();
+
+  // Advance every body by dt with the integrator. Euler leaves the forces
+  // of the state before the step; the others leave the forces of the new
+  // state.
+  void step(float dt, float damping);
+
+  // Total energy from the last forces on each body.
+  double energy() const;
+  momentum_t momentum() const;
+
+  // Compare the accelerations from the last compute_forces against the
+  // direct sum on sample_count evenly-spaced bodies.
+  force_error_t force_error(int sample_count);
+
+  solver_t solver = solver_t::barnes_hut;
+  float softening = .1f;
+  float theta = .5f;
+  int leaf_size = 16;
+
+  // Accumulate the SIMD solver's sums across tiles in double.
+  bool mixed_precision = false;
+
+  integrator_t integrator = integrator_t::euler;
+
+  // Number of power-of-two timestep levels. 1 steps every body with dt.
+  int num_levels = 1;
+
+  // Timestep accuracy. Leapfrog takes sqrt(2 eta softening / |a|) and
+  // Hermite takes eta |a| / |jerk|.
+  float eta = .025f;
+
+  int num_bodies = 0;
+  std::vector<vec4> positions, velocities;
+  std::vector<vec3> acc;
+  std::vector<float> phi;
+
+  // Timestep level of each body.
+  std::vector<int> levels;
+
+  // Time spent and bodies whose forces were computed in the last step or
+  // compute_forces.
+  double build_seconds = 0;
+  double force_seconds = 0;
+  int64_t evaluations = 0;
+
+private:
+  // Add the forces on the listed bodies, or on every body, to the step.
+  void accumulate_forces(const std::vector<int>* active);
+
+  void direct_sum(int i, vec3& a, float& u) const;
+  void direct_sum_jerk(int i, vec3& a, vec3& j, float& u) const;
+  void sort_bodies();
+
+  void step_euler(float dt, float damping);
+  void step_leapfrog(float dt);
+  void step_hermite(float dt);
+
+  // Start the block timesteps. Computes the forces on every body and
+  // assigns their levels.
+  void prepare(float dt);
+
+  // The level for a body with timestep dt2 whose step ends on substep s.
+  int choose_level(float dt, float dt2, int s) const;
+  bool on_boundary(int level, int s) const {
+    return 0 == s % (1<< (num_levels - 1 - level));
+  }
+
+  block_pool_t pool;
+  octree_t tree;
+  soa_bodies_t soa, soa_targets;
+
+  // Bodies in Morton order and the rank of each body in that order.
+  std::vector<vec4> sorted;
+  std::vector<int> ranks;
+
+  // The integrator and levels that prepare ran for.
+  integrator_t prepared_integrator = integrator_t::euler;
+  int prepared_levels = 0;
+
+  // Hermite state. Body i was last corrected at substep starts[i], and the
+  // predicted state is the source for the forces.
+  std::vector<vec3> jerk;
+  std::vector<int> starts;
+  std::vector<vec4> pred_pos, pred_vel;
+
+  std::vector<int> active;
+};
+
+inline void cpu_nbody_t::set_bodies(const vec4* pos, const vec4* vel,
+  int count) {
+
+  num_bodies = count;
+  positions.assign(pos, pos + count);
+  velocities.assign(vel, vel + count);
+  acc.resize(count);
+  phi.resize(count);
+  levels.assign(count, 0);
+
+  // Start the block timesteps over on the next step.
+  prepared_levels = 0;
+}
+
+inline void cpu_nbody_t::direct_sum(int i, vec3& a, float& u) const {
+  vec3 p = positions[i].xyz;
+  float softening2 = softening * softening;
+
+  vec3 a2 { };
+  float u2 = 0;
+  for(int j = 0; j < num_bodies; ++j) {
+    vec3 r = positions[j].xyz - p;
+    float inv_dist = inversesqrt(dot(r, r) + softening2);
+    float s = positions[j].w * inv_dist;
+    a2 += s * inv_dist * inv_dist * r;
+
+    // The self-interaction adds no force but would add to the potential.
+    if(j != i)
+      u2 -= s;
+  }
+
+  a = a2;
+  u = u2;
+}
+
+// Sum the acceleration, jerk and potential on body i from the predicted
+// state of every body.
+inline void cpu_nbody_t::direct_sum_jerk(int i, vec3& a, vec3& j,
+  float& u) const {
+
+  vec3 p = pred_pos[i].xyz;
+  vec3 v = pred_vel[i].xyz;
+  float softening2 = softening * softening;
+
+  vec3 a2 { }, j2 { };
+  float u2 = 0;
+  for(int k = 0; k < num_bodies; ++k) {
+    vec3 r = pred_pos[k].xyz - p;
+    vec3 w = pred_vel[k].xyz - v;
+    float inv_dist2 = 1 / (dot(r, r) + softening2);
+    float inv_dist = sqrtf(inv_dist2);
+    float s = pred_pos[k].w * inv_dist;
+    float s3 = s * inv_dist2;
+    a2 += s3 * r;
+    j2 += s3 * (w - 3 * dot(r, w) * inv_dist2 * r);
+
+    if(k != i)
+      u2 -= s;
+  }
+
+  a = a2;
+  j = j2;
+  u = u2;
+}
+
+inline void cpu_nbody_t::sort_bodies() {
+  const std::vector<uint32_t>& order = tree.sort_bodies(pool,
+    positions.data(), num_bodies);
+
+  sorted.resize(num_bodies);
+  ranks.resize(num_bodies);
+  for_each_range(pool, [&](int item, int begin, int end) {
+    for(int k = begin; k < end; ++k) {
+      sorted[k] = positions[order[k]];
+      ranks[order[k]] = k;
+    }
+  }, num_bodies, 4096);
+}
+
+inline void cpu_nbody_t::compute_forces() {
+  build_seconds = force_seconds = 0;
+  evaluations = 0;
+  accumulate_forces(nullptr);
+}
+
+inline void cpu_nbody_t::accumulate_forces(
+  const std::vector<int>* active) {
+
+  auto t0 = std::chrono::high_resolution_clock::now();
+
+  if(solver_t::barnes_hut == solver) {
+    // theta must stay below 2 / sqrt(3) so a body never accepts the cell
+    // it sits in.
+    sort_bodies();
+    tree.build(pool, sorted.data(), num_bodies, clamp(theta, .05f, 1.f),
+      leaf_size);
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  int count = active ? active->size() : num_bodies;
+  float softening2 = softening * softening;
+  if(solver_t::direct_simd == solver) {
+    // Split the bodies into SoA arrays. This is O(N) against the O(N^2)
+    // sum, so it counts as force time.
+    soa.assign(pool, positions.data(), num_bodies);
+    const soa_bodies_t* targets = &soa;
+    const int* indices = nullptr;
+    if(active) {
+      soa_targets.assign(pool, positions.data(), count, active->data());
+      targets = &soa_targets;
+      indices = active->data();
+    }
+
+    if(mixed_precision)
+      direct_forces<true>(pool, soa, *targets, indices, softening2,
+        acc.data(), phi.data());
+    else
+      direct_forces<false>(pool, soa, *targets, indices, softening2,
+        acc.data(), phi.data());
+
+  } else {
+    // Bodies in Morton order traverse similar paths through the tree, so
+    // contiguous ranges keep the top of the tree in cache.
+    bool morton = !active && solver_t::barnes_hut == solver;
+    for_each_range(pool, [&](int item, int begin, int end) {
+      for(int k = begin; k < end; ++k) {
+        int i = active ? (*active)[k] : morton ? tree.order[k] : k;
+        if(solver_t::barnes_hut == solver)
+          tree.evaluate(sorted.data(), positions[i].xyz, ranks[i],
+            softening2, acc[i], phi[i]);
+        else
+          direct_sum(i, acc[i], phi[i]);
+      }
+    }, count, solver_t::barnes_hut == solver ? 256 : 64);
+  }
+
+  evaluations += count;
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+  build_seconds += std::chrono::duration<double>(t1 - t0).count();
+  force_seconds += std::chrono::duration<double>(t2 - t1).count();
+}
+
+inline void cpu_nbody_t::step(float dt, float damping) {
+  num_levels = std::clamp(num_levels, 1, 16);
+  build_seconds = force_seconds = 0;
+  evaluations = 0;
+
+  if(integrator_t::euler == integrator) {
+    step_euler(dt, damping);
+    return;
+  }
+
+  if(integrator != prepared_integrator || num_levels != prepared_levels)
+    prepare(dt);
+
+  if(integrator_t::leapfrog == integrator)
+    step_leapfrog(dt);
+  else
+    step_hermite(dt);
+}
+
+inline void cpu_nbody_t::step_euler(float dt, float damping) {
+  accumulate_forces(nullptr);
+
+  for_each_range(pool, [&](int item, int begin, int end) {
+    for(int i = begin; i < end; ++i) {
+      vec4& vel = velocities[i];
+      vel.xyz += dt * acc[i];
+      vel.xyz *= damping;
+      positions[i].xyz += dt * vel.xyz;
+    }
+  }, num_bodies, 4096);
+}
+
+inline int cpu_nbody_t::choose_level(float dt, float dt2, int s) const {
+  // The coarsest level whose step fits in dt2.
+  int level = 0;
+  while(level < num_levels - 1 && dt2 < dt / (1<< level))
+    ++level;
+
+  // Refine until the step starts on a boundary of its level.
+  while(!on_boundary(level, s))
+    ++level;
+  return level;
+}
+
+inline void cpu_nbody_t::prepare(float dt) {
+  if(integrator_t::hermite == integrator) {
+    pred_pos = positions;
+    pred_vel = velocities;
+    jerk.resize(num_bodies);
+    starts.assign(num_bodies, 0);
+    for_each_range(pool, [&](int item, int begin, int end) {
+      for(int i = begin; i < end; ++i)
+        direct_sum_jerk(i, acc[i], jerk[i], phi[i]);
+    }, num_bodies, 64);
+    evaluations += num_bodies;
+
+  } else
+    accumulate_forces(nullptr);
+
+  for_each_range(pool, [&](int item, int begin, int end) {
+    for(int i = begin; i < end; ++i) {
+      float a = length(acc[i]);
+      float dt2 = integrator_t::hermite == integrator ?
+        eta * a / length(jerk[i]) : sqrtf(2 * eta * softening / a);
+      levels[i] = choose_level(dt, dt2, 0);
+    }
+  }, num_bodies, 4096);
+
+  prepared_integrator = integrator;
+  prepared_levels = num_levels;
+}
+
+inline void cpu_nbody_t::step_leapfrog(float dt) {
+  int num_substeps = 1<< (num_levels - 1);
+  float h = dt / num_substeps;
+
+  for(int s = 0; s < num_substeps; ++s) {
+    // Open the steps starting on this substep with a half kick and drift
+    // every body. Bodies in the middle of a step drift on the velocity from
+    // their opening kick.
+    for_each_range(pool, [&](int item, int begin, int end) {
+      for(int i = begin; i < end; ++i) {
+        vec4& vel = velocities[i];
+        if(on_boundary(levels[i], s))
+          vel.xyz += .5f * (dt / (1<< levels[i])) * acc[i];
+        positions[i].xyz += h * vel.xyz;
+      }
+    }, num_bodies, 4096);
+
+    // Compute the forces on the bodies whose steps end on the next substep.
+    active.clear();
+    for(int i = 0; i < num_bodies; ++i) {
+      if(on_boundary(levels[i], s + 1))
+        active.push_back(i);
+    }
+    accumulate_forces(num_bodies == (int)active.size() ? nullptr :
+      &active);
+
+    // Close their steps and choose the next ones.
+    for_each_range(pool, [&](int item, int begin, int end) {
+      for(int k = begin; k < end; ++k) {
+        int i = active[k];
+        velocities[i].xyz += .5f * (dt / (1<< levels[i])) * acc[i];
+        float dt2 = sqrtf(2 * eta * softening / length(acc[i]));
+        levels[i] = choose_level(dt, dt2, s + 1);
+      }
+    }, active.size(), 4096);
+  }
+}
+
+inline void cpu_nbody_t::step_hermite(float dt) {
+  int num_substeps = 1<< (num_levels - 1);
+  float h = dt / num_substeps;
+
+  for(int s = 0; s < num_substeps; ++s) {
+    // Predict every body to the end of the substep.
+    for_each_range(pool, [&](int item, int begin, int end) {
+      for(int i = begin; i < end; ++i) {
+        float t = (s + 1 - starts[i]) * h;
+        vec3 x = positions[i].xyz, v = velocities[i].xyz;
+        vec3 a = acc[i], j = jerk[i];
+        pred_pos[i] = vec4(x + t * (v + t * (.5f * a + t / 6 * j)),
+          positions[i].w);
+        pred_vel[i] = vec4(v + t * (a + .5f * t * j), velocities[i].w);
+      }
+    }, num_bodies, 4096);
+
+    active.clear();
+    for(int i = 0; i < num_bodies; ++i) {
+      if(on_boundary(levels[i], s + 1))
+        active.push_back(i);
+    }
+
+    // Correct the bodies whose steps end here. The forces only read the
+    // predicted state, so each body can be corrected as soon as its forces
+    // are known.
+    auto t0 = std::chrono::high_resolution_clock::now();
+    for_each_range(pool, [&](int item, int begin, int end) {
+      for(int k = begin; k < end; ++k) {
+        int i = active[k];
+        vec3 a1, j1;
+        direct_sum_jerk(i, a1, j1, phi[i]);
+
+        float t = (s + 1 - starts[i]) * h;
+        vec3 x0 = positions[i].xyz, v0 = velocities[i].xyz;
+        vec3 a0 = acc[i], j0 = jerk[i];
+        vec3 v1 = v0 + .5f * t * (a0 + a1) + t * t / 12 * (j0 - j1);
+        positions[i].xyz = x0 + .5f * t * (v0 + v1) +
+          t * t / 12 * (a0 - a1);
+        velocities[i].xyz = v1;
+        acc[i] = a1;
+        jerk[i] = j1;
+        starts[i] = s + 1;
+
+        float dt2 = eta * length(a1) / length(j1);
+        levels[i] = choose_level(dt, dt2, s + 1);
+      }
+    }, active.size(), 64);
+    auto t1 = std::chrono::high_resolution_clock::now();
+
+    force_seconds += std::chrono::duration<double>(t1 - t0).count();
+    evaluations += active.size();
+  }
+
+  // Every step ended on the last substep. Count the next ones from 0.
+  for(int& start : starts)
+    start = 0;
+}
+
+inline double cpu_nbody_t::energy() const {
+  // Kinetic energy plus half the pairwise potential, since every pair is
+  // counted from both ends.
+  double e = 0;
+  for(int i = 0; i < num_bodies; ++i) {
+    float mass = positions[i].w;
+    vec3 vel = velocities[i].xyz;
+    e += .5 * mass * dot(vel, vel) + .5 * mass * phi[i];
+  }
+  return e;
+}
+
+inline momentum_t cpu_nbody_t::momentum() const {
+  double total[3] { }, scale = 0;
+  for(int i = 0; i < num_bodies; ++i) {
+    vec3 p = positions[i].w * velocities[i].xyz;
+    total[0] += p.x;
+    total[1] += p.y;
+    total[2] += p.z;
+    scale += length(p);
+  }
+  return { vec3(total[0], total[1], total[2]), scale };
+}
+
+inline force_error_t cpu_nbody_t::force_error(int sample_count) {
+  sample_count = std::min(sample_count, num_bodies);
+  std::vector<double> errors(sample_count);
+
+  auto begin = std::chrono::high_resolution_clock::now();
+  for_each_range(pool, [&](int item, int begin, int end) {
+    for(int s = begin; s < end; ++s) {
+      int i = (int)((int64_t)s * num_bodies / sample_count);
+      vec3 a;
+      float u;
+      direct_sum(i, a, u);
+
+      float mag = length(a);
+      errors[s] = mag > 0 ? length(acc[i] - a) / mag : 0;
+    }
+  }, sample_count, 16);
+  auto end = std::chrono::high_resolution_clock::now();
+
+  force_error_t result { };
+  for(double e : errors) {
+    result.rms += e * e;
+    result.max = std::max(result.max, e);
+  }
+  if(sample_count) {
+    result.rms = sqrt(result.rms / sample_count);
+    result.direct_seconds = std::chrono::duration<double>(end - begin).count()
+      * num_bodies / sample_count;
+  }
+  return result;
+}
@@ -0,0 +1,159 @@
+#pragma once
+#include <type_traits>
+#include "simd.hxx"
+#include "aligned.hxx"
+#include "parallel.hxx"
+
+////////////////////////////////////////////////////////////////////////////////
+// All-pairs forces over structure-of-arrays bodies.
+//
+// integrate_shader gives each thread one body and streams the others
+// through a shared memory tile of NT bodies. This kernel does the same on
+// the CPU. Each SIMD lane holds one target body, and the sources are
+// broadcast one at a time from a tile small enough to stay in L1. Each
+// block of targets finishes a tile before moving to the next one, and the
+// targets' sums carry over between tiles.
+//
+// The inverse square root is the hardware estimate with one Newton step.
+// With mixed precision, each tile's partial sums are accumulated in float
+// and then added into double sums, so the rounding error doesn't grow with
+// the body count.
+//
+// The usual convention counts 20 flops per interaction.
+
+enum {
+  direct_flops = 20,
+
+  // 1024 sources are 16 KB of x, y, z and m: half of a typical L1d.
+  direct_tile = 1024,
+
+  // Targets per block. Two packets share each broadcast source.
+  direct_block = 2 * packet_width,
+
+  // Blocks per work item.
+  direct_grain = 16,
+};
+
+struct soa_bodies_t {
+  // Split pos into x, y, z and m, or only the bodies listed in indices. The
+  // arrays are padded with massless bodies to a whole number of blocks.
+  void assign(block_pool_t& pool, const vec4* pos, int count,
+    const int* indices = nullptr);
+
+  int count = 0;
+  aligned_vector_t<float> x, y, z, m;
+};
+
+inline void soa_bodies_t::assign(block_pool_t& pool, const vec4* pos,
+  int count2, const int* indices) {
+
+  count = count2;
+  int padded = (count + direct_block - 1) / direct_block * direct_block;
+  for(aligned_vector_t<float>* v : { &x, &y, &z, &m })
+    v->resize(padded);
+
+  for_each_range(pool, [&](int item, int begin, int end) {
+    for(int i = begin; i < end; ++i) {
+      vec4 p = i >= count ? vec4() : pos[indices ? indices[i] : i];
+      x[i] = p.x;
+      y[i] = p.y;
+      z[i] = p.z;
+      m[i] = p.w;
+    }
+  }, padded, 4096);
+}
+
+// Sum the sources [j0, j1) into the block of targets at i.
+inline void direct_tile_sums(const soa_bodies_t& bodies,
+  const soa_bodies_t& targets, int i, int j0, int j1, float softening2,
+  pfloat (&a)[2][4]) {
+
+  // Keep the sums in locals and unroll over the packets, so that the
+  // accumulators live in registers.
+  pfloat xi[2], yi[2], zi[2];
+  pfloat ax[2], ay[2], az[2], u[2];
+  @meta for(int k = 0; k < 2; ++k) {
+    xi[k] = *(const pfloat*)(targets.x.data() + i + k * packet_width);
+    yi[k] = *(const pfloat*)(targets.y.data() + i + k * packet_width);
+    zi[k] = *(const pfloat*)(targets.z.data() + i + k * packet_width);
+    ax[k] = ay[k] = az[k] = u[k] = 0.f;
+  }
+
+  for(int j = j0; j < j1; ++j) {
+    pfloat xj = bodies.x[j];
+    pfloat yj = bodies.y[j];
+    pfloat zj = bodies.z[j];
+    pfloat mj = bodies.m[j];
+
+    @meta for(int k = 0; k < 2; ++k) {
+      pfloat dx = xj - xi[k];
+      pfloat dy = yj - yi[k];
+      pfloat dz = zj - zi[k];
+      pfloat inv_dist = rsqrt(dx * dx + dy * dy + dz * dz + softening2);
+      pfloat s = mj * inv_dist;
+      pfloat s3 = s * inv_dist * inv_dist;
+      ax[k] += s3 * dx;
+      ay[k] += s3 * dy;
+      az[k] += s3 * dz;
+      u[k] += s;
+    }
+  }
+
+  @meta for(int k = 0; k < 2; ++k) {
+    a[k][0] = ax[k];
+    a[k][1] = ay[k];
+    a[k][2] = az[k];
+    a[k][3] = u[k];
+  }
+}
+
+// Write the acceleration and potential on each target from all bodies. The
+// targets must be a subset of the bodies. Target t is written to
+// indices[t], or t when indices is null. The potential excludes the
+// target's own softened self-interaction, like cpu_nbody_t::direct_sum.
+template<bool mixed>
+void direct_forces(block_pool_t& pool, const soa_bodies_t& bodies,
+  const soa_bodies_t& targets, const int* indices, float softening2,
+  vec3* acc, float* phi) {
+
+  typedef typename std::conditional<mixed, double, float>::type sum_t;
+
+  int count = bodies.count;
+  int num_targets = targets.count;
+  int num_blocks = (num_targets + direct_block - 1) / direct_block;
+  float inv_softening = softening2 > 0 ? 1 / sqrtf(softening2) : 0;
+
+  for_each_range(pool, [&](int item, int begin, int end) {
+    // The running sums for each block in the range, in ax, ay, az, u order.
+    sum_t sums[direct_grain][4][direct_block] { };
+
+    for(int j0 = 0; j0 < count; j0 += direct_tile) {
+      int j1 = std::min(j0 + direct_tile, count);
+      for(int b = begin; b < end; ++b) {
+        pfloat a[2][4];
+        direct_tile_sums(bodies, targets, direct_block * b, j0, j1,
+          softening2, a);
+
+        sum_t (&sum)[4][direct_block] = sums[b - begin];
+        for(int c = 0; c < 4; ++c) {
+          for(int k = 0; k < 2; ++k) {
+            for(int lane = 0; lane < packet_width; ++lane)
+              sum[c][k * packet_width + lane] += a[k][c][lane];
+          }
+        }
+      }
+    }
+
+    for(int b = begin; b < end; ++b) {
+      for(int lane = 0; lane < direct_block; ++lane) {
+        int t = direct_block * b + lane;
+        if(t < num_targets) {
+          int i = indices ? indices[t] : t;
+          const sum_t (&sum)[4][direct_block] = sums[b - begin];
+          acc[i] = vec3(sum[0][lane], sum[1][lane], sum[2][lane]);
+          phi[i] = -(float)sum[3][lane] + targets.m[t] * inv_softening;
+        }
+      }
+    }
+  }, num_blocks, direct_grain);
+}
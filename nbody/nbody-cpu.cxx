@@ -0,0 +1,287 @@
+// Headless driver for the CPU n-body solvers. This needs no GPU or OpenGL:
+// it loads a tipsy snapshot or seeds a random sphere, steps the simulation
+// and reports the time per step, the energy and momentum drift, the
+// all-pairs GFLOP/s and the force error of the approximate solvers against
+// the direct sum.
+
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <random>
+#include "tipsy_file.hxx"
+#include "cpu_nbody.hxx"
+
+template<typename type_t>
+const char* enum_to_string(type_t e) {
+  switch(e) {
+    @meta for enum(type_t e2 : type_t) {
+      case e2:
+        return @enum_name(e2);
+    }
+    default:
+      return nullptr;
+  }
+}
+
+struct options_t {
+  const char* tipsy = nullptr;
+  int num_bodies = 65536;
+  int steps = 10;
+  int num_threads = std::thread::hardware_concurrency();
+  float dt = .001f;
+  float softening = .01f;
+  float theta = .5f;
+  int leaf_size = 16;
+  int samples = 1024;
+  bool mixed_precision = false;
+  integrator_t integrator = integrator_t::euler;
+  int num_levels = 1;
+  float eta = .025f;
+
+  // Run both solvers in turn when compare is set.
+  solver_t solver = solver_t::barnes_hut;
+  bool compare = false;
+};
+
+inline void print_usage() {
+  printf(
+    "usage: nbody-cpu [options]\n"
+    "  -t, --tipsy PATH   load a tipsy snapshot instead of a random sphere\n"
+    "  -n, --bodies N     number of bodies in the random sphere (65536)\n"
+    "  -s, --steps N      number of time steps (10)\n"
+    "  -j, --threads N    worker threads (all cores)\n"
+    "  --dt DT            time step (0.001)\n"
+    "  --softening EPS    softening length (0.01)\n"
+    "  --theta THETA      Barnes-Hut opening angle (0.5)\n"
+    "  --leaf N           bodies per octree leaf (16)\n"
+    "  --samples N        bodies checked against the direct sum (1024)\n"
+    "  -S, --solver S     direct, simd, tree, or all to compare them (tree)\n"
+    "  -p, --precision P  single or mixed SIMD accumulation (single)\n"
+    "  -I, --integrator I euler, leapfrog or hermite (euler)\n"
+    "  -L, --levels N     block timestep levels (1)\n"
+    "  --eta ETA          timestep accuracy parameter (0.025)\n"
+  );
+}
+
+// Return 0 to run, 1 on error, and -1 to exit cleanly.
+inline int parse_options(int argc, char** argv, options_t& options) {
+  for(int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    auto is = [&](const char* a, const char* b = nullptr) {
+      return !strcmp(arg, a) || (b && !strcmp(arg, b));
+    };
+
+    if(is("-h", "--help")) {
+      print_usage();
+      return -1;
+    }
+
+    if(i + 1 == argc) {
+      fprintf(stderr, "missing value for %s\n", arg);
+      return 1;
+    }
+    const char* value = argv[++i];
+
+    if(is("-t", "--tipsy"))
+      options.tipsy = value;
+    else if(is("-n", "--bodies"))
+      options.num_bodies = atoi(value);
+    else if(is("-s", "--steps"))
+      options.steps = atoi(value);
+    else if(is("-j", "--threads"))
+      options.num_threads = atoi(value);
+    else if(is("--dt"))
+      options.dt = atof(value);
+    else if(is("--softening"))
+      options.softening = atof(value);
+    else if(is("--theta"))
+      options.theta = atof(value);
+    else if(is("--leaf"))
+      options.leaf_size = atoi(value);
+    else if(is("--samples"))
+      options.samples = atoi(value);
+    else if(is("-S", "--solver")) {
+      if(!strcmp(value, "direct"))
+        options.solver = solver_t::direct;
+      else if(!strcmp(value, "simd"))
+        options.solver = solver_t::direct_simd;
+      else if(!strcmp(value, "tree"))
+        options.solver = solver_t::barnes_hut;
+      else if(!strcmp(value, "all"))
+        options.compare = true;
+      else {
+        fprintf(stderr, "unknown solver %s\n", value);
+        return 1;
+      }
+    } else if(is("-p", "--precision")) {
+      if(!strcmp(value, "single"))
+        options.mixed_precision = false;
+      else if(!strcmp(value, "mixed"))
+        options.mixed_precision = true;
+      else {
+        fprintf(stderr, "unknown precision %s\n", value);
+        return 1;
+      }
+    } else if(is("-I", "--integrator")) {
+      if(!strcmp(value, "euler"))
+        options.integrator = integrator_t::euler;
+      else if(!strcmp(value, "leapfrog"))
+        options.integrator = integrator_t::leapfrog;
+      else if(!strcmp(value, "hermite"))
+        options.integrator = integrator_t::hermite;
+      else {
+        fprintf(stderr, "unknown integrator %s\n", value);
+        return 1;
+      }
+    } else if(is("-L", "--levels"))
+      options.num_levels = atoi(value);
+    else if(is("--eta"))
+      options.eta = atof(value);
+    else {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return 1;
+    }
+  }
+
+  if(options.num_bodies <= 0 || options.steps < 0 ||
+    options.num_threads <= 0 || options.leaf_size <= 0 ||
+    options.samples < 0 || options.num_levels < 1 ||
+    options.num_levels > 16) {
+    fprintf(stderr,
+      "invalid bodies, steps, threads, leaf size, samples or levels\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// A cold uniform sphere of unit mass and radius.
+inline void make_sphere(int count, std::vector<vec4>& positions,
+  std::vector<vec4>& velocities) {
+
+  std::mt19937 mt19937;
+  std::uniform_real_distribution<float> dist(-1, 1);
+
+  positions.resize(count);
+  velocities.resize(count);
+  for(int i = 0; i < count; ++i) {
+    vec3 p;
+    do {
+      p = vec3(dist(mt19937), dist(mt19937), dist(mt19937));
+    } while(dot(p, p) > 1);
+
+    positions[i] = vec4(p, 1.f / count);
+    velocities[i] = vec4(.1f * vec3(dist(mt19937), dist(mt19937),
+      dist(mt19937)), 0);
+  }
+}
+
+// Simulate from the initial state with one solver and report the time per
+// step and the energy and momentum drift.
+inline void run(const options_t& options, solver_t solver,
+  const std::vector<vec4>& positions, const std::vector<vec4>& velocities) {
+
+  cpu_nbody_t nbody(options.num_threads);
+  nbody.solver = solver;
+  nbody.softening = options.softening;
+  nbody.theta = options.theta;
+  nbody.leaf_size = options.leaf_size;
+  nbody.mixed_precision = options.mixed_precision;
+  nbody.integrator = options.integrator;
+  nbody.num_levels = options.num_levels;
+  nbody.eta = options.eta;
+  nbody.set_bodies(positions.data(), velocities.data(), positions.size());
+
+  // The energy of the initial state.
+  nbody.compute_forces();
+  double e0 = nbody.energy();
+  momentum_t p0 = nbody.momentum();
+
+  double seconds[2] { };
+  int64_t evaluations = 0;
+  for(int step = 0; step < options.steps; ++step) {
+    nbody.step(options.dt, 1);
+    seconds[0] += nbody.build_seconds;
+    seconds[1] += nbody.force_seconds;
+    evaluations += nbody.evaluations;
+  }
+
+  // The energy of the final state.
+  nbody.compute_forces();
+  double e1 = nbody.energy();
+  momentum_t p1 = nbody.momentum();
+
+  int steps = std::max(options.steps, 1);
+  double total = seconds[0] + seconds[1];
+  printf("%s, %s with %d levels:\n", enum_to_string(solver),
+    enum_to_string(options.integrator), options.num_levels);
+  if(solver_t::barnes_hut == solver)
+    printf("  build     %9.3f ms/step\n", 1000 * seconds[0] / steps);
+  printf("  forces    %9.3f ms/step\n", 1000 * seconds[1] / steps);
+  printf("  total     %9.3f ms/step  %.2f Mbody-steps/s\n",
+    1000 * total / steps, (double)nbody.num_bodies * steps / total / 1.0e6);
+  printf("  energy    %.6e -> %.6e  drift %.3e\n", e0, e1,
+    fabs((e1 - e0) / e0));
+  printf("  momentum  drift %.3e\n",
+    length(p1.total - p0.total) / p0.scale);
+  printf("  forces on %.0f bodies/step  (%.1f%% of all-body steps)\n",
+    (double)evaluations / steps, 100.0 * evaluations / steps /
+    nbody.num_bodies);
+
+  if(solver_t::barnes_hut != solver && seconds[1]) {
+    // Count every pair at the conventional flops per interaction.
+    double rate = (double)nbody.num_bodies * evaluations / seconds[1];
+    printf("  %.3f Ginteractions/s  %.1f GFLOP/s\n", rate / 1.0e9,
+      direct_flops * rate / 1.0e9);
+  }
+
+  if(solver_t::direct != solver && options.samples) {
+    // Check the accelerations of the final state against the direct sum.
+    force_error_t error = nbody.force_error(options.samples);
+    printf("  force error rms %.3e  max %.3e\n", error.rms, error.max);
+    printf("  direct sum %.3f ms/step (extrapolated)  %.1fx speedup\n",
+      1000 * error.direct_seconds, error.direct_seconds /
+      (nbody.build_seconds + nbody.force_seconds));
+  }
+}
+
+int main(int argc, char** argv) {
+  options_t options;
+  if(int result = parse_options(argc, argv, options)) {
+    if(result > 0)
+      print_usage();
+    return std::max(result, 0);
+  }
+
+  // Both solvers start from the same bodies.
+  std::vector<vec4> positions, velocities;
+  if(options.tipsy) {
+    tipsy_file_t file;
+    if(!file.open(options.tipsy))
+      return 1;
+
+    auto begin = std::chrono::high_resolution_clock::now();
+    block_pool_t pool(options.num_threads);
+    file.read(pool, positions, velocities);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - begin).count();
+    printf("read %s in %.3f ms  %.1f MB/s\n", options.tipsy, 1000 * seconds,
+      file.size / seconds / 1.0e6);
+
+  } else
+    make_sphere(options.num_bodies, positions, velocities);
+
+  printf("%d bodies, %d steps on %d threads, theta = %g\n",
+    (int)positions.size(), options.steps, options.num_threads, options.theta);
+
+  if(options.compare) {
+    @meta for enum(solver_t solver : solver_t) {
+      run(options, solver, positions, velocities);
+    }
+
+  } else
+    run(options, options.solver, positions, velocities);
+
+  return 0;
+}
@@ -1,9 +1,12 @@
 #define USE_IMGUI
 
 #include "appglfw.hxx"
-#include "tipsy.h"
+#include "tipsy_file.hxx"
+#include "cpu_nbody.hxx"
+#include "checkpoint.hxx"
 #include <random>
 #include <memory>
+#include <thread>
 
 struct uniforms_t {
   mat4 proj;
@@ -133,12 +136,20 @@ struct system_t {
   system_t(size_t num_particles);
   ~system_t();
 
+  // Move the bodies between the GPU buffers and the CPU solver.
+  void start_cpu();
+  void stop_cpu();
+
   size_t num_particles;
 
   // Storage buffers for positions and velocities.
   GLuint pos_buffer[2], vel_buffer;
   GLuint vao[2];
   int active = 0;
+
+  // When cpu is set, it holds the simulation and the positions are uploaded
+  // to pos_buffer[active] after each step for rendering.
+  std::unique_ptr<cpu_nbody_t> cpu;
 };
 
 system_t::system_t(size_t num_particles) : num_particles(num_particles) {
@@ -178,6 +189,27 @@ system_t::~system_t() {
   glDeleteBuffers(1, &vel_buffer);
 }
 
+void system_t::start_cpu() {
+  // Read back the current state.
+  std::vector<vec4> positions(num_particles), velocities(num_particles);
+  glGetNamedBufferSubData(pos_buffer[active], 0, sizeof(vec4) * num_particles,
+    positions.data());
+  glGetNamedBufferSubData(vel_buffer, 0, sizeof(vec4) * num_particles,
+    velocities.data());
+
+  cpu = std::make_unique<cpu_nbody_t>(std::thread::hardware_concurrency());
+  cpu->set_bodies(positions.data(), velocities.data(), num_particles);
+}
+
+void system_t::stop_cpu() {
+  // Hand the bodies back to integrate_shader.
+  glNamedBufferSubData(pos_buffer[active], 0, sizeof(vec4) * num_particles,
+    cpu->positions.data());
+  glNamedBufferSubData(vel_buffer, 0, sizeof(vec4) * num_particles,
+    cpu->velocities.data());
+  cpu.reset();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 enum nbody_config_t {
@@ -210,6 +242,13 @@ static const NBodyParams demoParams[] = {
 
 const int NumDemos = demoParams.length;
 
+enum class nbody_solver_t {
+  gpu_all_pairs,
+  cpu_all_pairs,
+  cpu_all_pairs_simd,
+  cpu_barnes_hut,
+};
+
 struct myapp_t : app_t {
   myapp_t(int num_particles);
   ~myapp_t();
@@ -230,6 +269,11 @@ struct myapp_t : app_t {
 
   void reset_tipsy(const char* path);
 
+  // Copy the current state to the checkpoint writer, or load a checkpoint
+  // into a new system.
+  void save_checkpoint(checkpoint_format_t format);
+  bool restore_checkpoint(const char* path);
+
   void configure();
   void update_uniforms();
   void advance();
@@ -239,6 +283,26 @@ struct myapp_t : app_t {
   int active_demo = 3;
   int particle_count;
 
+  nbody_solver_t solver = nbody_solver_t::gpu_all_pairs;
+  float theta = .5f;
+  bool mixed_precision = false;
+  integrator_t integrator = integrator_t::euler;
+  int num_levels = 1;
+  float eta = .025f;
+
+  // Energy and momentum when the CPU solver started, and the most recent.
+  double energy0 = 0, energy = 0;
+  momentum_t momentum0 { }, momentum { };
+  force_error_t force_error { };
+
+  // Steps and simulated time since the system was launched.
+  int64_t step = 0;
+  double time = 0;
+
+  checkpoint_writer_t checkpoints;
+  bool auto_checkpoint = false;
+  int checkpoint_interval = 1000;
+
   uniforms_t uniforms;
   GLuint ubo;
 
@@ -364,6 +428,11 @@ void myapp_t::display() {
   update_uniforms();
   advance();
   render();
+
+  ++step;
+  time += uniforms.dt;
+  if(auto_checkpoint && 0 == step % checkpoint_interval)
+    save_checkpoint(checkpoint_format_t::checkpoint);
 }
 
 void myapp_t::configure() {
@@ -418,6 +487,57 @@ void myapp_t::configure() {
     if(ImGui::Button("Load galaxy_20K.bin"))
       reset_tipsy("galaxy_20K.bin");
 
+    const char* solvers[] {
+      "GPU all-pairs", "CPU all-pairs", "CPU all-pairs SIMD", "CPU Barnes-Hut"
+    };
+    ImGui::Combo("Solver", (int*)&solver, solvers, 4);
+    ImGui::SliderFloat("theta", &theta, .1f, 1.f);
+    ImGui::Checkbox("Mixed precision", &mixed_precision);
+
+    // The CPU integrators. damping only applies to Euler.
+    const char* integrators[] { "Euler", "Leapfrog", "Hermite" };
+    ImGui::Combo("Integrator", (int*)&integrator, integrators, 3);
+    ImGui::SliderInt("Timestep levels", &num_levels, 1, 8);
+    ImGui::SliderFloat("eta", &eta, .001f, .1f);
+
+    if(cpu_nbody_t* cpu = system->cpu.get()) {
+      ImGui::Text("build %.2f ms  forces %.2f ms", 1000 * cpu->build_seconds,
+        1000 * cpu->force_seconds);
+      ImGui::Text("energy drift %.3e", fabs((energy - energy0) / energy0));
+      ImGui::Text("momentum drift %.3e",
+        length(momentum.total - momentum0.total) / momentum0.scale);
+      ImGui::Text("forces on %.1f%% of bodies per step",
+        100.0 * cpu->evaluations / cpu->num_bodies);
+      if(solver_t::barnes_hut != cpu->solver && cpu->force_seconds)
+        ImGui::Text("%.1f GFLOP/s", direct_flops * (double)cpu->num_bodies *
+          cpu->evaluations / cpu->force_seconds / 1.0e9);
+
+      // Sum a sample of bodies directly to check the approximation.
+      if(ImGui::Button("Measure force error"))
+        force_error = cpu->force_error(1024);
+      if(force_error.direct_seconds)
+        ImGui::Text("force error rms %.2e max %.2e\ndirect sum %.1f ms",
+          force_error.rms, force_error.max,
+          1000 * force_error.direct_seconds);
+    }
+
+    ImGui::NewLine();
+    ImGui::Text("step %d  time %.3f", (int)step, time);
+    if(ImGui::Button("Save checkpoint"))
+      save_checkpoint(checkpoint_format_t::checkpoint);
+    ImGui::SameLine();
+    if(ImGui::Button("Save tipsy"))
+      save_checkpoint(checkpoint_format_t::tipsy);
+    ImGui::SameLine();
+    if(ImGui::Button("Restore"))
+      restore_checkpoint("nbody.ckpt");
+
+    ImGui::Checkbox("Checkpoint every", &auto_checkpoint);
+    ImGui::SliderInt("steps", &checkpoint_interval, 100, 10000);
+    ImGui::Text("%d written  %d dropped  %d failed  last %.1f ms",
+      (int)checkpoints.written, (int)checkpoints.dropped,
+      (int)checkpoints.failed, 1000 * checkpoints.last_seconds);
+
     if(ImGui::Button("Next demo")) {
       active_demo = (active_demo + 1) % NumDemos;
       set_demo_params(active_demo);
@@ -439,6 +559,49 @@ void myapp_t::update_uniforms() {
 }
 
 void myapp_t::advance() {
+  if(nbody_solver_t::gpu_all_pairs != solver) {
+    if(!system->cpu) {
+      system->start_cpu();
+      energy0 = 0;
+      force_error = { };
+    }
+
+    cpu_nbody_t& cpu = *system->cpu;
+    switch(solver) {
+      case nbody_solver_t::cpu_all_pairs:
+        cpu.solver = solver_t::direct;
+        break;
+      case nbody_solver_t::cpu_all_pairs_simd:
+        cpu.solver = solver_t::direct_simd;
+        break;
+      default:
+        cpu.solver = solver_t::barnes_hut;
+        break;
+    }
+    cpu.mixed_precision = mixed_precision;
+    cpu.softening = uniforms.softening;
+    cpu.theta = theta;
+    cpu.integrator = integrator;
+    cpu.num_levels = num_levels;
+    cpu.eta = eta;
+    cpu.step(uniforms.dt, uniforms.damping);
+
+    // With Euler the forces are from the state before the step.
+    energy = cpu.energy();
+    momentum = cpu.momentum();
+    if(!energy0) {
+      energy0 = energy;
+      momentum0 = momentum;
+    }
+
+    // Upload the new positions for rendering.
+    glNamedBufferSubData(system->pos_buffer[system->active], 0,
+      sizeof(vec4) * system->num_particles, cpu.positions.data());
+    return;
+
+  } else if(system->cpu)
+    system->stop_cpu();
+
   // Integrate particles.
   glUseProgram(integrate_program);
 
@@ -548,6 +711,8 @@ void myapp_t::reset_positions(int num_particles, nbody_config_t config) {
   }
 
   system.reset(new system_t(num_particles));
+  step = 0;
+  time = 0;
 
   std::string s = "n-body: " + std::to_string(num_particles) + " particles";
   glfwSetWindowTitle(window, s.c_str());
@@ -609,25 +774,33 @@ void myapp_t::reset_expand(int num_particles, vec4* positions,
 }
 
 void myapp_t::reset_tipsy(const char* filename) {
-  std::vector<vec4> positions;
-  std::vector<vec4> velocities;
-  std::vector<int> bodies;
-  int total, first, second, third;
-  read_tipsy_file(positions, velocities, bodies, filename, 
-    total, first, second, third);
-
-  size_t num_particles = positions.size();
+  // Keep the current system if the file doesn't load.
+  tipsy_file_t file;
+  if(!file.open(filename))
+    return;
+
+  size_t num_particles = file.count();
   std::string s = "n-body: " + std::to_string(num_particles) + " particles";
   glfwSetWindowTitle(window, s.c_str());
 
   particle_count = num_particles;
   system.reset(new system_t(num_particles));
+  step = 0;
+  time = 0;
 
-  // Upload seed positions and velocities.
-  glNamedBufferSubData(system->pos_buffer[0], 0, sizeof(vec4) * num_particles, 
-    positions.data());
-  glNamedBufferSubData(system->vel_buffer, 0, sizeof(vec4) * num_particles,
-    velocities.data());
+  // Upload each chunk as soon as it's decoded, while the workers decode the
+  // rest of the file. The integration shader bounds checks the body count,
+  // so the bodies aren't padded to a multiple of 256.
+  std::vector<vec4> positions(num_particles);
+  std::vector<vec4> velocities(num_particles);
+  block_pool_t pool(std::thread::hardware_concurrency());
+  file.stream(pool, positions.data(), velocities.data(), nullptr, 65536,
+    [&](int begin, int end) {
+      glNamedBufferSubData(system->pos_buffer[0], sizeof(vec4) * begin,
+        sizeof(vec4) * (end - begin), positions.data() + begin);
+      glNamedBufferSubData(system->vel_buffer, sizeof(vec4) * begin,
+        sizeof(vec4) * (end - begin), velocities.data() + begin);
+    });
 
   // Reset the camera position.
   camera.distance = 50;
@@ -637,11 +810,77 @@ void myapp_t::reset_tipsy(const char* filename) {
   uniforms.point_size = 1.1;
 }
 
-int main() {
+void myapp_t::save_checkpoint(checkpoint_format_t format) {
+  // Drop this checkpoint if the writer still holds both buffers.
+  checkpoint_t* checkpoint = checkpoints.acquire();
+  if(!checkpoint)
+    return;
+
+  size_t num_particles = system->num_particles;
+  checkpoint->step = step;
+  checkpoint->time = time;
+  checkpoint->set_params(uniforms);
+  checkpoint->resize(num_particles);
+
+  if(cpu_nbody_t* cpu = system->cpu.get()) {
+    checkpoint->positions = cpu->positions;
+    checkpoint->velocities = cpu->velocities;
+
+  } else {
+    glGetNamedBufferSubData(system->pos_buffer[system->active], 0,
+      sizeof(vec4) * num_particles, checkpoint->positions.data());
+    glGetNamedBufferSubData(system->vel_buffer, 0,
+      sizeof(vec4) * num_particles, checkpoint->velocities.data());
+  }
+
+  // Checkpoints replace each other. Tipsy outputs are numbered by step for
+  // the analysis tools.
+  std::string path = "nbody.ckpt";
+  if(checkpoint_format_t::tipsy == format) {
+    char name[32];
+    snprintf(name, 32, "nbody_%08d.tipsy", (int)step);
+    path = name;
+  }
+  checkpoints.submit(checkpoint, std::move(path), format);
+}
+
+bool myapp_t::restore_checkpoint(const char* path) {
+  checkpoint_file_t file;
+  if(!file.open(path))
+    return false;
+
+  uniforms_t uniforms2;
+  if(!file.get_params(uniforms2)) {
+    fprintf(stderr, "%s: the parameters do not match uniforms_t\n", path);
+    return false;
+  }
+  uniforms = uniforms2;
+
+  size_t num_particles = file.count();
+  std::string s = "n-body: " + std::to_string(num_particles) + " particles";
+  glfwSetWindowTitle(window, s.c_str());
+
+  particle_count = num_particles;
+  system.reset(new system_t(num_particles));
+  step = file.header.step;
+  time = file.header.time;
+
+  // Upload straight from the mapping.
+  glNamedBufferSubData(system->pos_buffer[0], 0, sizeof(vec4) * num_particles,
+    file.positions());
+  glNamedBufferSubData(system->vel_buffer, 0, sizeof(vec4) * num_particles,
+    file.velocities());
+  return true;
+}
+
+int main(int argc, char** argv) {
   glfwInit();
   gl3wInit();
 
+  // Resume from a checkpoint given on the command line.
   myapp_t app(30720);
+  if(argc > 1 && !app.restore_checkpoint(argv[1]))
+    return 1;
   app.loop();
 
   return 0;
@@ -0,0 +1,289 @@
+#pragma once
+#include <vector>
+#include <cfloat>
+#include "parallel.hxx"
+#include "radix_sort.hxx"
+
+////////////////////////////////////////////////////////////////////////////////
+// Barnes-Hut octree over bodies sorted in Morton order.
+//
+// Each step:
+//  1. sort_bodies computes 30-bit Morton codes in the bounding cube and
+//     radix sorts them. The caller gathers its bodies into that order, so
+//     every node of the tree covers a contiguous run of bodies.
+//  2. build splits the runs level by level. A node's children are the runs
+//     sharing its next three Morton bits, found by binary search. Each level
+//     is built in parallel and the nodes are stored breadth-first, so the
+//     children of a node are adjacent.
+//  3. The monopole moments are accumulated from the deepest level up.
+//
+// A node is opened when the body is closer than size / theta plus the
+// offset of its center of mass from the cell center. This is the Salmon &
+// Warren bound, which never accepts a cell that contains the body.
+
+struct octree_t {
+  enum {
+    code_bits = 30,
+    max_depth = code_bits / 3,
+  };
+
+  struct node_t {
+    // Monopole.
+    vec3 com;
+    float mass;
+
+    // Squared opening distance.
+    float open2;
+
+    // Bodies [begin, end) in Morton order.
+    int begin, end;
+
+    // Children are nodes [first_child, first_child + num_children).
+    // num_children is 0 for leaves.
+    int first_child;
+    int num_children;
+  };
+
+  // Compute the Morton order of the bodies. Returns the gather indices.
+  const std::vector<uint32_t>& sort_bodies(block_pool_t& pool,
+    const vec4* pos, int count);
+
+  // Build the tree over the bodies after they're gathered into Morton order.
+  void build(block_pool_t& pool, const vec4* pos, int count, float theta,
+    int leaf_size);
+
+  // Sum the acceleration and potential on a body at p. self is the body's
+  // index, to skip it in the leaves.
+  void evaluate(const vec4* pos, vec3 p, int self, float softening2,
+    vec3& acc, float& phi) const;
+
+  // The bounding cube.
+  vec3 corner;
+  float size;
+
+  std::vector<uint32_t> codes;
+  std::vector<uint32_t> order;
+  std::vector<node_t> nodes;
+
+  // Nodes [levels[d], levels[d + 1]) are at depth d.
+  std::vector<int> levels;
+
+  // Per-node scratch for the level build.
+  std::vector<int> child_counts;
+
+  cpu_radix_sort radix_sort;
+};
+
+inline uint32_t spread_bits3(uint32_t x) {
+  x &= 0x3ff;
+  x = (x | (x<< 16)) & 0x030000ff;
+  x = (x | (x<<  8)) & 0x0300f00f;
+  x = (x | (x<<  4)) & 0x030c30c3;
+  x = (x | (x<<  2)) & 0x09249249;
+  return x;
+}
+
+inline const std::vector<uint32_t>& octree_t::sort_bodies(block_pool_t& pool,
+  const vec4* pos, int count) {
+
+  // Find the bounding box with one partial box per range.
+  const int grain = 4096;
+  int num_items = (count + grain - 1) / grain;
+  std::vector<vec3> mins(num_items, vec3(FLT_MAX));
+  std::vector<vec3> maxs(num_items, vec3(-FLT_MAX));
+  for_each_range(pool, [&](int item, int begin, int end) {
+    vec3 a = mins[item], b = maxs[item];
+    for(int i = begin; i < end; ++i) {
+      a = min(a, pos[i].xyz);
+      b = max(b, pos[i].xyz);
+    }
+    mins[item] = a;
+    maxs[item] = b;
+  }, count, grain);
+
+  vec3 lo(FLT_MAX), hi(-FLT_MAX);
+  for(int item = 0; item < num_items; ++item) {
+    lo = min(lo, mins[item]);
+    hi = max(hi, maxs[item]);
+  }
+
+  // Expand the box into a cube, with a little slack so the bodies on the
+  // far faces still quantize inside it.
+  vec3 extent = hi - lo;
+  size = max(max(max(extent.x, extent.y), extent.z), FLT_MIN) * 1.0001f;
+  corner = lo;
+
+  codes.resize(count);
+  float scale = 1024 / size;
+  for_each_range(pool, [&](int item, int begin, int end) {
+    for(int i = begin; i < end; ++i) {
+      ivec3 cell = clamp((ivec3)((pos[i].xyz - corner) * scale), 0, 1023);
+      codes[i] = spread_bits3(cell.x) | (spread_bits3(cell.y)<< 1) |
+        (spread_bits3(cell.z)<< 2);
+    }
+  }, count, grain);
+
+  radix_sort.sort(pool, codes, order, code_bits);
+  return order;
+}
+
+inline void octree_t::build(block_pool_t& pool, const vec4* pos, int count,
+  float theta, int leaf_size) {
+
+  nodes.clear();
+  levels.clear();
+  if(!count)
+    return;
+
+  // The root covers every body.
+  nodes.push_back({ vec3(), 0, 0, 0, count, -1, 0 });
+  levels.push_back(0);
+  levels.push_back(1);
+
+  for(int depth = 0; depth < max_depth; ++depth) {
+    int first = levels[depth];
+    int last = levels[depth + 1];
+    int shift = code_bits - 3 * (depth + 1);
+
+    // 1. Count the non-empty children of each splittable node.
+    child_counts.resize(last - first);
+    for_each_range(pool, [&](int item, int begin, int end) {
+      for(int n = first + begin; n < first + end; ++n) {
+        node_t& node = nodes[n];
+        int num_children = 0;
+        if(node.end - node.begin > leaf_size) {
+          for(int i = node.begin; i < node.end; ) {
+            // Skip to the first body with a different digit.
+            uint32_t digit = codes[i]>> shift;
+            i = std::upper_bound(codes.begin() + i, codes.begin() + node.end,
+              (digit<< shift) | ((1u<< shift) - 1)) - codes.begin();
+            ++num_children;
+          }
+        }
+        child_counts[n - first] = num_children;
+      }
+    }, last - first, 256);
+
+    // 2. Allocate the next level.
+    int next = last;
+    for(int n = first; n < last; ++n) {
+      nodes[n].first_child = next;
+      nodes[n].num_children = child_counts[n - first];
+      next += child_counts[n - first];
+    }
+    if(next == last)
+      break;
+
+    nodes.resize(next);
+    levels.push_back(next);
+
+    // 3. Fill in the children's body ranges.
+    for_each_range(pool, [&](int item, int begin, int end) {
+      for(int n = first + begin; n < first + end; ++n) {
+        const node_t& node = nodes[n];
+        int child = node.first_child;
+        for(int i = node.begin; i < node.end && node.num_children; ) {
+          uint32_t digit = codes[i]>> shift;
+          int j = std::upper_bound(codes.begin() + i,
+            codes.begin() + node.end, (digit<< shift) | ((1u<< shift) - 1)) -
+            codes.begin();
+          nodes[child++] = { vec3(), 0, 0, i, j, -1, 0 };
+          i = j;
+        }
+      }
+    }, last - first, 256);
+  }
+
+  // Accumulate the moments from the deepest level up.
+  float inv_theta = 1 / theta;
+  for(int depth = (int)levels.size() - 2; depth >= 0; --depth) {
+    int first = levels[depth];
+    int last = levels[depth + 1];
+    float cell_size = size / (1<< depth);
+
+    for_each_range(pool, [&](int item, int begin, int end) {
+      for(int n = first + begin; n < first + end; ++n) {
+        node_t& node = nodes[n];
+
+        vec3 moment { };
+        float mass = 0;
+        if(node.num_children) {
+          for(int c = 0; c < node.num_children; ++c) {
+            const node_t& child = nodes[node.first_child + c];
+            moment += child.mass * child.com;
+            mass += child.mass;
+          }
+        } else {
+          for(int i = node.begin; i < node.end; ++i) {
+            moment += pos[i].w * pos[i].xyz;
+            mass += pos[i].w;
+          }
+        }
+
+        // Massless cells are never opened or summed.
+        node.mass = mass;
+        node.com = mass > 0 ? moment / mass : vec3();
+
+        // The cell's center follows from the Morton code of any body in it.
+        uint32_t code = codes[node.begin];
+        ivec3 cell(0);
+        for(int d = 0; d < depth; ++d) {
+          uint32_t digit = code>> (code_bits - 3 * (d + 1));
+          cell = 2 * cell + ivec3(digit & 1, (digit>> 1) & 1,
+            (digit>> 2) & 1);
+        }
+        vec3 center = corner + cell_size * (vec3(cell) + .5f);
+
+        float open = cell_size * inv_theta + length(node.com - center);
+        node.open2 = open * open;
+      }
+    }, last - first, 256);
+  }
+}
+
+inline void octree_t::evaluate(const vec4* pos, vec3 p, int self,
+  float softening2, vec3& acc, float& phi) const {
+
+  // The tree is at most max_depth deep and each level pushes at most 8
+  // children.
+  int stack[8 * max_depth + 8];
+  int top = 0;
+  stack[top++] = 0;
+
+  vec3 a { };
+  float u = 0;
+  while(top) {
+    const node_t& node = nodes[stack[--top]];
+    vec3 r = node.com - p;
+    float dist2 = dot(r, r);
+
+    if(dist2 >= node.open2) {
+      // Far enough away. Use the monopole.
+      float inv_dist = inversesqrt(dist2 + softening2);
+      float s = node.mass * inv_dist;
+      a += s * inv_dist * inv_dist * r;
+      u -= s;
+
+    } else if(node.num_children) {
+      for(int c = 0; c < node.num_children; ++c) {
+        if(nodes[node.first_child + c].mass > 0)
+          stack[top++] = node.first_child + c;
+      }
+
+    } else {
+      // Sum the bodies in the leaf directly.
+      for(int i = node.begin; i < node.end; ++i) {
+        if(i != self) {
+          vec3 r = pos[i].xyz - p;
+          float inv_dist = inversesqrt(dot(r, r) + softening2);
+          float s = pos[i].w * inv_dist;
+          a += s * inv_dist * inv_dist * r;
+          u -= s;
+        }
+      }
+    }
+  }
+
+  acc = a;
+  phi = u;
+}
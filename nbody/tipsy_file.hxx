@@ -0,0 +1,288 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include "tipsy.h"
+#include "parallel.hxx"
+#include "aligned.hxx"
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory-mapped tipsy snapshots.
+//
+// read_tipsy_file pulls records through an ifstream one at a time and grows
+// its vectors body by body. tipsy_file_t maps the file instead, checks the
+// header against the file size, and decodes ranges of bodies in parallel
+// straight from the page cache into arrays sized up front.
+//
+// The records are stored gas, then dark, then star. Every kind starts with
+// the mass, position and velocity, so a body only needs its kind's offset,
+// record size and the locations of its softening and id.
+
+// Bodies in structure-of-arrays form. Each array starts on a cache line.
+struct tipsy_soa_t {
+  void resize(int count) {
+    for(auto* v : { &x, &y, &z, &mass, &vx, &vy, &vz, &eps })
+      v->resize(count);
+    ids.resize(count);
+  }
+
+  aligned_vector_t<float> x, y, z, mass;
+  aligned_vector_t<float> vx, vy, vz, eps;
+  aligned_vector_t<int> ids;
+};
+
+// One decoded body. pos.w holds the mass and vel.w the softening, as in
+// read_tipsy_file.
+struct tipsy_body_t {
+  vec4 pos;
+  vec4 vel;
+  int id;
+};
+
+struct tipsy_file_t {
+  tipsy_file_t() { }
+  ~tipsy_file_t() { close(); }
+
+  tipsy_file_t(const tipsy_file_t&) = delete;
+  tipsy_file_t& operator=(const tipsy_file_t&) = delete;
+
+  // Map the file and validate the header. Prints the reason and returns
+  // false on failure.
+  bool open(const char* path);
+  void close();
+
+  int count() const { return header.nbodies; }
+
+  // Call sink(i, body) for each body in [begin, end).
+  template<typename sink_t>
+  void decode(int begin, int end, sink_t sink) const;
+
+  // Decode every body in parallel. ids may be null.
+  void read(block_pool_t& pool, std::vector<vec4>& pos,
+    std::vector<vec4>& vel, std::vector<int>* ids = nullptr) const;
+  void read(block_pool_t& pool, tipsy_soa_t& soa) const;
+
+  // Decode into arrays of count() bodies in chunks of chunk_size bodies.
+  // func(begin, end) is called on this thread for each chunk in the order
+  // the chunks complete, so the caller can consume decoded bodies while the
+  // workers are still decoding the rest.
+  template<typename func_t>
+  void stream(block_pool_t& pool, vec4* pos, vec4* vel, int* ids,
+    int chunk_size, func_t func) const;
+
+  dump header { };
+  size_t size = 0;
+
+private:
+  struct segment_t {
+    // Bodies [first, end) are in this segment.
+    int first, end;
+
+    // Byte offset of the first record and the record size.
+    size_t offset, stride;
+
+    // Byte offsets of the softening and id in a record. Gas records have
+    // no id, so their bodies are numbered by index.
+    int eps, id;
+  };
+
+  const char* data = nullptr;
+  segment_t segments[3];
+};
+
+inline bool tipsy_file_t::open(const char* path) {
+  close();
+
+  int fd = ::open(path, O_RDONLY);
+  if(-1 == fd) {
+    fprintf(stderr, "cannot open file %s\n", path);
+    return false;
+  }
+
+  struct stat statbuf;
+  if(-1 == fstat(fd, &statbuf)) {
+    fprintf(stderr, "cannot stat file %s\n", path);
+    ::close(fd);
+    return false;
+  }
+
+  if(statbuf.st_size < (off_t)sizeof(dump)) {
+    fprintf(stderr, "file %s is too small to be a tipsy file\n", path);
+    ::close(fd);
+    return false;
+  }
+
+  // The mapping outlives the descriptor.
+  size = statbuf.st_size;
+  void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if(MAP_FAILED == p) {
+    fprintf(stderr, "cannot map file %s\n", path);
+    size = 0;
+    return false;
+  }
+  data = (const char*)p;
+
+  // Start reading ahead. The decode faults in the rest on every worker.
+  madvise(p, size, MADV_WILLNEED);
+  memcpy(&header, data, sizeof(dump));
+
+  const char* error = nullptr;
+  int64_t total = (int64_t)header.nsph + header.ndark + header.nstar;
+  if(3 != header.ndim) {
+    error = 3 == __builtin_bswap32(header.ndim) ?
+      "big-endian tipsy files are not supported" : "ndim is not 3";
+
+  } else if(header.nsph < 0 || header.ndark < 0 || header.nstar < 0 ||
+    header.nbodies != total) {
+    error = "nbodies does not match nsph + ndark + nstar";
+
+  } else if(!total) {
+    error = "the snapshot holds no bodies";
+
+  } else {
+    // Lay out the segments and require the file to end after the last one.
+    segments[0] = { 0, header.nsph, sizeof(dump), sizeof(gas_particle),
+      offsetof(gas_particle, hsmooth), -1 };
+    segments[1] = { segments[0].end, segments[0].end + header.ndark,
+      segments[0].offset + segments[0].stride * header.nsph,
+      sizeof(dark_particle), offsetof(dark_particle, eps),
+      offsetof(dark_particle, phi) };
+    segments[2] = { segments[1].end, segments[1].end + header.nstar,
+      segments[1].offset + segments[1].stride * header.ndark,
+      sizeof(star_particle), offsetof(star_particle, eps),
+      offsetof(star_particle, phi) };
+
+    size_t expected = segments[2].offset + segments[2].stride * header.nstar;
+    if(expected != size)
+      error = "the file size does not match the header";
+  }
+
+  if(error) {
+    fprintf(stderr, "%s: %s\n", path, error);
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+inline void tipsy_file_t::close() {
+  if(data)
+    munmap((void*)data, size);
+  data = nullptr;
+  size = 0;
+  header = { };
+}
+
+template<typename sink_t>
+void tipsy_file_t::decode(int begin, int end, sink_t sink) const {
+  for(const segment_t& seg : segments) {
+    int a = std::max(begin, seg.first);
+    int b = std::min(end, seg.end);
+    if(a >= b)
+      continue;
+
+    // Every record size is a multiple of 4 and the mapping is page-aligned,
+    // so the fields are aligned.
+    const char* record = data + seg.offset + seg.stride * (a - seg.first);
+    for(int i = a; i < b; ++i, record += seg.stride) {
+      const float* f = (const float*)record;
+      tipsy_body_t body;
+      body.pos = vec4(f[1], f[2], f[3], f[0]);
+      body.vel = vec4(f[4], f[5], f[6], *(const float*)(record + seg.eps));
+      body.id = seg.id >= 0 ? *(const int*)(record + seg.id) : i;
+      sink(i, body);
+    }
+  }
+}
+
+inline void tipsy_file_t::read(block_pool_t& pool, std::vector<vec4>& pos,
+  std::vector<vec4>& vel, std::vector<int>* ids) const {
+
+  pos.resize(count());
+  vel.resize(count());
+  if(ids)
+    ids->resize(count());
+
+  int* ids2 = ids ? ids->data() : nullptr;
+  for_each_range(pool, [&](int item, int begin, int end) {
+    decode(begin, end, [&](int i, const tipsy_body_t& body) {
+      pos[i] = body.pos;
+      vel[i] = body.vel;
+      if(ids2)
+        ids2[i] = body.id;
+    });
+  }, count(), 16384);
+}
+
+inline void tipsy_file_t::read(block_pool_t& pool, tipsy_soa_t& soa) const {
+  soa.resize(count());
+  for_each_range(pool, [&](int item, int begin, int end) {
+    decode(begin, end, [&](int i, const tipsy_body_t& body) {
+      soa.x[i] = body.pos.x;
+      soa.y[i] = body.pos.y;
+      soa.z[i] = body.pos.z;
+      soa.mass[i] = body.pos.w;
+      soa.vx[i] = body.vel.x;
+      soa.vy[i] = body.vel.y;
+      soa.vz[i] = body.vel.z;
+      soa.eps[i] = body.vel.w;
+      soa.ids[i] = body.id;
+    });
+  }, count(), 16384);
+}
+
+template<typename func_t>
+void tipsy_file_t::stream(block_pool_t& pool, vec4* pos, vec4* vel,
+  int* ids, int chunk_size, func_t func) const {
+
+  int num_chunks = (count() + chunk_size - 1) / chunk_size;
+  std::vector<int> chunks(num_chunks);
+  std::iota(chunks.begin(), chunks.end(), 0);
+
+  // The workers push finished chunks here.
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<int> done;
+
+  pool.execute(chunks, 1, [&](int tid, int level, int chunk) {
+    int begin = chunk_size * chunk;
+    int end = std::min(begin + chunk_size, count());
+    decode(begin, end, [&](int i, const tipsy_body_t& body) {
+      pos[i] = body.pos;
+      vel[i] = body.vel;
+      if(ids)
+        ids[i] = body.id;
+    });
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      done.push_back(chunk);
+    }
+    cv.notify_one();
+    return true;
+  });
+
+  for(int i = 0; i < num_chunks; ++i) {
+    int chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return done.size(); });
+      chunk = done.front();
+      done.pop_front();
+    }
+
+    int begin = chunk_size * chunk;
+    func(begin, std::min(begin + chunk_size, count()));
+  }
+  pool.wait();
+}
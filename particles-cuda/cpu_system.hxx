@@ -0,0 +1,482 @@
+#pragma once
+#include <memory>
+#include <numeric>
+#include <atomic>
+#include "block_pool.hxx"
+#include "radix_sort.hxx"
+#include "particles.hxx"
+
+////////////////////////////////////////////////////////////////////////////////
+// Multi-threaded CPU backend. This runs the same sort, collide and integrate
+// steps as system_t, on a persistent thread pool. The particles are stored
+// as structure-of-arrays, so the gather and integrate loops stream through
+// contiguous floats instead of strided vec4s.
+
+struct soa_vec3_t {
+  std::vector<float> x, y, z;
+
+  void resize(int count) {
+    x.resize(count);
+    y.resize(count);
+    z.resize(count);
+  }
+
+  vec3 get(int i) const {
+    return vec3(x[i], y[i], z[i]);
+  }
+  void set(int i, vec3 v) {
+    x[i] = v.x;
+    y[i] = v.y;
+    z[i] = v.z;
+  }
+
+  void swap(soa_vec3_t& rhs) {
+    x.swap(rhs.x);
+    y.swap(rhs.y);
+    z.swap(rhs.z);
+  }
+};
+
+// How sort_particles bins the particles into cells.
+enum class broadphase_t {
+  // Sort the cell hashes with cpu_radix_sort and find the cell boundaries.
+  radix_sort,
+
+  // The cells are known and bounded, so count the particles in each cell,
+  // scan the counts into cell_ranges and scatter the particles directly.
+  counting_sort,
+
+  // Start from the last step's bins and only move the particles that
+  // changed cells. Falls back to counting_sort when the bins are stale or
+  // too many particles moved.
+  incremental,
+};
+
+struct cpu_system_t {
+  cpu_system_t(int num_threads) : pool(num_threads) { }
+
+  // Resize, preserving the existing particles.
+  void resize(int count);
+
+  // Copy to and from the vec4 layout of the GL buffers.
+  void set_data_range(const vec4* pos, const vec4* vel, int first, int count);
+  void get_positions(vec4* pos);
+  void get_velocities(vec4* vel);
+
+  void update(const SimParams& params);
+  void sort_particles(const SimParams& params);
+  void collide(const SimParams& params);
+  void integrate(const SimParams& params);
+
+  // Binning strategies for sort_particles. Each leaves gather_indices,
+  // cell_ranges and the sorted cell_hash for gather().
+  void hash_particles(const SimParams& params, std::vector<uint32_t>& hash);
+  void bin_radix(const SimParams& params);
+  void bin_counting(const SimParams& params);
+  bool bin_incremental(const SimParams& params);
+  void scan_cells(int num_cells);
+  void gather();
+
+  // Call func(index) for each index in [0, count) on the pool. This is the
+  // CPU counterpart of transform<use_cuda>.
+  template<typename func_t>
+  void transform(const func_t& func, int count);
+
+  // Call func(item, begin, end) for each run of grain indices.
+  template<typename func_t>
+  void for_each_range(const func_t& func, int count, int grain);
+
+  block_pool_t pool;
+  int num_particles = 0;
+
+  soa_vec3_t positions, velocities;
+  soa_vec3_t positions_out, velocities_out;
+
+  // The .w component of the positions, which selects the color.
+  std::vector<float> colors, colors_out;
+
+  std::vector<uint32_t> cell_hash;
+  std::vector<uint32_t> gather_indices;
+  std::vector<ivec2> cell_ranges;
+
+  broadphase_t broadphase = broadphase_t::incremental;
+  cpu_radix_sort radix_sort;
+
+  // Scratch for counting sort. cell_counts holds the count of each cell and
+  // is then reused as the scatter cursors.
+  std::vector<uint32_t> cell_hash2;
+  std::vector<ivec2> cell_ranges2;
+  std::unique_ptr<std::atomic<int>[]> cell_counts;
+  int cell_capacity = 0;
+  std::vector<int> partials;
+
+  // The incremental mode needs the bins of the previous step on the same
+  // grid. Changing the particles invalidates them.
+  bool bins_valid = false;
+  ivec3 bins_grid = 0;
+  std::vector<std::vector<uint32_t> > mover_lists;
+  std::vector<uint32_t> movers;
+
+  // Particles that changed cells in the last incremental step, or -1 if it
+  // fell back to a full counting sort.
+  int num_movers = -1;
+};
+
+template<typename func_t>
+void cpu_system_t::for_each_range(const func_t& func, int count, int grain) {
+  std::vector<int> items((count + grain - 1) / grain);
+  std::iota(items.begin(), items.end(), 0);
+
+  pool.execute(items, 1, [&](int tid, int level, int item) {
+    int begin = grain * item;
+    int end = std::min(begin + grain, count);
+    func(item, begin, end);
+    return true;
+  });
+  pool.wait();
+}
+
+template<typename func_t>
+void cpu_system_t::transform(const func_t& func, int count) {
+  // Each work item is a run of grain particles.
+  for_each_range([&](int item, int begin, int end) {
+    for(int index = begin; index < end; ++index)
+      func(index);
+  }, count, 1024);
+}
+
+inline void cpu_system_t::resize(int count) {
+  num_particles = count;
+  positions.resize(count);
+  velocities.resize(count);
+  positions_out.resize(count);
+  velocities_out.resize(count);
+  colors.resize(count);
+  colors_out.resize(count);
+  cell_hash.resize(count);
+  cell_hash2.resize(count);
+  gather_indices.resize(count);
+  bins_valid = false;
+}
+
+inline void cpu_system_t::set_data_range(const vec4* pos, const vec4* vel,
+  int first, int count) {
+
+  bins_valid = false;
+  for(int i = 0; i < count; ++i) {
+    positions.set(first + i, pos[i].xyz);
+    colors[first + i] = pos[i].w;
+    velocities.set(first + i, vel[i].xyz);
+  }
+}
+
+inline void cpu_system_t::get_positions(vec4* pos) {
+  transform([=](int index) {
+    pos[index] = vec4(positions.get(index), colors[index]);
+  }, num_particles);
+}
+
+inline void cpu_system_t::get_velocities(vec4* vel) {
+  transform([=](int index) {
+    vel[index] = vec4(velocities.get(index), 0);
+  }, num_particles);
+}
+
+inline void cpu_system_t::update(const SimParams& params) {
+  sort_particles(params);
+  collide(params);
+  integrate(params);
+}
+
+inline void cpu_system_t::sort_particles(const SimParams& params) {
+  int num_cells = params.numCells();
+  cell_ranges.resize(num_cells);
+  if(num_cells > cell_capacity) {
+    cell_counts = std::make_unique<std::atomic<int>[]>(num_cells);
+    cell_capacity = num_cells;
+  }
+
+  // The bins of the last step are only meaningful on the same grid.
+  ivec3 grid = params.gridSize;
+  if(grid.x != bins_grid.x || grid.y != bins_grid.y || grid.z != bins_grid.z)
+    bins_valid = false;
+
+  switch(broadphase) {
+    case broadphase_t::radix_sort:
+      bin_radix(params);
+      break;
+
+    case broadphase_t::counting_sort:
+      hash_particles(params, cell_hash);
+      bin_counting(params);
+      break;
+
+    case broadphase_t::incremental:
+      if(!bin_incremental(params))
+        bin_counting(params);
+      break;
+  }
+
+  bins_valid = true;
+  bins_grid = grid;
+  gather();
+}
+
+inline void cpu_system_t::hash_particles(const SimParams& params,
+  std::vector<uint32_t>& hash) {
+
+  transform([&](int index) {
+    ivec3 gridPos = calcGridPos(positions.get(index), params);
+    hash[index] = hashGridPos(gridPos, params);
+  }, num_particles);
+}
+
+inline void cpu_system_t::bin_radix(const SimParams& params) {
+  int count = num_particles;
+  int num_cells = params.numCells();
+
+  // 1. Hash the particles into cells.
+  hash_particles(params, cell_hash);
+
+  // 2. Sort by hash. Only sort the bits that can be set.
+  int end_bit = 0;
+  while((1<< end_bit) < num_cells)
+    ++end_bit;
+  radix_sort.sort(pool, cell_hash, gather_indices, end_bit);
+
+  // 3. Find the cell ranges. Each bound is written by exactly one particle.
+  transform([&](int index) {
+    cell_ranges[index] = ivec2(0);
+  }, num_cells);
+
+  transform([&](int index) {
+    int hash = cell_hash[index];
+    int hash_prev = index ? (int)cell_hash[index - 1] : -1;
+
+    if(hash_prev < hash) {
+      if(index) cell_ranges[hash_prev].y = index;
+      cell_ranges[hash].x = index;
+    }
+
+    if(index == count - 1)
+      cell_ranges[hash].y = count;
+
+  }, count);
+}
+
+// Scan cell_counts into cell_ranges and clear the counts.
+inline void cpu_system_t::scan_cells(int num_cells) {
+  const int grain = 4096;
+  partials.resize((num_cells + grain - 1) / grain);
+
+  for_each_range([&](int item, int begin, int end) {
+    int sum = 0;
+    for(int c = begin; c < end; ++c)
+      sum += cell_counts[c].load(std::memory_order_relaxed);
+    partials[item] = sum;
+  }, num_cells, grain);
+
+  int sum = 0;
+  for(int& x : partials) {
+    int count = x;
+    x = sum;
+    sum += count;
+  }
+
+  for_each_range([&](int item, int begin, int end) {
+    int sum = partials[item];
+    for(int c = begin; c < end; ++c) {
+      int count = cell_counts[c].load(std::memory_order_relaxed);
+      cell_ranges[c] = ivec2(sum, sum + count);
+      sum += count;
+      cell_counts[c].store(0, std::memory_order_relaxed);
+    }
+  }, num_cells, grain);
+}
+
+// Expects the unsorted hashes in cell_hash.
+inline void cpu_system_t::bin_counting(const SimParams& params) {
+  int count = num_particles;
+  int num_cells = params.numCells();
+
+  // 1. Count the particles in each cell.
+  transform([&](int c) {
+    cell_counts[c].store(0, std::memory_order_relaxed);
+  }, num_cells);
+
+  transform([&](int index) {
+    cell_counts[cell_hash[index]].fetch_add(1, std::memory_order_relaxed);
+  }, count);
+
+  // 2. Scan the counts into the cell ranges.
+  scan_cells(num_cells);
+
+  // 3. Scatter each particle into its cell.
+  transform([&](int index) {
+    int hash = cell_hash[index];
+    int slot = cell_counts[hash].fetch_add(1, std::memory_order_relaxed);
+    gather_indices[cell_ranges[hash].x + slot] = index;
+  }, count);
+
+  // 4. The scatter order within a cell depends on thread timing. Restore
+  //    index order, which makes the result identical to the stable radix
+  //    sort. Cells only hold a handful of particles, so insertion sort.
+  transform([&](int c) {
+    ivec2 range = cell_ranges[c];
+    uint32_t* data = gather_indices.data();
+    for(int i = range.x + 1; i < range.y; ++i) {
+      uint32_t x = data[i];
+      int j = i;
+      for(; j > range.x && data[j - 1] > x; --j)
+        data[j] = data[j - 1];
+      data[j] = x;
+    }
+
+    for(int i = range.x; i < range.y; ++i)
+      cell_hash2[i] = c;
+  }, num_cells);
+
+  cell_hash.swap(cell_hash2);
+  num_movers = -1;
+}
+
+// Between steps the particles are already in cell order, and most stay in
+// their cell. Keep each cell's stayers in place at the front of its new
+// range and append the particles that arrived, in index order. Only the
+// movers are handled serially.
+inline bool cpu_system_t::bin_incremental(const SimParams& params) {
+  int count = num_particles;
+  int num_cells = params.numCells();
+
+  if(!bins_valid) {
+    hash_particles(params, cell_hash);
+    return false;
+  }
+
+  // 1. Rehash and collect the particles that changed cells.
+  hash_particles(params, cell_hash2);
+
+  const int grain = 4096;
+  mover_lists.resize((count + grain - 1) / grain);
+  for_each_range([&](int item, int begin, int end) {
+    std::vector<uint32_t>& list = mover_lists[item];
+    list.clear();
+    for(int index = begin; index < end; ++index) {
+      if(cell_hash2[index] != cell_hash[index])
+        list.push_back(index);
+    }
+  }, count, grain);
+
+  movers.clear();
+  for(const std::vector<uint32_t>& list : mover_lists)
+    movers.insert(movers.end(), list.begin(), list.end());
+
+  if(movers.size() > count / 4) {
+    // Too much has changed. Rebin everything.
+    cell_hash.swap(cell_hash2);
+    return false;
+  }
+
+  std::stable_sort(movers.begin(), movers.end(), [&](uint32_t a, uint32_t b) {
+    return cell_hash2[a] < cell_hash2[b];
+  });
+
+  // 2. Adjust the old counts by the movers and scan for the new ranges.
+  transform([&](int c) {
+    ivec2 range = cell_ranges[c];
+    cell_counts[c].store(range.y - range.x, std::memory_order_relaxed);
+  }, num_cells);
+
+  for(uint32_t index : movers) {
+    cell_counts[cell_hash[index]].fetch_sub(1, std::memory_order_relaxed);
+    cell_counts[cell_hash2[index]].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  cell_ranges2.swap(cell_ranges);
+  cell_ranges.resize(num_cells);
+  scan_cells(num_cells);
+
+  // 3. Copy the stayers of each cell and note where the arrivals start.
+  transform([&](int c) {
+    ivec2 old_range = cell_ranges2[c];
+    int first = cell_ranges[c].x;
+    int dest = first;
+    for(int index = old_range.x; index < old_range.y; ++index) {
+      if(cell_hash2[index] == c)
+        gather_indices[dest++] = index;
+    }
+    cell_counts[c].store(dest - first, std::memory_order_relaxed);
+  }, num_cells);
+
+  // 4. Append the arrivals.
+  for(uint32_t index : movers) {
+    int hash = cell_hash2[index];
+    int slot = cell_counts[hash].fetch_add(1, std::memory_order_relaxed);
+    gather_indices[cell_ranges[hash].x + slot] = index;
+  }
+
+  // Keep the sorted hashes for the next step.
+  transform([&](int index) {
+    cell_hash[index] = cell_hash2[gather_indices[index]];
+  }, count);
+
+  num_movers = movers.size();
+  return true;
+}
+
+// Reorder the particles by gather_indices.
+inline void cpu_system_t::gather() {
+  transform([&](int index) {
+    int gather = gather_indices[index];
+    positions_out.set(index, positions.get(gather));
+    velocities_out.set(index, velocities.get(gather));
+    colors_out[index] = colors[gather];
+  }, num_particles);
+
+  positions.swap(positions_out);
+  velocities.swap(velocities_out);
+  colors.swap(colors_out);
+}
+
+inline void cpu_system_t::collide(const SimParams& params) {
+  float r = params.particleRadius;
+
+  transform([&](int index) {
+    vec3 f { };
+    vec3 pos = positions.get(index);
+    vec3 vel = velocities.get(index);
+
+    ivec3 gridPos = calcGridPos(pos, params);
+
+    for(int z = -1; z <= 1; ++z) {
+      for(int y = -1; y <= 1; ++y) {
+        for(int x = -1; x <= 1; ++x) {
+          int hash = hashGridPos(gridPos + ivec3(x, y, z), params);
+          ivec2 range = cell_ranges[hash];
+
+          for(int i = range.x; i < range.y; ++i) {
+            if(i != index) {
+              f += collide_spheres(pos, positions.get(i), vel,
+                velocities.get(i), r, r, params);
+            }
+          }
+        }
+      }
+    }
+
+    velocities_out.set(index, vel + f);
+
+  }, num_particles);
+
+  velocities.swap(velocities_out);
+}
+
+inline void cpu_system_t::integrate(const SimParams& params) {
+  transform([&](int index) {
+    vec3 pos = positions.get(index);
+    vec3 vel = velocities.get(index);
+    integrate_particle(pos, vel, params);
+    positions.set(index, pos);
+    velocities.set(index, vel);
+  }, num_particles);
+}
@@ -0,0 +1,173 @@
+// Headless driver for the CPU backend of the particles simulation. This
+// needs no GPU, OpenGL or CUDA: it drops a cube of particles into the box,
+// steps the simulation and reports the time spent in each stage.
+
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include "particles.hxx"
+#include "cpu_system.hxx"
+
+template<typename type_t>
+const char* enum_to_string(type_t e) {
+  switch(e) {
+    @meta for enum(type_t e2 : type_t) {
+      case e2:
+        return @enum_name(e2);
+    }
+    default:
+      return nullptr;
+  }
+}
+
+struct options_t {
+  int num_bodies = 262144;
+  float radius = 1.f / 128;
+  int steps = 100;
+  int num_threads = std::thread::hardware_concurrency();
+
+  // Run every broadphase mode in turn when compare is set.
+  broadphase_t broadphase = broadphase_t::incremental;
+  bool compare = false;
+};
+
+inline void print_usage() {
+  printf(
+    "usage: particles-cpu [options]\n"
+    "  -n, --bodies N     number of particles (262144)\n"
+    "  -r, --radius R     particle radius (0.0078125)\n"
+    "  -s, --steps N      number of time steps (100)\n"
+    "  -j, --threads N    worker threads (all cores)\n"
+    "  -b, --broadphase B radix, counting, incremental, or all to compare\n"
+    "                     them (incremental)\n"
+  );
+}
+
+// Return 0 to run, 1 on error, and -1 to exit cleanly.
+inline int parse_options(int argc, char** argv, options_t& options) {
+  for(int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    auto is = [&](const char* a, const char* b) {
+      return !strcmp(arg, a) || !strcmp(arg, b);
+    };
+
+    if(is("-h", "--help")) {
+      print_usage();
+      return -1;
+    }
+
+    if(i + 1 == argc) {
+      fprintf(stderr, "missing value for %s\n", arg);
+      return 1;
+    }
+    const char* value = argv[++i];
+
+    if(is("-n", "--bodies"))
+      options.num_bodies = atoi(value);
+    else if(is("-r", "--radius"))
+      options.radius = atof(value);
+    else if(is("-s", "--steps"))
+      options.steps = atoi(value);
+    else if(is("-j", "--threads"))
+      options.num_threads = atoi(value);
+    else if(is("-b", "--broadphase")) {
+      if(!strcmp(value, "radix"))
+        options.broadphase = broadphase_t::radix_sort;
+      else if(!strcmp(value, "counting"))
+        options.broadphase = broadphase_t::counting_sort;
+      else if(!strcmp(value, "incremental"))
+        options.broadphase = broadphase_t::incremental;
+      else if(!strcmp(value, "all"))
+        options.compare = true;
+      else {
+        fprintf(stderr, "unknown broadphase %s\n", value);
+        return 1;
+      }
+    } else {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return 1;
+    }
+  }
+
+  if(options.num_bodies <= 0 || options.radius <= 0 || options.steps < 0 ||
+    options.num_threads <= 0) {
+    fprintf(stderr, "invalid particle count, radius, steps or threads\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// Simulate from the initial state with one broadphase mode and report the
+// time spent in each stage.
+inline void run(const options_t& options, const SimParams& params,
+  broadphase_t broadphase, const std::vector<vec4>& pos_host,
+  const std::vector<vec4>& vel_host) {
+
+  cpu_system_t system(options.num_threads);
+  system.broadphase = broadphase;
+  system.resize(params.numBodies);
+  system.set_data_range(pos_host.data(), vel_host.data(), 0,
+    params.numBodies);
+
+  // Accumulate the time spent in each stage.
+  double seconds[3] { };
+  auto time = [&](int stage, auto f) {
+    auto begin = std::chrono::high_resolution_clock::now();
+    f();
+    auto end = std::chrono::high_resolution_clock::now();
+    seconds[stage] += std::chrono::duration<double>(end - begin).count();
+  };
+
+  int64_t movers = 0;
+  for(int step = 0; step < options.steps; ++step) {
+    time(0, [&] { system.sort_particles(params); });
+    time(1, [&] { system.collide(params); });
+    time(2, [&] { system.integrate(params); });
+    movers += std::max(system.num_movers, 0);
+  }
+
+  int steps = std::max(options.steps, 1);
+  double total = seconds[0] + seconds[1] + seconds[2];
+  printf("%s:\n", enum_to_string(broadphase));
+  printf("  sort      %9.3f ms/step", 1000 * seconds[0] / steps);
+  if(broadphase_t::incremental == broadphase)
+    printf("  %.2f%% moved cells", 100.0 * movers / steps / params.numBodies);
+  printf("\n");
+  printf("  collide   %9.3f ms/step\n", 1000 * seconds[1] / steps);
+  printf("  integrate %9.3f ms/step\n", 1000 * seconds[2] / steps);
+  printf("  total     %9.3f ms/step  %.2f Mparticle-steps/s\n",
+    1000 * total / steps, (double)params.numBodies * steps / total / 1.0e6);
+}
+
+int main(int argc, char** argv) {
+  options_t options;
+  if(int result = parse_options(argc, argv, options)) {
+    if(result > 0)
+      print_usage();
+    return std::max(result, 0);
+  }
+
+  SimParams params { };
+  params.numBodies = options.num_bodies;
+  params.particleRadius = options.radius;
+  params.update_grid();
+
+  // Every mode starts from the same particles.
+  std::vector<vec4> pos_host, vel_host;
+  make_grid(params, params.numBodies, pos_host, vel_host);
+
+  printf("%d particles, %d cells, %d steps on %d threads\n",
+    params.numBodies, params.numCells(), options.steps, options.num_threads);
+
+  if(options.compare) {
+    @meta for enum(broadphase_t mode : broadphase_t) {
+      run(options, params, mode, pos_host, vel_host);
+    }
+
+  } else
+    run(options, params, options.broadphase, pos_host, vel_host);
+
+  return 0;
+}
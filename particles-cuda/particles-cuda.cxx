@@ -28,6 +28,10 @@
 #define USE_IMGUI
 #include "../include/appglfw.hxx"
 
+// Simulation parameters and the multi-threaded CPU backend.
+#include "particles.hxx"
+#include "cpu_system.hxx"
+
 using namespace mgpu::gl;
 
 // Create dual-use buffers.
@@ -197,105 +201,11 @@ void cub_radix_sort::sort(uint32_t* keys1, uint32_t* indices1, size_t count) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-
-// Simulation parameters are stored in host memory in system_t kept in UBO 1
-// to support shaders.
-struct SimParams {
-  // Particle characteristics.
-  int   numBodies         = 30000;
-  float particleRadius    = 1.f / 64;
-
-  // Particle distribution. This world box is always centered at the origin.
-  vec3  worldSize         = vec3(2, 2, 1.5);
-  vec3  cellSize          = 0;
-  ivec3 gridSize          = 0;
-
-  // Integration.
-  vec3  gravity           = vec3(0, -.0003, 0);
-  float deltaTime         = 0.3f;
-  float globalDamping     = 1;
-
-  // Physics.
-  float spring            = 0.5f;
-  float damping           = 0.02f;
-  float shear             = 0.1f;
-  float attraction        = 0;
-  float boundaryDamping   = -0.5f;
-
-  // TODO: The wrecking ball.
-  vec3  colliderPos       = vec3(-1.2, -0.8, 0.8);
-  float colliderRadius    = 0.2f;
-
-  // Rendering parameters.
-  mat4 view               = mat4();
-  mat4 proj               = mat4();
-  float pointScale        = 0;
-  float pointRadius       = 0.0625f;
-  float fov               = radians(60.0f);
-
-  int sort_backend        = 0;
-  int collide_backend     = 0;
-  int integrate_backend   = 0;
-
-  vec3 worldMax() const noexcept { return  worldSize / 2; }
-  vec3 worldMin() const noexcept { return -worldSize / 2; }
-
-  int numCells() const noexcept {
-    return gridSize.x * gridSize.y * gridSize.z;
-  }
-
-  int cellHash(ivec3 cell) const noexcept {
-    return cell.x + gridSize.x * (cell.y + gridSize.y * cell.z);
-  }
-};
-
 // Park the simulation parameters at ubo 1 and keep it there throughout the
 // frame. UBO 0 is reserved for gl_transform.
 [[spirv::uniform(1)]]
 SimParams sim_params_ubo;
 
-inline vec3 collide_spheres(vec3 posA, vec3 posB, vec3 velA, vec3 velB,
-  float radiusA, float radiusB, const SimParams& params) {
-
-  vec3 relPos = posB - posA;
-  float dist = length(relPos);
-  float collideDist = radiusA + radiusB;
-
-  vec3 force { };
-  if(dist < collideDist) {
-    vec3 norm = relPos / dist;
-
-    // relative velocity.
-    vec3 relVel = velB - velA;
-
-    // relative tangential velocity.
-    vec3 tanVel = relVel - dot(relVel, relVel) * norm;
-
-    // spring force.
-    force = -params.spring * (collideDist - dist) * norm;
-    
-    // dashpot (damping) fgorce
-    force += params.damping * relVel;
-
-    // tangential shear force
-    force += params.shear * tanVel;
-
-    // attraction
-    force += params.attraction * relPos;
-  }
-
-  return force;
-}
-
-inline ivec3 calcGridPos(vec3 p, const SimParams& params) {
-  return (ivec3)floor((p - params.worldMin()) / params.cellSize);
-}
-
-inline int hashGridPos(ivec3 p, const SimParams& params) {
-  p = clamp(p, ivec3(0), params.gridSize - 1);
-  return params.cellHash(p);
-}
-
 struct system_t {
   system_t(SimParams params);
   
@@ -317,6 +227,10 @@ struct system_t {
   template<bool use_cuda> 
   void collide();
 
+  // Move the particles between the GL buffers and the CPU backend.
+  void start_cpu();
+  void stop_cpu();
+
   // Host and device copies of SimParams.
   SimParams params;  
   gl_buffer_t<const SimParams> params_ubo;
@@ -339,20 +253,13 @@ struct system_t {
   // Cache of buffers for merge sort.
   mergesort_pipeline_t<uint32_t, uint32_t> opengl_sort;
   cub_radix_sort cuda_sort;
-};
 
-inline float frand(float range) {
-  return (range / RAND_MAX) * rand();
-}
-inline float frand(float min, float max) {
-  return min + frand(max - min);
-}
-inline float frand() {
-  return frand(1);
-}
-inline vec3 frand3(float r) {
-  return vec3(frand(-r, r), frand(-r, r), frand(-r, r));
-}
+  // When use_cpu is set, the CPU backend holds the simulation and the
+  // positions are uploaded each frame for rendering.
+  bool use_cpu = false;
+  std::unique_ptr<cpu_system_t> cpu;
+  std::vector<vec4> cpu_staging;
+};
 
 system_t::system_t(SimParams params) : params(params) {
   reset();
@@ -370,12 +277,12 @@ void system_t::resize(bool clear) {
     velocities_out.resize(num_particles);
     cell_hash.resize(num_particles);
     gather_indices.resize(num_particles);
+
+    if(cpu)
+      cpu->resize(num_particles);
   }
 
-  // Compute an optimal grid size.
-  float diam = 2 * params.particleRadius;
-  params.gridSize = max(1, ivec3(floor(params.worldSize / diam)));
-  params.cellSize = params.worldSize / (vec3)params.gridSize;
+  params.update_grid();
   cell_ranges.resize(params.numCells());
 
   if(clear)
@@ -389,42 +296,60 @@ void system_t::reset() {
 }
 
 void system_t::init_grid(int count) {
-  int s = (int)ceil(powf((float)count, 1.f / 3));
-  float spacing = 2 * params.particleRadius;
-  float jitter = .1f * params.particleRadius;
-
-  int num_particles = params.numBodies;
-  int first = num_particles - count;
-
-  float r = params.particleRadius;
-  float coef = 1.f / count;
-
-  float extent = spacing * s + jitter;
-  vec3 center = vec3(
-    (params.worldSize.x - extent) / 2,   // center in x
-     params.worldSize.y - extent,        // place at the top in y
-    (params.worldSize.z - extent) / 2    // center in z
-  ) + params.worldMin();
-
-  std::vector<vec4> pos_host(count);
-  std::vector<vec4> vel_host(count);
-  for(int z = 0, index = 0; z < s; ++z) {
-    for(int y = 0; y < s; ++y) {
-      for(int x = 0; x < s && index < count; ++x, ++index) {
-        vec3 pos = spacing * vec3(x, y, z) + r + frand(jitter) + center;
-        pos_host[index] = vec4(pos, coef * index);
-
-        // Give the particle some downward velocity.
-        vel_host[index] = vec4(0, -.03, 0, 0);
-      }
-    }
-  }
+  std::vector<vec4> pos_host, vel_host;
+  make_grid(params, count, pos_host, vel_host);
 
+  int first = params.numBodies - count;
   positions.set_data_range(pos_host.data(), first, count);
   velocities.set_data_range(vel_host.data(), first, count);
+
+  if(cpu)
+    cpu->set_data_range(pos_host.data(), vel_host.data(), first, count);
+}
+
+void system_t::start_cpu() {
+  int num_particles = params.numBodies;
+  cpu = std::make_unique<cpu_system_t>(std::thread::hardware_concurrency());
+  cpu->resize(num_particles);
+
+  // Read the particles back from the GL buffers.
+  std::vector<vec4> vel_host(num_particles);
+  cpu_staging.resize(num_particles);
+  glGetNamedBufferSubData(positions.gl_buffer, 0,
+    sizeof(vec4) * num_particles, cpu_staging.data());
+  glGetNamedBufferSubData(velocities.gl_buffer, 0,
+    sizeof(vec4) * num_particles, vel_host.data());
+  cpu->set_data_range(cpu_staging.data(), vel_host.data(), 0, num_particles);
+}
+
+void system_t::stop_cpu() {
+  int num_particles = params.numBodies;
+  cpu_staging.resize(num_particles);
+
+  cpu->get_positions(cpu_staging.data());
+  positions.set_data_range(cpu_staging.data(), 0, num_particles);
+  cpu->get_velocities(cpu_staging.data());
+  velocities.set_data_range(cpu_staging.data(), 0, num_particles);
+
+  cpu.reset();
 }
 
 void system_t::update(float deltaTime) {
+  if(use_cpu) {
+    if(!cpu)
+      start_cpu();
+
+    cpu->update(params);
+
+    // Upload the positions for rendering.
+    cpu_staging.resize(params.numBodies);
+    cpu->get_positions(cpu_staging.data());
+    positions.set_data_range(cpu_staging.data(), 0, params.numBodies);
+    return;
+
+  } else if(cpu)
+    stop_cpu();
+
   // Reorder the particles so that we can perform fast collision detection.
   if(1 == params.sort_backend)
     sort_particles<true>();
@@ -602,24 +527,7 @@ void system_t::integrate() {
 
     vec3 pos = pos4.xyz;
     vec3 vel = vel4.xyz;
-
-    // Apply gravity and damping.
-    vel += params.gravity;
-    vel *= params.globalDamping;
-
-    // Integrate the position.
-    pos += vel * params.deltaTime;
-
-    // Collide with the cube sides.
-    vec3 min = params.worldMin() + params.particleRadius;
-    bvec3 clip_min = pos < min;
-    pos = clip_min ? min : pos;
-    vel *= clip_min ? params.boundaryDamping : 1;
-
-    vec3 max = params.worldMax() - params.particleRadius;
-    bvec3 clip_max = pos > max;
-    pos = clip_max ? max : pos;
-    vel *= clip_max ? params.boundaryDamping : 1;
+    integrate_particle(pos, vel, params);
 
     // Store updated terms.
     pos_data[index] = vec4(pos, pos4.w);
@@ -851,6 +759,13 @@ void myapp_t::configure() {
     ImGui::Combo("Sort backend", &params.sort_backend, backends, 2);
     ImGui::Combo("Collide backend", &params.collide_backend, backends, 2);
     ImGui::Combo("Integrate backend", &params.integrate_backend, backends, 2);
+    ImGui::Checkbox("Simulate on CPU", &system->use_cpu);
+    if(system->cpu) {
+      const char* broadphases[] { "Radix sort", "Counting sort", "Incremental" };
+      int broadphase = (int)system->cpu->broadphase;
+      ImGui::Combo("CPU broadphase", &broadphase, broadphases, 3);
+      system->cpu->broadphase = (broadphase_t)broadphase;
+    }
 
     if(ImGui::Button("New Cube"))
       system->reset();
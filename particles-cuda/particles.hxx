@@ -0,0 +1,172 @@
+#pragma once
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+
+// Simulation state and physics shared by the OpenGL, CUDA and CPU backends.
+
+// Simulation parameters are stored in host memory in system_t kept in UBO 1
+// to support shaders.
+struct SimParams {
+  // Particle characteristics.
+  int   numBodies         = 30000;
+  float particleRadius    = 1.f / 64;
+
+  // Particle distribution. This world box is always centered at the origin.
+  vec3  worldSize         = vec3(2, 2, 1.5);
+  vec3  cellSize          = 0;
+  ivec3 gridSize          = 0;
+
+  // Integration.
+  vec3  gravity           = vec3(0, -.0003, 0);
+  float deltaTime         = 0.3f;
+  float globalDamping     = 1;
+
+  // Physics.
+  float spring            = 0.5f;
+  float damping           = 0.02f;
+  float shear             = 0.1f;
+  float attraction        = 0;
+  float boundaryDamping   = -0.5f;
+
+  // TODO: The wrecking ball.
+  vec3  colliderPos       = vec3(-1.2, -0.8, 0.8);
+  float colliderRadius    = 0.2f;
+
+  // Rendering parameters.
+  mat4 view               = mat4();
+  mat4 proj               = mat4();
+  float pointScale        = 0;
+  float pointRadius       = 0.0625f;
+  float fov               = radians(60.0f);
+
+  int sort_backend        = 0;
+  int collide_backend     = 0;
+  int integrate_backend   = 0;
+
+  vec3 worldMax() const noexcept { return  worldSize / 2; }
+  vec3 worldMin() const noexcept { return -worldSize / 2; }
+
+  // Compute an optimal grid size.
+  void update_grid() noexcept {
+    float diam = 2 * particleRadius;
+    gridSize = max(1, ivec3(floor(worldSize / diam)));
+    cellSize = worldSize / (vec3)gridSize;
+  }
+
+  int numCells() const noexcept {
+    return gridSize.x * gridSize.y * gridSize.z;
+  }
+
+  int cellHash(ivec3 cell) const noexcept {
+    return cell.x + gridSize.x * (cell.y + gridSize.y * cell.z);
+  }
+};
+
+inline vec3 collide_spheres(vec3 posA, vec3 posB, vec3 velA, vec3 velB,
+  float radiusA, float radiusB, const SimParams& params) {
+
+  vec3 relPos = posB - posA;
+  float dist = length(relPos);
+  float collideDist = radiusA + radiusB;
+
+  vec3 force { };
+  if(dist < collideDist) {
+    vec3 norm = relPos / dist;
+
+    // relative velocity.
+    vec3 relVel = velB - velA;
+
+    // relative tangential velocity.
+    vec3 tanVel = relVel - dot(relVel, relVel) * norm;
+
+    // spring force.
+    force = -params.spring * (collideDist - dist) * norm;
+    
+    // dashpot (damping) fgorce
+    force += params.damping * relVel;
+
+    // tangential shear force
+    force += params.shear * tanVel;
+
+    // attraction
+    force += params.attraction * relPos;
+  }
+
+  return force;
+}
+
+inline void integrate_particle(vec3& pos, vec3& vel, const SimParams& params) {
+  // Apply gravity and damping.
+  vel += params.gravity;
+  vel *= params.globalDamping;
+
+  // Integrate the position.
+  pos += vel * params.deltaTime;
+
+  // Collide with the cube sides.
+  vec3 min = params.worldMin() + params.particleRadius;
+  bvec3 clip_min = pos < min;
+  pos = clip_min ? min : pos;
+  vel *= clip_min ? params.boundaryDamping : 1;
+
+  vec3 max = params.worldMax() - params.particleRadius;
+  bvec3 clip_max = pos > max;
+  pos = clip_max ? max : pos;
+  vel *= clip_max ? params.boundaryDamping : 1;
+}
+
+inline ivec3 calcGridPos(vec3 p, const SimParams& params) {
+  return (ivec3)floor((p - params.worldMin()) / params.cellSize);
+}
+
+inline int hashGridPos(ivec3 p, const SimParams& params) {
+  p = clamp(p, ivec3(0), params.gridSize - 1);
+  return params.cellHash(p);
+}
+
+inline float frand(float range) {
+  return (range / RAND_MAX) * rand();
+}
+inline float frand(float min, float max) {
+  return min + frand(max - min);
+}
+inline float frand() {
+  return frand(1);
+}
+inline vec3 frand3(float r) {
+  return vec3(frand(-r, r), frand(-r, r), frand(-r, r));
+}
+
+// Generate count particles in a jittered cube at the top of the box.
+inline void make_grid(const SimParams& params, int count,
+  std::vector<vec4>& pos_host, std::vector<vec4>& vel_host) {
+
+  int s = (int)ceil(powf((float)count, 1.f / 3));
+  float spacing = 2 * params.particleRadius;
+  float jitter = .1f * params.particleRadius;
+
+  float r = params.particleRadius;
+  float coef = 1.f / count;
+
+  float extent = spacing * s + jitter;
+  vec3 center = vec3(
+    (params.worldSize.x - extent) / 2,   // center in x
+     params.worldSize.y - extent,        // place at the top in y
+    (params.worldSize.z - extent) / 2    // center in z
+  ) + params.worldMin();
+
+  pos_host.resize(count);
+  vel_host.resize(count);
+  for(int z = 0, index = 0; z < s; ++z) {
+    for(int y = 0; y < s; ++y) {
+      for(int x = 0; x < s && index < count; ++x, ++index) {
+        vec3 pos = spacing * vec3(x, y, z) + r + frand(jitter) + center;
+        pos_host[index] = vec4(pos, coef * index);
+
+        // Give the particle some downward velocity.
+        vel_host[index] = vec4(0, -.03, 0, 0);
+      }
+    }
+  }
+}
@@ -0,0 +1,118 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include "block_pool.hxx"
+
+////////////////////////////////////////////////////////////////////////////////
+// Parallel LSD radix sort for the CPU backend. This is the counterpart of
+// cub_radix_sort: a stable key-index sort, where the indices come out as the
+// gather indices of the sorted keys.
+//
+// Each pass sorts on radix_bits bits of the key. The input is split into
+// contiguous partitions, one work item each:
+//  1. Each partition histograms its digits.
+//  2. A serial scan over (digit, partition) gives each partition its first
+//     output slot for each digit.
+//  3. Each partition scatters its keys in order, which keeps the sort stable.
+// Passes where every key has the same digit are skipped.
+
+struct cpu_radix_sort {
+  enum {
+    radix_bits = 11,
+    num_buckets = 1<< radix_bits,
+  };
+
+  // Sort keys on bits [0, end_bit) and fill indices with the gather
+  // indices. Both vectors may be swapped with internal storage.
+  void sort(block_pool_t& pool, std::vector<uint32_t>& keys,
+    std::vector<uint32_t>& indices, int end_bit);
+
+  std::vector<uint32_t> keys2;
+  std::vector<uint32_t> indices2;
+
+  // num_partitions x num_buckets counts, then offsets.
+  std::vector<uint32_t> histogram;
+};
+
+inline void cpu_radix_sort::sort(block_pool_t& pool,
+  std::vector<uint32_t>& keys, std::vector<uint32_t>& indices, int end_bit) {
+
+  int count = keys.size();
+  indices.resize(count);
+  keys2.resize(count);
+  indices2.resize(count);
+
+  // Use a few partitions per thread so stealing can even out the load, but
+  // keep each one large enough to amortize its histogram.
+  int num_partitions = std::max(1, std::min(4 * pool.num_threads(),
+    count / 4096));
+  histogram.resize(num_partitions * num_buckets);
+
+  std::vector<int> partitions(num_partitions);
+  for(int i = 0; i < num_partitions; ++i)
+    partitions[i] = i;
+
+  auto range = [=](int p) {
+    return std::make_pair((int64_t)count * p / num_partitions,
+      (int64_t)count * (p + 1) / num_partitions);
+  };
+
+  bool first_pass = true;
+  for(int bit = 0; bit < end_bit; bit += radix_bits) {
+    // 1. Histogram each partition.
+    pool.execute(partitions, 1, [&](int tid, int level, int p) {
+      uint32_t* hist = histogram.data() + num_buckets * p;
+      std::fill_n(hist, (int)num_buckets, 0);
+
+      auto [begin, end] = range(p);
+      for(int64_t i = begin; i < end; ++i)
+        ++hist[(keys[i]>> bit) & (num_buckets - 1)];
+      return true;
+    });
+    pool.wait();
+
+    // 2. Exclusive scan in digit-major order.
+    uint32_t sum = 0;
+    bool trivial = false;
+    for(int digit = 0; digit < num_buckets; ++digit) {
+      uint32_t digit_count = 0;
+      for(int p = 0; p < num_partitions; ++p) {
+        uint32_t& x = histogram[num_buckets * p + digit];
+        uint32_t c = x;
+        x = sum;
+        sum += c;
+        digit_count += c;
+      }
+      trivial |= digit_count == count;
+    }
+
+    if(trivial && !first_pass)
+      continue;
+
+    // 3. Scatter. The first pass also generates the natural indices.
+    pool.execute(partitions, 1, [&](int tid, int level, int p) {
+      uint32_t* offsets = histogram.data() + num_buckets * p;
+
+      auto [begin, end] = range(p);
+      for(int64_t i = begin; i < end; ++i) {
+        uint32_t key = keys[i];
+        uint32_t dest = offsets[(key>> bit) & (num_buckets - 1)]++;
+        keys2[dest] = key;
+        indices2[dest] = first_pass ? (uint32_t)i : indices[i];
+      }
+      return true;
+    });
+    pool.wait();
+
+    keys.swap(keys2);
+    indices.swap(indices2);
+    first_pass = false;
+  }
+
+  if(first_pass) {
+    // No passes ran, so the keys were already in order.
+    for(int i = 0; i < count; ++i)
+      indices[i] = i;
+  }
+}
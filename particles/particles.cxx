@@ -7,6 +7,7 @@
 
 #define USE_IMGUI
 #include "../include/appglfw.hxx"
+#include "checkpoint.hxx"
 
 using namespace mgpu::gl;
 
@@ -464,9 +465,22 @@ struct myapp_t : app_t {
   void display() override;
   void configure();
 
+  // Copy the current state to the checkpoint writer, or load a checkpoint
+  // into the system.
+  void save_checkpoint(checkpoint_format_t format);
+  bool restore_checkpoint(const char* path);
+
   // Simulation data.
   std::unique_ptr<system_t> system;
 
+  // Steps and simulated time since the cube was dropped.
+  int64_t step = 0;
+  double time = 0;
+
+  checkpoint_writer_t checkpoints;
+  bool auto_checkpoint = false;
+  int checkpoint_interval = 1000;
+
   // GL rendering.
   GLuint spheres_program, lines_program;
   GLuint spheres_vao, lines_vao;
@@ -594,6 +608,61 @@ void myapp_t::display() {
 
   // Integrate for the next frame.
   system->update(.1);
+
+  ++step;
+  time += params.deltaTime;
+  if(auto_checkpoint && 0 == step % checkpoint_interval)
+    save_checkpoint(checkpoint_format_t::checkpoint);
+}
+
+void myapp_t::save_checkpoint(checkpoint_format_t format) {
+  // Drop this checkpoint if the writer still holds both buffers.
+  checkpoint_t* checkpoint = checkpoints.acquire();
+  if(!checkpoint)
+    return;
+
+  int num_particles = system->params.numBodies;
+  checkpoint->step = step;
+  checkpoint->time = time;
+  checkpoint->set_params(system->params);
+  checkpoint->resize(num_particles);
+  glGetNamedBufferSubData(system->positions, 0, sizeof(vec4) * num_particles,
+    checkpoint->positions.data());
+  glGetNamedBufferSubData(system->velocities, 0,
+    sizeof(vec4) * num_particles, checkpoint->velocities.data());
+
+  // Checkpoints replace each other. Tipsy outputs are numbered by step.
+  std::string path = "particles.ckpt";
+  if(checkpoint_format_t::tipsy == format) {
+    char name[32];
+    snprintf(name, 32, "particles_%08d.tipsy", (int)step);
+    path = name;
+  }
+  checkpoints.submit(checkpoint, std::move(path), format);
+}
+
+bool myapp_t::restore_checkpoint(const char* path) {
+  checkpoint_file_t file;
+  if(!file.open(path))
+    return false;
+
+  SimParams params;
+  if(!file.get_params(params)) {
+    fprintf(stderr, "%s: the parameters do not match SimParams\n", path);
+    return false;
+  }
+
+  // Resize the buffers to the stored count, then overwrite the new cube
+  // with the stored particles.
+  params.numBodies = file.count();
+  system->params = params;
+  system->resize();
+  system->positions.set_data_range(file.positions(), 0, file.count());
+  system->velocities.set_data_range(file.velocities(), 0, file.count());
+
+  step = file.header.step;
+  time = file.header.time;
+  return true;
 }
 
 void myapp_t::configure() {
@@ -612,22 +681,47 @@ void myapp_t::configure() {
     ImGui::SliderFloat("attraction", &params.attraction, 0, .1);
     ImGui::SliderFloat("boundary damping", &params.boundaryDamping, -1, 0);
 
-    if(ImGui::Button("New Cube"))
+    if(ImGui::Button("New Cube")) {
       system->reset();
+      step = 0;
+      time = 0;
+    }
 
     if(ImGui::Button("Reset")) {
       system->params = SimParams();
       system->reset();
+      step = 0;
+      time = 0;
     }
 
+    ImGui::NewLine();
+    ImGui::Text("step %d  time %.3f", (int)step, time);
+    if(ImGui::Button("Save checkpoint"))
+      save_checkpoint(checkpoint_format_t::checkpoint);
+    ImGui::SameLine();
+    if(ImGui::Button("Save tipsy"))
+      save_checkpoint(checkpoint_format_t::tipsy);
+    ImGui::SameLine();
+    if(ImGui::Button("Restore"))
+      restore_checkpoint("particles.ckpt");
+
+    ImGui::Checkbox("Checkpoint every", &auto_checkpoint);
+    ImGui::SliderInt("steps", &checkpoint_interval, 100, 10000);
+    ImGui::Text("%d written  %d dropped  %d failed  last %.1f ms",
+      (int)checkpoints.written, (int)checkpoints.dropped,
+      (int)checkpoints.failed, 1000 * checkpoints.last_seconds);
+
   ImGui::End();
 }
 
-int main() { 
+int main(int argc, char** argv) {
   glfwInit();
   gl3wInit();
 
+  // Resume from a checkpoint given on the command line.
   myapp_t app;
+  if(argc > 1 && !app.restore_checkpoint(argv[1]))
+    return 1;
   app.loop();
 
   return 0;
@@ -1,18 +1,122 @@
 #pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+// The order in which 8x8 blocks are dealt out to the workers. The Z-order
+// and Hilbert curves keep consecutive blocks close in 2D, so a contiguous
+// run of the curve is a compact region of the image rather than a strip of
+// rows.
+enum class block_order_t {
+  row_major,
+  morton,
+  hilbert,
+};
+
+// Interleave the bits of x and y.
+inline uint32_t morton_index(uint32_t x, uint32_t y) {
+  auto spread = [](uint32_t a) {
+    a &= 0xffff;
+    a = (a | (a<< 8)) & 0x00ff00ff;
+    a = (a | (a<< 4)) & 0x0f0f0f0f;
+    a = (a | (a<< 2)) & 0x33333333;
+    a = (a | (a<< 1)) & 0x55555555;
+    return a;
+  };
+  return spread(x) | (spread(y)<< 1);
+}
+
+// Distance of (x, y) along the Hilbert curve filling an n x n square. n is
+// a power of two.
+inline uint32_t hilbert_index(uint32_t n, uint32_t x, uint32_t y) {
+  uint32_t d = 0;
+  for(uint32_t s = n / 2; s; s /= 2) {
+    uint32_t rx = (x & s) ? 1 : 0;
+    uint32_t ry = (y & s) ? 1 : 0;
+    d += s * s * ((3 * rx) ^ ry);
+
+    // Rotate the quadrant so the sub-curve joins up with its neighbors.
+    if(!ry) {
+      if(rx) {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
 
 struct adam7_t {
   int blocksX, blocksY;
+  block_order_t order = block_order_t::row_major;
+
+  // Block indices (by * blocksX + bx) sorted along the curve. Grids that
+  // aren't square powers of two use the curve of the enclosing square and
+  // skip the blocks that fall outside.
+  std::vector<int> block_order() const;
 
+  // Each thread processes a contiguous run of the block order.
   template<typename func_t>
   bool process(int tid, int num_threads, int num_levels, bool interlace,
     func_t& func);
+
+  // Process a single 8x8 block at one level. This is the unit of work handed
+  // out by block_pool_t.
+  template<typename func_t>
+  bool process_block(int block, int level, int num_levels, bool interlace,
+    func_t& func);
 };
 
+inline std::vector<int> adam7_t::block_order() const {
+  int num_blocks = blocksX * blocksY;
+  std::vector<int> blocks(num_blocks);
+  for(int i = 0; i < num_blocks; ++i)
+    blocks[i] = i;
+
+  if(block_order_t::row_major == order)
+    return blocks;
+
+  uint32_t n = 1;
+  while(n < (uint32_t)blocksX || n < (uint32_t)blocksY)
+    n *= 2;
+
+  std::vector<uint32_t> keys(num_blocks);
+  for(int i = 0; i < num_blocks; ++i) {
+    uint32_t x = i % blocksX;
+    uint32_t y = i / blocksX;
+    keys[i] = block_order_t::morton == order ?
+      morton_index(x, y) : hilbert_index(n, x, y);
+  }
+
+  std::sort(blocks.begin(), blocks.end(), [&](int a, int b) {
+    return keys[a] < keys[b];
+  });
+  return blocks;
+}
+
 template<typename func_t>
 bool adam7_t::process(int tid, int num_threads, int num_levels, bool interlace,
   func_t& func) {
 
-  int num_blocks = blocksX * blocksY;
+  std::vector<int> blocks = block_order();
+  int num_blocks = blocks.size();
+  int begin = (int64_t)num_blocks * tid / num_threads;
+  int end = (int64_t)num_blocks * (tid + 1) / num_threads;
+
+  for(int level = 0; level < num_levels; ++level) {
+    for(int i = begin; i < end; ++i) {
+      if(!process_block(blocks[i], level, num_levels, interlace, func))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+template<typename func_t>
+bool adam7_t::process_block(int block, int level, int num_levels, 
+  bool interlace, func_t& func) {
 
   assert(0 < num_levels && num_levels <= 7);
 
@@ -49,28 +153,24 @@ bool adam7_t::process(int tid, int num_threads, int num_levels, bool interlace,
     8, 8, 4, 4, 2, 2, 1,
   };
 
-  for(int level = 0; level < num_levels; ++level) {
-    int count = points_per_level[level];
-    const char* lx = block_points_x + scan_points_per_level[level];
-    const char* ly = block_points_y + scan_points_per_level[level];
-    int sx = section_size_x[interlace ? level : num_levels - 1];
-    int sy = section_size_y[interlace ? level : num_levels - 1];
-
-    for(int block = tid; block < num_blocks; block += num_threads) {
-      int bx = block % blocksX;
-      int by = block / blocksX;
-
-      int x0 = 8 * bx;
-      int y0 = 8 * by;
-      for(int i = 0; i < count; ++i) {
-        int x = x0 + lx[i];
-        int y = y0 + ly[i];
-
-        // Invoke the function for point (x, y) to fill a section (sx, sy).
-        if(!func(x, y, sx, sy))
-          return false;
-      }
-    }
+  int count = points_per_level[level];
+  const char* lx = block_points_x + scan_points_per_level[level];
+  const char* ly = block_points_y + scan_points_per_level[level];
+  int sx = section_size_x[interlace ? level : num_levels - 1];
+  int sy = section_size_y[interlace ? level : num_levels - 1];
+
+  int bx = block % blocksX;
+  int by = block / blocksX;
+
+  int x0 = 8 * bx;
+  int y0 = 8 * by;
+  for(int i = 0; i < count; ++i) {
+    int x = x0 + lx[i];
+    int y = y0 + ly[i];
+
+    // Invoke the function for point (x, y) to fill a section (sx, sy).
+    if(!func(x, y, sx, sy))
+      return false;
   }
 
   return true;
@@ -22,6 +22,7 @@
 
 // Interlacing
 #include "adam7.hxx"
+#include "block_pool.hxx"
 
 template<typename type_t>
 const char* enum_to_string(type_t x) {
@@ -1224,6 +1225,126 @@ struct [[
   [[.imgui::range_float { 0, 5 }]] float kappa = 2.0;
 };
 
+struct ray_cone_t {
+  vec3 axis;
+  float spread;
+};
+
+// Trace a screen-space tile of rays as one cone, then each ray on its own.
+//
+// The rays of a tile leave the same origin, so at distance t along the cone
+// axis every ray's point is within t * spread of the axis point, where
+// spread bounds |dir - axis| over the tile. With the global Lipschitz bound
+// k, a field value v < 0 on the axis clears every ray by -v / k - t * spread.
+// One Object evaluation advances the whole tile until that clearance drops
+// below epsilon. Then the rays split and continue with over-relaxed segment
+// tracing: each step is bounded by KSegment over the candidate segment, as
+// in segment_tracer_t, then stretched by omega, and the ray falls back to
+// unrelaxed steps the first time a step overshoots. KSegment bounds the
+// derivative along the segment only, so the cone, which needs clearance
+// across the tile, keeps KGlobal.
+//
+// Each pixel marches its tile's cone itself, so the cone steps are counted
+// as a share of tile * tile pixels: the cost of a pass shared by the tile,
+// not the work each invocation does.
+struct [[
+  .imgui::title="cone tracing"
+]] cone_tracer_t {
+  // March the cone from ra. Returns the distance all rays can advance to
+  // and the number of Object evaluations.
+  template<typename scene_t>
+  trace_result_t march_cone(const scene_t& scene, vec3 o, ray_cone_t cone,
+    float ra, float rb, int max_steps) {
+
+    float t = ra;
+    int i = 0;
+    float k = scene.KGlobal();
+
+    while(i < max_steps) {
+      ++i;
+
+      float v = scene.Object(o + t * cone.axis);
+      float clearance = -v / k - t * cone.spread;
+
+      // Split the tile.
+      if(clearance < epsilon)
+        break;
+
+      t += clearance;
+
+      // Break if every ray has escaped.
+      if(t > rb)
+        break;
+    }
+
+    return { false, i, t };
+  }
+
+  template<typename scene_t>
+  trace_result_t trace(const scene_t& scene, vec3 o, vec3 dir, float ra,
+    float rb, int max_steps) {
+
+    float t = ra;
+    float prev_t = ra;
+    float prev_r = 0;
+    float w = omega;
+    float candidate = 1;
+    int i = 0;
+    bool hit = false;
+
+    while(i < max_steps) {
+      ++i;
+
+      vec3 p = o + t * dir;
+      float v = scene.Object(p);
+
+      // Lipschitz constant on the segment from the last point through the
+      // next candidate step, so r is safe behind p for the overshoot test
+      // and ahead of p for the step.
+      float k = scene.KSegment(o + prev_t * dir, o + (t + candidate) * dir);
+      float r = abs(v) / k;
+
+      // There's no previous step to overshoot on the first iteration.
+      if(w > 1 && prev_r > 0 && (v > 0 || r + prev_r < t - prev_t)) {
+        // The relaxed step may have crossed the surface. Go back to the
+        // unrelaxed step and stop relaxing.
+        t = prev_t + max(epsilon, prev_r);
+        w = 1;
+
+      } else if(v > 0) {
+        // Hit.
+        hit = true;
+        break;
+
+      } else {
+        // Move along ray, no further than the segment length.
+        float step = max(epsilon, min(w * r, candidate));
+        prev_t = t;
+        prev_r = min(r, candidate);
+        t += step;
+        candidate = kappa * step;
+      }
+
+      // Break if ray has escaped.
+      if(t > rb)
+        break;
+    }
+
+    return { hit, i, t };
+  }
+
+  // The share of a tile's cone steps charged to each of its pixels.
+  int shared_steps(int cone_steps) const {
+    int area = tile * tile;
+    return (cone_steps + area - 1) / area;
+  }
+
+  [[.imgui::range_float { 0, .3 }]] float epsilon = .1;
+  [[.imgui::range_float { 1, 2 }]] float omega = 1.6;
+  [[.imgui::range_float { 0, 5 }]] float kappa = 2.0;
+  [[.imgui::range_int { 1, 32 }]] int tile = 8;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // Scene distance fields
 
@@ -1369,17 +1490,60 @@ struct [[
       mix(ShadeColor2, ShadeColor3, 2 * t - 1);
   }
 
+  vec3 Ray(vec2 pixel, shadertoy_uniforms_t u) {
+    float asp = u.resolution.x / u.resolution.y;
+    vec3 rd = normalize(vec3(asp * pixel.x, pixel.y - 1.5f, -4.f));
+    return RotateY(rd, .25f * u.time);
+  }
+
+  template<typename tracer2_t>
+  trace_result_t Trace(tracer2_t& tr, vec2 frag_coord, vec3 ro, vec3 rd,
+    shadertoy_uniforms_t u) {
+
+    trace_result_t result { };
+    if constexpr(std::is_same_v<tracer2_t, cone_tracer_t>) {
+      // March this pixel's tile, then the pixel's ray from where the tile
+      // split.
+      trace_result_t cone = tr.march_cone(scene, ro,
+        TileCone(tr.tile, frag_coord, u), 20, 60, MaxSteps);
+
+      result = { false, 0, cone.t };
+      if(cone.t <= 60)
+        result = tr.trace(scene, ro, rd, cone.t, 60, MaxSteps);
+      result.steps += tr.shared_steps(cone.steps);
+
+    } else
+      result = tr.trace(scene, ro, rd, 20, 60, MaxSteps);
+
+    return result;
+  }
+
+  // The cone around the rays of the tile holding frag_coord. The rays pass
+  // through a rectangle on the image plane, so a cone around the corner
+  // rays holds them all.
+  ray_cone_t TileCone(int tile, vec2 frag_coord, shadertoy_uniforms_t u) {
+    vec2 lo = floor(frag_coord / tile) * tile;
+    vec2 hi = lo + tile;
+    vec3 corners[4] {
+      Ray(2 * (lo / u.resolution) - 1, u),
+      Ray(2 * (vec2(hi.x, lo.y) / u.resolution) - 1, u),
+      Ray(2 * (vec2(lo.x, hi.y) / u.resolution) - 1, u),
+      Ray(2 * (hi / u.resolution) - 1, u),
+    };
+
+    ray_cone_t cone { };
+    cone.axis = normalize(corners[0] + corners[1] + corners[2] + corners[3]);
+    for(int i = 0; i < 4; ++i)
+      cone.spread = max(cone.spread, length(corners[i] - cone.axis));
+    return cone;
+  }
+
   vec4 render(vec2 frag_coord, shadertoy_uniforms_t u) {
     vec2 pixel = 2 * (frag_coord / u.resolution) - 1;
     vec2 mouse = 2 * (u.mouse.xy / u.resolution.xy) - 1;
 
-    float asp = u.resolution.x / u.resolution.y;
-    vec3 rd = normalize(vec3(asp * pixel.x, pixel.y - 1.5f, -4.f));
-    vec3 ro(0, 18, 40);
-
-    float a = .25f * u.time;
-    ro = RotateY(ro, a);
-    rd = RotateY(rd, a);
+    vec3 ro = RotateY(vec3(0, 18, 40), .25f * u.time);
+    vec3 rd = Ray(pixel, u);
 
     // Shade this object.
     vec3 color = Background(rd);
@@ -1389,10 +1553,10 @@ struct [[
     constexpr bool is_dual = tracer_t.template == tracer_pair_t;
     if constexpr(is_dual)
       result = (pixel.x < mouse.x) ?
-        tracer.left.trace(scene, ro, rd, 20, 60, MaxSteps) :
-        tracer.right.trace(scene, ro, rd, 20, 60, MaxSteps);
+        Trace(tracer.left, frag_coord, ro, rd, u) :
+        Trace(tracer.right, frag_coord, ro, rd, u);
     else
-      result = tracer.trace(scene, ro, rd, 20, 60, MaxSteps);
+      result = Trace(tracer, frag_coord, ro, rd, u);
 
     // Render the window.
     if(pixel.y > mouse.y) {
@@ -3097,6 +3261,14 @@ enum typename class shader_program_t {
     tracer_pair_t<sphere_tracer_t, segment_tracer_t>, 
     blobs_t
   >,
+  ConeTracer = tracer_engine_t<
+    cone_tracer_t,
+    blobs_t
+  >,
+  ConeDualTracer = tracer_engine_t<
+    tracer_pair_t<sphere_tracer_t, cone_tracer_t>,
+    blobs_t
+  >,
   Raymarcher = raymarch_prims_t,
   band_limited1_t,
   band_limited2_t,
@@ -3318,36 +3490,32 @@ void software_fbo_t::set_block(vec4 color, int x, int y, int sx, int sy) {
 }
 
 struct cpu_compute_t {
-  cpu_compute_t(int num_threads, int width, int height);
+  cpu_compute_t(block_pool_t* pool, int width, int height);
   ~cpu_compute_t();
 
   void pool_execute();
-  void thread_execute(int tid);
+  bool block_execute(int level, int block);
   bool pixel_execute(int x, int y, int sx, int sy);
   bool is_complete() const;
   void join();
-  void update();
-
-  static void thread_entry(cpu_compute_t* compute, int tid);
 
-  std::vector<std::thread> threads;
-  std::atomic<int> complete_count;
+  // The pool is owned by the app and outlives shader and size changes.
+  block_pool_t* pool;
   std::atomic<bool> okay;
 
   int width, height;
   shadertoy_uniforms_t uniforms;
   int num_levels = 0;
   bool interlace = false;
+  block_order_t order = block_order_t::row_major;
 
   program_base_t* program;
   std::unique_ptr<software_fbo_t> fbo;
 };
 
-cpu_compute_t::cpu_compute_t(int num_threads, int width, int height) :
-  width(width), height(height) {
+cpu_compute_t::cpu_compute_t(block_pool_t* pool, int width, int height) :
+  pool(pool), width(width), height(height) {
 
-  complete_count = num_threads;
-  threads.resize(num_threads);
   okay = false;
 
   int width2 = (width + 7) & ~7;
@@ -3362,20 +3530,23 @@ cpu_compute_t::~cpu_compute_t() {
 
 void cpu_compute_t::pool_execute() {
   okay = true;
-  complete_count = 0;
-  for(int tid = 0; tid < threads.size(); ++tid)
-    threads[tid] = std::thread(thread_entry, this, tid);
+
+  // Deal out the 8x8 blocks along the chosen curve. The pool splits the
+  // list into contiguous runs, one per worker, and rebalances by stealing.
+  adam7_t adam7 { (width + 7) / 8, (height + 7) / 8, order };
+  pool->execute(adam7.block_order(), num_levels,
+    [this](int tid, int level, int block) {
+      return block_execute(level, block);
+    });
 }
 
-void cpu_compute_t::thread_execute(int tid) {
+bool cpu_compute_t::block_execute(int level, int block) {
   adam7_t adam7 { (width + 7) / 8, (height + 7) / 8 };
 
   auto f = [&](int x, int y, int sx, int sy) {
     return pixel_execute(x, y, sx, sy);
   };
-  adam7.process(tid, threads.size(), num_levels, interlace, f);
-
-  ++complete_count;
+  return adam7.process_block(block, level, num_levels, interlace, f);
 }
 
 bool cpu_compute_t::pixel_execute(int x, int y, int sx, int sy) {
@@ -3394,18 +3565,13 @@ bool cpu_compute_t::pixel_execute(int x, int y, int sx, int sy) {
 }
 
 bool cpu_compute_t::is_complete() const {
-  return threads.size() == complete_count;
+  return pool->is_complete();
 }
 
 void cpu_compute_t::join() {
   okay = false;
-  for(std::thread& t : threads)
-    if(t.joinable())
-      t.join();
-}
-
-void cpu_compute_t::thread_entry(cpu_compute_t* compute, int tid) {
-  compute->thread_execute(tid);
+  pool->cancel();
+  pool->wait();
 }
 
 
@@ -3430,11 +3596,13 @@ struct app_t {
   bool debug_on_click = false;
   int backend = 1;
   bool interlace = false;
+  int block_order = (int)block_order_t::hilbert;
   bool asynchronous = true;
   int num_threads = 1;
   int num_levels = 1;
 
   std::unique_ptr<cuda_compute_t> cuda_compute;
+  std::unique_ptr<block_pool_t> pool;
   std::unique_ptr<cpu_compute_t> cpu_compute;
 
   app_t();
@@ -3633,9 +3801,15 @@ void app_t::loop() {
         // CPU rendering.
         cuda_compute.reset();
 
-        if(!cpu_compute || cpu_compute->threads.size() != num_threads) {
-          // Create a new thread pool.
-          cpu_compute = std::make_unique<cpu_compute_t>(num_threads, width,
+        if(!pool || pool->num_threads() != num_threads) {
+          // Create a new thread pool. The workers persist across frames and
+          // shader changes.
+          cpu_compute.reset();
+          pool = std::make_unique<block_pool_t>(num_threads);
+        }
+
+        if(!cpu_compute) {
+          cpu_compute = std::make_unique<cpu_compute_t>(pool.get(), width,
             height);
           cpu_compute->program = program.get();
         }
@@ -3650,6 +3824,7 @@ void app_t::loop() {
 
           cpu_compute->num_levels = num_levels;
           cpu_compute->interlace = interlace;
+        cpu_compute->order = (block_order_t)block_order;
           cpu_compute->uniforms = uniforms;
           cpu_compute->pool_execute();
 
@@ -3710,6 +3885,9 @@ bool app_t::configure() {
     changed |= ImGui::SliderInt("Thread pool size", &num_threads, 1, 32);
     changed |= ImGui::SliderInt("Detail levels", &num_levels, 1, 7);
     changed |= ImGui::Checkbox("Interlacing", &interlace);
+
+    const char* orders[] { "Row major", "Z-order", "Hilbert" };
+    changed |= ImGui::Combo("Block order", &block_order, orders, 3);
     ImGui::Checkbox("Asynchronous", &asynchronous);
   }
 
@@ -3720,8 +3898,14 @@ bool app_t::configure() {
   changed |= ImGui::Combo("Active shader", &current, items, items.length);
 
   if(current != (int)active_shader) {
-    cpu_compute.reset();
+    // Stop the workers before destroying the program they're evaluating.
+    if(cpu_compute)
+      cpu_compute->join();
+
     set_active_shader((shader_program_t)current);
+
+    if(cpu_compute)
+      cpu_compute->program = program.get();
   }
 
   program->configure(2 != backend);
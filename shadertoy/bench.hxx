@@ -0,0 +1,348 @@
+#pragma once
+
+// CPU benchmark harness. This is included by render.hxx when building the
+// shadertoy-bench target with SHADERTOY_BENCH. Every shader_program_t entry
+// is rendered at each resolution and thread count, and the timings are
+// written as JSON so runs can be compared across shader and compiler
+// changes.
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_options_t {
+  std::vector<ivec2> resolutions { ivec2(640, 360), ivec2(1920, 1080) };
+  std::vector<int> threads;
+  std::vector<const char*> shaders;
+  int warmup = 1;
+  int reps = 5;
+  float time = 1;
+  eval_mode_t mode = eval_mode_t::packet;
+  block_order_t order = block_order_t::hilbert;
+  bool compare = false;
+  const char* output = nullptr;
+};
+
+struct bench_run_t {
+  ivec2 resolution;
+  int num_threads;
+  double seconds;       // median over the repetitions
+  double ns_per_pixel;
+  double mpixels_per_second;
+  double efficiency;    // relative to the smallest thread count
+
+  // With --compare, the median scalar time over the median subgroup time.
+  double subgroup_speedup;
+};
+
+struct bench_result_t {
+  shader_program_t shader;
+
+  // Single-threaded user-mode instructions per pixel at the first
+  // resolution, or negative when the counters are unavailable. This
+  // includes the pool's overhead, which is small next to the shaders.
+  double instructions_per_pixel;
+  std::vector<bench_run_t> runs;
+};
+
+inline void print_bench_usage() {
+  printf(
+    "usage: shadertoy-bench [options] [shader...]\n"
+    "  shader             shader index, name or title (all by default)\n"
+    "  -r, --resolutions  comma-separated WxH list (640x360,1920x1080)\n"
+    "  -j, --threads      comma-separated thread counts (1, 2, 4, ... and\n"
+    "                     all cores)\n"
+    "  --warmup N         untimed frames before each measurement (1)\n"
+    "  --reps N           timed frames per measurement (5)\n"
+    "  --time T           shader time in seconds (1)\n"
+    "  --scalar           evaluate one pixel per call instead of packets\n"
+    "  --subgroup         evaluate 32-lane subgroups of quads\n"
+    "  --compare          also time scalar and subgroup modes and report\n"
+    "                     the subgroup speedup\n"
+    "  -o, --output PATH  write the JSON here instead of stdout\n"
+  );
+}
+
+// Parse a comma-separated list, calling parse on each item.
+template<typename type_t, typename parse_t>
+bool parse_list(const char* s, std::vector<type_t>& list, parse_t parse) {
+  list.clear();
+  while(*s) {
+    type_t x;
+    if(!parse(s, x))
+      return false;
+    list.push_back(x);
+
+    s = strchr(s, ',');
+    if(!s)
+      break;
+    ++s;
+  }
+  return list.size();
+}
+
+inline int parse_bench_options(int argc, char** argv,
+  bench_options_t& options) {
+
+  for(int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    auto is = [&](const char* a, const char* b = nullptr) {
+      return !strcmp(arg, a) || (b && !strcmp(arg, b));
+    };
+
+    if(is("--help")) {
+      print_bench_usage();
+      return -1;
+
+    } else if(is("--scalar")) {
+      options.mode = eval_mode_t::scalar;
+
+    } else if(is("--subgroup")) {
+      options.mode = eval_mode_t::subgroup;
+
+    } else if(is("--compare")) {
+      options.compare = true;
+
+    } else if('-' == arg[0]) {
+      if(i + 1 == argc) {
+        fprintf(stderr, "missing value for %s\n", arg);
+        return 1;
+      }
+      const char* value = argv[++i];
+
+      bool okay = true;
+      if(is("-r", "--resolutions")) {
+        okay = parse_list(value, options.resolutions,
+          [](const char* s, ivec2& x) {
+            return 2 == sscanf(s, "%dx%d", &x.x, &x.y) && x.x > 0 && x.y > 0;
+          });
+
+      } else if(is("-j", "--threads")) {
+        okay = parse_list(value, options.threads, [](const char* s, int& x) {
+          return 1 == sscanf(s, "%d", &x) && x > 0;
+        });
+
+      } else if(is("--warmup"))
+        options.warmup = atoi(value);
+      else if(is("--reps"))
+        okay = (options.reps = atoi(value)) > 0;
+      else if(is("--time"))
+        options.time = atof(value);
+      else if(is("-o", "--output"))
+        options.output = value;
+      else {
+        fprintf(stderr, "unknown option %s\n", arg);
+        return 1;
+      }
+
+      if(!okay) {
+        fprintf(stderr, "invalid value %s for %s\n", value, arg);
+        return 1;
+      }
+
+    } else
+      options.shaders.push_back(arg);
+  }
+
+  if(options.threads.empty()) {
+    // Powers of two up to the core count, and the core count itself.
+    int num_cores = std::max(1u, std::thread::hardware_concurrency());
+    for(int t = 1; t < num_cores; t *= 2)
+      options.threads.push_back(t);
+    options.threads.push_back(num_cores);
+  }
+  std::sort(options.threads.begin(), options.threads.end());
+
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+inline double measure_instructions(program_base_t* program,
+  const bench_options_t& options, const shadertoy_uniforms_t& u,
+  frame_t& frame) {
+
+  // Open the counter before the worker starts and read it after it exits.
+  perf_counter_t counter(perf_counter_t::instructions);
+  if(!counter.valid())
+    return -1;
+
+  counter.start();
+  {
+    block_pool_t pool(1);
+    render_frame(pool, program, u, options.mode, options.order, frame);
+  }
+  counter.stop();
+
+  return (double)counter.read() / (frame.width * frame.height);
+}
+
+// The median time of a frame in one mode.
+inline double time_frames(block_pool_t& pool, program_base_t* program,
+  const shadertoy_uniforms_t& u, eval_mode_t mode,
+  const bench_options_t& options, frame_t& frame) {
+
+  for(int i = 0; i < options.warmup; ++i)
+    render_frame(pool, program, u, mode, options.order, frame);
+
+  // Report the median, which shrugs off a frame interrupted by the OS.
+  std::vector<double> times(options.reps);
+  for(double& t : times) {
+    auto begin = std::chrono::high_resolution_clock::now();
+    render_frame(pool, program, u, mode, options.order, frame);
+    auto end = std::chrono::high_resolution_clock::now();
+    t = std::chrono::duration<double>(end - begin).count();
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+inline bench_result_t bench_shader(shader_program_t shader,
+  const bench_options_t& options) {
+
+  std::unique_ptr<program_base_t> program = make_program(shader);
+  bench_result_t result { shader, -1 };
+
+  for(size_t r = 0; r < options.resolutions.size(); ++r) {
+    ivec2 res = options.resolutions[r];
+    frame_t frame;
+    frame.width = res.x;
+    frame.height = res.y;
+    frame.data.resize(res.x * res.y);
+
+    shadertoy_uniforms_t u { };
+    u.mouse = vec4(.5, .5, .5, .5);
+    u.resolution = vec2(res.x, res.y);
+    u.time = options.time;
+
+    if(!r)
+      result.instructions_per_pixel = measure_instructions(program.get(),
+        options, u, frame);
+
+    double pixels = (double)res.x * res.y;
+    double base = 0;
+    for(int num_threads : options.threads) {
+      block_pool_t pool(num_threads);
+
+      bench_run_t run;
+      run.resolution = res;
+      run.num_threads = num_threads;
+      run.seconds = time_frames(pool, program.get(), u, options.mode, options,
+        frame);
+      run.ns_per_pixel = 1.0e9 * run.seconds / pixels;
+      run.mpixels_per_second = pixels / run.seconds / 1.0e6;
+
+      // Throughput per thread relative to the first thread count.
+      double per_thread = run.mpixels_per_second / num_threads;
+      if(!base)
+        base = per_thread;
+      run.efficiency = per_thread / base;
+
+      // Time whichever of the two modes wasn't just measured.
+      run.subgroup_speedup = 0;
+      if(options.compare) {
+        double scalar = eval_mode_t::scalar == options.mode ? run.seconds :
+          time_frames(pool, program.get(), u, eval_mode_t::scalar, options,
+            frame);
+        double subgroup = eval_mode_t::subgroup == options.mode ?
+          run.seconds : time_frames(pool, program.get(), u,
+            eval_mode_t::subgroup, options, frame);
+        run.subgroup_speedup = scalar / subgroup;
+      }
+
+      result.runs.push_back(run);
+
+      fprintf(stderr, "%-16s %4dx%-4d %3d threads %9.2f ns/pixel "
+        "%9.2f Mpixel/s %6.1f%%", enum_to_string(shader), res.x, res.y,
+        num_threads, run.ns_per_pixel, run.mpixels_per_second,
+        100 * run.efficiency);
+      if(options.compare)
+        fprintf(stderr, "  subgroup %.2fx scalar", run.subgroup_speedup);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  return result;
+}
+
+inline void write_bench_json(FILE* f, const bench_options_t& options,
+  const std::vector<bench_result_t>& results) {
+
+  fprintf(f, "{\n");
+  fprintf(f, "  \"circle_build\": %d,\n", __circle_build__);
+  fprintf(f, "  \"eval_mode\": \"%s\",\n", enum_to_string(options.mode));
+  fprintf(f, "  \"packet_width\": %d,\n", packet_width);
+  fprintf(f, "  \"warmup\": %d,\n", options.warmup);
+  fprintf(f, "  \"repetitions\": %d,\n", options.reps);
+  fprintf(f, "  \"time\": %g,\n", options.time);
+  fprintf(f, "  \"shaders\": [\n");
+
+  for(size_t i = 0; i < results.size(); ++i) {
+    const bench_result_t& result = results[i];
+    fprintf(f, "    {\n");
+    fprintf(f, "      \"name\": \"%s\",\n", enum_to_string(result.shader));
+    if(result.instructions_per_pixel >= 0)
+      fprintf(f, "      \"instructions_per_pixel\": %.1f,\n",
+        result.instructions_per_pixel);
+    else
+      fprintf(f, "      \"instructions_per_pixel\": null,\n");
+    fprintf(f, "      \"runs\": [\n");
+
+    for(size_t j = 0; j < result.runs.size(); ++j) {
+      const bench_run_t& run = result.runs[j];
+      fprintf(f, "        { \"width\": %d, \"height\": %d, \"threads\": %d, "
+        "\"ns_per_pixel\": %.3f, \"mpixels_per_second\": %.3f, "
+        "\"scaling_efficiency\": %.4f", run.resolution.x,
+        run.resolution.y, run.num_threads, run.ns_per_pixel,
+        run.mpixels_per_second, run.efficiency);
+      if(options.compare)
+        fprintf(f, ", \"subgroup_speedup\": %.4f", run.subgroup_speedup);
+      fprintf(f, " }%s\n", j + 1 < result.runs.size() ? "," : "");
+    }
+
+    fprintf(f, "      ]\n");
+    fprintf(f, "    }%s\n", i + 1 < results.size() ? "," : "");
+  }
+
+  fprintf(f, "  ]\n");
+  fprintf(f, "}\n");
+}
+
+int main(int argc, char** argv) {
+  bench_options_t options;
+  if(int result = parse_bench_options(argc, argv, options)) {
+    if(result > 0)
+      print_bench_usage();
+    return std::max(result, 0);
+  }
+
+  // Select the shaders before running anything, so a typo fails fast.
+  std::vector<shader_program_t> shaders;
+  for(const char* name : options.shaders) {
+    shader_program_t shader;
+    if(!find_shader(name, shader)) {
+      fprintf(stderr, "unknown shader %s\n", name);
+      return 1;
+    }
+    shaders.push_back(shader);
+  }
+  if(shaders.empty()) {
+    @meta for enum(shader_program_t e : shader_program_t) {
+      shaders.push_back(e);
+    }
+  }
+
+  std::vector<bench_result_t> results;
+  for(shader_program_t shader : shaders)
+    results.push_back(bench_shader(shader, options));
+
+  FILE* f = stdout;
+  if(options.output && !(f = fopen(options.output, "w"))) {
+    fprintf(stderr, "could not write %s\n", options.output);
+    return 1;
+  }
+
+  write_bench_json(f, options, results);
+  if(f != stdout)
+    fclose(f);
+
+  return 0;
+}
@@ -0,0 +1,150 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+// A hardware event counter for the calling thread and every thread it
+// creates after the counter is opened. The counts of the child threads are
+// only folded in when they exit, so open the counter before starting a
+// block_pool_t and read it after the pool is destroyed.
+//
+// Counters are unavailable off Linux or when perf_event_paranoid forbids
+// them. valid() is false and read() returns 0.
+//
+// perf has no generic L2 event, so l2_misses opens the core PMU's raw L2
+// miss event: L2_RQSTS.MISS on Intel since Haswell, and the L2 misses of
+// data and instruction fetches on AMD since Zen. On other processors the
+// counter isn't valid.
+struct perf_counter_t {
+  enum kind_t {
+    instructions,
+    l1d_misses,
+    l2_misses,
+    llc_misses,
+  };
+
+  perf_counter_t(kind_t kind);
+  ~perf_counter_t();
+
+  perf_counter_t(const perf_counter_t&) = delete;
+  perf_counter_t& operator=(const perf_counter_t&) = delete;
+
+  bool valid() const { return fd >= 0; }
+  void start();
+  void stop();
+  uint64_t read() const;
+
+private:
+  int fd = -1;
+};
+
+#ifdef __linux__
+
+// The raw config of the L2 miss event, or 0 if the processor isn't known.
+// Raw x86 events are the event select with the unit mask in bits 8-15.
+inline uint64_t perf_l2_miss_event() {
+#if defined(__x86_64__)
+  unsigned a, b, c, d;
+  if(!__get_cpuid(0, &a, &b, &c, &d))
+    return 0;
+
+  char vendor[13] { };
+  memcpy(vendor + 0, &b, 4);
+  memcpy(vendor + 4, &d, 4);
+  memcpy(vendor + 8, &c, 4);
+
+  __get_cpuid(1, &a, &b, &c, &d);
+  unsigned family = (a>> 8 & 0xf) + (a>> 20 & 0xff);
+
+  // L2_RQSTS.MISS.
+  if(!strcmp(vendor, "GenuineIntel") && 6 == family)
+    return 0x3f24;
+
+  // L2_CACHE_REQ_STAT.IC_DC_MISS_IN_L2.
+  if(!strcmp(vendor, "AuthenticAMD") && family >= 0x17)
+    return 0x0964;
+#endif
+  return 0;
+}
+
+inline perf_counter_t::perf_counter_t(kind_t kind) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  switch(kind) {
+    case instructions:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+
+    case l1d_misses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ<< 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS<< 16);
+      break;
+
+    case l2_misses:
+      attr.type = PERF_TYPE_RAW;
+      attr.config = perf_l2_miss_event();
+      if(!attr.config)
+        return;
+      break;
+
+    case llc_misses:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+  }
+
+  fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+inline perf_counter_t::~perf_counter_t() {
+  if(fd >= 0)
+    close(fd);
+}
+
+inline void perf_counter_t::start() {
+  if(fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+inline void perf_counter_t::stop() {
+  if(fd >= 0)
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+}
+
+inline uint64_t perf_counter_t::read() const {
+  uint64_t count = 0;
+  if(fd >= 0 && sizeof(count) != ::read(fd, &count, sizeof(count)))
+    count = 0;
+  return count;
+}
+
+#else
+
+inline perf_counter_t::perf_counter_t(kind_t kind) { }
+inline perf_counter_t::~perf_counter_t() { }
+inline void perf_counter_t::start() { }
+inline void perf_counter_t::stop() { }
+inline uint64_t perf_counter_t::read() const { return 0; }
+
+#endif
@@ -0,0 +1,574 @@
+#pragma once
+
+// Headless batch renderer. This is included at the bottom of shadertoy.cxx
+// when building the shadertoy-render target with SHADERTOY_HEADLESS. There's
+// no window or GL context: every frame is evaluated on the CPU through
+// program_t::eval and streamed to disk as PNG or EXR.
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../thirdparty/stb/stb_image_write.h"
+#include "perf_counter.hxx"
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <cstring>
+#include <algorithm>
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct frame_t {
+  int width, height;
+
+  // Linear float color. Row 0 is the bottom of the image, like FragCoord.
+  std::vector<vec4> data;
+};
+
+inline bool write_png(const char* path, const frame_t& frame) {
+  // Convert to RGBA8 the same way software_fbo_t does, and flip so the top
+  // row comes first.
+  std::vector<uint32_t> rgba(frame.width * frame.height);
+  for(int y = 0; y < frame.height; ++y) {
+    const vec4* src = frame.data.data() + frame.width * y;
+    uint32_t* dest = rgba.data() + frame.width * (frame.height - 1 - y);
+    for(int x = 0; x < frame.width; ++x) {
+      ivec4 color = clamp((ivec4)(255.f * src[x] + 1.f / 512), 0, 255);
+      dest[x] = color.r | (color.g<< 8) | (color.b<< 16) | 0xff000000;
+    }
+  }
+
+  return 0 != stbi_write_png(path, frame.width, frame.height, 4, rgba.data(),
+    4 * frame.width);
+}
+
+// Write a single-part scanline OpenEXR file with uncompressed 32-bit float
+// RGBA channels. That's the simplest layout every EXR reader accepts.
+inline bool write_exr(const char* path, const frame_t& frame) {
+  FILE* f = fopen(path, "wb");
+  if(!f)
+    return false;
+
+  std::vector<char> header;
+  auto put = [&](const void* p, size_t size) {
+    const char* c = (const char*)p;
+    header.insert(header.end(), c, c + size);
+  };
+  auto put_int = [&](int32_t x) { put(&x, 4); };
+  auto put_str = [&](const char* s) { put(s, strlen(s) + 1); };
+  auto put_attrib = [&](const char* name, const char* type, int32_t size) {
+    put_str(name);
+    put_str(type);
+    put_int(size);
+  };
+
+  // Magic number and version 2, single-part scanline.
+  put_int(20000630);
+  put_int(2);
+
+  // Channels must be sorted by name.
+  const char* channels[4] { "A", "B", "G", "R" };
+  put_attrib("channels", "chlist", 4 * 18 + 1);
+  for(const char* name : channels) {
+    put_str(name);
+    put_int(2);               // FLOAT
+    put_int(0);               // pLinear and reserved
+    put_int(1);               // xSampling
+    put_int(1);               // ySampling
+  }
+  header.push_back(0);
+
+  char compression = 0;       // NO_COMPRESSION
+  put_attrib("compression", "compression", 1);
+  put(&compression, 1);
+
+  int32_t box[4] { 0, 0, frame.width - 1, frame.height - 1 };
+  put_attrib("dataWindow", "box2i", 16);
+  put(box, 16);
+  put_attrib("displayWindow", "box2i", 16);
+  put(box, 16);
+
+  char line_order = 0;        // INCREASING_Y
+  put_attrib("lineOrder", "lineOrder", 1);
+  put(&line_order, 1);
+
+  float aspect = 1;
+  put_attrib("pixelAspectRatio", "float", 4);
+  put(&aspect, 4);
+
+  float center[2] { 0, 0 };
+  put_attrib("screenWindowCenter", "v2f", 8);
+  put(center, 8);
+
+  float window_width = 1;
+  put_attrib("screenWindowWidth", "float", 4);
+  put(&window_width, 4);
+
+  header.push_back(0);
+
+  // Offset table. Each scanline is its y, its byte count, and then each
+  // channel's row of pixels.
+  int32_t line_size = 4 * sizeof(float) * frame.width;
+  uint64_t offset = header.size() + sizeof(uint64_t) * frame.height;
+  for(int y = 0; y < frame.height; ++y) {
+    put(&offset, 8);
+    offset += 8 + line_size;
+  }
+  fwrite(header.data(), 1, header.size(), f);
+
+  std::vector<float> line(4 * frame.width);
+  for(int y = 0; y < frame.height; ++y) {
+    // EXR scanlines go top to bottom.
+    const vec4* src = frame.data.data() +
+      frame.width * (frame.height - 1 - y);
+    for(int x = 0; x < frame.width; ++x) {
+      line[0 * frame.width + x] = src[x].a;
+      line[1 * frame.width + x] = src[x].b;
+      line[2 * frame.width + x] = src[x].g;
+      line[3 * frame.width + x] = src[x].r;
+    }
+
+    fwrite(&y, 4, 1, f);
+    fwrite(&line_size, 4, 1, f);
+    fwrite(line.data(), 1, line_size, f);
+  }
+
+  bool okay = !ferror(f);
+  fclose(f);
+  return okay;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+inline std::unique_ptr<program_base_t> make_program(shader_program_t shader) {
+  switch(shader) {
+    @meta for enum(shader_program_t e : shader_program_t) {
+      case e:
+        return std::make_unique<program_t<@enum_type(e)> >();
+    }
+    default:
+      return nullptr;
+  }
+}
+
+// Match a shader by its index, enumerator name or imgui::title.
+inline bool find_shader(const char* name, shader_program_t& shader) {
+  char* end;
+  long index = strtol(name, &end, 10);
+  if(!*end) {
+    if(index < 0 || index >= @enum_count(shader_program_t))
+      return false;
+    shader = (shader_program_t)index;
+    return true;
+  }
+
+  @meta for enum(shader_program_t e : shader_program_t) {
+    if(!strcmp(name, @enum_name(e)) ||
+      !strcmp(name, @attribute(@enum_type(e), imgui::title))) {
+      shader = e;
+      return true;
+    }
+  }
+  return false;
+}
+
+inline void print_shaders() {
+  @meta for enum(shader_program_t e : shader_program_t) {
+    printf("%2d  %-16s %s\n", (int)e, @enum_name(e),
+      @attribute(@enum_type(e), imgui::title));
+  }
+}
+
+// Render one frame with every worker in the pool. Each work item is an 8x8
+// block evaluated at full resolution. In packet and subgroup modes the
+// block's pixels are evaluated together.
+inline void render_frame(block_pool_t& pool, program_base_t* program,
+  const shadertoy_uniforms_t& u, eval_mode_t mode, block_order_t order,
+  frame_t& frame) {
+
+  adam7_t adam7 { (frame.width + 7) / 8, (frame.height + 7) / 8, order };
+  int blocksX = adam7.blocksX;
+
+  pool.execute(adam7.block_order(), 1, [&](int tid, int level, int block) {
+    int x0 = 8 * (block % blocksX);
+    int y0 = 8 * (block / blocksX);
+    int x1 = std::min(x0 + 8, frame.width);
+    int y1 = std::min(y0 + 8, frame.height);
+
+    if(eval_mode_t::subgroup == mode) {
+      // Evaluate whole quads. Lanes past the edge of the frame are helpers
+      // that only feed their neighbors' derivatives.
+      vec2 coords[64];
+      vec4 colors[64];
+      for(int i = 0; i < 64; ++i)
+        coords[i] = vec2(ivec2(x0, y0) + subgroup_pixel(i)) + .5f;
+
+      program->eval_subgroup(coords, colors, 64, u);
+
+      for(int i = 0; i < 64; ++i) {
+        ivec2 pixel = ivec2(x0, y0) + subgroup_pixel(i);
+        if(pixel.x < x1 && pixel.y < y1)
+          frame.data[frame.width * pixel.y + pixel.x] = colors[i];
+      }
+
+    } else if(eval_mode_t::packet == mode) {
+      vec2 coords[64];
+      vec4 colors[64];
+      int count = 0;
+      for(int y = y0; y < y1; ++y) {
+        for(int x = x0; x < x1; ++x)
+          coords[count++] = vec2(x + .5f, y + .5f);
+      }
+
+      program->eval_packet(coords, colors, count, u);
+
+      count = 0;
+      for(int y = y0; y < y1; ++y) {
+        for(int x = x0; x < x1; ++x)
+          frame.data[frame.width * y + x] = colors[count++];
+      }
+
+    } else {
+      for(int y = y0; y < y1; ++y) {
+        for(int x = x0; x < x1; ++x) {
+          vec2 coord(x + .5f, y + .5f);
+          frame.data[frame.width * y + x] = program->eval(coord, u);
+        }
+      }
+    }
+    return true;
+  });
+  pool.wait();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct render_options_t {
+  const char* shader = nullptr;
+  int width = 1920;
+  int height = 1080;
+  float start = 0;
+  float end = 0;
+  float fps = 30;
+  int num_threads = std::thread::hardware_concurrency();
+  eval_mode_t mode = eval_mode_t::packet;
+  block_order_t order = block_order_t::hilbert;
+
+  // Render every block order in turn without writing images, and report
+  // the throughput and cache misses of each.
+  bool compare_orders = false;
+
+  // printf pattern for the frame number. The extension selects the format.
+  const char* output = "frame_%04d.png";
+};
+
+inline void print_usage() {
+  printf(
+    "usage: shadertoy-render [options] shader\n"
+    "  shader             shader index, name or title (see --list), or\n"
+    "                     all with --compare-orders\n"
+    "  -w, --width N      image width (1920)\n"
+    "  -h, --height N     image height (1080)\n"
+    "  --start T          time of first frame in seconds (0)\n"
+    "  --end T            time at which to stop (start, for a single frame)\n"
+    "  --fps F            frames per second (30)\n"
+    "  -j, --threads N    worker threads (all cores)\n"
+    "  --scalar           evaluate one pixel per call instead of packets\n"
+    "  --subgroup         evaluate 32-lane subgroups of quads, for subgroup\n"
+    "                     operations and derivatives\n"
+    "  --order ORDER      block order: row, morton or hilbert (hilbert)\n"
+    "  --compare-orders   benchmark each block order instead of writing\n"
+    "                     images\n"
+    "  -o, --output PATH  printf pattern for the frame number, ending in\n"
+    "                     .png or .exr (frame_%%04d.png)\n"
+    "  --list             print the available shaders\n"
+  );
+}
+
+// Return 0 to render, 1 on error, and -1 to exit cleanly.
+inline int parse_options(int argc, char** argv, render_options_t& options) {
+  for(int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    auto is = [&](const char* a, const char* b = nullptr) {
+      return !strcmp(arg, a) || (b && !strcmp(arg, b));
+    };
+
+    if(is("--list")) {
+      print_shaders();
+      return -1;
+
+    } else if(is("--help")) {
+      print_usage();
+      return -1;
+
+    } else if(is("--scalar")) {
+      options.mode = eval_mode_t::scalar;
+
+    } else if(is("--subgroup")) {
+      options.mode = eval_mode_t::subgroup;
+
+    } else if(is("--compare-orders")) {
+      options.compare_orders = true;
+
+    } else if('-' == arg[0]) {
+      if(i + 1 == argc) {
+        fprintf(stderr, "missing value for %s\n", arg);
+        return 1;
+      }
+      const char* value = argv[++i];
+
+      if(is("-w", "--width"))
+        options.width = atoi(value);
+      else if(is("-h", "--height"))
+        options.height = atoi(value);
+      else if(is("--start"))
+        options.start = atof(value);
+      else if(is("--end"))
+        options.end = atof(value);
+      else if(is("--fps"))
+        options.fps = atof(value);
+      else if(is("-j", "--threads"))
+        options.num_threads = atoi(value);
+      else if(is("-o", "--output"))
+        options.output = value;
+      else if(is("--order")) {
+        if(!strcmp(value, "row"))
+          options.order = block_order_t::row_major;
+        else if(!strcmp(value, "morton"))
+          options.order = block_order_t::morton;
+        else if(!strcmp(value, "hilbert"))
+          options.order = block_order_t::hilbert;
+        else {
+          fprintf(stderr, "unknown block order %s\n", value);
+          return 1;
+        }
+      }
+      else {
+        fprintf(stderr, "unknown option %s\n", arg);
+        return 1;
+      }
+
+    } else
+      options.shader = arg;
+  }
+
+  if(!options.shader) {
+    fprintf(stderr, "no shader specified\n");
+    return 1;
+  }
+
+  if(options.width <= 0 || options.height <= 0 || options.fps <= 0 ||
+    options.num_threads <= 0) {
+    fprintf(stderr, "invalid size, frame rate or thread count\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Counters that can't be opened are NaN.
+struct order_result_t {
+  double seconds;
+  double l1d_misses;
+  double l2_misses;
+  double llc_misses;
+};
+
+// Time every frame of one shader with one block order. The counters are
+// opened before the pool's threads are created, and read after they exit,
+// so that the workers' counts are included.
+inline order_result_t measure_order(shader_program_t shader,
+  const render_options_t& options, block_order_t order, int num_frames) {
+
+  std::unique_ptr<program_base_t> program = make_program(shader);
+
+  frame_t frame;
+  frame.width = options.width;
+  frame.height = options.height;
+  frame.data.resize(options.width * options.height);
+
+  shadertoy_uniforms_t u { };
+  u.mouse = vec4(.5, .5, .5, .5);
+  u.resolution = vec2(options.width, options.height);
+
+  perf_counter_t l1d(perf_counter_t::l1d_misses);
+  perf_counter_t l2(perf_counter_t::l2_misses);
+  perf_counter_t llc(perf_counter_t::llc_misses);
+  order_result_t result { };
+
+  {
+    block_pool_t pool(options.num_threads);
+
+    // Warm up the caches and the pool before measuring.
+    u.time = options.start;
+    render_frame(pool, program.get(), u, options.mode, order, frame);
+
+    l1d.start();
+    l2.start();
+    llc.start();
+    auto begin = std::chrono::high_resolution_clock::now();
+    for(int i = 0; i < num_frames; ++i) {
+      u.time = options.start + i / options.fps;
+      render_frame(pool, program.get(), u, options.mode, order, frame);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    result.seconds = std::chrono::duration<double>(end - begin).count();
+  }
+
+  l1d.stop();
+  l2.stop();
+  llc.stop();
+
+  auto count = [](const perf_counter_t& counter) {
+    return counter.valid() ? (double)counter.read() : NAN;
+  };
+  result.l1d_misses = count(l1d);
+  result.l2_misses = count(l2);
+  result.llc_misses = count(llc);
+  return result;
+}
+
+inline int compare_orders(const render_options_t& options, int num_frames) {
+  std::vector<shader_program_t> shaders;
+  if(!strcmp(options.shader, "all")) {
+    @meta for enum(shader_program_t e : shader_program_t) {
+      shaders.push_back(e);
+    }
+
+  } else {
+    shader_program_t shader;
+    if(!find_shader(options.shader, shader)) {
+      fprintf(stderr, "unknown shader %s\n", options.shader);
+      return 1;
+    }
+    shaders.push_back(shader);
+  }
+
+  const block_order_t orders[] {
+    block_order_t::row_major, block_order_t::morton, block_order_t::hilbert
+  };
+
+  printf("%d frames at %dx%d on %d threads (%s)\n", num_frames,
+    options.width, options.height, options.num_threads,
+    enum_to_string(options.mode));
+  printf("%-16s %-8s %10s %8s %12s %12s %12s\n", "shader", "order",
+    "Mpixel/s", "speedup", "L1D miss/px", "L2 miss/px", "LLC miss/px");
+
+  double pixels = (double)num_frames * options.width * options.height;
+  for(shader_program_t shader : shaders) {
+    double base = 0;
+    for(block_order_t order : orders) {
+      order_result_t result = measure_order(shader, options, order,
+        num_frames);
+
+      double rate = pixels / result.seconds / 1.0e6;
+      if(block_order_t::row_major == order)
+        base = rate;
+
+      printf("%-16s %-8s %10.2f %7.2fx %12.3f %12.3f %12.3f\n",
+        enum_to_string(shader), enum_to_string(order), rate, rate / base,
+        result.l1d_misses / pixels, result.l2_misses / pixels,
+        result.llc_misses / pixels);
+    }
+  }
+
+  return 0;
+}
+
+#ifdef SHADERTOY_BENCH
+
+#include "bench.hxx"
+
+#else
+
+int main(int argc, char** argv) {
+  render_options_t options;
+  if(int result = parse_options(argc, argv, options)) {
+    if(result > 0)
+      print_usage();
+    return std::max(result, 0);
+  }
+
+  int num_frames = std::max(1,
+    (int)ceil((options.end - options.start) * options.fps));
+
+  if(options.compare_orders)
+    return compare_orders(options, num_frames);
+
+  shader_program_t shader;
+  if(!find_shader(options.shader, shader)) {
+    fprintf(stderr, "unknown shader %s\n", options.shader);
+    return 1;
+  }
+
+  const char* ext = strrchr(options.output, '.');
+  bool exr = ext && !strcmp(ext, ".exr");
+  if(!exr && !(ext && !strcmp(ext, ".png"))) {
+    fprintf(stderr, "output must end in .png or .exr\n");
+    return 1;
+  }
+
+  std::unique_ptr<program_base_t> program = make_program(shader);
+  block_pool_t pool(options.num_threads);
+
+  printf("%s: %d frames at %dx%d on %d threads (%s)\n",
+    enum_to_string(shader), num_frames, options.width, options.height,
+    options.num_threads, enum_to_string(options.mode));
+
+  // Double buffer the frames. The next frame renders while the previous
+  // one is encoded and written on another thread.
+  frame_t frames[2];
+  for(frame_t& frame : frames) {
+    frame.width = options.width;
+    frame.height = options.height;
+    frame.data.resize(options.width * options.height);
+  }
+  std::future<bool> pending;
+
+  shadertoy_uniforms_t u { };
+  u.mouse = vec4(.5, .5, .5, .5);
+  u.resolution = vec2(options.width, options.height);
+
+  double pixels = (double)options.width * options.height;
+  double total_seconds = 0;
+  bool okay = true;
+
+  for(int i = 0; i < num_frames; ++i) {
+    frame_t& frame = frames[i % 2];
+    u.time = options.start + i / options.fps;
+
+    auto begin = std::chrono::high_resolution_clock::now();
+    render_frame(pool, program.get(), u, options.mode, options.order,
+      frame);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - begin).count();
+    total_seconds += seconds;
+    printf("frame %4d  t = %8.3f  %9.2f ms  %8.2f Mpixel/s\n", i, u.time,
+      1000 * seconds, pixels / seconds / 1.0e6);
+
+    if(pending.valid())
+      okay &= pending.get();
+
+    char path[4096];
+    snprintf(path, sizeof(path), options.output, i);
+    pending = std::async(std::launch::async, [&frame, exr](std::string path) {
+      bool result = exr ? write_exr(path.c_str(), frame) :
+        write_png(path.c_str(), frame);
+      if(!result)
+        fprintf(stderr, "could not write %s\n", path.c_str());
+      return result;
+    }, std::string(path));
+  }
+
+  if(pending.valid())
+    okay &= pending.get();
+
+  printf("%d frames in %.3f s: %.2f ms/frame  %.2f Mpixel/s\n", num_frames,
+    total_seconds, 1000 * total_seconds / num_frames,
+    num_frames * pixels / total_seconds / 1.0e6);
+
+  return okay ? 0 : 1;
+}
+
+#endif // SHADERTOY_BENCH
@@ -2,6 +2,9 @@
 #error "Circle build 103 required to reliably compile this sample"
 #endif
 
+// Define SHADERTOY_HEADLESS to build the shadertoy-render batch renderer.
+// That build has no ImGui or OpenGL dependencies.
+#ifndef SHADERTOY_HEADLESS
 #include <imgui.h>
 #include <backends/imgui_impl_glfw.h>
 #include <backends/imgui_impl_opengl3.h>
@@ -9,6 +12,8 @@
 #define GL_GLEXT_PROTOTYPES
 #include <gl3w/GL/gl3w.h>
 #include <GLFW/glfw3.h>
+#endif // SHADERTOY_HEADLESS
+
 #include <cstdio>
 #include <cstdlib>
 #include <complex>
@@ -17,9 +22,18 @@
 #include <atomic>
 #include <thread>
 #include <csignal>
+#include <algorithm>
+#include <cstring>
 
 // Interlacing
 #include "adam7.hxx"
+#include "block_pool.hxx"
+
+// SIMD packet evaluation on the CPU.
+#include "simd.hxx"
+
+// Subgroup and quad operations on the CPU.
+#include "subgroup.hxx"
 
 template<typename type_t>
 const char* enum_to_string(type_t x) {
@@ -53,6 +67,8 @@ namespace imgui {
   using url      [[attribute]] = const char*;
 }
 
+#ifndef SHADERTOY_HEADLESS
+
 // Return true if any option has changed.
 template<typename options_t>
 bool render_imgui(options_t& options, const char* child_name = nullptr) {
@@ -183,6 +199,8 @@ bool render_imgui(options_t& options, const char* child_name = nullptr) {
   return changed;
 }
 
+#endif // SHADERTOY_HEADLESS
+
 ////////////////////////////////////////////////////////////////////////////////
 
 [[using spirv: in, location(0)]]
@@ -1114,6 +1132,13 @@ struct trace_result_t {
   float t;
 };
 
+// One trace_result_t per lane.
+struct packet_trace_result_t {
+  pmask hit;
+  pint steps;
+  pfloat t;
+};
+
 struct sphere_tracer_t {
   template<typename scene_t>
   trace_result_t trace(const scene_t& scene, vec3 o, vec3 dir, float ra, 
@@ -1147,6 +1172,39 @@ struct sphere_tracer_t {
     return { hit, i, t  };
   }
 
+  // March a packet of rays together. Lanes that hit or escape drop out of
+  // the active mask, and the loop runs until every lane is done.
+  template<typename scene_t>
+  packet_trace_result_t trace(const scene_t& scene, pvec3 o, pvec3 dir, 
+    float ra, float rb, int max_steps) {
+
+    pfloat t = ra;
+    pint steps = 0;
+    pmask hit = 0;
+    pmask active = -1;
+    float k = scene.KGlobal();
+
+    for(int i = 0; i < max_steps && any(active); ++i) {
+      steps = select(active, steps + 1, steps);
+
+      pvec3 p = o + t * dir;
+      pfloat v = scene.Object(p);
+
+      // Hit.
+      pmask h = active & (v > 0);
+      hit = hit | h;
+      active = active & ~h;
+
+      // Move along ray.
+      t = select(active, t + max(epsilon, abs(v) / k), t);
+
+      // Retire lanes that have escaped.
+      active = active & ~(t > rb);
+    }
+
+    return { hit, steps, t };
+  }
+
   [[.imgui::range_float {0, .3 }]] float epsilon = .1;
 };
 
@@ -1201,6 +1259,179 @@ struct segment_tracer_t {
   [[.imgui::range_float { 0, 5 }]] float kappa = 2.0;
 };
 
+struct ray_cone_t {
+  vec3 axis;
+  float spread;
+};
+
+// Trace a screen-space tile of rays as one cone, then each ray on its own.
+//
+// The rays of a tile leave the same origin, so at distance t along the cone
+// axis every ray's point is within t * spread of the axis point, where
+// spread bounds |dir - axis| over the tile. With the global Lipschitz bound
+// k, a field value v < 0 on the axis clears every ray by -v / k - t * spread.
+// One Object evaluation advances the whole tile until that clearance drops
+// below epsilon. Then the rays split and continue with over-relaxed segment
+// tracing: each step is bounded by KSegment over the candidate segment, as
+// in segment_tracer_t, then stretched by omega, and the ray falls back to
+// unrelaxed steps the first time a step overshoots. KSegment bounds the
+// derivative along the segment only, so the cone, which needs clearance
+// across the tile, keeps KGlobal.
+//
+// The cone is marched once per tile, so its steps are counted as a share
+// of tile * tile pixels. The GPU repeats the cone march in every pixel of
+// the tile, so there the count is the cost of a shared pass, not the work
+// each invocation does.
+struct cone_tracer_t {
+  // March the cone from ra. Returns the distance all rays can advance to
+  // and the number of Object evaluations.
+  template<typename scene_t>
+  trace_result_t march_cone(const scene_t& scene, vec3 o, ray_cone_t cone,
+    float ra, float rb, int max_steps) {
+
+    float t = ra;
+    int i = 0;
+    float k = scene.KGlobal();
+
+    while(i < max_steps) {
+      ++i;
+
+      float v = scene.Object(o + t * cone.axis);
+      float clearance = -v / k - t * cone.spread;
+
+      // Split the tile.
+      if(clearance < epsilon)
+        break;
+
+      t += clearance;
+
+      // Break if every ray has escaped.
+      if(t > rb)
+        break;
+    }
+
+    return { false, i, t };
+  }
+
+  template<typename scene_t>
+  trace_result_t trace(const scene_t& scene, vec3 o, vec3 dir, float ra,
+    float rb, int max_steps) {
+
+    float t = ra;
+    float prev_t = ra;
+    float prev_r = 0;
+    float w = omega;
+    float candidate = 1;
+    int i = 0;
+    bool hit = false;
+
+    while(i < max_steps) {
+      ++i;
+
+      vec3 p = o + t * dir;
+      float v = scene.Object(p);
+
+      // Lipschitz constant on the segment from the last point through the
+      // next candidate step, so r is safe behind p for the overshoot test
+      // and ahead of p for the step.
+      float k = scene.KSegment(o + prev_t * dir, o + (t + candidate) * dir);
+      float r = abs(v) / k;
+
+      // There's no previous step to overshoot on the first iteration.
+      if(w > 1 && prev_r > 0 && (v > 0 || r + prev_r < t - prev_t)) {
+        // The relaxed step may have crossed the surface. Go back to the
+        // unrelaxed step and stop relaxing.
+        t = prev_t + max(epsilon, prev_r);
+        w = 1;
+
+      } else if(v > 0) {
+        // Hit.
+        hit = true;
+        break;
+
+      } else {
+        // Move along ray, no further than the segment length.
+        float step = max(epsilon, min(w * r, candidate));
+        prev_t = t;
+        prev_r = min(r, candidate);
+        t += step;
+        candidate = kappa * step;
+      }
+
+      // Break if ray has escaped.
+      if(t > rb)
+        break;
+    }
+
+    return { hit, i, t };
+  }
+
+  // The share of a tile's cone steps charged to each of its pixels.
+  int shared_steps(int cone_steps) const {
+    int area = tile * tile;
+    return (cone_steps + area - 1) / area;
+  }
+
+  // The packet version of trace. Each lane starts at its own ra.
+  template<typename scene_t>
+  packet_trace_result_t trace(const scene_t& scene, pvec3 o, pvec3 dir,
+    pfloat ra, float rb, int max_steps) {
+
+    pfloat t = ra;
+    pfloat prev_t = ra;
+    pfloat prev_r = 0;
+    pfloat w = omega;
+    pfloat candidate = 1;
+    pint steps = 0;
+    pmask hit = 0;
+    pmask active = ~(t > rb);
+
+    for(int i = 0; i < max_steps && any(active); ++i) {
+      steps = select(active, steps + 1, steps);
+
+      pvec3 p = o + t * dir;
+      pfloat v = scene.Object(p);
+
+      // The scene's segment bound is scalar, so take it lane by lane.
+      pvec3 a = o + prev_t * dir;
+      pvec3 b = o + (t + candidate) * dir;
+      pfloat k;
+      for(int lane = 0; lane < packet_width; ++lane)
+        k[lane] = scene.KSegment(a.get(lane), b.get(lane));
+      pfloat r = abs(v) / k;
+
+      pmask fail = active & (w > 1.f) & (prev_r > 0) &
+        ((v > 0) | (r + prev_r < t - prev_t));
+      pmask h = active & ~fail & (v > 0);
+      pmask move = active & ~fail & ~h;
+      hit = hit | h;
+      active = active & ~h;
+
+      // Relaxed steps that may have crossed the surface go back to the
+      // unrelaxed step.
+      t = select(fail, prev_t + max(epsilon, prev_r), t);
+      w = select(fail, pfloat(1), w);
+
+      // Move along ray, no further than the segment length.
+      pfloat step = max(epsilon, min(w * r, candidate));
+      prev_t = select(move, t, prev_t);
+      prev_r = select(move, min(r, candidate), prev_r);
+      t = select(move, t + step, t);
+      candidate = select(move, kappa * step, candidate);
+
+      // Retire lanes that have escaped.
+      active = active & ~(t > rb);
+    }
+
+    return { hit, steps, t };
+  }
+
+  [[.imgui::range_float { 0, .3 }]] float epsilon = .1;
+  [[.imgui::range_float { 1, 2 }]] float omega = 1.6;
+  [[.imgui::range_float { 0, 5 }]] float kappa = 2.0;
+  [[.imgui::range_int { 1, 32 }]] int tile = 8;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // Scene distance fields
 
@@ -1224,6 +1455,25 @@ struct blobs_t {
     return I - T;
   }
 
+  // Packet versions of the field for the SIMD tracers.
+  pfloat Falloff(pfloat x, float R) const {
+    pfloat xx = saturate(x / R);
+    pfloat y = 1 - xx * xx;
+    return y * y * y;
+  }
+
+  pfloat Vertex(pvec3 p, vec3 c, float R, float e) const {
+    return e * Falloff(length(p - c), R);
+  }
+
+  pfloat Object(pvec3 p) const {
+    pfloat I = 0;
+    I += Vertex(p, vec3(-radius / 2,      0, 0), radius, 1);
+    I += Vertex(p, vec3( radius / 2,      0, 0), radius, 1);
+    I += Vertex(p, vec3( radius / 3, radius, 0), radius, 1);
+    return I - T;
+  }
+
   float FalloffK(float e, float R) const {
     return e * 1.72f * abs(e) / R;
   }
@@ -1335,30 +1585,151 @@ struct [[
       mix(ShadeColor2, ShadeColor3, 2 * t - 1);
   }
 
-  vec4 render(vec2 frag_coord, shadertoy_uniforms_t u) {
-    vec2 pixel = 2 * (frag_coord / u.resolution) - 1;
-    vec2 mouse = 2 * (u.mouse.xy / u.resolution.xy) - 1;
+  static constexpr bool is_dual = std::pair == tracer_t.template;
 
+  vec3 Ray(vec2 pixel, shadertoy_uniforms_t u) {
     float asp = u.resolution.x / u.resolution.y;
     vec3 rd = normalize(vec3(asp * pixel.x, pixel.y - 1.5f, -4.f));
-    vec3 ro(0, 18, 40);
+    return RotateY(rd, .25f * u.time);
+  }
 
-    float a = .25f * u.time;
-    ro = RotateY(ro, a);
-    rd = RotateY(rd, a);
+  vec3 Origin(shadertoy_uniforms_t u) {
+    return RotateY(vec3(0, 18, 40), .25f * u.time);
+  }
 
-    // Shade this object.
-    vec3 color = Background(rd);
+  vec4 render(vec2 frag_coord, shadertoy_uniforms_t u) {
+    vec2 pixel = 2 * (frag_coord / u.resolution) - 1;
+    vec2 mouse = 2 * (u.mouse.xy / u.resolution.xy) - 1;
+
+    vec3 ro = Origin(u);
+    vec3 rd = Ray(pixel, u);
 
     trace_result_t result { };
 
-    constexpr bool is_dual = std::pair == tracer_t.template;
     if constexpr(is_dual)
       result = (pixel.x < mouse.x) ?
-        tracer.first.trace(scene, ro, rd, 20, 60, MaxSteps) :
-        tracer.second.trace(scene, ro, rd, 20, 60, MaxSteps);
+        Trace(tracer.first, frag_coord, ro, rd, u) :
+        Trace(tracer.second, frag_coord, ro, rd, u);
     else
-      result = tracer.trace(scene, ro, rd, 20, 60, MaxSteps);
+      result = Trace(tracer, frag_coord, ro, rd, u);
+
+    return ShadeResult(pixel, mouse, ro, rd, result, u);
+  }
+
+  template<typename tracer2_t>
+  trace_result_t Trace(tracer2_t& tr, vec2 frag_coord, vec3 ro, vec3 rd,
+    shadertoy_uniforms_t u) {
+
+    trace_result_t result { };
+    if constexpr(std::is_same_v<tracer2_t, cone_tracer_t>) {
+      // March this pixel's tile, then the pixel's ray from where the tile
+      // split.
+      trace_result_t cone = tr.march_cone(scene, ro,
+        TileCone(tr.tile, frag_coord, u), 20, 60, MaxSteps);
+
+      result = { false, 0, cone.t };
+      if(cone.t <= 60)
+        result = tr.trace(scene, ro, rd, cone.t, 60, MaxSteps);
+      result.steps += tr.shared_steps(cone.steps);
+
+    } else
+      result = tr.trace(scene, ro, rd, 20, 60, MaxSteps);
+
+    return result;
+  }
+
+  // The cone around the rays of the tile holding frag_coord. The rays pass
+  // through a rectangle on the image plane, so a cone around the corner
+  // rays holds them all.
+  ray_cone_t TileCone(int tile, vec2 frag_coord, shadertoy_uniforms_t u) {
+    vec2 lo = floor(frag_coord / tile) * tile;
+    vec2 hi = lo + tile;
+    vec3 corners[4] {
+      Ray(2 * (lo / u.resolution) - 1, u),
+      Ray(2 * (vec2(hi.x, lo.y) / u.resolution) - 1, u),
+      Ray(2 * (vec2(lo.x, hi.y) / u.resolution) - 1, u),
+      Ray(2 * (hi / u.resolution) - 1, u),
+    };
+
+    ray_cone_t cone { };
+    cone.axis = normalize(corners[0] + corners[1] + corners[2] + corners[3]);
+    for(int i = 0; i < 4; ++i)
+      cone.spread = max(cone.spread, length(corners[i] - cone.axis));
+    return cone;
+  }
+
+  // Evaluate packet_width pixels at once. The sphere and cone tracers march
+  // all the rays together in SIMD. Shading runs once per lane after the
+  // march.
+  void render_packet(const vec2* frag_coord, vec4* colors, 
+    shadertoy_uniforms_t u) {
+
+    if constexpr(std::is_same_v<tracer_t, sphere_tracer_t>) {
+      vec2 mouse = 2 * (u.mouse.xy / u.resolution.xy) - 1;
+      vec3 ro = Origin(u);
+
+      vec2 pixel[packet_width];
+      pvec3 rd;
+      for(int i = 0; i < packet_width; ++i) {
+        pixel[i] = 2 * (frag_coord[i] / u.resolution) - 1;
+        rd.set(i, Ray(pixel[i], u));
+      }
+
+      packet_trace_result_t result = tracer.trace(scene, ro, rd, 20, 60, 
+        MaxSteps);
+
+      for(int i = 0; i < packet_width; ++i) {
+        trace_result_t r { 0 != result.hit[i], result.steps[i], 
+          result.t[i] };
+        colors[i] = ShadeResult(pixel[i], mouse, ro, rd.get(i), r, u);
+      }
+
+    } else if constexpr(std::is_same_v<tracer_t, cone_tracer_t>) {
+      vec2 mouse = 2 * (u.mouse.xy / u.resolution.xy) - 1;
+      vec3 ro = Origin(u);
+
+      // March each tile's cone once. The lanes come in runs of pixels from
+      // the same tile.
+      vec2 pixel[packet_width];
+      pvec3 rd;
+      pfloat ra;
+      pint shared;
+      vec2 last_tile(-1);
+      trace_result_t cone { };
+      for(int i = 0; i < packet_width; ++i) {
+        pixel[i] = 2 * (frag_coord[i] / u.resolution) - 1;
+        rd.set(i, Ray(pixel[i], u));
+
+        vec2 tile = floor(frag_coord[i] / tracer.tile);
+        if(tile.x != last_tile.x || tile.y != last_tile.y) {
+          cone = tracer.march_cone(scene, ro,
+            TileCone(tracer.tile, frag_coord[i], u), 20, 60, MaxSteps);
+          last_tile = tile;
+        }
+        ra[i] = cone.t;
+        shared[i] = tracer.shared_steps(cone.steps);
+      }
+
+      packet_trace_result_t result = tracer.trace(scene, ro, rd, ra, 60,
+        MaxSteps);
+
+      for(int i = 0; i < packet_width; ++i) {
+        trace_result_t r { 0 != result.hit[i], result.steps[i] + shared[i],
+          result.t[i] };
+        colors[i] = ShadeResult(pixel[i], mouse, ro, rd.get(i), r, u);
+      }
+
+    } else {
+      for(int i = 0; i < packet_width; ++i)
+        colors[i] = render(frag_coord[i], u);
+    }
+  }
+
+  vec4 ShadeResult(vec2 pixel, vec2 mouse, vec3 ro, vec3 rd, 
+    trace_result_t result, shadertoy_uniforms_t u) {
+
+    // Shade this object.
+    vec3 color = Background(rd);
 
     // Render the window.
     if(pixel.y > mouse.y) {
@@ -1957,9 +2328,10 @@ struct palette_t {
   vec3 fcos(vec3 x) const {
     vec3 w = x;
 
-    // Take the derivative of this term. Only available in SPIR-V builds.
-    if codegen(__is_spirv_target)
-      w = glfrag_fwidth(x);
+    // Take the derivative of this term. On the CPU this needs the quads of
+    // subgroup evaluation.
+    if(has_derivatives())
+      w = quad_fwidth(x);
 
     return Approximate ?
       cos(x) * smoothstep(PI2, 0.f, w) :
@@ -2852,7 +3224,7 @@ struct [[
   
   uint get_num_active_lanes() {
     // Submit a flag for each active lane and add up the bits.
-    ivec4 bc = bitCount(gl_subgroupBallot(true));
+    ivec4 bc = bitCount(subgroup_ballot(true));
     uint num_active_lanes = bc.x + bc.y + bc.z + bc.w;
     return num_active_lanes;
   }
@@ -2874,7 +3246,8 @@ struct [[
     float texP = tex_pattern(pos);
     vec4 color = vec4(texP * pos / u.resolution, 0, 1);
 
-    if codegen(__is_spirv_target) {
+    // On the CPU these modes need subgroup evaluation.
+    if(has_subgroups()) {
 
       switch(render_mode) {        
         case DefaultColoring:
@@ -2883,46 +3256,47 @@ struct [[
 
         case ColorByLane: {
           // Color by lane ID.
-          float x = (float)gl_SubgroupInvocationID / gl_SubgroupSize;
+          float x = (float)subgroup_invocation_id() / subgroup_size();
           color = vec4(x, x, x, 1);
           break;
         }
 
         case FirstLaneWhite:
           // Mark the first lane as white pixel.
-          if(gl_subgroupElect())
+          if(subgroup_elect())
             color = vec4(1);
           break;
 
         case FirstWhiteLastRed:
           // Color the first lane white and the last active lane red.
-          if(gl_subgroupElect())
+          if(subgroup_elect())
             color = vec4(1);
-          else if(gl_SubgroupInvocationID == gl_subgroupMax(gl_SubgroupInvocationID))
+          else if(subgroup_invocation_id() ==
+            subgroup_max(subgroup_invocation_id()))
             color = vec4(1, 0, 0, 1);
           break;
      
         case ActiveLaneRatio: {
-          float active_ratio = get_num_active_lanes() / float(gl_SubgroupSize);
+          float active_ratio = get_num_active_lanes() / float(subgroup_size());
           color = vec4(active_ratio, active_ratio, active_ratio, 1);
           break;
         }
         
         case BroadcastFirst:
           // Broadcast the color in the first lane.
-          color = gl_subgroupBroadcastFirst(color);
+          color = subgroup_broadcast_first(color);
           break;
 
         case AverageLanes: {
           // Paint the wave with the averaged color inside the wave.
-          color = gl_subgroupAdd(color) / get_num_active_lanes();
+          color = subgroup_add(color) / get_num_active_lanes();
           break;
         }
 
         case PrefixSum: {
           // First, compute the prefix sum color each lane to first lane.
-          vec4 base_color = gl_subgroupBroadcastFirst(color);
-          vec4 prefix_color = gl_subgroupExclusiveAdd(color - base_color);
+          vec4 base_color = subgroup_broadcast_first(color);
+          vec4 prefix_color = subgroup_exclusive_add(color - base_color);
 
           // Then, normalize by the number of active lanes.
           color = prefix_color / get_num_active_lanes();
@@ -2930,8 +3304,8 @@ struct [[
         }
 
         case QuadColoring: {
-          float dx = gl_subgroupQuadSwapHorizontal(pos.x) - pos.x;
-          float dy = gl_subgroupQuadSwapVertical(pos.y) - pos.y;
+          float dx = subgroup_quad_swap_horizontal(pos.x) - pos.x;
+          float dy = subgroup_quad_swap_vertical(pos.y) - pos.y;
 
           if(dx > 0 && dy > 0)
             color = vec4(1, 0, 0, 1);
@@ -3027,6 +3401,16 @@ enum typename class shader_program_t {
     std::pair<sphere_tracer_t, segment_tracer_t>, 
     blobs_t
   >,
+  ConeTracer = tracer_engine_t<
+    "Cone tracer (Click to display step counts)",
+    cone_tracer_t,
+    blobs_t
+  >,
+  ConeDualTracer = tracer_engine_t<
+    "Tracer comparison (Left is sphere tracing, right is cone tracing)",
+    std::pair<sphere_tracer_t, cone_tracer_t>,
+    blobs_t
+  >,
   Raymarcher = raymarch_prims_t,
   band_limited1_t,
   band_limited2_t,
@@ -3036,16 +3420,57 @@ enum typename class shader_program_t {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-struct program_base_t {
-  // Return true if any parameter has changed.
-  virtual bool configure(bool update_ubo) = 0;
+// Shaders that define render_packet evaluate packet_width pixels at once
+// in SIMD. The others are run one lane at a time.
+template<typename shader_t, typename = void>
+constexpr bool has_render_packet = false;
 
+template<typename shader_t>
+constexpr bool has_render_packet<shader_t, 
+  std::void_t<decltype(&shader_t::render_packet)> > = true;
+
+// How the CPU backend evaluates a run of pixels.
+enum class eval_mode_t {
+  scalar,       // render one pixel at a time
+  packet,       // render_packet when the shader has it
+  subgroup,     // 32-lane subgroups of 2x2 quads
+};
+
+// The pixel of lane i of an 8x8 block in subgroup order. The block is two
+// 8x4 subgroups of 2x2 quads, so lanes i ^ 1 and i ^ 2 are the horizontal
+// and vertical neighbors of lane i.
+inline ivec2 subgroup_pixel(int i) {
+  int quad = i / 4;
+  return ivec2(2 * (quad % 4) + (i & 1), 2 * (quad / 4) + (i>> 1 & 1));
+}
+
+struct program_base_t {
   // Evaluate the shader with the CPU at this coordinate.
   virtual vec4 eval(vec2 coord, shadertoy_uniforms_t u, 
     bool signal = false) = 0;
 
+  // Evaluate the shader at count coordinates. This is one virtual call for
+  // a whole run of pixels, and uses render_packet when it's available.
+  virtual void eval_packet(const vec2* coords, vec4* colors, int count,
+    const shadertoy_uniforms_t& u) = 0;
+
+  // Evaluate the shader in lockstep over subgroups of 32 coordinates, so
+  // that subgroup operations and derivatives work like on the GPU. The
+  // coordinates are in subgroup_pixel order. Shaders with render_packet use
+  // no subgroup operations, and are evaluated as packets instead.
+  virtual void eval_subgroup(const vec2* coords, vec4* colors, int count,
+    const shadertoy_uniforms_t& u) = 0;
+
+  void eval_points(eval_mode_t mode, const vec2* coords, vec4* colors,
+    int count, const shadertoy_uniforms_t& u);
+
+#ifndef SHADERTOY_HEADLESS
+  // Return true if any parameter has changed.
+  virtual bool configure(bool update_ubo) = 0;
+
   GLuint program;
   GLuint ubo;
+#endif
 };
 
 template<typename shader_t>
@@ -3053,11 +3478,92 @@ struct program_t : program_base_t {
   // Keep an instance of the shader parameters in memory to drive ImGui.
   shader_t shader;
 
+  vec4 eval(vec2 coord, shadertoy_uniforms_t u, bool signal) override;
+  void eval_packet(const vec2* coords, vec4* colors, int count,
+    const shadertoy_uniforms_t& u) override;
+  void eval_subgroup(const vec2* coords, vec4* colors, int count,
+    const shadertoy_uniforms_t& u) override;
+
+#ifndef SHADERTOY_HEADLESS
   program_t();
   bool configure(bool update_ubo) override;
-  vec4 eval(vec2 coord, shadertoy_uniforms_t u, bool signal) override;
+#endif
 };
 
+template<typename shader_t>
+vec4 program_t<shader_t>::eval(vec2 coord, shadertoy_uniforms_t u, 
+  bool signal) {
+
+  if(signal)
+    raise(SIGINT);
+
+  return shader.render(coord, u);
+}
+
+template<typename shader_t>
+void program_t<shader_t>::eval_packet(const vec2* coords, vec4* colors,
+  int count, const shadertoy_uniforms_t& u) {
+
+  if constexpr(has_render_packet<shader_t>) {
+    for(int i = 0; i < count; i += packet_width) {
+      // Fill a partial packet by repeating its last coordinate.
+      int n = std::min(packet_width, count - i);
+      vec2 lane_coords[packet_width];
+      vec4 lane_colors[packet_width];
+      for(int lane = 0; lane < packet_width; ++lane)
+        lane_coords[lane] = coords[i + std::min(lane, n - 1)];
+
+      shader.render_packet(lane_coords, lane_colors, u);
+
+      for(int lane = 0; lane < n; ++lane)
+        colors[i + lane] = lane_colors[lane];
+    }
+
+  } else {
+    for(int i = 0; i < count; ++i)
+      colors[i] = shader.render(coords[i], u);
+  }
+}
+
+template<typename shader_t>
+void program_t<shader_t>::eval_subgroup(const vec2* coords, vec4* colors,
+  int count, const shadertoy_uniforms_t& u) {
+
+  if constexpr(has_render_packet<shader_t>) {
+    eval_packet(coords, colors, count, u);
+
+  } else {
+    subgroup_t& subgroup = subgroup_t::local();
+    for(int i = 0; i < count; i += subgroup_t::max_lanes) {
+      int n = std::min((int)subgroup_t::max_lanes, count - i);
+      subgroup.run(n, [&](int lane) {
+        colors[i + lane] = shader.render(coords[i + lane], u);
+      });
+    }
+  }
+}
+
+inline void program_base_t::eval_points(eval_mode_t mode, const vec2* coords,
+  vec4* colors, int count, const shadertoy_uniforms_t& u) {
+
+  switch(mode) {
+    case eval_mode_t::scalar:
+      for(int i = 0; i < count; ++i)
+        colors[i] = eval(coords[i], u);
+      break;
+
+    case eval_mode_t::packet:
+      eval_packet(coords, colors, count, u);
+      break;
+
+    case eval_mode_t::subgroup:
+      eval_subgroup(coords, colors, count, u);
+      break;
+  }
+}
+
+#ifndef SHADERTOY_HEADLESS
+
 template<typename shader_t>
 program_t<shader_t>::program_t() {
   // Create vertex and fragment shader handles.
@@ -3092,17 +3598,34 @@ bool program_t<shader_t>::configure(bool update_ubo) {
   return changed;
 }
 
-template<typename shader_t>
-vec4 program_t<shader_t>::eval(vec2 coord, shadertoy_uniforms_t u, 
-  bool signal) {
+////////////////////////////////////////////////////////////////////////////////
 
-  if(signal)
-    raise(SIGINT);
+// Convert float color sums to RGBA8, packet_width pixels at a time. Each
+// pixel's rgb is divided by its sample count in .a. Pixels with no samples
+// come out black.
+inline void pack_rgba8(const vec4* sums, uint32_t* dest, int count) {
+  for(int i = 0; i < count; i += packet_width) {
+    int n = std::min(packet_width, count - i);
+
+    pfloat r = 0, g = 0, b = 0, w = 1;
+    for(int lane = 0; lane < n; ++lane) {
+      vec4 sum = sums[i + lane];
+      r[lane] = sum.r;
+      g[lane] = sum.g;
+      b[lane] = sum.b;
+      w[lane] = sum.a;
+    }
 
-  return shader.render(coord, u);
-}
+    pfloat scale = 255.f / max(w, 1.f);
+    pint r2 = to_int(clamp(r * scale + 1.f / 512, 0.f, 255.f));
+    pint g2 = to_int(clamp(g * scale + 1.f / 512, 0.f, 255.f));
+    pint b2 = to_int(clamp(b * scale + 1.f / 512, 0.f, 255.f));
 
-////////////////////////////////////////////////////////////////////////////////
+    for(int lane = 0; lane < n; ++lane)
+      dest[i + lane] = r2[lane] | (g2[lane]<< 8) | (b2[lane]<< 16) | 
+        0xff000000;
+  }
+}
 
 struct software_fbo_t {
   software_fbo_t(int width, int height);
@@ -3114,13 +3637,50 @@ struct software_fbo_t {
   GLuint fbo;
   int width, height;
 
+  // The CPU threads write linear float color into 32x32 tiles. A row of an
+  // 8x8 block is two cache lines of sums and one of lum2, so threads working
+  // on neighboring blocks never share a line. A tile is marked dirty when
+  // written, and update() only converts and uploads dirty tiles.
+  enum { tile_size = 32 };
+  struct alignas(64) tile_t {
+    // .rgb is the sum of the samples, .a is the number of samples.
+    vec4 sums[tile_size][tile_size];
+
+    // .x is the sum of the squared luminance of the samples, for estimating
+    // variance. .y is padding: with floats a block row would be 32 bytes,
+    // and horizontally adjacent blocks would share a line.
+    vec2 lum2[tile_size][tile_size];
+
+    std::atomic<bool> dirty;
+  };
+
+  int tilesX, tilesY;
+  std::unique_ptr<tile_t[]> tiles;
+
+  // RGBA8 staging image for uploads.
   std::vector<uint32_t> data;
 
+  tile_t& get_tile(int x, int y) {
+    return tiles[tilesX * (y / tile_size) + x / tile_size];
+  }
+
   void update();
   void blit(int width2, int height2);
   void set_block(vec4 color, int x, int y, int sx, int sy);
+
+  // Add a sample to pixel (x, y) of the tile. The caller marks it dirty.
+  void add_sample(tile_t& tile, vec4 color, int x, int y);
+
+  // The squared standard error of the luminance at (x, y).
+  float error2(const tile_t& tile, int x, int y) const;
+
+  void mark_dirty(tile_t& tile);
 };
 
+inline float luminance(vec3 color) {
+  return dot(color, vec3(.2126f, .7152f, .0722f));
+}
+
 software_fbo_t::software_fbo_t(int width, int height) :
   width(width), height(height) {
 
@@ -3130,6 +3690,10 @@ software_fbo_t::software_fbo_t(int width, int height) :
   glTextureStorage2D(texture, 1, GL_RGBA8, width, height);
   glNamedFramebufferTexture(fbo, GL_COLOR_ATTACHMENT0, texture, 0);
 
+  tilesX = (width + tile_size - 1) / tile_size;
+  tilesY = (height + tile_size - 1) / tile_size;
+  tiles = std::make_unique<tile_t[]>(tilesX * tilesY);
+
   data.resize(width * height);
 }
 
@@ -3139,9 +3703,42 @@ software_fbo_t::~software_fbo_t() {
 }
 
 void software_fbo_t::update() {
-  // Upload the texture data.
-  glTextureSubImage2D(texture, 0, 0, 0, width, height, GL_RGBA, 
-    GL_UNSIGNED_BYTE, data.data());
+  // Upload from the linear staging image, one span of tiles at a time.
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+
+  for(int ty = 0; ty < tilesY; ++ty) {
+    int y0 = tile_size * ty;
+    int y1 = std::min(height, y0 + tile_size);
+
+    // Pack the dirty tiles in this row and find the span that covers them.
+    int first = tilesX;
+    int last = -1;
+    for(int tx = 0; tx < tilesX; ++tx) {
+      tile_t& tile = tiles[tilesX * ty + tx];
+
+      // Clear the flag before reading, so a write that lands during the
+      // conversion marks the tile for the next update.
+      if(!tile.dirty.exchange(false))
+        continue;
+
+      int x0 = tile_size * tx;
+      int count = std::min(width, x0 + tile_size) - x0;
+      for(int y = y0; y < y1; ++y)
+        pack_rgba8(tile.sums[y - y0], data.data() + width * y + x0, count);
+
+      first = std::min(first, tx);
+      last = tx;
+    }
+
+    if(first <= last) {
+      int x0 = tile_size * first;
+      int x1 = std::min(width, tile_size * (last + 1));
+      glTextureSubImage2D(texture, 0, x0, y0, x1 - x0, y1 - y0, GL_RGBA, 
+        GL_UNSIGNED_BYTE, data.data() + width * y0 + x0);
+    }
+  }
+
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 }
 
 void software_fbo_t::blit(int width2, int height2) {
@@ -3155,49 +3752,93 @@ void software_fbo_t::blit(int width2, int height2) {
 }
 
 void software_fbo_t::set_block(vec4 color, int x, int y, int sx, int sy) {
-  // Convert the color to RGBA8.
-  ivec4 color2 = clamp((ivec4)(255.f * color + 1.f / 512), 0, 255);
-  uint32_t packed = color2.r | (color2.g<< 8) | (color2.b<< 16) | 0xff000000;
-
-  int index = width * y + x;
+  // adam7 sections never straddle a tile, since tiles are a multiple of 8.
+  tile_t& tile = get_tile(x, y);
+  x %= tile_size;
+  y %= tile_size;
+
+  // Store the color as a single sample.
+  vec4 sum = vec4(color.rgb, 1);
+  float lum = luminance(color.rgb);
   for(int row = 0; row < sy; ++row) {
-    for(int col = 0; col < sx; ++col)
-      data[index + col] = packed;
-    index += width;
+    for(int col = 0; col < sx; ++col) {
+      tile.sums[y + row][x + col] = sum;
+      tile.lum2[y + row][x + col].x = lum * lum;
+    }
   }
+
+  mark_dirty(tile);
+}
+
+void software_fbo_t::add_sample(tile_t& tile, vec4 color, int x, int y) {
+  x %= tile_size;
+  y %= tile_size;
+
+  float lum = luminance(color.rgb);
+  tile.sums[y][x] += vec4(color.rgb, 1);
+  tile.lum2[y][x].x += lum * lum;
+}
+
+float software_fbo_t::error2(const tile_t& tile, int x, int y) const {
+  x %= tile_size;
+  y %= tile_size;
+
+  vec4 sum = tile.sums[y][x];
+  float n = max(sum.a, 1.f);
+  float mean = luminance(sum.rgb) / n;
+  float var = max(tile.lum2[y][x].x / n - mean * mean, 0.f);
+  return var / n;
+}
+
+void software_fbo_t::mark_dirty(tile_t& tile) {
+  // Only write the flag when it changes, to keep the line shared.
+  if(!tile.dirty.load(std::memory_order_relaxed))
+    tile.dirty.store(true, std::memory_order_relaxed);
 }
 
 struct cpu_compute_t {
-  cpu_compute_t(int num_threads, int width, int height);
+  cpu_compute_t(block_pool_t* pool, int width, int height);
   ~cpu_compute_t();
 
   void pool_execute();
-  void thread_execute(int tid);
+  bool block_execute(int level, int block);
   bool pixel_execute(int x, int y, int sx, int sy);
   bool is_complete() const;
   void join();
-  void update();
 
-  static void thread_entry(cpu_compute_t* compute, int tid);
+  // Progressive refinement. Pass 0 is the adam7 pass. Each later pass adds
+  // a jittered sample to every pixel of the blocks whose error is still
+  // above the threshold. Returns false when the image has converged.
+  bool accumulate_execute();
+  bool sample_block(int block);
 
-  std::vector<std::thread> threads;
-  std::atomic<int> complete_count;
+  // The pool is owned by the app and outlives shader and size changes.
+  block_pool_t* pool;
   std::atomic<bool> okay;
 
   int width, height;
-  shadertoy_uniforms_t uniforms;
+  shadertoy_uniforms_t uniforms { };
   int num_levels = 0;
   bool interlace = false;
+  block_order_t order = block_order_t::row_major;
+  eval_mode_t mode = eval_mode_t::scalar;
+
+  // Every block is sampled for the first min_passes passes, so the variance
+  // estimates have something to go on.
+  enum { min_passes = 4 };
+  int pass = 0;
+  int max_samples = 64;
+  float threshold = .002f;
+  bool converged = false;
+  std::atomic<int> blocks_sampled;
 
   program_base_t* program;
   std::unique_ptr<software_fbo_t> fbo;
 };
 
-cpu_compute_t::cpu_compute_t(int num_threads, int width, int height) :
-  width(width), height(height) {
+cpu_compute_t::cpu_compute_t(block_pool_t* pool, int width, int height) :
+  pool(pool), width(width), height(height) {
 
-  complete_count = num_threads;
-  threads.resize(num_threads);
   okay = false;
 
   int width2 = (width + 7) & ~7;
@@ -3212,20 +3853,80 @@ cpu_compute_t::~cpu_compute_t() {
 
 void cpu_compute_t::pool_execute() {
   okay = true;
-  complete_count = 0;
-  for(int tid = 0; tid < threads.size(); ++tid)
-    threads[tid] = std::thread(thread_entry, this, tid);
+  pass = 0;
+  converged = false;
+
+  // Deal out the 8x8 blocks along the chosen curve. The pool splits the
+  // list into contiguous runs, one per worker, and rebalances by stealing.
+  adam7_t adam7 { (width + 7) / 8, (height + 7) / 8, order };
+  pool->execute(adam7.block_order(), num_levels,
+    [this](int tid, int level, int block) {
+      return block_execute(level, block);
+    });
 }
 
-void cpu_compute_t::thread_execute(int tid) {
+bool cpu_compute_t::block_execute(int level, int block) {
   adam7_t adam7 { (width + 7) / 8, (height + 7) / 8 };
 
-  auto f = [&](int x, int y, int sx, int sy) {
-    return pixel_execute(x, y, sx, sy);
+  if(eval_mode_t::subgroup == mode) {
+    // Quads need their neighboring pixels, so evaluate the whole block at
+    // full resolution on the first level and skip the others.
+    if(level)
+      return okay;
+
+    int x0 = 8 * (block % adam7.blocksX);
+    int y0 = 8 * (block / adam7.blocksX);
+    vec2 coords[64];
+    vec4 colors[64];
+    for(int i = 0; i < 64; ++i)
+      coords[i] = vec2(ivec2(x0, y0) + subgroup_pixel(i)) + .5f;
+
+    program->eval_subgroup(coords, colors, 64, uniforms);
+
+    if(!okay)
+      return false;
+
+    for(int i = 0; i < 64; ++i) {
+      ivec2 pixel = ivec2(x0, y0) + subgroup_pixel(i);
+      fbo->set_block(colors[i], pixel.x, pixel.y, 1, 1);
+    }
+    return okay;
+  }
+
+  if(eval_mode_t::scalar == mode) {
+    auto f = [&](int x, int y, int sx, int sy) {
+      return pixel_execute(x, y, sx, sy);
+    };
+    return adam7.process_block(block, level, num_levels, interlace, f);
+  }
+
+  // Gather this level's points in the block and evaluate them as packets.
+  // A level has at most 32 points.
+  struct point_t { int x, y, sx, sy; };
+  point_t points[32];
+  vec2 coords[32];
+  vec4 colors[32];
+  int count = 0;
+
+  auto gather = [&](int x, int y, int sx, int sy) {
+    points[count] = { x, y, sx, sy };
+    coords[count] = vec2(x + .5f, y + .5f);
+    ++count;
+    return true;
   };
-  adam7.process(tid, threads.size(), num_levels, interlace, f);
+  adam7.process_block(block, level, num_levels, interlace, gather);
+
+  // Immediately break if any setting has changed.
+  if(!okay)
+    return false;
+
+  program->eval_packet(coords, colors, count, uniforms);
 
-  ++complete_count;
+  for(int i = 0; i < count; ++i)
+    fbo->set_block(colors[i], points[i].x, points[i].y, points[i].sx, 
+      points[i].sy);
+
+  return okay;
 }
 
 bool cpu_compute_t::pixel_execute(int x, int y, int sx, int sy) {
@@ -3243,19 +3944,103 @@ bool cpu_compute_t::pixel_execute(int x, int y, int sx, int sy) {
   return true;
 }
 
+// Subpixel offset for a sample pass at (x, y). This is an R2 low-discrepancy
+// sequence over the passes, rotated by a per-pixel hash so that neighboring
+// pixels don't share a pattern.
+inline vec2 sample_jitter(int x, int y, int pass) {
+  uint h = (uint)x * 0x8da6b343u ^ (uint)y * 0xd8163841u;
+  h ^= h>> 16;
+  h *= 0x7feb352du;
+  h ^= h>> 15;
+  vec2 rotation = vec2(h & 0xffff, h>> 16) / 65536.f;
+  return fract(rotation + (float)pass * vec2(.7548776662f, .5698402910f));
+}
+
+bool cpu_compute_t::accumulate_execute() {
+  // Stop when the last pass found nothing to refine or the budget is spent.
+  if(converged || pass >= max_samples ||
+    (pass > min_passes && !blocks_sampled)) {
+    converged = true;
+    return false;
+  }
+
+  okay = true;
+  ++pass;
+  blocks_sampled = 0;
+
+  adam7_t adam7 { (width + 7) / 8, (height + 7) / 8, order };
+  pool->execute(adam7.block_order(), 1,
+    [this](int tid, int level, int block) {
+      return sample_block(block);
+    });
+  return true;
+}
+
+bool cpu_compute_t::sample_block(int block) {
+  if(!okay)
+    return false;
+
+  int blocksX = (width + 7) / 8;
+  int x0 = 8 * (block % blocksX);
+  int y0 = 8 * (block / blocksX);
+  software_fbo_t::tile_t& tile = fbo->get_tile(x0, y0);
+
+  // If the adam7 pass didn't reach full detail, the first pass replaces its
+  // coarse sections with one centered sample per pixel.
+  bool replace = 1 == pass && num_levels < 7;
+
+  if(!replace && pass > min_passes) {
+    // Skip blocks whose every pixel has converged.
+    float max_error2 = 0;
+    for(int y = y0; y < y0 + 8; ++y) {
+      for(int x = x0; x < x0 + 8; ++x)
+        max_error2 = max(max_error2, fbo->error2(tile, x, y));
+    }
+    if(max_error2 < threshold * threshold)
+      return true;
+  }
+
+  ++blocks_sampled;
+
+  // Subgroup evaluation keeps the pixels in quads.
+  ivec2 pixels[64];
+  vec2 coords[64];
+  vec4 colors[64];
+  for(int i = 0; i < 64; ++i) {
+    pixels[i] = ivec2(x0, y0) + (eval_mode_t::subgroup == mode ?
+      subgroup_pixel(i) : ivec2(i % 8, i / 8));
+    int x = pixels[i].x;
+    int y = pixels[i].y;
+    vec2 offset = replace ? vec2(.5f) : sample_jitter(x, y, pass);
+    coords[i] = vec2(x, y) + offset;
+  }
+
+  program->eval_points(mode, coords, colors, 64, uniforms);
+
+  if(!okay)
+    return false;
+
+  for(int i = 0; i < 64; ++i) {
+    int x = pixels[i].x;
+    int y = pixels[i].y;
+    if(replace)
+      fbo->set_block(colors[i], x, y, 1, 1);
+    else
+      fbo->add_sample(tile, colors[i], x, y);
+  }
+  fbo->mark_dirty(tile);
+
+  return true;
+}
+
 bool cpu_compute_t::is_complete() const {
-  return threads.size() == complete_count;
+  return pool->is_complete();
 }
 
 void cpu_compute_t::join() {
   okay = false;
-  for(std::thread& t : threads)
-    if(t.joinable())
-      t.join();
-}
-
-void cpu_compute_t::thread_entry(cpu_compute_t* compute, int tid) {
-  compute->thread_execute(tid);
+  pool->cancel();
+  pool->wait();
 }
 
 
@@ -3280,10 +4065,16 @@ struct app_t {
   bool debug_on_click = false;
   bool render_cpu = false;
   bool interlace = false;
+  int block_order = (int)block_order_t::hilbert;
   bool asynchronous = true;
+  int eval_mode = (int)eval_mode_t::packet;
+  bool accumulate = true;
+  int max_samples = 64;
+  float error_threshold = .002f;
   int num_threads = 1;
   int num_levels = 1;
   std::unique_ptr<software_fbo_t> software_fbo;
+  std::unique_ptr<block_pool_t> pool;
   std::unique_ptr<cpu_compute_t> cpu_compute;
 
   app_t();
@@ -3447,14 +4238,30 @@ void app_t::loop() {
     ImGui::Render();
 
     if(render_cpu) {
-      if(!cpu_compute || cpu_compute->threads.size() != num_threads) {
-        // Create a new thread pool.
-        cpu_compute = std::make_unique<cpu_compute_t>(num_threads, width,
+      if(!pool || pool->num_threads() != num_threads) {
+        // Create a new thread pool. The workers persist across frames and
+        // shader changes.
+        cpu_compute.reset();
+        pool = std::make_unique<block_pool_t>(num_threads);
+      }
+
+      if(!cpu_compute) {
+        cpu_compute = std::make_unique<cpu_compute_t>(pool.get(), width,
           height);
         cpu_compute->program = program.get();
       }
 
-      if(changed || cpu_compute->is_complete()) {
+      bool same_uniforms = !memcmp(&uniforms, &cpu_compute->uniforms,
+        sizeof(uniforms));
+
+      if(!changed && accumulate && same_uniforms &&
+        cpu_compute->is_complete()) {
+        // Nothing has changed since the frame finished. Keep refining it
+        // with more samples until it converges.
+        cpu_compute->accumulate_execute();
+        cpu_compute->fbo->update();
+
+      } else if(changed || cpu_compute->is_complete()) {
         // Either the shader settings have changed or we finished the frame.
         // Either way, update the settings and start again.
         cpu_compute->join();
@@ -3464,6 +4271,10 @@ void app_t::loop() {
 
         cpu_compute->num_levels = num_levels;
         cpu_compute->interlace = interlace;
+        cpu_compute->order = (block_order_t)block_order;
+        cpu_compute->mode = (eval_mode_t)eval_mode;
+        cpu_compute->max_samples = max_samples;
+        cpu_compute->threshold = error_threshold;
         cpu_compute->uniforms = uniforms;
         cpu_compute->pool_execute();
 
@@ -3536,7 +4347,23 @@ bool app_t::configure() {
     changed |= ImGui::SliderInt("Thread pool size", &num_threads, 1, 32);
     changed |= ImGui::SliderInt("Detail levels", &num_levels, 1, 7);
     changed |= ImGui::Checkbox("Interlacing", &interlace);
+
+    const char* orders[] { "Row major", "Z-order", "Hilbert" };
+    changed |= ImGui::Combo("Block order", &block_order, orders, 3);
+
+    // Subgroup evaluation runs subgroup operations and derivatives like the
+    // GPU, so the CPU output can serve as a reference.
+    const char* modes[] { "Scalar", "Packet", "Subgroup" };
+    changed |= ImGui::Combo("Evaluation", &eval_mode, modes, 3);
     ImGui::Checkbox("Asynchronous", &asynchronous);
+
+    // Progressive refinement when the time and mouse are held still.
+    changed |= ImGui::Checkbox("Accumulate samples", &accumulate);
+    if(accumulate) {
+      changed |= ImGui::SliderInt("Max samples", &max_samples, 1, 256);
+      changed |= ImGui::SliderFloat("Error threshold", &error_threshold, 0,
+        .02f, "%.4f");
+    }
   }
 
   int current = (int)active_shader;
@@ -3546,11 +4373,17 @@ bool app_t::configure() {
   changed |= ImGui::Combo("Active shader", &current, items, items.length);
 
   if(current != (int)active_shader) {
-    cpu_compute.reset();
+    // Stop the workers before destroying the program they're evaluating.
+    if(cpu_compute)
+      cpu_compute->join();
+
     set_active_shader((shader_program_t)current);
+
+    if(cpu_compute)
+      cpu_compute->program = program.get();
   }
 
-  program->configure(!render_cpu);
+  changed |= program->configure(!render_cpu);
   ImGui::End();
 
   return changed;
@@ -3582,3 +4415,9 @@ int main() {
 
   return 0;
 }
+
+#else // SHADERTOY_HEADLESS
+
+#include "render.hxx"
+
+#endif // SHADERTOY_HEADLESS
@@ -0,0 +1,184 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <numeric>
+
+// A bounding volume hierarchy for nearest-surface queries over SDF
+// primitives.
+//
+// Each primitive's bounds hold its surface, so the distance from a point to
+// the bounds is a lower bound on the primitive's distance. nearest() walks
+// the tree near child first and skips any node or primitive whose bounds are
+// farther away than the closest surface found so far. Away from the surfaces
+// that's a handful of box tests instead of an SDF per primitive.
+//
+// Inside overlapping primitives the pruning may return a distance that isn't
+// the most negative one. Sphere tracing only needs the sign and the distance
+// near zero, which are exact.
+
+struct aabb_t {
+  vec3 lo, hi;
+};
+
+inline aabb_t aabb_around(vec3 center, vec3 radius) noexcept {
+  return { center - radius, center + radius };
+}
+
+inline aabb_t aabb_union(aabb_t a, aabb_t b) noexcept {
+  return { min(a.lo, b.lo), max(a.hi, b.hi) };
+}
+
+inline vec3 aabb_center(aabb_t a) noexcept {
+  return .5f * (a.lo + a.hi);
+}
+
+// Distance from p to the box, or 0 inside it.
+inline float aabb_distance(aabb_t a, vec3 p) noexcept {
+  return length(max(max(a.lo - p, p - a.hi), 0.f));
+}
+
+struct bvh_node_t {
+  aabb_t box;
+
+  // Leaves hold the primitives [first, first + count). Interior nodes have
+  // count 0. Their left child follows them and first is the right child.
+  int first, count;
+};
+
+struct scene_bvh_t {
+  // Build the tree over the primitive bounds. order[i] is the primitive in
+  // slot i. The leaves refer to slots, so the caller should permute its
+  // primitives into this order.
+  void build(const std::vector<aabb_t>& bounds, int leaf_size,
+    std::vector<int>& order);
+
+  // Return the slot of the nearest primitive and its distance in dist, or
+  // -1 if none is closer than dist. sd(i) is the signed distance of the
+  // primitive in slot i.
+  template<typename sd_t>
+  int nearest(vec3 p, float& dist, sd_t sd) const noexcept;
+
+  int depth() const { return max_depth; }
+
+  std::vector<bvh_node_t> nodes;
+
+  // The primitive bounds in slot order.
+  std::vector<aabb_t> boxes;
+
+private:
+  int build_node(std::vector<int>& order, const std::vector<aabb_t>& bounds,
+    int begin, int end, int leaf_size, int level);
+
+  int max_depth = 0;
+};
+
+inline void scene_bvh_t::build(const std::vector<aabb_t>& bounds,
+  int leaf_size, std::vector<int>& order) {
+
+  int count = bounds.size();
+  order.resize(count);
+  std::iota(order.begin(), order.end(), 0);
+
+  nodes.clear();
+  boxes.clear();
+  max_depth = 0;
+  if(!count)
+    return;
+
+  nodes.reserve(2 * count / std::max(leaf_size, 1) + 1);
+  build_node(order, bounds, 0, count, std::max(leaf_size, 1), 1);
+
+  boxes.resize(count);
+  for(int i = 0; i < count; ++i)
+    boxes[i] = bounds[order[i]];
+}
+
+inline int scene_bvh_t::build_node(std::vector<int>& order,
+  const std::vector<aabb_t>& bounds, int begin, int end, int leaf_size,
+  int level) {
+
+  int index = nodes.size();
+  nodes.push_back({ });
+  max_depth = std::max(max_depth, level);
+
+  aabb_t box = bounds[order[begin]];
+  aabb_t centers { aabb_center(box), aabb_center(box) };
+  for(int i = begin + 1; i < end; ++i) {
+    box = aabb_union(box, bounds[order[i]]);
+    vec3 c = aabb_center(bounds[order[i]]);
+    centers = aabb_union(centers, { c, c });
+  }
+  nodes[index].box = box;
+
+  if(end - begin <= leaf_size) {
+    nodes[index].first = begin;
+    nodes[index].count = end - begin;
+    return index;
+  }
+
+  // Split at the median center along the widest axis of the centers.
+  vec3 extent = centers.hi - centers.lo;
+  int axis = extent.x > extent.y ?
+    (extent.x > extent.z ? 0 : 2) :
+    (extent.y > extent.z ? 1 : 2);
+
+  int mid = (begin + end) / 2;
+  std::nth_element(order.begin() + begin, order.begin() + mid,
+    order.begin() + end, [&](int a, int b) {
+      return aabb_center(bounds[a])[axis] < aabb_center(bounds[b])[axis];
+    });
+
+  build_node(order, bounds, begin, mid, leaf_size, level + 1);
+  int right = build_node(order, bounds, mid, end, leaf_size, level + 1);
+  nodes[index].first = right;
+  nodes[index].count = 0;
+  return index;
+}
+
+template<typename sd_t>
+int scene_bvh_t::nearest(vec3 p, float& dist, sd_t sd) const noexcept {
+  int result = -1;
+  if(nodes.empty())
+    return result;
+
+  // The far children waiting to be visited, with their box distances.
+  struct entry_t {
+    int node;
+    float dist;
+  };
+  entry_t stack[64];
+  int top = 0;
+
+  entry_t cur { 0, aabb_distance(nodes[0].box, p) };
+  while(true) {
+    if(cur.dist < dist) {
+      const bvh_node_t& node = nodes[cur.node];
+      if(node.count) {
+        for(int i = node.first; i < node.first + node.count; ++i) {
+          if(aabb_distance(boxes[i], p) < dist) {
+            float d = sd(i);
+            if(d < dist) {
+              dist = d;
+              result = i;
+            }
+          }
+        }
+
+      } else {
+        // Descend into the nearer child and come back for the other.
+        entry_t a { cur.node + 1, aabb_distance(nodes[cur.node + 1].box, p) };
+        entry_t b { node.first, aabb_distance(nodes[node.first].box, p) };
+        if(b.dist < a.dist)
+          std::swap(a, b);
+        stack[top++] = b;
+        cur = a;
+        continue;
+      }
+    }
+
+    if(!top)
+      break;
+    cur = stack[--top];
+  }
+  return result;
+}
@@ -17,12 +17,19 @@
 #include <atomic>
 #include <thread>
 #include <csignal>
+#include <tuple>
+#include <random>
+#include <chrono>
 
 #include <fstream>
 #include "json.hpp"
 
 // Interlacing
 #include "adam7.hxx"
+#include "block_pool.hxx"
+
+// Runtime scenes
+#include "scene_bvh.hxx"
 
 namespace imgui {
   // imgui attribute tags.
@@ -611,58 +618,459 @@ struct shape_t {
 ////////////////////////////////////////////////////////////////////////////////
 // Load an object from json.
 
-inline void check(bool valid, const std::string& name, 
+inline bool check(bool valid, const std::string& name,
   const std::string error) {
 
-  if(!valid) {
+  if(!valid)
     fprintf(stderr, "%s: %s\n", name.c_str(), error.c_str());
-    exit(1);
-  }
+  return valid;
 }
 
-// Load a class object consisting of class objects, vectors and scalars from
-// a JSON.
+// Read a class object consisting of class objects, vectors and scalars from
+// a JSON. Prints the reason and returns false on a missing or mistyped item.
 template<typename obj_t>
-obj_t load_from_json(std::string name, nlohmann::json& j) {
-  obj_t obj { };
+bool read_from_json(const std::string& name, const nlohmann::json& j,
+  obj_t& obj) {
 
   if(j.is_null()) {
     fprintf(stderr, "no JSON item for %s\n", name.c_str());
-    exit(1);
+    return false;
   }
 
   if constexpr(std::is_class_v<obj_t>) {
     // Read any class type.
-    check(j.is_object(), name, "expected object type");
-    @meta for(int i = 0; i < @member_count(obj_t); ++i)
-      obj.@member_value(i) = load_from_json<@member_type(obj_t, i)>(
-        name + "." + @member_name(obj_t, i),
-        j[@member_name(obj_t, i)]
-      );
+    if(!check(j.is_object(), name, "expected object type"))
+      return false;
+
+    @meta for(int i = 0; i < @member_count(obj_t); ++i) {{
+      std::string name2 = name + "." + @member_name(obj_t, i);
+      auto it = j.find(@member_name(obj_t, i));
+      if(j.end() == it) {
+        fprintf(stderr, "no JSON item for %s\n", name2.c_str());
+        return false;
+      }
+      if(!read_from_json(name2, *it, obj.@member_value(i)))
+        return false;
+    }}
 
   } else if constexpr(__is_vector(obj_t)) {
     static_assert(std::is_same_v<float, __underlying_type(obj_t)>);
     constexpr int size = __vector_size(obj_t);
 
-    check(j.is_array(), name, "expected array type");
-    check(j.size() == size, name, 
-      "expected " + std::to_string(size) + " array elements");
+    if(!check(j.is_array(), name, "expected array type") ||
+      !check(j.size() == size, name,
+        "expected " + std::to_string(size) + " array elements"))
+      return false;
 
     for(int i = 0; i < size; ++i) {
-      obj[i] = load_from_json<__underlying_type(obj_t)>(
-        name + "[" + std::to_string(i) + "]",
-        j[i]
-      );
+      __underlying_type(obj_t) x;
+      if(!read_from_json(name + "[" + std::to_string(i) + "]", j[i], x))
+        return false;
+      obj[i] = x;
     }
 
   } else {
     static_assert(std::is_integral_v<obj_t> || std::is_floating_point_v<obj_t>);
-    check(j.is_number(), name, "expected number type");
-    obj = j;
+    if(!check(j.is_number(), name, "expected number type"))
+      return false;
+    obj = j.get<obj_t>();
   }
+  return true;
+}
+
+// Like read_from_json, but exit on failure. The compile-time scenes load
+// through this.
+template<typename obj_t>
+obj_t load_from_json(std::string name, nlohmann::json& j) {
+  obj_t obj { };
+  if(!read_from_json(name, j, obj))
+    exit(1);
   return obj;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Per-pixel counters for the debug heat maps. Only the CPU keeps them.
+
+struct map_stats_t {
+  int sdfs;     // SDF evaluations.
+  int steps;    // map() calls.
+};
+
+inline thread_local map_stats_t map_stats;
+
+[[gnu::always_inline]] inline void count_map(int sdfs, int steps) {
+  if codegen(!__is_spirv_target) {
+    map_stats.sdfs += sdfs;
+    map_stats.steps += steps;
+  }
+}
+
+// Return the counters and reset them.
+[[gnu::always_inline]] inline map_stats_t take_map_stats() {
+  map_stats_t stats { };
+  if codegen(!__is_spirv_target) {
+    stats = map_stats;
+    map_stats = { };
+  }
+  return stats;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Scenes loaded at runtime.
+//
+// json_scene_t bakes scene.json into the shader when the program is built.
+// runtime_scene_t reads it when the app runs, so scenes can be edited and
+// reloaded without recompiling. The primitives are flattened into a table.
+// Each entry holds a type tag, an index into the array of shapes of that
+// type, a translation, a scale and a material. A BVH over the entries'
+// bounds lets map() evaluate only the primitives near the point.
+//
+// The table lives in host memory, so these scenes only render on the CPU.
+
+enum typename class sdf_type_t {
+  sphere_t;
+  box_t;
+  bounding_box_t;
+  ellipsoid_t;
+  torus_t;
+  capped_torus_t;
+  hex_prism_t;
+  octagon_prism_t;
+  capsule_t;
+  round_cone_t;
+  round_cone2_t;
+  tri_prism_t;
+  cylinder_t;
+  cylinder2_t;
+  cone_t;
+  capped_cone_t;
+  capped_cone2_t;
+  solid_angle_t;
+  octahedron_t;
+  pyramid_t;
+  rhombus_t;
+};
+
+// Conservative bounds of each primitive's surface.
+inline aabb_t sdf_bounds(const sphere_t& s) {
+  return aabb_around(s.pos, vec3(s.s));
+}
+inline aabb_t sdf_bounds(const box_t& s) {
+  return aabb_around(s.pos, s.b);
+}
+inline aabb_t sdf_bounds(const bounding_box_t& s) {
+  return aabb_around(s.pos, s.b);
+}
+inline aabb_t sdf_bounds(const ellipsoid_t& s) {
+  return aabb_around(s.pos, s.r);
+}
+inline aabb_t sdf_bounds(const torus_t& s) {
+  float r = s.t.x + s.t.y;
+  return aabb_around(s.pos, vec3(r, s.t.y, r));
+}
+inline aabb_t sdf_bounds(const capped_torus_t& s) {
+  return aabb_around(s.pos, vec3(s.ra + s.rb));
+}
+inline aabb_t sdf_bounds(const hex_prism_t& s) {
+  // h.x is the apothem. The corners are at h.x / cos(30).
+  float r = 1.1547005f * s.h.x;
+  return aabb_around(s.pos, vec3(r, r, s.h.y));
+}
+inline aabb_t sdf_bounds(const octagon_prism_t& s) {
+  // r is the apothem. The corners are at r / cos(22.5).
+  float r = 1.0823922f * s.r;
+  return aabb_around(s.pos, vec3(r, r, s.h));
+}
+inline aabb_t sdf_bounds(const capsule_t& s) {
+  return { s.pos + min(s.a, s.b) - s.r, s.pos + max(s.a, s.b) + s.r };
+}
+inline aabb_t sdf_bounds(const round_cone_t& s) {
+  float r = max(s.r1, s.r2);
+  return { s.pos + vec3(-r, -s.r1, -r), s.pos + vec3(r, s.h + s.r2, r) };
+}
+inline aabb_t sdf_bounds(const round_cone2_t& s) {
+  return {
+    s.pos + min(s.a - s.r1, s.b - s.r2),
+    s.pos + max(s.a + s.r1, s.b + s.r2)
+  };
+}
+inline aabb_t sdf_bounds(const tri_prism_t& s) {
+  return aabb_around(s.pos, vec3(s.h.x, s.h.x, s.h.y));
+}
+inline aabb_t sdf_bounds(const cylinder_t& s) {
+  return aabb_around(s.pos, vec3(s.h.x, s.h.y, s.h.x));
+}
+inline aabb_t sdf_bounds(const cylinder2_t& s) {
+  return { s.pos + min(s.a, s.b) - s.r, s.pos + max(s.a, s.b) + s.r };
+}
+inline aabb_t sdf_bounds(const cone_t& s) {
+  // The tip is at pos and the base is h below it.
+  float r = s.h * s.c.x / s.c.y;
+  return { s.pos + vec3(-r, -s.h, -r), s.pos + vec3(r, 0, r) };
+}
+inline aabb_t sdf_bounds(const capped_cone_t& s) {
+  float r = max(s.r1, s.r2);
+  return aabb_around(s.pos, vec3(r, s.h, r));
+}
+inline aabb_t sdf_bounds(const capped_cone2_t& s) {
+  float r = max(s.ra, s.rb);
+  return { s.pos + min(s.a, s.b) - r, s.pos + max(s.a, s.b) + r };
+}
+inline aabb_t sdf_bounds(const solid_angle_t& s) {
+  return aabb_around(s.pos, vec3(s.ra));
+}
+inline aabb_t sdf_bounds(const octahedron_t& s) {
+  return aabb_around(s.pos, vec3(s.s));
+}
+inline aabb_t sdf_bounds(const pyramid_t& s) {
+  // A unit square base with its apex h above it.
+  return { s.pos + vec3(-.5f, 0, -.5f), s.pos + vec3(.5f, s.h, .5f) };
+}
+inline aabb_t sdf_bounds(const rhombus_t& s) {
+  return aabb_around(s.pos, vec3(s.la + s.ra, s.h, s.lb + s.ra));
+}
+
+template<typename sdf_t>
+sdf_type_t sdf_type_of() {
+  sdf_type_t type { };
+  @meta for enum(sdf_type_t e : sdf_type_t) {
+    if constexpr(std::is_same_v<sdf_t, @enum_type(e)>)
+      type = e;
+  }
+  return type;
+}
+
+struct runtime_scene_t {
+  // Load a scene from a scene.json file. Prints the reason and returns false
+  // on failure.
+  bool load(const char* path, int index);
+
+  // Fill the scene with count copies of the basic_scene_t shapes on a
+  // jittered grid over the floor.
+  void generate(int count, int seed);
+
+  // Append a primitive drawn at offset + scale * sdf.
+  template<typename sdf_t>
+  void add(const sdf_t& sdf, float material, vec3 offset = vec3(),
+    float scale = 1);
+
+  // Build the BVH and put the table into its order.
+  void build(int leaf_size);
+
+  int size() const { return types.size(); }
+
+  float sd(int i, vec3 p) const noexcept;
+  vec2 map(vec3 p) const noexcept;
+
+  std::string name;
+  bool use_bvh = true;
+
+  // The primitive table.
+  std::vector<sdf_type_t> types;
+  std::vector<int> indices;
+  std::vector<vec3> offsets;
+  std::vector<float> scales;
+  std::vector<float> materials;
+  std::vector<aabb_t> bounds;
+
+  // The shapes of each type.
+  std::tuple<std::vector<@enum_types(sdf_type_t)>...> shapes;
+
+  scene_bvh_t bvh;
+};
+
+inline bool runtime_scene_t::load(const char* path, int index) {
+  std::ifstream i(path);
+  if(!i.is_open()) {
+    fprintf(stderr, "cannot open scene file %s\n", path);
+    return false;
+  }
+
+  nlohmann::json j = nlohmann::json::parse(i, nullptr, false);
+  if(!j.is_object() || !j["scenes"].is_array()) {
+    fprintf(stderr, "%s: expected an array of scenes\n", path);
+    return false;
+  }
+
+  nlohmann::json& scenes = j["scenes"];
+  if(index < 0 || index >= scenes.size()) {
+    fprintf(stderr, "%s: no scene %d\n", path, index);
+    return false;
+  }
+
+  nlohmann::json& scene = scenes[index];
+  if(!scene.is_object() || !scene["objects"].is_array()) {
+    fprintf(stderr, "%s: scene %d needs an array of objects\n", path, index);
+    return false;
+  }
+
+  // Fill a new scene, so this one is untouched on failure.
+  runtime_scene_t loaded;
+  if(scene["name"].is_string())
+    loaded.name = scene["name"].get<std::string>();
+
+  for(nlohmann::json& object : scene["objects"]) {
+    if(!object.is_object()) {
+      fprintf(stderr, "%s: scene %d has an object that isn't a JSON object\n",
+        path, index);
+      return false;
+    }
+
+    std::string type, object_name;
+    if(object["type"].is_string())
+      type = object["type"].get<std::string>();
+    object_name = object["name"].is_string() ?
+      object["name"].get<std::string>() : type;
+
+    // Dispatch on the type name. The sdf is read like json_scene_t reads
+    // it at compile time.
+    bool found = false;
+    @meta for enum(sdf_type_t e : sdf_type_t) {
+      if(!found && type == @type_string(@enum_type(e))) {
+        @enum_type(e) sdf { };
+        float material = 0;
+        if(!read_from_json(object_name, object, sdf) ||
+          !read_from_json(object_name + ".material", object["material"],
+            material)) {
+          fprintf(stderr, "%s: cannot load %s\n", path, object_name.c_str());
+          return false;
+        }
+        loaded.add(sdf, material);
+        found = true;
+      }
+    }
+
+    if(!found) {
+      fprintf(stderr, "%s: %s has unknown type \"%s\"\n", path,
+        object_name.c_str(), type.c_str());
+      return false;
+    }
+  }
+
+  *this = std::move(loaded);
+  return true;
+}
+
+template<typename sdf_t>
+void runtime_scene_t::add(const sdf_t& sdf, float material, vec3 offset,
+  float scale) {
+
+  std::vector<sdf_t>& v = std::get<std::vector<sdf_t> >(shapes);
+  types.push_back(sdf_type_of<sdf_t>());
+  indices.push_back(v.size());
+  offsets.push_back(offset);
+  scales.push_back(scale);
+  materials.push_back(material);
+
+  aabb_t box = sdf_bounds(sdf);
+  bounds.push_back({ offset + scale * box.lo, offset + scale * box.hi });
+  v.push_back(sdf);
+}
+
+inline void runtime_scene_t::build(int leaf_size) {
+  std::vector<int> order;
+  bvh.build(bounds, leaf_size, order);
+
+  // Permute the table so each leaf's primitives are contiguous.
+  auto permute = [&](auto& v) {
+    auto v2 = v;
+    for(int i = 0; i < size(); ++i)
+      v2[i] = v[order[i]];
+    v = std::move(v2);
+  };
+  permute(types);
+  permute(indices);
+  permute(offsets);
+  permute(scales);
+  permute(materials);
+  permute(bounds);
+}
+
+inline float runtime_scene_t::sd(int i, vec3 p) const noexcept {
+  count_map(1, 0);
+  float scale = scales[i];
+  p = (p - offsets[i]) / scale;
+
+  float d = 0;
+  switch(types[i]) {
+    @meta for enum(sdf_type_t e : sdf_type_t) {
+      case e:
+        d = std::get<(int)e>(shapes)[indices[i]].sd(p);
+        break;
+    }
+  }
+  return scale * d;
+}
+
+inline vec2 runtime_scene_t::map(vec3 p) const noexcept {
+  float dist = 1e10;
+  int i = -1;
+  if(use_bvh) {
+    i = bvh.nearest(p, dist, [&](int j) { return sd(j, p); });
+
+  } else {
+    for(int j = 0; j < size(); ++j) {
+      float d = sd(j, p);
+      if(d < dist) {
+        dist = d;
+        i = j;
+      }
+    }
+  }
+
+  return vec2(dist, i < 0 ? 0.f : materials[i] / 2 + 1.5f);
+}
+
+// The scene rendered by raymarch_prims_t<runtime_json_t>. The app loads it
+// with the workers stopped.
+inline runtime_scene_t runtime_scene;
+
+struct [[
+  .imgui::title="scene.json loaded at runtime (CPU)"
+]] runtime_json_t { };
+
+////////////////////////////////////////////////////////////////////////////////
+// Bounding hierarchies for scenes known at compile time.
+//
+// The grouping is decided at compile time from the members' initial values,
+// using the same median split as the runtime BVH. raymarch_prims_t unrolls
+// the tree into map() with @meta, so each box test guards straight-line SDF
+// calls. map() first evaluates the leaf with the nearest box, which usually
+// holds the nearest surface, and then culls the rest of the tree against
+// it. The boxes are refit from the current member values, so they follow
+// edits made in the UI.
+
+enum { scene_group_size = 2 };
+
+// Call at compile time. order receives the member in each leaf slot.
+template<typename scene_t>
+scene_bvh_t make_scene_groups(std::vector<int>& order) {
+  scene_t scene;
+  std::vector<aabb_t> boxes;
+  @meta for(int i = 0; i < @member_count(scene_t); ++i)
+    boxes.push_back(sdf_bounds(scene.@member_value(i).sdf));
+
+  scene_bvh_t groups;
+  groups.build(boxes, scene_group_size, order);
+  return groups;
+}
+
+template<typename scene_t>
+int count_scene_groups() {
+  std::vector<int> order;
+  return std::max<int>(1, make_scene_groups<scene_t>(order).nodes.size());
+}
+
+// A ramp from blue through green to red for t in [0, 1].
+inline vec3 heat_color(float t) noexcept {
+  t = clamp(t, 0.f, 1.f);
+  return clamp(vec3(
+    1.5f - abs(4 * t - 3),
+    1.5f - abs(4 * t - 2),
+    1.5f - abs(4 * t - 1)
+  ), 0.f, 1.f);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 @meta nlohmann::json scene_json;
@@ -677,32 +1085,148 @@ struct [[
     return d1.x < d2.x ? d1 : d2;
   }
 
+  // The runtime scene is only in host memory.
+  static constexpr bool runtime = std::is_same_v<scene_t, runtime_json_t>;
+
+  static constexpr int num_groups = (@meta count_scene_groups<scene_t>());
+
   vec2 map(vec3 pos) const noexcept {
+    count_map(0, 1);
     vec2 res(1e10, 0);
 
-    if constexpr(inline_scene) {
+    if constexpr(runtime) {
+      // The GPU gets only the floor.
+      if codegen(__is_spirv_target)
+        res = vec2(1e10, 0);
+      else
+        res = runtime_scene.map(pos);
+
+    } else if constexpr(inline_scene) {
       // Create a scene object that's an automatic variable. It's not a 
       // member of this class so won't be bound to the UBO.
       scene_t scene;
-      @meta for(int i = 0; i < @member_count(scene_t); ++i) {
-        res = opU(res, vec2(
-          scene.@member_value(i).sdf.sd(pos), 
-          scene.@member_value(i).material / 2 + 1.5f
-        ));
-      }
+      res = map_groups(scene, pos);
 
     } else {
       // Raymarch on the scene member object.
-      @meta for(int i = 0; i < @member_count(scene_t); ++i) {
-        res = opU(res, vec2(
-          scene.@member_value(i).sdf.sd(pos), 
-          scene.@member_value(i).material / 2 + 1.5f
-        ));
+      res = map_groups(scene, pos);
+    }
+    return res;
+  }
+
+  vec2 map_groups(const scene_t& scene, vec3 pos) const noexcept {
+    vec2 res(1e10, 0);
+
+    @meta std::vector<int> order;
+    @meta scene_bvh_t groups = make_scene_groups<scene_t>(order);
+    @meta int num_nodes = groups.nodes.size();
+
+    if(!culling) {
+      @meta for(int g = 0; g < num_nodes; ++g) {
+        @meta if(groups.nodes[g].count)
+          res = map_leaf<g>(scene, pos, res);
+      }
+
+    } else {
+      // Start with the leaf whose box is nearest. Its distance bounds the
+      // walk below, which then skips most of the other groups.
+      float leaf_dist[num_groups];
+      int nearest = -1;
+      float nearest_dist = 1e10;
+      @meta for(int g = 0; g < num_nodes; ++g) {
+        @meta if(groups.nodes[g].count) {
+          leaf_dist[g] = aabb_distance(bounds[g], pos);
+          if(leaf_dist[g] < nearest_dist) {
+            nearest_dist = leaf_dist[g];
+            nearest = g;
+          }
+        }
       }
+
+      switch(nearest) {
+        @meta for(int g = 0; g < num_nodes; ++g) {
+          @meta if(groups.nodes[g].count) {
+            case g:
+              res = map_leaf<g>(scene, pos, res);
+              break;
+          }
+        }
+      }
+
+      // Walk the groups in preorder. A group is entered if its parent was
+      // and its box is closer than the nearest surface found so far.
+      bool visit[num_groups];
+      @meta std::vector<int> parents(num_nodes, -1);
+      @meta for(int g = 0; g < num_nodes; ++g) {{
+        @meta bvh_node_t node = groups.nodes[g];
+        @meta int parent = parents[g];
+
+        bool open = true;
+        @meta if(parent >= 0)
+          open = visit[parent];
+
+        @meta if(node.count) {
+          if(open && g != nearest && leaf_dist[g] < res.x)
+            res = map_leaf<g>(scene, pos, res);
+        }
+
+        @meta if(!node.count) {
+          @meta parents[g + 1] = g;
+          @meta parents[node.first] = g;
+          visit[g] = open && aabb_distance(bounds[g], pos) < res.x;
+        }
+      }}
     }
     return res;
   }
 
+  // Evaluate the members in leaf group g.
+  template<int g>
+  vec2 map_leaf(const scene_t& scene, vec3 pos, vec2 res) const noexcept {
+    @meta std::vector<int> order;
+    @meta scene_bvh_t groups = make_scene_groups<scene_t>(order);
+    @meta bvh_node_t node = groups.nodes[g];
+
+    @meta for(int k = node.first; k < node.first + node.count; ++k) {
+      @meta int i = order[k];
+      res = opU(res, vec2(
+        scene.@member_value(i).sdf.sd(pos),
+        scene.@member_value(i).material / 2 + 1.5f
+      ));
+    }
+    count_map(node.count, 0);
+    return res;
+  }
+
+  // Refit the group boxes to the scene members.
+  void update_bounds() noexcept {
+    if constexpr(inline_scene)
+      fit_bounds(scene_t());
+    else
+      fit_bounds(scene);
+  }
+
+  void fit_bounds(const scene_t& scene) noexcept {
+    @meta std::vector<int> order;
+    @meta scene_bvh_t groups = make_scene_groups<scene_t>(order);
+
+    // Children follow their parents, so fit them in reverse.
+    @meta for(int g = (int)groups.nodes.size() - 1; g >= 0; --g) {{
+      @meta bvh_node_t node = groups.nodes[g];
+      @meta if(node.count) {
+        @meta int i = order[node.first];
+        aabb_t box = sdf_bounds(scene.@member_value(i).sdf);
+        @meta for(int k = node.first + 1; k < node.first + node.count; ++k) {
+          @meta int j = order[k];
+          box = aabb_union(box, sdf_bounds(scene.@member_value(j).sdf));
+        }
+        bounds[g] = box;
+      }
+      @meta if(!node.count)
+        bounds[g] = aabb_union(bounds[g + 1], bounds[node.first]);
+    }}
+  }
+
   // http://iquilezles.org/www/articles/boxfunctions/boxfunctions.htm
   vec2 iBox(vec3 ro, vec3 rd, vec3 rad) const noexcept {
     vec3 m = 1 / rd;
@@ -921,14 +1445,37 @@ struct [[
     vec3 rdy = ca * normalize(vec3(py, 2.5f));
 
     // render
+    take_map_stats();
     vec3 col = render(ro, rd, rdx, rdy);
     col = pow(col, vec3(0.4545));
 
+    // The counters are zero on the GPU, which keeps the shaded color.
+    map_stats_t stats = take_map_stats();
+    if(heat_map && stats.steps) {
+      int count = 1 == heat_map ? stats.sdfs : stats.steps;
+      col = heat_color(log2(1.f + count) / log2(1.f + heat_max));
+    }
+
     return vec4(col, 1);
   }
 
   float distance = 5;
 
+  // Skip groups of primitives whose boxes are farther than the nearest
+  // surface found so far.
+  bool culling = true;
+
+  // CPU only. 1 shows SDF evaluations per pixel and 2 shows map() calls,
+  // on a log scale up to heat_max.
+  [[.imgui::range_int { 0, 2 }]]
+  int heat_map = 0;
+
+  [[.imgui::range_float { 16, 16384 }]]
+  float heat_max = 4096;
+
+  // The group boxes. render_imgui skips arrays.
+  aabb_t bounds[num_groups];
+
   @meta if(!inline_scene)
     scene_t scene;
 };
@@ -967,6 +1514,46 @@ struct [[
   shape_t<round_cone2_t>   round_cone2   = { vec3( 2, 0.15,  0), vec3(.1, 0, 0), vec3(-.1, .35, .1), .15f, .05f, 51.7f };
 };
 
+inline void runtime_scene_t::generate(int count, int seed) {
+  *this = runtime_scene_t { };
+  name = std::to_string(count) + " generated primitives";
+
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> pick(0, @member_count(basic_scene_t) - 1);
+  std::uniform_real_distribution<float> uniform(0, 1);
+
+  // Cover [-3, 3] on x and z, with the primitives shrunk to fit their cells.
+  int n = (int)ceil(sqrt((float)count));
+  float cell = 6.f / n;
+
+  basic_scene_t basic;
+  for(int i = 0; i < count; ++i) {
+    vec3 center(
+      -3 + cell * (i % n + .5f + .3f * (uniform(rng) - .5f)),
+      0,
+      -3 + cell * (i / n + .5f + .3f * (uniform(rng) - .5f))
+    );
+    float material = 2 * M_PIf32 * uniform(rng);
+
+    int m = pick(rng);
+    @meta for(int j = 0; j < @member_count(basic_scene_t); ++j) {
+      if(j == m) {
+        auto sdf = basic.@member_value(j).sdf;
+        sdf.pos = vec3();
+
+        // Scale the largest side to 80% of the cell and rest the shape on
+        // the floor.
+        aabb_t box = sdf_bounds(sdf);
+        vec3 extent = box.hi - box.lo;
+        float scale = .8f * cell / max(extent.x, max(extent.y, extent.z));
+        vec3 offset = center - scale * aabb_center(box);
+        offset.y = -scale * box.lo.y;
+        add(sdf, material, offset, scale);
+      }
+    }
+  }
+}
+
 template<int scene_index>
 struct [[
   .imgui::title=@string(scene_json[scene_index]["name"])
@@ -1010,6 +1597,7 @@ struct [[
 
 enum typename class shader_program_t {
   raymarch_prims_t<basic_scene_t>;
+  raymarch_prims_t<runtime_json_t, true>;
 
   @meta for(int i = 0; i < scene_json.size(); ++i) {
     raymarch_prims_t<json_scene_t<i>, false>;
@@ -1030,6 +1618,9 @@ struct program_base_t {
 
   GLuint program;
   GLuint ubo;
+
+  // The shader renders runtime_scene.
+  bool uses_runtime_scene = false;
 };
 
 template<typename shader_t>
@@ -1044,6 +1635,9 @@ struct program_t : program_base_t {
 
 template<typename shader_t>
 program_t<shader_t>::program_t() {
+  uses_runtime_scene = shader_t::runtime;
+  shader.update_bounds();
+
   // Create vertex and fragment shader handles.
   GLuint vs = glCreateShader(GL_VERTEX_SHADER);
   GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
@@ -1070,6 +1664,8 @@ program_t<shader_t>::program_t() {
 template<typename shader_t>
 bool program_t<shader_t>::configure(bool update_ubo) {
   bool changed = render_imgui(shader);
+  if(changed)
+    shader.update_bounds();
   if(update_ubo)
     glNamedBufferSubData(ubo, 0, sizeof(shader_t), &shader);
 
@@ -1152,37 +1748,40 @@ void software_fbo_t::set_block(vec4 color, int x, int y, int sx, int sy) {
 }
 
 struct cpu_compute_t {
-  cpu_compute_t(int num_threads, int width, int height);
+  cpu_compute_t(block_pool_t* pool, int width, int height);
   ~cpu_compute_t();
 
   void pool_execute();
-  void thread_execute(int tid);
+  bool block_execute(int level, int block);
   bool pixel_execute(int x, int y, int sx, int sy);
   bool is_complete() const;
   void join();
-  void update();
-
-  static void thread_entry(cpu_compute_t* compute, int tid);
 
-  std::vector<std::thread> threads;
-  std::atomic<int> complete_count;
+  // The pool is owned by the app and outlives shader and size changes.
+  block_pool_t* pool;
   std::atomic<bool> okay;
 
+  // The last block to finish records the frame time.
+  std::chrono::steady_clock::time_point start;
+  std::atomic<int> pending;
+  std::atomic<double> frame_seconds;
+
   int width, height;
   shadertoy_uniforms_t uniforms;
   int num_levels = 0;
   bool interlace = false;
+  block_order_t order = block_order_t::row_major;
 
   program_base_t* program;
   std::unique_ptr<software_fbo_t> fbo;
 };
 
-cpu_compute_t::cpu_compute_t(int num_threads, int width, int height) :
-  width(width), height(height) {
+cpu_compute_t::cpu_compute_t(block_pool_t* pool, int width, int height) :
+  pool(pool), width(width), height(height) {
 
-  complete_count = num_threads;
-  threads.resize(num_threads);
   okay = false;
+  pending = 0;
+  frame_seconds = 0;
 
   int width2 = (width + 7) & ~7;
   int height2 = (height + 7) & ~7;
@@ -1196,20 +1795,33 @@ cpu_compute_t::~cpu_compute_t() {
 
 void cpu_compute_t::pool_execute() {
   okay = true;
-  complete_count = 0;
-  for(int tid = 0; tid < threads.size(); ++tid)
-    threads[tid] = std::thread(thread_entry, this, tid);
+
+  // Deal out the 8x8 blocks along the chosen curve. The pool splits the
+  // list into contiguous runs, one per worker, and rebalances by stealing.
+  adam7_t adam7 { (width + 7) / 8, (height + 7) / 8, order };
+  std::vector<int> blocks = adam7.block_order();
+  start = std::chrono::steady_clock::now();
+  pending = blocks.size() * num_levels;
+  pool->execute(blocks, num_levels,
+    [this](int tid, int level, int block) {
+      return block_execute(level, block);
+    });
 }
 
-void cpu_compute_t::thread_execute(int tid) {
+bool cpu_compute_t::block_execute(int level, int block) {
   adam7_t adam7 { (width + 7) / 8, (height + 7) / 8 };
 
   auto f = [&](int x, int y, int sx, int sy) {
     return pixel_execute(x, y, sx, sy);
   };
-  adam7.process(tid, threads.size(), num_levels, interlace, f);
+  if(!adam7.process_block(block, level, num_levels, interlace, f))
+    return false;
 
-  ++complete_count;
+  if(1 == pending--) {
+    frame_seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  }
+  return true;
 }
 
 bool cpu_compute_t::pixel_execute(int x, int y, int sx, int sy) {
@@ -1228,18 +1840,13 @@ bool cpu_compute_t::pixel_execute(int x, int y, int sx, int sy) {
 }
 
 bool cpu_compute_t::is_complete() const {
-  return threads.size() == complete_count;
+  return pool->is_complete();
 }
 
 void cpu_compute_t::join() {
   okay = false;
-  for(std::thread& t : threads)
-    if(t.joinable())
-      t.join();
-}
-
-void cpu_compute_t::thread_entry(cpu_compute_t* compute, int tid) {
-  compute->thread_execute(tid);
+  pool->cancel();
+  pool->wait();
 }
 
 
@@ -1264,18 +1871,28 @@ struct app_t {
   bool debug_on_click = false;
   bool render_cpu = false;
   bool interlace = false;
+  int block_order = (int)block_order_t::hilbert;
   bool asynchronous = true;
   int num_threads = 1;
   int num_levels = 1;
   std::unique_ptr<software_fbo_t> software_fbo;
+  std::unique_ptr<block_pool_t> pool;
   std::unique_ptr<cpu_compute_t> cpu_compute;
 
+  // Settings for runtime_scene. A generated count of 0 loads the scene at
+  // scene_index from scene.json.
+  int scene_index = 0;
+  int generated_count = 0;
+  bool scene_bvh = true;
+  int leaf_size = 4;
+
   app_t();
   void loop();
   void button_callback(int button, int action, int mods);
 
   bool configure();
   void set_active_shader(shader_program_t shader);
+  void load_runtime_scene();
 
   void display_gpu();
   void display_cpu();
@@ -1431,9 +2048,15 @@ void app_t::loop() {
     ImGui::Render();
 
     if(render_cpu) {
-      if(!cpu_compute || cpu_compute->threads.size() != num_threads) {
-        // Create a new thread pool.
-        cpu_compute = std::make_unique<cpu_compute_t>(num_threads, width,
+      if(!pool || pool->num_threads() != num_threads) {
+        // Create a new thread pool. The workers persist across frames and
+        // shader changes.
+        cpu_compute.reset();
+        pool = std::make_unique<block_pool_t>(num_threads);
+      }
+
+      if(!cpu_compute) {
+        cpu_compute = std::make_unique<cpu_compute_t>(pool.get(), width,
           height);
         cpu_compute->program = program.get();
       }
@@ -1448,6 +2071,7 @@ void app_t::loop() {
 
         cpu_compute->num_levels = num_levels;
         cpu_compute->interlace = interlace;
+        cpu_compute->order = (block_order_t)block_order;
         cpu_compute->uniforms = uniforms;
         cpu_compute->pool_execute();
 
@@ -1520,6 +2144,9 @@ bool app_t::configure() {
     changed |= ImGui::SliderInt("Thread pool size", &num_threads, 1, 32);
     changed |= ImGui::SliderInt("Detail levels", &num_levels, 1, 7);
     changed |= ImGui::Checkbox("Interlacing", &interlace);
+
+    const char* orders[] { "Row major", "Z-order", "Hilbert" };
+    changed |= ImGui::Combo("Block order", &block_order, orders, 3);
     ImGui::Checkbox("Asynchronous", &asynchronous);
   }
 
@@ -1530,11 +2157,42 @@ bool app_t::configure() {
   changed |= ImGui::Combo("Active shader", &current, items, items.length);
 
   if(current != (int)active_shader) {
-    cpu_compute.reset();
+    // Stop the workers before destroying the program they're evaluating.
+    if(cpu_compute)
+      cpu_compute->join();
+
     set_active_shader((shader_program_t)current);
+
+    if(cpu_compute)
+      cpu_compute->program = program.get();
   }
 
   program->configure(!render_cpu);
+
+  if(program->uses_runtime_scene) {
+    bool reload = ImGui::Button("Reload scene.json");
+    reload |= ImGui::InputInt("scene.json index", &scene_index);
+    reload |= ImGui::InputInt("Generated primitives", &generated_count, 100,
+      1000);
+    reload |= ImGui::Checkbox("BVH", &scene_bvh);
+    reload |= ImGui::SliderInt("BVH leaf size", &leaf_size, 1, 16);
+
+    if(reload) {
+      // Stop the workers before replacing the scene they're reading.
+      if(cpu_compute)
+        cpu_compute->join();
+      load_runtime_scene();
+      changed = true;
+    }
+
+    ImGui::Text("%s: %d primitives, %d BVH nodes, depth %d",
+      runtime_scene.name.c_str(), runtime_scene.size(),
+      (int)runtime_scene.bvh.nodes.size(), runtime_scene.bvh.depth());
+  }
+
+  if(render_cpu && cpu_compute)
+    ImGui::Text("CPU frame %.1f ms", 1000 * cpu_compute->frame_seconds);
+
   ImGui::End();
 
   return changed;
@@ -1551,6 +2209,25 @@ void app_t::set_active_shader(shader_program_t shader) {
     }
   }
   active_shader = shader;
+
+  if(program->uses_runtime_scene && !runtime_scene.size())
+    load_runtime_scene();
+}
+
+void app_t::load_runtime_scene() {
+  scene_index = std::max(scene_index, 0);
+  generated_count = std::max(generated_count, 0);
+
+  // Keep the previous scene if the file doesn't load.
+  runtime_scene_t scene;
+  if(generated_count)
+    scene.generate(generated_count, 0);
+  else if(!scene.load("scene.json", scene_index))
+    return;
+
+  scene.build(leaf_size);
+  scene.use_bvh = scene_bvh;
+  runtime_scene = std::move(scene);
 }
 
 
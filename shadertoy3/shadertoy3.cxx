@@ -23,6 +23,13 @@
 
 // Interlacing
 #include "adam7.hxx"
+#include "block_pool.hxx"
+
+// Subgroup and quad operations on the CPU.
+#include "subgroup.hxx"
+
+// Batched inference for the neural SDF on the CPU.
+#include "neural_sdf.hxx"
 
 namespace imgui {
   // imgui attribute tags.
@@ -233,25 +240,32 @@ struct [[
   .imgui::url="https://www.shadertoy.com/view/wdVfzz"
 ]] bunny_t {
 
-  vec4 render(vec2 frag_coord, shadertoy_uniforms_t u) {
+  void camera_ray(vec2 frag_coord, shadertoy_uniforms_t u, vec3& ro,
+    vec3& rd) {
     vec2 p = (frag_coord / u.resolution) * 2 - 1;
     p.x *= u.resolution.x / u.resolution.y;
 
     // ray cast
-    float rx = ((u.mouse.y / u.resolution.y) - 0.5f) * 3;    
+    float rx = ((u.mouse.y / u.resolution.y) - 0.5f) * 3;
     float ry = ((u.mouse.x / u.resolution.x) - 0.5f) * 6;
-    
+
     // camera
     mat3 m = rotY(ry) * rotX(-rx);
-    vec3 ro = m * vec3(0, 0, 1.5) * Zoom;
-    vec3 rd = m * normalize(vec3(p, -2));
-            
+    ro = m * vec3(0, 0, 1.5) * Zoom;
+    rd = m * normalize(vec3(p, -2));
+  }
+
+  vec4 render(vec2 frag_coord, shadertoy_uniforms_t u) {
+    vec3 ro, rd;
+    camera_ray(frag_coord, u, ro, rd);
+
     bool hit=false;
     vec3 hitPos = raycast(ro, rd, hit);
 
+    // On the CPU the normal needs the quads of subgroup evaluation.
     vec4 color;
-    if codegen(__is_spirv_target) {
-      vec3 n = normalize(cross(glfrag_dFdx(hitPos), glfrag_dFdy(hitPos)));
+    if(has_derivatives()) {
+      vec3 n = normalize(cross(quad_dfdx(hitPos), quad_dfdy(hitPos)));
       color = vec4(hit ? n * .5f + .5f : 0.f, 1);
 
     } else {
@@ -261,6 +275,37 @@ struct [[
     return color;
   }
 
+  // Render count pixels in subgroup_pixel order on the CPU. The rays are
+  // marched together through neural_sdf_t, and the normals are taken across
+  // each 2x2 quad of positions like quad_dfdx and quad_dfdy.
+  void render_batch(const vec2* coords, vec4* colors, int count,
+    const shadertoy_uniforms_t& u) {
+
+    // The weights may have been edited since the last block.
+    static thread_local neural_sdf_t sdf;
+    sdf.load(weights, biases);
+
+    for(int i0 = 0; i0 < count; i0 += neural_sdf_t::max_batch) {
+      int n = std::min((int)neural_sdf_t::max_batch, count - i0);
+      vec3 ro[neural_sdf_t::max_batch], rd[neural_sdf_t::max_batch];
+      vec3 pos[neural_sdf_t::max_batch];
+      bool hit[neural_sdf_t::max_batch];
+      for(int i = 0; i < n; ++i)
+        camera_ray(coords[i0 + i], u, ro[i], rd[i]);
+
+      sdf.march(ro, rd, n, maxSteps, .001f * hitThreshold, pos, hit);
+
+      for(int i = 0; i < n; ++i) {
+        // Quads missing a lane have zero derivatives, as in subgroup_t.
+        int x0 = i & ~1, x1 = i | 1, y0 = i & ~2, y1 = i | 2;
+        vec3 dx = x1 < n ? pos[x1] - pos[x0] : vec3(0);
+        vec3 dy = y1 < n ? pos[y1] - pos[y0] : vec3(0);
+        vec3 normal = normalize(cross(dx, dy));
+        colors[i0 + i] = vec4(hit[i] ? normal * .5f + .5f : 0.f, 1);
+      }
+    }
+  }
+
   float leakyReLU(float x) {
     return max(0.0f, x) + 0.1f * min(0.0f, x);
   }
@@ -400,6 +445,14 @@ struct program_base_t {
   virtual vec4 eval(vec2 coord, shadertoy_uniforms_t u, 
     bool signal = false) = 0;
 
+  // Evaluate the shader in lockstep over subgroups of 32 coordinates, so
+  // that subgroup operations and derivatives work like on the GPU. The
+  // coordinates are in subgroup_pixel order.
+  // With batched set, shaders with a render_batch member render the whole
+  // list through it instead.
+  virtual void eval_subgroup(const vec2* coords, vec4* colors, int count,
+    const shadertoy_uniforms_t& u, bool batched) = 0;
+
   GLuint program;
   GLuint ubo;
 };
@@ -412,8 +465,34 @@ struct program_t : program_base_t {
   program_t();
   bool configure(bool update_ubo) override;
   vec4 eval(vec2 coord, shadertoy_uniforms_t u, bool signal) override;
+  void eval_subgroup(const vec2* coords, vec4* colors, int count,
+    const shadertoy_uniforms_t& u, bool batched) override;
 };
 
+// Call the shader's render_batch if it has one. Returns false otherwise.
+template<typename shader_t>
+auto render_batch(shader_t& shader, const vec2* coords, vec4* colors,
+  int count, const shadertoy_uniforms_t& u, int) ->
+  decltype(shader.render_batch(coords, colors, count, u), true) {
+
+  shader.render_batch(coords, colors, count, u);
+  return true;
+}
+
+template<typename shader_t>
+bool render_batch(shader_t& shader, const vec2* coords, vec4* colors,
+  int count, const shadertoy_uniforms_t& u, long) {
+  return false;
+}
+
+// The pixel of lane i of an 8x8 block in subgroup order. The block is two
+// 8x4 subgroups of 2x2 quads, so lanes i ^ 1 and i ^ 2 are the horizontal
+// and vertical neighbors of lane i.
+inline ivec2 subgroup_pixel(int i) {
+  int quad = i / 4;
+  return ivec2(2 * (quad % 4) + (i & 1), 2 * (quad / 4) + (i>> 1 & 1));
+}
+
 template<typename shader_t>
 program_t<shader_t>::program_t() {
   // Create vertex and fragment shader handles.
@@ -458,6 +537,22 @@ vec4 program_t<shader_t>::eval(vec2 coord, shadertoy_uniforms_t u,
   return shader.render(coord, u);
 }
 
+template<typename shader_t>
+void program_t<shader_t>::eval_subgroup(const vec2* coords, vec4* colors,
+  int count, const shadertoy_uniforms_t& u, bool batched) {
+
+  if(batched && render_batch(shader, coords, colors, count, u, 0))
+    return;
+
+  subgroup_t& subgroup = subgroup_t::local();
+  for(int i = 0; i < count; i += subgroup_t::max_lanes) {
+    int n = std::min((int)subgroup_t::max_lanes, count - i);
+    subgroup.run(n, [&](int lane) {
+      colors[i + lane] = shader.render(coords[i + lane], u);
+    });
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 struct software_fbo_t {
@@ -524,36 +619,34 @@ void software_fbo_t::set_block(vec4 color, int x, int y, int sx, int sy) {
 }
 
 struct cpu_compute_t {
-  cpu_compute_t(int num_threads, int width, int height);
+  cpu_compute_t(block_pool_t* pool, int width, int height);
   ~cpu_compute_t();
 
   void pool_execute();
-  void thread_execute(int tid);
+  bool block_execute(int level, int block);
   bool pixel_execute(int x, int y, int sx, int sy);
   bool is_complete() const;
   void join();
-  void update();
 
-  static void thread_entry(cpu_compute_t* compute, int tid);
-
-  std::vector<std::thread> threads;
-  std::atomic<int> complete_count;
+  // The pool is owned by the app and outlives shader and size changes.
+  block_pool_t* pool;
   std::atomic<bool> okay;
 
   int width, height;
   shadertoy_uniforms_t uniforms;
   int num_levels = 0;
   bool interlace = false;
+  block_order_t order = block_order_t::row_major;
+  bool subgroups = false;
+  bool batched = false;
 
   program_base_t* program;
   std::unique_ptr<software_fbo_t> fbo;
 };
 
-cpu_compute_t::cpu_compute_t(int num_threads, int width, int height) :
-  width(width), height(height) {
+cpu_compute_t::cpu_compute_t(block_pool_t* pool, int width, int height) :
+  pool(pool), width(width), height(height) {
 
-  complete_count = num_threads;
-  threads.resize(num_threads);
   okay = false;
 
   int width2 = (width + 7) & ~7;
@@ -568,20 +661,50 @@ cpu_compute_t::~cpu_compute_t() {
 
 void cpu_compute_t::pool_execute() {
   okay = true;
-  complete_count = 0;
-  for(int tid = 0; tid < threads.size(); ++tid)
-    threads[tid] = std::thread(thread_entry, this, tid);
+
+  // Deal out the 8x8 blocks along the chosen curve. The pool splits the
+  // list into contiguous runs, one per worker, and rebalances by stealing.
+  adam7_t adam7 { (width + 7) / 8, (height + 7) / 8, order };
+  pool->execute(adam7.block_order(), num_levels,
+    [this](int tid, int level, int block) {
+      return block_execute(level, block);
+    });
 }
 
-void cpu_compute_t::thread_execute(int tid) {
+bool cpu_compute_t::block_execute(int level, int block) {
   adam7_t adam7 { (width + 7) / 8, (height + 7) / 8 };
 
+  if(subgroups) {
+    // Quads need their neighboring pixels, so evaluate the whole block at
+    // full resolution on the first level and skip the others.
+    if(level)
+      return okay;
+
+    int x0 = 8 * (block % adam7.blocksX);
+    int y0 = 8 * (block / adam7.blocksX);
+    vec2 coords[64];
+    vec4 colors[64];
+    for(int i = 0; i < 64; ++i)
+      coords[i] = vec2(ivec2(x0, y0) + subgroup_pixel(i)) + .5f;
+
+    program->eval_subgroup(coords, colors, 64, uniforms, batched);
+
+    if(!okay)
+      return false;
+
+    // Helper lanes past the edge of the frame aren't written.
+    for(int i = 0; i < 64; ++i) {
+      ivec2 pixel = ivec2(x0, y0) + subgroup_pixel(i);
+      if(pixel.x < width && pixel.y < height)
+        fbo->set_block(colors[i], pixel.x, pixel.y, 1, 1);
+    }
+    return okay;
+  }
+
   auto f = [&](int x, int y, int sx, int sy) {
     return pixel_execute(x, y, sx, sy);
   };
-  adam7.process(tid, threads.size(), num_levels, interlace, f);
-
-  ++complete_count;
+  return adam7.process_block(block, level, num_levels, interlace, f);
 }
 
 bool cpu_compute_t::pixel_execute(int x, int y, int sx, int sy) {
@@ -600,18 +723,13 @@ bool cpu_compute_t::pixel_execute(int x, int y, int sx, int sy) {
 }
 
 bool cpu_compute_t::is_complete() const {
-  return threads.size() == complete_count;
+  return pool->is_complete();
 }
 
 void cpu_compute_t::join() {
   okay = false;
-  for(std::thread& t : threads)
-    if(t.joinable())
-      t.join();
-}
-
-void cpu_compute_t::thread_entry(cpu_compute_t* compute, int tid) {
-  compute->thread_execute(tid);
+  pool->cancel();
+  pool->wait();
 }
 
 
@@ -636,10 +754,14 @@ struct app_t {
   bool debug_on_click = false;
   bool render_cpu = false;
   bool interlace = false;
+  int block_order = (int)block_order_t::hilbert;
   bool asynchronous = true;
+  bool subgroups = false;
+  bool batched = true;
   int num_threads = 1;
   int num_levels = 1;
   std::unique_ptr<software_fbo_t> software_fbo;
+  std::unique_ptr<block_pool_t> pool;
   std::unique_ptr<cpu_compute_t> cpu_compute;
 
   app_t();
@@ -803,9 +925,15 @@ void app_t::loop() {
     ImGui::Render();
 
     if(render_cpu) {
-      if(!cpu_compute || cpu_compute->threads.size() != num_threads) {
-        // Create a new thread pool.
-        cpu_compute = std::make_unique<cpu_compute_t>(num_threads, width,
+      if(!pool || pool->num_threads() != num_threads) {
+        // Create a new thread pool. The workers persist across frames and
+        // shader changes.
+        cpu_compute.reset();
+        pool = std::make_unique<block_pool_t>(num_threads);
+      }
+
+      if(!cpu_compute) {
+        cpu_compute = std::make_unique<cpu_compute_t>(pool.get(), width,
           height);
         cpu_compute->program = program.get();
       }
@@ -820,6 +948,9 @@ void app_t::loop() {
 
         cpu_compute->num_levels = num_levels;
         cpu_compute->interlace = interlace;
+        cpu_compute->order = (block_order_t)block_order;
+        cpu_compute->subgroups = subgroups;
+        cpu_compute->batched = batched;
         cpu_compute->uniforms = uniforms;
         cpu_compute->pool_execute();
 
@@ -892,6 +1023,18 @@ bool app_t::configure() {
     changed |= ImGui::SliderInt("Thread pool size", &num_threads, 1, 32);
     changed |= ImGui::SliderInt("Detail levels", &num_levels, 1, 7);
     changed |= ImGui::Checkbox("Interlacing", &interlace);
+
+    const char* orders[] { "Row major", "Z-order", "Hilbert" };
+    changed |= ImGui::Combo("Block order", &block_order, orders, 3);
+
+    // Run 2x2 quads in lockstep for the derivatives of the normals. This
+    // renders whole blocks on the first level, so it's off by default to
+    // keep the interlaced levels, and it's slower than scalar evaluation.
+    changed |= ImGui::Checkbox("Subgroup evaluation", &subgroups);
+
+    // March each block's rays together through the batched network.
+    if(subgroups)
+      changed |= ImGui::Checkbox("Batched inference", &batched);
     ImGui::Checkbox("Asynchronous", &asynchronous);
   }
 
@@ -902,8 +1045,14 @@ bool app_t::configure() {
   changed |= ImGui::Combo("Active shader", &current, items, items.length);
 
   if(current != (int)active_shader) {
-    cpu_compute.reset();
+    // Stop the workers before destroying the program they're evaluating.
+    if(cpu_compute)
+      cpu_compute->join();
+
     set_active_shader((shader_program_t)current);
+
+    if(cpu_compute)
+      cpu_compute->program = program.get();
   }
 
   program->configure(!render_cpu);
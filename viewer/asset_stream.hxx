@@ -0,0 +1,233 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include "image_decode.hxx"
+
+// Streaming uploads for model assets.
+//
+// Images are decoded and mipmapped on worker threads into decoded_image_t.
+// The main thread owns the GL context. Each frame it copies a bounded amount
+// of buffer and pixel data into a persistently mapped staging ring and
+// issues the GPU-side copies from there, so a large scene never stalls one
+// frame on a single upload.
+
+////////////////////////////////////////////////////////////////////////////////
+// A persistently mapped ring of upload memory.
+//
+// The ring is split into segments. Each frame writes into the current
+// segment, and next() fences it and moves on. A segment is only reused once
+// the GPU has passed its fence, so the CPU never overwrites data that a
+// pending copy still reads.
+
+struct staging_ring_t {
+  staging_ring_t(size_t segment_size, int num_segments);
+  ~staging_ring_t();
+
+  staging_ring_t(const staging_ring_t&) = delete;
+  staging_ring_t& operator=(const staging_ring_t&) = delete;
+
+  // The bytes left in the current segment.
+  size_t available() const { return segment_size - align(used); }
+
+  // Reserve size bytes in the current segment. size must not exceed
+  // available(). Returns the offset into buffer.
+  size_t alloc(size_t size);
+  char* data(size_t offset) { return mapped + offset; }
+
+  // Fence the current segment and wait for the next one to be free.
+  void next();
+
+  bool empty() const { return !used; }
+
+  GLuint buffer = 0;
+
+private:
+  // Offsets are aligned for PBO reads of any pixel format.
+  static size_t align(size_t x) { return (x + 15) & ~(size_t)15; }
+
+  char* mapped = nullptr;
+  size_t segment_size;
+  int current = 0;
+  size_t used = 0;
+  std::vector<GLsync> fences;
+};
+
+inline staging_ring_t::staging_ring_t(size_t segment_size,
+  int num_segments) : segment_size(segment_size), fences(num_segments) {
+
+  GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+    GL_MAP_COHERENT_BIT;
+  glCreateBuffers(1, &buffer);
+  glNamedBufferStorage(buffer, segment_size * num_segments, nullptr, flags);
+  mapped = (char*)glMapNamedBufferRange(buffer, 0,
+    segment_size * num_segments, flags);
+}
+
+inline staging_ring_t::~staging_ring_t() {
+  for(GLsync fence : fences) {
+    if(fence)
+      glDeleteSync(fence);
+  }
+  glUnmapNamedBuffer(buffer);
+  glDeleteBuffers(1, &buffer);
+}
+
+inline size_t staging_ring_t::alloc(size_t size) {
+  size_t offset = align(used);
+  used = offset + size;
+  return segment_size * current + offset;
+}
+
+inline void staging_ring_t::next() {
+  fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  current = (current + 1) % fences.size();
+  used = 0;
+
+  if(GLsync fence = fences[current]) {
+    // Only blocks when the GPU is a whole ring of frames behind.
+    while(GL_TIMEOUT_EXPIRED == glClientWaitSync(fence,
+      GL_SYNC_FLUSH_COMMANDS_BIT, 1000000));
+    glDeleteSync(fence);
+    fences[current] = nullptr;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Pending buffer and texture uploads.
+//
+// Buffers go first, since no mesh can draw without them. Then texture levels
+// go in order of size, so every texture gets its smallest levels before any
+// texture gets its largest. A texture's GL_TEXTURE_BASE_LEVEL follows its
+// finest complete level, which keeps it complete and sampleable while the
+// finer levels are still streaming.
+
+struct upload_queue_t {
+  // Copy size bytes from data into buffer. data must stay valid until the
+  // upload completes.
+  void push_buffer(int index, GLuint buffer, const void* data, size_t size);
+
+  // Upload the mip chain of image into texture, which must have storage for
+  // all of its levels.
+  void push_image(std::unique_ptr<decoded_image_t> image, GLuint texture);
+
+  // Copy as much as fits in the ring's current segment. Calls
+  // buffer_done(index) as each buffer lands and level_done(index, level) as
+  // each texture level lands. Returns the number of bytes copied.
+  template<typename buffer_done_t, typename level_done_t>
+  size_t pump(staging_ring_t& ring, buffer_done_t buffer_done,
+    level_done_t level_done);
+
+  bool empty() const { return buffers.empty() && levels.empty(); }
+
+private:
+  struct buffer_upload_t {
+    int index;
+    GLuint buffer;
+    const char* data;
+    size_t size, done;
+  };
+
+  struct image_upload_t {
+    std::unique_ptr<decoded_image_t> image;
+    GLuint texture;
+  };
+
+  struct level_upload_t {
+    // The image is freed when its last level has landed.
+    std::shared_ptr<image_upload_t> image;
+    int level;
+    int y;
+    size_t size;
+  };
+
+  std::deque<buffer_upload_t> buffers;
+  std::deque<level_upload_t> levels;
+};
+
+inline void upload_queue_t::push_buffer(int index, GLuint buffer,
+  const void* data, size_t size) {
+  buffers.push_back({ index, buffer, (const char*)data, size, 0 });
+}
+
+inline void upload_queue_t::push_image(std::unique_ptr<decoded_image_t> image,
+  GLuint texture) {
+
+  auto upload = std::make_shared<image_upload_t>();
+  upload->image = std::move(image);
+  upload->texture = texture;
+
+  // Insert the levels smallest first after any pending levels of the same
+  // size. Each level then follows the coarser levels of its own texture.
+  const decoded_image_t& im = *upload->image;
+  for(int level = im.levels - 1; level >= 0; --level) {
+    size_t size = 4 * (size_t)im.level_width(level) * im.level_height(level);
+    auto it = std::upper_bound(levels.begin(), levels.end(), size,
+      [](size_t size, const level_upload_t& l) { return size < l.size; });
+    levels.insert(it, { upload, level, 0, size });
+  }
+}
+
+template<typename buffer_done_t, typename level_done_t>
+size_t upload_queue_t::pump(staging_ring_t& ring, buffer_done_t buffer_done,
+  level_done_t level_done) {
+
+  size_t copied = 0;
+  while(buffers.size()) {
+    buffer_upload_t& b = buffers.front();
+    size_t size = std::min(b.size - b.done, ring.available());
+    if(!size)
+      return copied;
+
+    size_t offset = ring.alloc(size);
+    memcpy(ring.data(offset), b.data + b.done, size);
+    glCopyNamedBufferSubData(ring.buffer, b.buffer, offset, b.done, size);
+    b.done += size;
+    copied += size;
+
+    if(b.done < b.size)
+      return copied;
+
+    buffer_done(b.index);
+    buffers.pop_front();
+  }
+
+  // Read pixels from the ring through the unpack buffer binding.
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring.buffer);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+  while(levels.size()) {
+    level_upload_t& l = levels.front();
+    const decoded_image_t& image = *l.image->image;
+    int width = image.level_width(l.level);
+    int height = image.level_height(l.level);
+    size_t pitch = 4 * (size_t)width;
+
+    // Upload whole rows, so a large level can span several frames.
+    int rows = std::min<size_t>(height - l.y, ring.available() / pitch);
+    if(!rows)
+      break;
+
+    size_t offset = ring.alloc(pitch * rows);
+    memcpy(ring.data(offset), image.level_data(l.level) + pitch * l.y,
+      pitch * rows);
+    glTextureSubImage2D(l.image->texture, l.level, 0, l.y, width, rows,
+      GL_RGBA, GL_UNSIGNED_BYTE, (const void*)offset);
+    l.y += rows;
+    copied += pitch * rows;
+
+    if(l.y < height)
+      break;
+
+    glTextureParameteri(l.image->texture, GL_TEXTURE_BASE_LEVEL, l.level);
+    level_done(image.index, l.level);
+    levels.pop_front();
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  return copied;
+}
@@ -0,0 +1,436 @@
+#define CGLTF_IMPLEMENTATION
+#include "../thirdparty/cgltf/cgltf.h"
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_JPEG
+#define STBI_ONLY_PNG
+#include "../thirdparty/stb/stb_image.h"
+
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cfloat>
+#include "material.hxx"
+#include "image_decode.hxx"
+#include "block_pool.hxx"
+#include "baked.hxx"
+#include "mesh_opt.hxx"
+
+// Bake a glTF and its images into a file the viewer maps without parsing.
+//
+//   bake [-O] model.gltf model.bake
+//
+// -O reorders each primitive for the post-transform cache, overdraw and
+// vertex fetch, quantizes its normals, tangents and texcoords, and reports
+// the simulated cache behavior before and after.
+
+struct bake_writer_t {
+  // Append size bytes to a section at the given alignment and return their
+  // offset in the section.
+  size_t append(bake_section_t s, const void* data, size_t size,
+    size_t align = 16);
+
+  template<typename type_t>
+  void push(bake_section_t s, const type_t& x) {
+    append(s, &x, sizeof(type_t), alignof(type_t));
+  }
+
+  bool write(const char* path) const;
+
+  std::vector<char> sections[bake_section_count];
+};
+
+inline size_t bake_writer_t::append(bake_section_t s, const void* data,
+  size_t size, size_t align) {
+
+  std::vector<char>& v = sections[s];
+  size_t offset = (v.size() + align - 1) / align * align;
+  v.resize(offset + size);
+  memcpy(v.data() + offset, data, size);
+  return offset;
+}
+
+bool bake_writer_t::write(const char* path) const {
+  // Lay out the sections on pages after the header.
+  bake_header_t header { };
+  memcpy(header.magic, bake_magic, 8);
+  header.version = bake_version;
+  header.material_size = sizeof(material_t);
+
+  uint64_t offset = bake_alignment;
+  for(int s = 0; s < bake_section_count; ++s) {
+    header.sections[s] = { offset, sections[s].size() };
+    offset += (sections[s].size() + bake_alignment - 1) / bake_alignment *
+      bake_alignment;
+  }
+  header.file_size = offset;
+
+  FILE* f = fopen(path, "wb");
+  if(!f) {
+    fprintf(stderr, "cannot open file %s\n", path);
+    return false;
+  }
+
+  std::vector<char> padding(bake_alignment);
+  bool ok = 1 == fwrite(&header, sizeof(header), 1, f);
+  ok &= 1 == fwrite(padding.data(), bake_alignment - sizeof(header), 1, f);
+  for(const std::vector<char>& section : sections) {
+    size_t pad = (bake_alignment - section.size() % bake_alignment) %
+      bake_alignment;
+    if(section.size())
+      ok &= 1 == fwrite(section.data(), section.size(), 1, f);
+    if(pad)
+      ok &= 1 == fwrite(padding.data(), pad, 1, f);
+  }
+
+  ok &= !fclose(f);
+  if(!ok)
+    fprintf(stderr, "cannot write file %s\n", path);
+  return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The vertex cache behavior of a primitive before and after optimization.
+struct prim_report_t {
+  vertex_cache_stats_t before, after;
+  uint32_t stride_before;
+};
+
+// With optimize, float normals and tangents are stored as snorm16 and float
+// texcoords in [0, 1] as unorm16. Both round to within 1/65534 of the
+// source, finer than an 8-bit normal map or a 16k texture resolves.
+// Returns the quantized component type, or 0 to store the attribute as is.
+int quantize_type(const cgltf_attribute& attrib) {
+  const cgltf_accessor* accessor = attrib.data;
+  if(cgltf_component_type_r_32f != accessor->component_type)
+    return 0;
+
+  switch(attrib.type) {
+    case cgltf_attribute_type_normal:
+    case cgltf_attribute_type_tangent:
+      return cgltf_component_type_r_16;
+
+    case cgltf_attribute_type_texcoord: {
+      float x[2];
+      for(size_t i = 0; i < accessor->count; ++i) {
+        if(!cgltf_accessor_read_float(accessor, i, x, 2) ||
+          x[0] < 0 || x[0] > 1 || x[1] < 0 || x[1] > 1)
+          return 0;
+      }
+      return cgltf_component_type_r_16u;
+    }
+
+    default:
+      return 0;
+  }
+}
+
+// Interleave the attributes of prim into the geometry section and convert
+// its indices to 16 bits, or 32 when they don't fit. Primitives without
+// indices get a sequential index list, since the viewer draws elements.
+// With optimize, the triangles and vertices are reordered by mesh_opt.hxx
+// and the attributes quantized.
+bool bake_prim(bake_writer_t& writer, const cgltf_data* data,
+  const cgltf_primitive& prim, bool optimize, bake_prim_t& prim2,
+  prim_report_t& report) {
+
+  prim2 = { };
+  prim2.material = prim.material ? prim.material - data->materials : 0;
+
+  if(cgltf_primitive_type_triangles != prim.type) {
+    fprintf(stderr, "skipping primitive that isn't a triangle list\n");
+    return false;
+  }
+
+  if(!prim.attributes_count || prim.attributes_count > bake_max_attribs) {
+    fprintf(stderr, "skipping primitive with %d attributes\n",
+      (int)prim.attributes_count);
+    return false;
+  }
+
+  // Each attribute starts on 4 bytes, like a glTF buffer view with a
+  // vertex stride.
+  size_t count = prim.attributes[0].data->count;
+  int quantized[bake_max_attribs] { };
+  int position_offset = -1;
+  report.stride_before = 0;
+  for(int a = 0; a < prim.attributes_count; ++a) {
+    const cgltf_attribute& attrib = prim.attributes[a];
+    const cgltf_accessor* accessor = attrib.data;
+    if(!accessor->buffer_view || accessor->is_sparse ||
+      count != accessor->count) {
+      fprintf(stderr, "skipping primitive with unsupported accessors\n");
+      return false;
+    }
+
+    size_t size = cgltf_calc_size(accessor->type, accessor->component_type);
+    report.stride_before += (size + 3) & ~3;
+
+    bake_attrib_t& attrib2 = prim2.attribs[a];
+    attrib2.type = attrib.type;
+    attrib2.index = attrib.index;
+    attrib2.component_type = accessor->component_type;
+    attrib2.components = accessor->type;
+    attrib2.normalized = accessor->normalized;
+    attrib2.offset = prim2.stride;
+
+    if(optimize && (quantized[a] = quantize_type(attrib))) {
+      attrib2.component_type = quantized[a];
+      attrib2.normalized = true;
+      size = cgltf_calc_size(accessor->type, (cgltf_component_type)
+        quantized[a]);
+    }
+    prim2.stride += (size + 3) & ~3;
+
+    if(cgltf_attribute_type_position == attrib.type &&
+      cgltf_type_vec3 == accessor->type &&
+      cgltf_component_type_r_32f == accessor->component_type)
+      position_offset = attrib2.offset;
+
+    if(cgltf_attribute_type_position == attrib.type && accessor->has_min &&
+      accessor->has_max) {
+      for(int i = 0; i < 3; ++i) {
+        prim2.min[i] = accessor->min[i];
+        prim2.max[i] = accessor->max[i];
+      }
+    }
+  }
+  prim2.attrib_count = prim.attributes_count;
+
+  std::vector<char> vertices(prim2.stride * count);
+  for(int a = 0; a < prim.attributes_count; ++a) {
+    const cgltf_accessor* accessor = prim.attributes[a].data;
+    const cgltf_buffer_view* view = accessor->buffer_view;
+    char* dest = vertices.data() + prim2.attribs[a].offset;
+
+    if(quantized[a]) {
+      int n = cgltf_num_components(accessor->type);
+      for(size_t i = 0; i < count; ++i) {
+        float x[4];
+        cgltf_accessor_read_float(accessor, i, x, n);
+        for(int c = 0; c < n; ++c) {
+          if(cgltf_component_type_r_16 == quantized[a]) {
+            int16_t q = (int16_t)lround(std::clamp(x[c], -1.f, 1.f) * 32767);
+            memcpy(dest + prim2.stride * i + 2 * c, &q, 2);
+          } else {
+            uint16_t q = (uint16_t)lround(std::clamp(x[c], 0.f, 1.f) * 65535);
+            memcpy(dest + prim2.stride * i + 2 * c, &q, 2);
+          }
+        }
+      }
+
+    } else {
+      size_t size = cgltf_calc_size(accessor->type,
+        accessor->component_type);
+      const char* src = (const char*)view->buffer->data + view->offset +
+        accessor->offset;
+      for(size_t i = 0; i < count; ++i)
+        memcpy(dest + prim2.stride * i, src + accessor->stride * i, size);
+    }
+  }
+
+  std::vector<uint32_t> indices;
+  if(prim.indices) {
+    indices.resize(prim.indices->count);
+    for(size_t i = 0; i < indices.size(); ++i)
+      indices[i] = cgltf_accessor_read_index(prim.indices, i);
+
+  } else {
+    indices.resize(count);
+    std::iota(indices.begin(), indices.end(), 0);
+  }
+
+  for(uint32_t index : indices) {
+    if(index >= count) {
+      fprintf(stderr, "skipping primitive with out of range indices\n");
+      return false;
+    }
+  }
+
+  report.before = analyze_vertex_cache(indices, count);
+  if(optimize && 0 == indices.size() % 3) {
+    std::vector<uint32_t> cold_starts = optimize_vertex_cache(indices,
+      count);
+
+    // Draw outward-facing clusters first, judged from the center of the
+    // bounds.
+    if(-1 != position_offset) {
+      float min[3] { FLT_MAX, FLT_MAX, FLT_MAX };
+      float max[3] { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+      for(size_t i = 0; i < count; ++i) {
+        float p[3];
+        memcpy(p, vertices.data() + prim2.stride * i + position_offset, 12);
+        for(int k = 0; k < 3; ++k) {
+          min[k] = std::min(min[k], p[k]);
+          max[k] = std::max(max[k], p[k]);
+        }
+      }
+
+      float center[3];
+      for(int k = 0; k < 3; ++k) {
+        center[k] = .5f * (min[k] + max[k]);
+        prim2.min[k] = min[k];
+        prim2.max[k] = max[k];
+      }
+      optimize_overdraw(indices, vertices.data() + position_offset,
+        prim2.stride, center, cold_starts, count);
+    }
+
+    count = optimize_vertex_fetch(indices, vertices, prim2.stride);
+  }
+  report.after = analyze_vertex_cache(indices, count);
+
+  prim2.vertex_count = count;
+  prim2.vertex_offset = writer.append(bake_section_geometry,
+    vertices.data(), vertices.size());
+  prim2.index_count = indices.size();
+
+  uint32_t max_index = 0;
+  for(uint32_t index : indices)
+    max_index = std::max(max_index, index);
+
+  if(max_index < 65536) {
+    std::vector<uint16_t> indices16(indices.begin(), indices.end());
+    prim2.index_size = 2;
+    prim2.index_offset = writer.append(bake_section_geometry,
+      indices16.data(), 2 * indices16.size());
+
+  } else {
+    prim2.index_size = 4;
+    prim2.index_offset = writer.append(bake_section_geometry,
+      indices.data(), 4 * indices.size());
+  }
+
+  return true;
+}
+
+int main(int argc, char** argv) {
+  bool optimize = argc > 1 && !strcmp(argv[1], "-O");
+  if(3 + optimize != argc) {
+    fprintf(stderr, "usage: %s [-O] model.gltf model.bake\n", argv[0]);
+    return 1;
+  }
+
+  const char* path = argv[1 + optimize];
+  const char* out_path = argv[2 + optimize];
+  auto start = std::chrono::steady_clock::now();
+
+  cgltf_options options { };
+  cgltf_data* data = nullptr;
+  cgltf_result result = cgltf_parse_file(&options, path, &data);
+  if(cgltf_result_success == result)
+    result = cgltf_load_buffers(&options, data, path);
+  if(cgltf_result_success != result) {
+    fprintf(stderr, "cannot load %s: cgltf error %d\n", path, (int)result);
+    return 1;
+  }
+  double load_ms = elapsed_ms(start);
+
+  // Decode the images and build their mips in parallel.
+  std::vector<std::unique_ptr<decoded_image_t>> images(data->images_count);
+  {
+    block_pool_t pool(std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<int> image_list(data->images_count);
+    std::iota(image_list.begin(), image_list.end(), 0);
+    pool.execute(image_list, 1, [&](int tid, int level, int index) {
+      images[index] = decode_gltf_image(data, index, path);
+      return true;
+    });
+    pool.wait();
+  }
+  double decode_ms = elapsed_ms(start) - load_ms;
+
+  bake_writer_t writer;
+  for(int i = 0; i < data->images_count; ++i) {
+    const decoded_image_t* image = images[i].get();
+    if(!image) {
+      fprintf(stderr, "cannot bake %s without image %d\n", path, i);
+      return 1;
+    }
+
+    bake_image_t image2 { };
+    image2.width = image->width;
+    image2.height = image->height;
+    image2.levels = std::min<int>(image->levels, bake_max_levels);
+    size_t base = writer.append(bake_section_pixels, image->pixels.data(),
+      image->pixels.size());
+    for(int level = 0; level < image2.levels; ++level)
+      image2.offsets[level] = base + image->offsets[level];
+    writer.push(bake_section_images, image2);
+  }
+
+  for(int i = 0; i < data->samplers_count; ++i) {
+    const cgltf_sampler& sampler = data->samplers[i];
+    writer.push(bake_section_samplers, bake_sampler_t {
+      sampler.mag_filter, sampler.min_filter, sampler.wrap_s, sampler.wrap_t
+    });
+  }
+
+  for(int i = 0; i < data->textures_count; ++i) {
+    const cgltf_texture& texture = data->textures[i];
+    writer.push(bake_section_textures, bake_texture_t {
+      texture.image ? (int)(texture.image - data->images) : -1,
+      texture.sampler ? (int)(texture.sampler - data->samplers) : -1
+    });
+  }
+
+  for(int i = 0; i < data->materials_count; ++i)
+    writer.push(bake_section_materials, load_material(data,
+      data->materials + i));
+
+  int num_prims = 0;
+  vertex_cache_stats_t before, after;
+  if(optimize)
+    printf("Simulated 16-entry FIFO vertex cache:\n");
+  for(int i = 0; i < data->meshes_count; ++i) {
+    const cgltf_mesh& mesh = data->meshes[i];
+    bake_mesh_t mesh2 { num_prims, 0 };
+    for(int p = 0; p < mesh.primitives_count; ++p) {
+      bake_prim_t prim2;
+      prim_report_t report;
+      if(!bake_prim(writer, data, mesh.primitives[p], optimize, prim2,
+        report))
+        continue;
+
+      writer.push(bake_section_prims, prim2);
+      ++mesh2.prim_count;
+
+      if(optimize) {
+        printf("  mesh %d prim %d: %zu tris, ACMR %.3f -> %.3f, "
+          "ATVR %.3f -> %.3f, stride %u -> %u\n", i, p,
+          report.before.triangles, report.before.acmr(), report.after.acmr(),
+          report.before.atvr(), report.after.atvr(), report.stride_before,
+          prim2.stride);
+      }
+      before.triangles += report.before.triangles;
+      before.vertices += report.before.vertices;
+      before.misses += report.before.misses;
+      after.triangles += report.after.triangles;
+      after.vertices += report.after.vertices;
+      after.misses += report.after.misses;
+    }
+    num_prims += mesh2.prim_count;
+    writer.push(bake_section_meshes, mesh2);
+  }
+
+  if(!writer.write(out_path))
+    return 1;
+
+  printf("Baked %d meshes, %d primitives and %d images into %s\n",
+    (int)data->meshes_count, num_prims, (int)data->images_count, out_path);
+  if(optimize)
+    printf("  ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n", before.acmr(),
+      after.acmr(), before.atvr(), after.atvr());
+  printf("  geometry: %zu bytes\n",
+    writer.sections[bake_section_geometry].size());
+  printf("  pixels:   %zu bytes\n",
+    writer.sections[bake_section_pixels].size());
+  printf("  load %.1f ms, decode %.1f ms, total %.1f ms\n", load_ms, decode_ms,
+    elapsed_ms(start));
+
+  cgltf_free(data);
+  return 0;
+}
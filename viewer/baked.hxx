@@ -0,0 +1,213 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include "material.hxx"
+
+////////////////////////////////////////////////////////////////////////////////
+// Baked models.
+//
+// The bake tool turns a glTF and its images into one file that the viewer
+// maps and uploads without parsing. Every primitive's attributes are
+// interleaved into one vertex stream. Every image is stored as a full RGBA8
+// mip chain, and materials are stored as material_t.
+//
+// The file is a header and a table of sections. Each section starts on a
+// page, so geometry and pixels can be handed to GL straight from the
+// mapping. Offsets inside records are relative to their section.
+
+enum bake_section_t {
+  bake_section_materials,   // material_t
+  bake_section_textures,    // bake_texture_t
+  bake_section_samplers,    // bake_sampler_t
+  bake_section_images,      // bake_image_t
+  bake_section_meshes,      // bake_mesh_t
+  bake_section_prims,       // bake_prim_t
+  bake_section_geometry,    // Vertex and index data.
+  bake_section_pixels,      // Mip levels.
+  bake_section_count,
+};
+
+enum {
+  bake_version = 1,
+  bake_alignment = 4096,
+  bake_max_attribs = 8,
+  bake_max_levels = 16,
+};
+
+const char bake_magic[8] { 'G', 'L', 'T', 'F', 'B', 'A', 'K', 'E' };
+
+struct bake_header_t {
+  char magic[8];
+  uint32_t version;
+
+  // Reject files written by a build with a different material layout.
+  uint32_t material_size;
+  uint64_t file_size;
+
+  struct section_t {
+    uint64_t offset;
+    uint64_t size;
+  };
+  section_t sections[bake_section_count];
+};
+
+struct bake_texture_t {
+  int32_t image;
+  int32_t sampler;
+};
+
+// The glTF sampler fields. 0 means the glTF left them out.
+struct bake_sampler_t {
+  int32_t mag_filter, min_filter;
+  int32_t wrap_s, wrap_t;
+};
+
+struct bake_image_t {
+  int32_t width, height;
+  int32_t levels;
+  int32_t padding;
+  uint64_t offsets[bake_max_levels];
+};
+
+struct bake_mesh_t {
+  int32_t first_prim;
+  int32_t prim_count;
+};
+
+struct bake_attrib_t {
+  int32_t type;             // cgltf_attribute_type
+  int32_t index;            // The n in TEXCOORD_n.
+  int32_t component_type;   // cgltf_component_type
+  int32_t components;       // cgltf_type
+  int32_t normalized;
+  int32_t offset;           // Byte offset in the vertex.
+};
+
+struct bake_prim_t {
+  uint64_t vertex_offset;
+  uint64_t index_offset;
+  uint32_t vertex_count;
+  uint32_t stride;
+  uint32_t index_count;
+  uint32_t index_size;      // 2 or 4.
+
+  int32_t material;
+  int32_t attrib_count;
+  bake_attrib_t attribs[bake_max_attribs];
+
+  // Bounds of the positions.
+  float min[3], max[3];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct baked_file_t {
+  baked_file_t() { }
+  ~baked_file_t() { close(); }
+
+  baked_file_t(const baked_file_t&) = delete;
+  baked_file_t& operator=(const baked_file_t&) = delete;
+
+  // Map the file and validate the header and section table. Prints the
+  // reason and returns false on failure.
+  bool open(const char* path);
+  void close();
+
+  const bake_header_t& header() const {
+    return *(const bake_header_t*)data;
+  }
+
+  // The records of a section.
+  template<typename type_t>
+  const type_t* section(bake_section_t s, int& count) const {
+    const bake_header_t::section_t& sec = header().sections[s];
+    count = sec.size / sizeof(type_t);
+    return (const type_t*)(data + sec.offset);
+  }
+
+  const char* section_data(bake_section_t s) const {
+    return data + header().sections[s].offset;
+  }
+  size_t section_size(bake_section_t s) const {
+    return header().sections[s].size;
+  }
+
+  const char* data = nullptr;
+  size_t size = 0;
+};
+
+inline bool baked_file_t::open(const char* path) {
+  close();
+
+  int fd = ::open(path, O_RDONLY);
+  if(-1 == fd) {
+    fprintf(stderr, "cannot open file %s\n", path);
+    return false;
+  }
+
+  struct stat statbuf;
+  if(-1 == fstat(fd, &statbuf)) {
+    fprintf(stderr, "cannot stat file %s\n", path);
+    ::close(fd);
+    return false;
+  }
+
+  if(statbuf.st_size < (off_t)sizeof(bake_header_t)) {
+    fprintf(stderr, "file %s is too small to be a baked model\n", path);
+    ::close(fd);
+    return false;
+  }
+
+  size = statbuf.st_size;
+  void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if(MAP_FAILED == p) {
+    fprintf(stderr, "cannot map file %s\n", path);
+    size = 0;
+    return false;
+  }
+  data = (const char*)p;
+
+  // Everything in the file is read, so read ahead all of it.
+  madvise(p, size, MADV_WILLNEED);
+
+  const char* error = nullptr;
+  const bake_header_t& h = header();
+  if(memcmp(h.magic, bake_magic, 8))
+    error = "not a baked model";
+  else if(bake_version != h.version)
+    error = "the bake version is not supported";
+  else if(sizeof(material_t) != h.material_size)
+    error = "the file was baked with a different material layout";
+  else if(size != h.file_size)
+    error = "the file size does not match the header";
+  else {
+    for(const bake_header_t::section_t& sec : h.sections) {
+      if(sec.offset % bake_alignment || sec.offset > size ||
+        sec.size > size - sec.offset) {
+        error = "a section is out of bounds";
+        break;
+      }
+    }
+  }
+
+  if(error) {
+    fprintf(stderr, "%s: %s\n", path, error);
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+inline void baked_file_t::close() {
+  if(data)
+    munmap((void*)data, size);
+  data = nullptr;
+  size = 0;
+}
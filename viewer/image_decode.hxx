@@ -0,0 +1,139 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
+// Decoding glTF images into RGBA8 mip chains. Include stb_image first.
+
+inline double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+// An RGBA8 image and its full mip chain, largest level first.
+struct decoded_image_t {
+  int index;
+  int width, height;
+  int levels;
+
+  // Level l starts at offsets[l] in pixels.
+  std::vector<uint8_t> pixels;
+  std::vector<size_t> offsets;
+
+  // Time spent in stb_image and in building the mips.
+  double decode_ms;
+
+  int level_width(int level) const { return std::max(1, width >> level); }
+  int level_height(int level) const { return std::max(1, height >> level); }
+  const uint8_t* level_data(int level) const {
+    return pixels.data() + offsets[level];
+  }
+};
+
+// Box filter each level down from the one above it. This matches what
+// glGenerateTextureMipmap does for a linear RGBA8 texture.
+inline void build_mips(decoded_image_t& image) {
+  for(int level = 1; level < image.levels; ++level) {
+    int w0 = image.level_width(level - 1);
+    int h0 = image.level_height(level - 1);
+    int w = image.level_width(level);
+    int h = image.level_height(level);
+    const uint8_t* src = image.level_data(level - 1);
+    uint8_t* dest = image.pixels.data() + image.offsets[level];
+
+    for(int y = 0; y < h; ++y) {
+      // Clamp the second tap on levels that are one texel wide or tall.
+      const uint8_t* row0 = src + 4 * w0 * std::min(2 * y, h0 - 1);
+      const uint8_t* row1 = src + 4 * w0 * std::min(2 * y + 1, h0 - 1);
+      for(int x = 0; x < w; ++x) {
+        int x0 = 4 * std::min(2 * x, w0 - 1);
+        int x1 = 4 * std::min(2 * x + 1, w0 - 1);
+        for(int c = 0; c < 4; ++c) {
+          int sum = row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c];
+          dest[4 * (w * y + x) + c] = (sum + 2) / 4;
+        }
+      }
+    }
+  }
+}
+
+// Decode a PNG or JPEG from a file, or from memory when size is non-zero.
+// Returns null and prints the reason on failure.
+inline std::unique_ptr<decoded_image_t> decode_image(int index,
+  const char* path, const void* data = nullptr, size_t size = 0) {
+
+  auto start = std::chrono::steady_clock::now();
+
+  int width, height, comp;
+  stbi_uc* pixels = size ?
+    stbi_load_from_memory((const stbi_uc*)data, size, &width, &height, &comp,
+      STBI_rgb_alpha) :
+    stbi_load(path, &width, &height, &comp, STBI_rgb_alpha);
+  if(!pixels) {
+    printf("cannot decode image %s: %s\n", path, stbi_failure_reason());
+    return nullptr;
+  }
+
+  auto image = std::make_unique<decoded_image_t>();
+  image->index = index;
+  image->width = width;
+  image->height = height;
+
+  int levels = 1;
+  while((width | height) >> levels)
+    ++levels;
+  image->levels = levels;
+
+  size_t total = 0;
+  image->offsets.resize(levels);
+  for(int level = 0; level < levels; ++level) {
+    image->offsets[level] = total;
+    total += 4 * (size_t)image->level_width(level) * image->level_height(level);
+  }
+
+  image->pixels.resize(total);
+  memcpy(image->pixels.data(), pixels, 4 * (size_t)width * height);
+  stbi_image_free(pixels);
+
+  build_mips(*image);
+  image->decode_ms = elapsed_ms(start);
+  return image;
+}
+
+// Decode image index of the glTF at gltf_path. The image is either embedded
+// in a buffer view or named by a uri relative to the glTF. Include cgltf
+// first.
+inline std::unique_ptr<decoded_image_t> decode_gltf_image(
+  const cgltf_data* data, int index, const char* gltf_path) {
+
+  const cgltf_image* image = data->images + index;
+  if(image->buffer_view) {
+    // Images embedded in a binary glTF.
+    const cgltf_buffer_view* view = image->buffer_view;
+    return decode_image(index, image->name ? image->name : "embedded",
+      (const char*)view->buffer->data + view->offset, view->size);
+
+  } else if(image->uri) {
+    char path[260];
+    const char* s0 = strrchr(gltf_path, '/');
+    const char* s1 = strrchr(gltf_path, '\\');
+    const char* slash = s0 ? (s1 && s1 > s0 ? s1 : s0) : s1;
+
+    if(slash) {
+      size_t prefix = slash - gltf_path + 1;
+      strncpy(path, gltf_path, prefix);
+      strcpy(path + prefix, image->uri);
+
+    } else {
+      strcpy(path, image->uri);
+    }
+
+    return decode_image(index, path);
+  }
+
+  return nullptr;
+}
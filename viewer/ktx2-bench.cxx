@@ -0,0 +1,116 @@
+#include <vector>
+#include <memory>
+#include <numeric>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <unistd.h>
+#include "ktx2.hxx"
+#include "block_pool.hxx"
+
+// Time the KTX2 parser and level inflation without a GL context.
+//
+//   ktx2-bench [-t threads] [-n iterations] file.ktx2...
+
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+const char* scheme_names[] { "none", "BasisLZ", "zstd", "zlib" };
+
+int main(int argc, char** argv) {
+  int num_threads = std::max(1u, std::thread::hardware_concurrency());
+  int iterations = 5;
+
+  int opt;
+  while(-1 != (opt = getopt(argc, argv, "t:n:"))) {
+    switch(opt) {
+      case 't': num_threads = std::max(1, atoi(optarg)); break;
+      case 'n': iterations = std::max(1, atoi(optarg)); break;
+      default:
+        fprintf(stderr, "usage: %s [-t threads] [-n iterations] "
+          "file.ktx2...\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if(optind == argc) {
+    fprintf(stderr, "no files given\n");
+    return 1;
+  }
+
+  // Open every file and print its layout.
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::unique_ptr<ktx2_file_t>> files;
+  for(int i = optind; i < argc; ++i) {
+    auto file = std::make_unique<ktx2_file_t>();
+    if(!file->open(argv[i]))
+      return 1;
+    files.push_back(std::move(file));
+  }
+  double open_ms = elapsed_ms(start);
+
+  struct level_t {
+    int file;
+    int level;
+  };
+  std::vector<level_t> levels;
+  size_t stored = 0, decoded = 0;
+  for(int f = 0; f < files.size(); ++f) {
+    const ktx2_file_t& file = *files[f];
+    size_t file_stored = 0, file_decoded = 0;
+    for(int level = 0; level < file.levels(); ++level) {
+      levels.push_back({ f, level });
+      file_stored += file.level_index(level).byteLength;
+      file_decoded += file.level_size(level);
+    }
+    stored += file_stored;
+    decoded += file_decoded;
+
+    printf("%s: %s %dx%d, %d levels, %d layers, %d faces, %s\n",
+      file.path.c_str(), file.format->name, file.width(0), file.height(0),
+      file.levels(), file.layers(), file.faces(),
+      scheme_names[file.header().supercompressionScheme]);
+    printf("  stored %.2f MB, decoded %.2f MB\n", file_stored / 1.0e6,
+      file_decoded / 1.0e6);
+  }
+  printf("opened %d files in %.2f ms\n", (int)files.size(), open_ms);
+
+  // Decode into buffers allocated once, so the timings only cover the
+  // inflation and the page faults on the mapping.
+  std::vector<std::vector<char>> buffers(levels.size());
+  for(int i = 0; i < levels.size(); ++i)
+    buffers[i].resize(files[levels[i].file]->level_size(levels[i].level));
+
+  std::vector<int> items(levels.size());
+  std::iota(items.begin(), items.end(), 0);
+
+  block_pool_t pool(num_threads);
+  double best_ms = 1e30;
+  for(int it = 0; it < iterations; ++it) {
+    std::atomic<int> failures { 0 };
+    auto start = std::chrono::steady_clock::now();
+    pool.execute(items, 1, [&](int tid, int level2, int item) {
+      const level_t& l = levels[item];
+      if(!files[l.file]->decode_level(l.level, buffers[item].data()))
+        ++failures;
+      return true;
+    });
+    pool.wait();
+    double ms = elapsed_ms(start);
+    best_ms = std::min(best_ms, ms);
+
+    if(failures)
+      return 1;
+
+    printf("iteration %d: %.2f ms, %.1f MB/s\n", it, ms,
+      decoded / 1.0e3 / ms);
+  }
+
+  printf("best of %d with %d threads: %.2f ms, %.1f MB/s decoded\n",
+    iterations, num_threads, best_ms, decoded / 1.0e3 / best_ms);
+  printf("stored %.2f MB, decoded %.2f MB\n", stored / 1.0e6,
+    decoded / 1.0e6);
+  return 0;
+}
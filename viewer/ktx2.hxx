@@ -0,0 +1,339 @@
+#pragma once
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <algorithm>
+#include <zstd.h>
+#include <zlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// KTX2 textures.
+//
+// ktx2_file_t maps a KTX2 file and validates its header and level index
+// against the file size and the format. It handles 2D textures, arrays, cube
+// maps and cube map arrays in the uncompressed and BC formats listed in
+// ktx2_formats. A level is an array of layers, each an array of faces, each
+// tightly packed.
+//
+// Levels stored with Zstandard or zlib supercompression are inflated by
+// decode_level. BasisLZ and UASTC need the Basis Universal transcoder, which
+// this tree doesn't carry, so those files are rejected with a reason.
+//
+// Nothing here calls GL, so the parser can be benchmarked headless.
+
+const uint8_t ktx2_identifier[12] {
+  0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
+};
+
+enum ktx2_scheme_t {
+  ktx2_scheme_none = 0,
+  ktx2_scheme_basislz = 1,
+  ktx2_scheme_zstd = 2,
+  ktx2_scheme_zlib = 3,
+};
+
+struct ktx2_header_t {
+  char identifier[12];
+  uint32_t vkFormat;
+  uint32_t typeSize;
+  uint32_t width;
+  uint32_t height;
+  uint32_t pixelDepth;
+  uint32_t layerCount;
+  uint32_t faceCount;
+  uint32_t levelCount;
+  uint32_t supercompressionScheme;
+
+  // Index
+  uint32_t dfdByteOffset;
+  uint32_t dfdByteLength;
+  uint32_t kvdByteOffset;
+  uint32_t kvdByteLength;
+  uint64_t sgdByteOffset;
+  uint64_t sgdByteLength;
+};
+
+// The level index follows the header.
+struct ktx2_level_t {
+  uint64_t byteOffset;
+  uint64_t byteLength;
+  uint64_t uncompressedByteLength;
+};
+
+// The storage of a vkFormat. Uncompressed formats are 1x1 blocks.
+struct ktx2_format_t {
+  uint32_t vk_format;
+  uint8_t block_bytes;
+  uint8_t block_width, block_height;
+  const char* name;
+};
+
+const ktx2_format_t ktx2_formats[] {
+  {   9,  1, 1, 1, "R8_UNORM" },
+  {  16,  2, 1, 1, "R8G8_UNORM" },
+  {  37,  4, 1, 1, "R8G8B8A8_UNORM" },
+  {  43,  4, 1, 1, "R8G8B8A8_SRGB" },
+  {  44,  4, 1, 1, "B8G8R8A8_UNORM" },
+  {  50,  4, 1, 1, "B8G8R8A8_SRGB" },
+  {  70,  2, 1, 1, "R16_UNORM" },
+  {  76,  2, 1, 1, "R16_SFLOAT" },
+  {  77,  4, 1, 1, "R16G16_UNORM" },
+  {  83,  4, 1, 1, "R16G16_SFLOAT" },
+  {  90,  6, 1, 1, "R16G16B16_SFLOAT" },
+  {  91,  8, 1, 1, "R16G16B16A16_UNORM" },
+  {  97,  8, 1, 1, "R16G16B16A16_SFLOAT" },
+  { 100,  4, 1, 1, "R32_SFLOAT" },
+  { 103,  8, 1, 1, "R32G32_SFLOAT" },
+  { 106, 12, 1, 1, "R32G32B32_SFLOAT" },
+  { 109, 16, 1, 1, "R32G32B32A32_SFLOAT" },
+  { 122,  4, 1, 1, "B10G11R11_UFLOAT_PACK32" },
+  { 123,  4, 1, 1, "E5B9G9R9_UFLOAT_PACK32" },
+  { 131,  8, 4, 4, "BC1_RGB_UNORM_BLOCK" },
+  { 132,  8, 4, 4, "BC1_RGB_SRGB_BLOCK" },
+  { 133,  8, 4, 4, "BC1_RGBA_UNORM_BLOCK" },
+  { 134,  8, 4, 4, "BC1_RGBA_SRGB_BLOCK" },
+  { 135, 16, 4, 4, "BC2_UNORM_BLOCK" },
+  { 136, 16, 4, 4, "BC2_SRGB_BLOCK" },
+  { 137, 16, 4, 4, "BC3_UNORM_BLOCK" },
+  { 138, 16, 4, 4, "BC3_SRGB_BLOCK" },
+  { 139,  8, 4, 4, "BC4_UNORM_BLOCK" },
+  { 140,  8, 4, 4, "BC4_SNORM_BLOCK" },
+  { 141, 16, 4, 4, "BC5_UNORM_BLOCK" },
+  { 142, 16, 4, 4, "BC5_SNORM_BLOCK" },
+  { 143, 16, 4, 4, "BC6H_UFLOAT_BLOCK" },
+  { 144, 16, 4, 4, "BC6H_SFLOAT_BLOCK" },
+  { 145, 16, 4, 4, "BC7_UNORM_BLOCK" },
+  { 146, 16, 4, 4, "BC7_SRGB_BLOCK" },
+};
+
+inline const ktx2_format_t* find_ktx2_format(uint32_t vk_format) {
+  for(const ktx2_format_t& format : ktx2_formats) {
+    if(vk_format == format.vk_format)
+      return &format;
+  }
+  return nullptr;
+}
+
+struct ktx2_file_t {
+  ktx2_file_t() { }
+  ~ktx2_file_t() { close(); }
+
+  ktx2_file_t(const ktx2_file_t&) = delete;
+  ktx2_file_t& operator=(const ktx2_file_t&) = delete;
+
+  // Map the file and validate it. Prints the reason and returns false on
+  // failure.
+  bool open(const char* path);
+  void close();
+
+  const ktx2_header_t& header() const { return *(const ktx2_header_t*)data; }
+  const ktx2_level_t& level_index(int level) const {
+    return ((const ktx2_level_t*)(data + sizeof(ktx2_header_t)))[level];
+  }
+
+  // A level count of 0 asks the loader to generate the mips from level 0.
+  int levels() const { return std::max(1u, header().levelCount); }
+  bool generate_mips() const { return !header().levelCount; }
+
+  int layers() const { return std::max(1u, header().layerCount); }
+  int faces() const { return header().faceCount; }
+  bool is_array() const { return header().layerCount > 0; }
+  bool is_cube() const { return 6 == header().faceCount; }
+
+  int width(int level) const { return std::max(1u, header().width >> level); }
+  int height(int level) const {
+    return std::max(1u, header().height >> level);
+  }
+
+  // Bytes in one face of one layer, and in the whole level.
+  size_t image_size(int level) const;
+  size_t level_size(int level) const {
+    return image_size(level) * layers() * faces();
+  }
+
+  bool is_supercompressed() const {
+    return ktx2_scheme_none != header().supercompressionScheme;
+  }
+
+  // The level's bytes as stored in the file.
+  const char* stored_level(int level) const {
+    return data + level_index(level).byteOffset;
+  }
+
+  // Write level_size(level) bytes into dest, inflating a supercompressed
+  // level. Prints the reason and returns false on failure.
+  bool decode_level(int level, void* dest) const;
+
+  const ktx2_format_t* format = nullptr;
+  const char* data = nullptr;
+  size_t size = 0;
+  std::string path;
+};
+
+inline size_t ktx2_file_t::image_size(int level) const {
+  size_t blocks_x = (width(level) + format->block_width - 1) /
+    format->block_width;
+  size_t blocks_y = (height(level) + format->block_height - 1) /
+    format->block_height;
+  return blocks_x * blocks_y * format->block_bytes;
+}
+
+inline bool ktx2_file_t::open(const char* path2) {
+  close();
+  path = path2;
+
+  int fd = ::open(path2, O_RDONLY);
+  if(-1 == fd) {
+    fprintf(stderr, "cannot open file %s\n", path2);
+    return false;
+  }
+
+  struct stat statbuf;
+  if(-1 == fstat(fd, &statbuf)) {
+    fprintf(stderr, "cannot stat file %s\n", path2);
+    ::close(fd);
+    return false;
+  }
+
+  if(statbuf.st_size < (off_t)sizeof(ktx2_header_t)) {
+    fprintf(stderr, "file %s is too small to be a ktx2 file\n", path2);
+    ::close(fd);
+    return false;
+  }
+
+  size = statbuf.st_size;
+  void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if(MAP_FAILED == p) {
+    fprintf(stderr, "cannot map file %s\n", path2);
+    size = 0;
+    return false;
+  }
+  data = (const char*)p;
+
+  const ktx2_header_t& h = header();
+  const char* error = nullptr;
+  char message[64];
+  if(memcmp(h.identifier, ktx2_identifier, 12))
+    error = "the KTX2 identifier is wrong";
+
+  // A 32-bit dimension has at most 32 levels. Check this first, so that the
+  // level index size and the shift below can't overflow.
+  else if(h.levelCount > 32)
+    error = "there are more levels than the dimensions allow";
+
+  else if(sizeof(ktx2_header_t) + sizeof(ktx2_level_t) * levels() > size)
+    error = "the level index is truncated";
+
+  else if(!h.width || !h.height)
+    error = "the texture is empty";
+
+  else if(h.pixelDepth > 0)
+    error = "3D textures are not supported";
+
+  else if(1 != h.faceCount && 6 != h.faceCount)
+    error = "the face count must be 1 or 6";
+
+  else if(6 == h.faceCount && h.width != h.height)
+    error = "cube map faces must be square";
+
+  else if(!((h.width | h.height) >> (levels() - 1)))
+    error = "there are more levels than the dimensions allow";
+
+  else if(ktx2_scheme_basislz == h.supercompressionScheme)
+    error = "BasisLZ needs the Basis Universal transcoder";
+
+  else if(h.supercompressionScheme > ktx2_scheme_zlib)
+    error = "the supercompression scheme is unknown";
+
+  else if(!h.vkFormat) {
+    // The format is in the data format descriptor. Its color model is at
+    // byte 8 of the first descriptor block, which follows the total size.
+    const uint8_t* dfd = (const uint8_t*)data + h.dfdByteOffset;
+    bool uastc = h.dfdByteLength > 12 &&
+      (uint64_t)h.dfdByteOffset + h.dfdByteLength <= size && 166 == dfd[12];
+    error = uastc ?
+      "UASTC needs the Basis Universal transcoder" :
+      "the format is undefined";
+
+  } else if(!(format = find_ktx2_format(h.vkFormat))) {
+    snprintf(message, sizeof(message), "vkFormat %u is not supported",
+      h.vkFormat);
+    error = message;
+
+  } else {
+    for(int level = 0; level < levels(); ++level) {
+      const ktx2_level_t& index = level_index(level);
+      size_t expected = level_size(level);
+      if(index.byteOffset > size ||
+        index.byteLength > size - index.byteOffset)
+        error = "a level is out of bounds";
+      else if(is_supercompressed() ?
+        expected != index.uncompressedByteLength :
+        expected != index.byteLength)
+        error = "a level size does not match the format";
+
+      if(error)
+        break;
+    }
+  }
+
+  if(error) {
+    fprintf(stderr, "%s: %s\n", path2, error);
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+inline void ktx2_file_t::close() {
+  if(data)
+    munmap((void*)data, size);
+  data = nullptr;
+  size = 0;
+  format = nullptr;
+}
+
+inline bool ktx2_file_t::decode_level(int level, void* dest) const {
+  const ktx2_level_t& index = level_index(level);
+  size_t expected = level_size(level);
+  const char* src = stored_level(level);
+
+  switch(header().supercompressionScheme) {
+    case ktx2_scheme_none:
+      memcpy(dest, src, expected);
+      return true;
+
+    case ktx2_scheme_zstd: {
+      size_t result = ZSTD_decompress(dest, expected, src, index.byteLength);
+      if(ZSTD_isError(result) || expected != result) {
+        fprintf(stderr, "%s: level %d: %s\n", path.c_str(), level,
+          ZSTD_isError(result) ? ZSTD_getErrorName(result) :
+            "the inflated size is wrong");
+        return false;
+      }
+      return true;
+    }
+
+    case ktx2_scheme_zlib: {
+      uLongf length = expected;
+      int result = uncompress((Bytef*)dest, &length, (const Bytef*)src,
+        index.byteLength);
+      if(Z_OK != result || expected != length) {
+        fprintf(stderr, "%s: level %d: zlib error %d\n", path.c_str(), level,
+          result);
+        return false;
+      }
+      return true;
+    }
+
+    default:
+      return false;
+  }
+}
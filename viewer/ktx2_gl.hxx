@@ -0,0 +1,310 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "ktx2.hxx"
+#include "block_pool.hxx"
+
+////////////////////////////////////////////////////////////////////////////////
+// Streaming KTX2 textures into GL.
+//
+// ktx2_loader_t creates each texture's storage up front, inflates the
+// supercompressed levels on its own pool, and uploads a bounded number of
+// bytes per frame from the smallest level to the largest. Each texture's
+// GL_TEXTURE_BASE_LEVEL follows its finest resident level, so the texture
+// can be sampled as soon as its smallest level lands. Levels stored without
+// supercompression are uploaded straight from the mapping.
+
+// The S3TC enums are from EXT_texture_compression_s3tc and
+// EXT_texture_sRGB, which aren't in the core headers.
+enum : GLenum {
+  ktx2_gl_rgb_s3tc_dxt1 = 0x83F0,
+  ktx2_gl_rgba_s3tc_dxt1 = 0x83F1,
+  ktx2_gl_rgba_s3tc_dxt3 = 0x83F2,
+  ktx2_gl_rgba_s3tc_dxt5 = 0x83F3,
+  ktx2_gl_srgb_s3tc_dxt1 = 0x8C4C,
+  ktx2_gl_srgb_alpha_s3tc_dxt1 = 0x8C4D,
+  ktx2_gl_srgb_alpha_s3tc_dxt3 = 0x8C4E,
+  ktx2_gl_srgb_alpha_s3tc_dxt5 = 0x8C4F,
+};
+
+// Compressed formats have a type of GL_NONE.
+struct ktx2_gl_format_t {
+  uint32_t vk_format;
+  GLenum internal_format;
+  GLenum format;
+  GLenum type;
+};
+
+const ktx2_gl_format_t ktx2_gl_formats[] {
+  {   9, GL_R8,             GL_RED,  GL_UNSIGNED_BYTE },
+  {  16, GL_RG8,            GL_RG,   GL_UNSIGNED_BYTE },
+  {  37, GL_RGBA8,          GL_RGBA, GL_UNSIGNED_BYTE },
+  {  43, GL_SRGB8_ALPHA8,   GL_RGBA, GL_UNSIGNED_BYTE },
+  {  44, GL_RGBA8,          GL_BGRA, GL_UNSIGNED_BYTE },
+  {  50, GL_SRGB8_ALPHA8,   GL_BGRA, GL_UNSIGNED_BYTE },
+  {  70, GL_R16,            GL_RED,  GL_UNSIGNED_SHORT },
+  {  76, GL_R16F,           GL_RED,  GL_HALF_FLOAT },
+  {  77, GL_RG16,           GL_RG,   GL_UNSIGNED_SHORT },
+  {  83, GL_RG16F,          GL_RG,   GL_HALF_FLOAT },
+  {  90, GL_RGB16F,         GL_RGB,  GL_HALF_FLOAT },
+  {  91, GL_RGBA16,         GL_RGBA, GL_UNSIGNED_SHORT },
+  {  97, GL_RGBA16F,        GL_RGBA, GL_HALF_FLOAT },
+  { 100, GL_R32F,           GL_RED,  GL_FLOAT },
+  { 103, GL_RG32F,          GL_RG,   GL_FLOAT },
+  { 106, GL_RGB32F,         GL_RGB,  GL_FLOAT },
+  { 109, GL_RGBA32F,        GL_RGBA, GL_FLOAT },
+  { 122, GL_R11F_G11F_B10F, GL_RGB,  GL_UNSIGNED_INT_10F_11F_11F_REV },
+  { 123, GL_RGB9_E5,        GL_RGB,  GL_UNSIGNED_INT_5_9_9_9_REV },
+  { 131, ktx2_gl_rgb_s3tc_dxt1 },
+  { 132, ktx2_gl_srgb_s3tc_dxt1 },
+  { 133, ktx2_gl_rgba_s3tc_dxt1 },
+  { 134, ktx2_gl_srgb_alpha_s3tc_dxt1 },
+  { 135, ktx2_gl_rgba_s3tc_dxt3 },
+  { 136, ktx2_gl_srgb_alpha_s3tc_dxt3 },
+  { 137, ktx2_gl_rgba_s3tc_dxt5 },
+  { 138, ktx2_gl_srgb_alpha_s3tc_dxt5 },
+  { 139, GL_COMPRESSED_RED_RGTC1 },
+  { 140, GL_COMPRESSED_SIGNED_RED_RGTC1 },
+  { 141, GL_COMPRESSED_RG_RGTC2 },
+  { 142, GL_COMPRESSED_SIGNED_RG_RGTC2 },
+  { 143, GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT },
+  { 144, GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT },
+  { 145, GL_COMPRESSED_RGBA_BPTC_UNORM },
+  { 146, GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM },
+};
+
+inline const ktx2_gl_format_t* find_ktx2_gl_format(uint32_t vk_format) {
+  for(const ktx2_gl_format_t& format : ktx2_gl_formats) {
+    if(vk_format == format.vk_format)
+      return &format;
+  }
+  return nullptr;
+}
+
+struct ktx2_loader_t {
+  ktx2_loader_t(int num_threads) : pool(num_threads) { }
+  ~ktx2_loader_t() {
+    // The workers write into levels, which is destroyed before pool.
+    pool.cancel();
+    pool.wait();
+  }
+
+  // Map the file and create its texture. Returns 0 and prints the reason on
+  // failure. No levels are resident until update.
+  GLuint load(const char* path);
+
+  // Start inflating the supercompressed levels of every loaded file.
+  void start();
+
+  // Upload the ready levels smallest first, up to budget bytes. At least one
+  // level is uploaded when one is ready. Returns true when every level is
+  // resident.
+  bool update(size_t budget);
+
+private:
+  struct level_t {
+    int texture;
+    int level;
+    size_t size;
+
+    // Supercompressed levels are inflated here.
+    std::vector<char> decoded;
+    std::atomic<bool> ready;
+  };
+
+  struct texture_t {
+    std::unique_ptr<ktx2_file_t> file;
+    const ktx2_gl_format_t* format;
+    GLuint texture;
+    GLenum target;
+
+    // The next level to upload, counting down to 0.
+    int next;
+    std::vector<level_t*> levels;
+  };
+
+  void upload(texture_t& tex, int level, const char* data);
+
+  block_pool_t pool;
+  std::vector<texture_t> textures;
+  std::vector<std::unique_ptr<level_t>> levels;
+
+  std::chrono::steady_clock::time_point start_time;
+  size_t uploaded = 0;
+  bool complete = false;
+};
+
+inline GLuint ktx2_loader_t::load(const char* path) {
+  auto file = std::make_unique<ktx2_file_t>();
+  if(!file->open(path))
+    return 0;
+
+  const ktx2_gl_format_t* format = find_ktx2_gl_format(
+    file->header().vkFormat);
+  if(!format) {
+    fprintf(stderr, "%s: %s has no GL format\n", path, file->format->name);
+    return 0;
+  }
+
+  if(file->generate_mips() && GL_NONE == format->type) {
+    fprintf(stderr, "%s: cannot generate mips for %s\n", path,
+      file->format->name);
+    return 0;
+  }
+
+  texture_t tex { };
+  tex.format = format;
+  tex.target = file->is_cube() ?
+    (file->is_array() ? GL_TEXTURE_CUBE_MAP_ARRAY : GL_TEXTURE_CUBE_MAP) :
+    (file->is_array() ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D);
+
+  // Allocate the whole chain when the mips are generated from level 0.
+  int width = file->width(0);
+  int height = file->height(0);
+  int storage_levels = file->levels();
+  if(file->generate_mips()) {
+    while((width | height) >> storage_levels)
+      ++storage_levels;
+  }
+
+  glCreateTextures(tex.target, 1, &tex.texture);
+  if(GL_TEXTURE_2D == tex.target || GL_TEXTURE_CUBE_MAP == tex.target)
+    glTextureStorage2D(tex.texture, storage_levels, format->internal_format,
+      width, height);
+  else
+    glTextureStorage3D(tex.texture, storage_levels, format->internal_format,
+      width, height, file->layers() * file->faces());
+
+  glTextureParameteri(tex.texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTextureParameteri(tex.texture, GL_TEXTURE_MIN_FILTER,
+    GL_LINEAR_MIPMAP_LINEAR);
+  glTextureParameteri(tex.texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTextureParameteri(tex.texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  tex.next = file->levels() - 1;
+  for(int level = 0; level < file->levels(); ++level) {
+    auto l = std::make_unique<level_t>();
+    l->texture = textures.size();
+    l->level = level;
+    l->size = file->level_size(level);
+    l->ready = !file->is_supercompressed();
+    tex.levels.push_back(l.get());
+    levels.push_back(std::move(l));
+  }
+
+  tex.file = std::move(file);
+  textures.push_back(std::move(tex));
+  complete = false;
+  return textures.back().texture;
+}
+
+inline void ktx2_loader_t::start() {
+  start_time = std::chrono::steady_clock::now();
+
+  // Order the levels by size. Each worker starts on its own run of the list
+  // and works towards larger levels, so the smallest levels are inflated
+  // first and the largest ones are split among the thieves.
+  std::vector<int> items;
+  for(int i = 0; i < levels.size(); ++i) {
+    if(!levels[i]->ready)
+      items.push_back(i);
+  }
+  std::stable_sort(items.begin(), items.end(), [&](int a, int b) {
+    return levels[a]->size < levels[b]->size;
+  });
+
+  pool.execute(items, 1, [this](int tid, int level2, int item) {
+    level_t& l = *levels[item];
+    const ktx2_file_t& file = *textures[l.texture].file;
+    l.decoded.resize(l.size);
+    if(!file.decode_level(l.level, l.decoded.data())) {
+      // Upload zeros rather than stall the texture.
+      std::fill(l.decoded.begin(), l.decoded.end(), 0);
+    }
+    l.ready = true;
+    return true;
+  });
+}
+
+inline void ktx2_loader_t::upload(texture_t& tex, int level,
+  const char* data) {
+
+  const ktx2_file_t& file = *tex.file;
+  int width = file.width(level);
+  int height = file.height(level);
+  int depth = file.layers() * file.faces();
+  size_t size = file.level_size(level);
+  GLenum internal_format = tex.format->internal_format;
+
+  // KTX2 rows are tightly packed.
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  if(GL_TEXTURE_2D == tex.target) {
+    if(GL_NONE == tex.format->type)
+      glCompressedTextureSubImage2D(tex.texture, level, 0, 0, width, height,
+        internal_format, size, data);
+    else
+      glTextureSubImage2D(tex.texture, level, 0, 0, width, height,
+        tex.format->format, tex.format->type, data);
+
+  } else {
+    // Cube map faces and array layers are both slices in z.
+    if(GL_NONE == tex.format->type)
+      glCompressedTextureSubImage3D(tex.texture, level, 0, 0, 0, width,
+        height, depth, internal_format, size, data);
+    else
+      glTextureSubImage3D(tex.texture, level, 0, 0, 0, width, height, depth,
+        tex.format->format, tex.format->type, data);
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+  glTextureParameteri(tex.texture, GL_TEXTURE_BASE_LEVEL, level);
+  if(!level && file.generate_mips())
+    glGenerateTextureMipmap(tex.texture);
+}
+
+inline bool ktx2_loader_t::update(size_t budget) {
+  if(complete)
+    return true;
+
+  size_t bytes = 0;
+  while(true) {
+    // Upload the smallest ready level of any texture.
+    texture_t* best = nullptr;
+    bool pending = false;
+    for(texture_t& tex : textures) {
+      if(tex.next < 0)
+        continue;
+      pending = true;
+
+      level_t* l = tex.levels[tex.next];
+      if(l->ready && (!best || l->size < best->levels[best->next]->size))
+        best = &tex;
+    }
+
+    if(!pending) {
+      complete = true;
+      printf("Streamed %d KTX2 textures (%.1f MB) after %.1f ms\n",
+        (int)textures.size(), uploaded / 1.0e6,
+        std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - start_time).count());
+      return true;
+    }
+
+    if(!best)
+      return false;
+
+    level_t* l = best->levels[best->next];
+    if(bytes && bytes + l->size > budget)
+      return false;
+
+    upload(*best, l->level, l->decoded.size() ? l->decoded.data() :
+      best->file->stored_level(l->level));
+    l->decoded = std::vector<char>();
+    bytes += l->size;
+    uploaded += l->size;
+    --best->next;
+  }
+}
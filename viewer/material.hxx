@@ -0,0 +1,217 @@
+#pragma once
+
+// glTF materials. material_uniform_t is the UBO layout the shaders read,
+// and material_t is also stored as-is in baked models.
+
+// PBR metallic roughness
+struct pbrMetallicRoughness_t {
+  // baseColorTexture
+  // metallicRoughnessTexture
+  vec4 baseColorFactor;
+  float metallicFactor;
+  float roughnessFactor;
+  float padding0, padding1;
+};
+
+// KHR_materials_pbrSpecularGlossiness
+struct KHR_materials_pbrSpecularGlossiness_t {
+  // diffuseTexture
+  // specularGlossinessTexture
+  vec4 diffuseFactor;
+  vec3 specularFactor;
+  float glossinessFactor;
+};
+
+// KHR_materials_clearcoat
+struct KHR_materials_clearcoat_t {
+  // clearcoatTexture
+  // clearcoatRoughnessTexture
+  // clearcoatNormalTexture
+  float clearcoatFactor;
+  float clearcoatRoughnessFactor;
+  float padding0, padding1;
+};
+
+// KHR_materials_transmission 
+struct KHR_materials_transmission_t {
+  // transmissionTexture
+  float transmissionFactor;
+  float ior;
+  float padding0, padding1;
+};
+
+struct material_uniform_t {
+  // Textures:
+  // normalTexture
+  // occlusionTexture
+  // emissiveTexture
+  vec3 emissiveFactor;
+  float alphaCutoff;
+
+  // Material models
+  pbrMetallicRoughness_t pbrMetallicRoughness;
+  KHR_materials_pbrSpecularGlossiness_t pbrSpecularGlossiness;
+  KHR_materials_clearcoat_t clearcoat;
+  KHR_materials_transmission_t transmission;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct texture_view_t {
+  // Index of the texture in the gltf stream.
+  int index = -1;
+
+  // Index of the TEXCOORD_n in the vertex attribute stream. 
+  int texcoord = 0;
+
+  // The scalar multiplied applied to each normal vector of the normal
+  // texture.
+  // Also strength for occlusionTextureInfo.
+  float scale = 1.f;
+
+  explicit operator bool() const noexcept { return -1 != index; }
+};
+
+struct material_textures_t {
+  // Core:
+  texture_view_t normal;
+  texture_view_t occlusion;
+  texture_view_t emissive;
+
+  // pbrMetallicRoughness
+  texture_view_t baseColor;
+  texture_view_t metallicRoughness;
+
+  // KHR_materials_pbrSpecularGlossiness
+  texture_view_t diffuse;
+  texture_view_t specularGlossiness;
+
+  // KHR_materials_clearcoat
+  texture_view_t clearcoat;
+  texture_view_t clearcoatRoughness;
+  texture_view_t clearcoatNormal;
+
+  // KHR_materials_transmission
+  texture_view_t transmission;
+};
+
+struct material_t {
+  bool has_pbr_metallic_roughness;
+  bool has_pbr_specular_glossiness;
+  bool has_clearcoat;
+  bool has_transmission;
+
+  material_uniform_t uniform;
+  material_textures_t textures;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Read materials from a glTF. Include cgltf first.
+
+inline texture_view_t load_texture_view(const cgltf_data* data,
+  const cgltf_texture_view& view) {
+  texture_view_t view2;
+  if(view.texture)
+    view2.index = view.texture - data->textures;
+  view2.texcoord = view.texcoord;
+  view2.scale = view.scale;
+  return view2;
+}
+
+inline material_t load_material(const cgltf_data* data,
+  const cgltf_material* material) {
+  material_t material2 { };
+
+  // Core terms.
+  material2.uniform.emissiveFactor = vec3(
+    material->emissive_factor[0],
+    material->emissive_factor[1],
+    material->emissive_factor[2]
+  );
+  material2.uniform.alphaCutoff = material->alpha_cutoff;
+
+  material2.textures.normal = load_texture_view(data,
+    material->normal_texture);
+  material2.textures.occlusion = load_texture_view(data,
+    material->occlusion_texture);
+  material2.textures.emissive = load_texture_view(data,
+    material->emissive_texture);
+
+  if(material->has_pbr_metallic_roughness) {
+    material2.has_pbr_metallic_roughness = true;
+
+    material2.uniform.pbrMetallicRoughness.baseColorFactor = vec4(
+      material->pbr_metallic_roughness.base_color_factor[0],
+      material->pbr_metallic_roughness.base_color_factor[1],
+      material->pbr_metallic_roughness.base_color_factor[2],
+      material->pbr_metallic_roughness.base_color_factor[3]
+    );
+    material2.uniform.pbrMetallicRoughness.metallicFactor = 
+      material->pbr_metallic_roughness.metallic_factor;
+    material2.uniform.pbrMetallicRoughness.roughnessFactor = 
+      material->pbr_metallic_roughness.roughness_factor;
+
+    material2.textures.baseColor = load_texture_view(data,
+      material->pbr_metallic_roughness.base_color_texture);
+    material2.textures.metallicRoughness = load_texture_view(data,
+      material->pbr_metallic_roughness.metallic_roughness_texture
+    );
+  }
+
+  if(material->has_pbr_specular_glossiness) {
+    material2.has_pbr_specular_glossiness = true;
+
+    material2.uniform.pbrSpecularGlossiness.diffuseFactor = vec4(
+      material->pbr_specular_glossiness.diffuse_factor[0],
+      material->pbr_specular_glossiness.diffuse_factor[1],
+      material->pbr_specular_glossiness.diffuse_factor[2],
+      material->pbr_specular_glossiness.diffuse_factor[3]
+    );
+    material2.uniform.pbrSpecularGlossiness.specularFactor = vec3(
+      material->pbr_specular_glossiness.specular_factor[0],
+      material->pbr_specular_glossiness.specular_factor[1],
+      material->pbr_specular_glossiness.specular_factor[2]
+    );
+    material2.uniform.pbrSpecularGlossiness.glossinessFactor = 
+      material->pbr_specular_glossiness.glossiness_factor;
+
+    material2.textures.diffuse = load_texture_view(data,
+      material->pbr_specular_glossiness.diffuse_texture
+    );
+    material2.textures.specularGlossiness = load_texture_view(data,
+      material->pbr_specular_glossiness.specular_glossiness_texture
+    );
+  }
+
+  if(material->has_clearcoat) {
+    material2.has_clearcoat = true;
+
+    material2.uniform.clearcoat.clearcoatFactor = 
+      material->clearcoat.clearcoat_factor;
+    material2.uniform.clearcoat.clearcoatRoughnessFactor = 
+      material->clearcoat.clearcoat_roughness_factor;
+
+    material2.textures.clearcoat = load_texture_view(data,
+      material->clearcoat.clearcoat_texture
+    );
+    material2.textures.clearcoatRoughness = load_texture_view(data,
+      material->clearcoat.clearcoat_roughness_texture
+    );
+    material2.textures.clearcoatNormal = load_texture_view(data,
+      material->clearcoat.clearcoat_normal_texture
+    );
+  }
+
+  if(material->has_transmission) {
+    material2.has_transmission = true;
+
+    material2.uniform.transmission.transmissionFactor = 
+      material->transmission.transmission_factor;
+
+    material2.textures.transmission = load_texture_view(data,
+      material->transmission.transmission_texture
+    );
+  }
+
+  return material2;
+}
@@ -0,0 +1,300 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+////////////////////////////////////////////////////////////////////////////////
+// Triangle list optimization.
+//
+// Three passes over an indexed triangle list, run in this order:
+//
+//  1. optimize_vertex_cache reorders triangles with Tipsify (Sander, Nehab
+//     and Barczak 2007), which fans around each vertex while its neighbors
+//     are still in a FIFO post-transform cache. It returns the points where
+//     it had to jump to a cold part of the mesh.
+//  2. optimize_overdraw splits the order into clusters at those jumps and at
+//     points where a restart costs little cache efficiency, then draws the
+//     clusters that face out from the mesh center first, so they tend to
+//     occlude the rest.
+//  3. optimize_vertex_fetch renumbers the vertices in order of first use,
+//     so the vertex fetches walk memory forward.
+//
+// analyze_vertex_cache simulates the FIFO cache, so the passes can be
+// measured without a GPU.
+
+struct vertex_cache_stats_t {
+  size_t triangles = 0;
+  size_t vertices = 0;      // Distinct vertices referenced.
+  size_t misses = 0;
+
+  // Average cache miss ratio: transforms per triangle, from 0.5 to 3.
+  float acmr() const { return triangles ? (float)misses / triangles : 0; }
+
+  // Average transform to vertex ratio: 1 is ideal.
+  float atvr() const { return vertices ? (float)misses / vertices : 0; }
+};
+
+inline vertex_cache_stats_t analyze_vertex_cache(
+  const std::vector<uint32_t>& indices, size_t vertex_count,
+  int cache_size = 16) {
+
+  vertex_cache_stats_t stats;
+  stats.triangles = indices.size() / 3;
+
+  // A vertex is cached when fewer than cache_size misses have happened
+  // since its own.
+  std::vector<size_t> stamps(vertex_count, 0);
+  std::vector<char> seen(vertex_count, 0);
+  size_t time = cache_size + 1;
+  for(uint32_t v : indices) {
+    if(time - stamps[v] > cache_size) {
+      stamps[v] = time++;
+      ++stats.misses;
+    }
+    if(!seen[v]) {
+      seen[v] = 1;
+      ++stats.vertices;
+    }
+  }
+  return stats;
+}
+
+// Reorder the triangles for a FIFO cache of cache_size vertices. Returns the
+// triangle index at the start of each run that begins on a cold cache.
+inline std::vector<uint32_t> optimize_vertex_cache(
+  std::vector<uint32_t>& indices, size_t vertex_count, int cache_size = 16) {
+
+  size_t num_tris = indices.size() / 3;
+
+  // The triangles around each vertex, and how many are left to emit.
+  std::vector<uint32_t> offsets(vertex_count + 1, 0);
+  for(uint32_t v : indices)
+    ++offsets[v + 1];
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  std::vector<uint32_t> live(vertex_count);
+  for(size_t v = 0; v < vertex_count; ++v)
+    live[v] = offsets[v + 1] - offsets[v];
+
+  std::vector<uint32_t> adjacency(indices.size());
+  {
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for(size_t i = 0; i < indices.size(); ++i)
+      adjacency[fill[indices[i]]++] = i / 3;
+  }
+
+  std::vector<size_t> stamps(vertex_count, 0);
+  std::vector<char> emitted(num_tris, 0);
+  std::vector<uint32_t> dead_end;
+  std::vector<uint32_t> candidates;
+  std::vector<uint32_t> output;
+  std::vector<uint32_t> cold_starts;
+  output.reserve(indices.size());
+
+  size_t time = cache_size + 1;
+  size_t cursor = 0;
+  int64_t fan = vertex_count ? 0 : -1;
+  bool cold = true;
+  while(fan >= 0) {
+    candidates.clear();
+    for(uint32_t i = offsets[fan]; i < offsets[fan + 1]; ++i) {
+      uint32_t t = adjacency[i];
+      if(emitted[t])
+        continue;
+
+      if(cold) {
+        cold_starts.push_back(output.size() / 3);
+        cold = false;
+      }
+
+      for(int k = 0; k < 3; ++k) {
+        uint32_t v = indices[3 * t + k];
+        output.push_back(v);
+        dead_end.push_back(v);
+        candidates.push_back(v);
+        --live[v];
+        if(time - stamps[v] > cache_size)
+          stamps[v] = time++;
+      }
+      emitted[t] = 1;
+    }
+
+    // Fan next around the candidate that will still be cached after its
+    // remaining triangles are emitted, preferring the oldest.
+    fan = -1;
+    int64_t best = -1;
+    for(uint32_t v : candidates) {
+      if(!live[v])
+        continue;
+      int64_t age = time - stamps[v];
+      int64_t priority = age + 2 * live[v] <= cache_size ? age : 0;
+      if(priority > best) {
+        best = priority;
+        fan = v;
+      }
+    }
+
+    if(-1 == fan) {
+      // Dead end. Back up through recently used vertices, then scan
+      // forward through the input.
+      while(dead_end.size() && -1 == fan) {
+        uint32_t v = dead_end.back();
+        dead_end.pop_back();
+        if(live[v])
+          fan = v;
+      }
+      while(-1 == fan && cursor < vertex_count) {
+        if(live[cursor])
+          fan = cursor;
+        ++cursor;
+      }
+
+      // The next run starts cold unless the fan vertex is still cached.
+      cold = -1 == fan || time - stamps[fan] > cache_size;
+    }
+  }
+
+  indices.swap(output);
+  return cold_starts;
+}
+
+// Sort clusters of triangles so those most likely to occlude the others
+// come first. center is the middle of the primitive's bounds. positions
+// holds vertex v at positions + stride * v. Clusters start at the cold
+// starts from optimize_vertex_cache, and are split further where restarting
+// on a cold cache keeps the ACMR within threshold of the cluster's.
+inline void optimize_overdraw(std::vector<uint32_t>& indices,
+  const char* positions, size_t stride, const float center[3],
+  const std::vector<uint32_t>& cold_starts, size_t vertex_count,
+  float threshold = 1.05f, int cache_size = 16) {
+
+  size_t num_tris = indices.size() / 3;
+  if(num_tris < 2)
+    return;
+
+  auto position = [&](uint32_t v, float p[3]) {
+    memcpy(p, positions + stride * v, 3 * sizeof(float));
+  };
+
+  // Split the hard clusters at soft boundaries.
+  std::vector<size_t> starts;
+  std::vector<size_t> hard(cold_starts.begin(), cold_starts.end());
+  if(hard.empty() || hard[0])
+    hard.insert(hard.begin(), 0);
+  hard.push_back(num_tris);
+
+  std::vector<size_t> stamps(vertex_count, 0);
+  size_t time = cache_size + 1;
+  for(size_t c = 0; c + 1 < hard.size(); ++c) {
+    size_t begin = hard[c], end = hard[c + 1];
+
+    // The cluster's own miss ratio from a cold cache.
+    time += cache_size + 1;
+    size_t misses = 0;
+    for(size_t i = 3 * begin; i < 3 * end; ++i) {
+      uint32_t v = indices[i];
+      if(time - stamps[v] > cache_size) {
+        stamps[v] = time++;
+        ++misses;
+      }
+    }
+    float target = threshold * misses / (end - begin);
+
+    starts.push_back(begin);
+    time += cache_size + 1;
+    misses = 0;
+    for(size_t t = begin; t < end; ++t) {
+      for(int k = 0; k < 3; ++k) {
+        uint32_t v = indices[3 * t + k];
+        if(time - stamps[v] > cache_size) {
+          stamps[v] = time++;
+          ++misses;
+        }
+      }
+
+      // Restart here if the run so far paid for its cold start.
+      size_t run = t + 1 - starts.back();
+      if(t + 1 < end && run > 1 && misses <= target * run) {
+        starts.push_back(t + 1);
+        time += cache_size + 1;
+        misses = 0;
+      }
+    }
+  }
+  starts.push_back(num_tris);
+
+  // Score each cluster by how far its area-weighted centroid lies along its
+  // area-weighted normal from the center.
+  size_t num_clusters = starts.size() - 1;
+  std::vector<float> scores(num_clusters);
+  for(size_t c = 0; c < num_clusters; ++c) {
+    double centroid[3] { }, normal[3] { }, area = 0;
+    for(size_t t = starts[c]; t < starts[c + 1]; ++t) {
+      float a[3], b[3], d[3];
+      position(indices[3 * t + 0], a);
+      position(indices[3 * t + 1], b);
+      position(indices[3 * t + 2], d);
+
+      float e1[3] { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+      float e2[3] { d[0] - a[0], d[1] - a[1], d[2] - a[2] };
+      float n[3] {
+        e1[1] * e2[2] - e1[2] * e2[1],
+        e1[2] * e2[0] - e1[0] * e2[2],
+        e1[0] * e2[1] - e1[1] * e2[0],
+      };
+      float twice_area = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+      for(int i = 0; i < 3; ++i) {
+        centroid[i] += twice_area * (a[i] + b[i] + d[i]) / 3;
+        normal[i] += n[i];
+      }
+      area += twice_area;
+    }
+
+    double len = sqrt(normal[0] * normal[0] + normal[1] * normal[1] +
+      normal[2] * normal[2]);
+    float score = 0;
+    if(area > 0 && len > 0) {
+      for(int i = 0; i < 3; ++i)
+        score += (centroid[i] / area - center[i]) * normal[i] / len;
+    }
+    scores[c] = score;
+  }
+
+  std::vector<uint32_t> order(num_clusters);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return scores[a] > scores[b];
+  });
+
+  std::vector<uint32_t> output;
+  output.reserve(indices.size());
+  for(uint32_t c : order)
+    output.insert(output.end(), indices.begin() + 3 * starts[c],
+      indices.begin() + 3 * starts[c + 1]);
+  indices.swap(output);
+}
+
+// Renumber the vertices in order of first use and move their data to
+// match. Unreferenced vertices are dropped. Returns the new vertex count.
+inline size_t optimize_vertex_fetch(std::vector<uint32_t>& indices,
+  std::vector<char>& vertices, size_t stride) {
+
+  size_t vertex_count = vertices.size() / stride;
+  std::vector<uint32_t> remap(vertex_count, UINT32_MAX);
+  std::vector<char> output(vertices.size());
+  uint32_t next = 0;
+  for(uint32_t& v : indices) {
+    if(UINT32_MAX == remap[v]) {
+      memcpy(output.data() + stride * next, vertices.data() + stride * v,
+        stride);
+      remap[v] = next++;
+    }
+    v = remap[v];
+  }
+
+  output.resize(stride * next);
+  vertices.swap(output);
+  return next;
+}
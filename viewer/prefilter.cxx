@@ -0,0 +1,871 @@
+// Prefilter an equirectangular HDR into the image-based lighting maps the
+// viewer reads. This needs no GPU or OpenGL.
+//
+//   prefilter [options] env.hdr out_dir
+//
+// writes
+//   out_dir/ggx/specular.ktx2         GGX radiance, roughness by mip level
+//   out_dir/lambertian/diffuse.ktx2   Irradiance over pi
+//   out_dir/charlie/sheen.ktx2        Charlie radiance, roughness by level
+//   out_dir/lut_ggx.ktx2              GGX scale and bias in .rg
+//   out_dir/lut_charlie.ktx2          Charlie albedo in .b
+//
+// The cube maps are filtered with importance sampling. Each sample reads the
+// source cube at a mip level that matches its solid angle, so a few hundred
+// samples per texel don't alias. The irradiance comes from the 9 spherical
+// harmonics coefficients of the source unless --sampled is given.
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_HDR
+#include "../thirdparty/stb/stb_image.h"
+
+#include <vector>
+#include <string>
+#include <numeric>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <sys/stat.h>
+#include "brdf.hxx"
+#include "simd.hxx"
+#include "block_pool.hxx"
+#include "ktx2.hxx"
+
+struct options_t {
+  int size = 256;
+  int lambertian_size = 64;
+  int lut_size = 256;
+  int samples = 1024;
+  int lut_samples = 512;
+  int num_threads = std::thread::hardware_concurrency();
+
+  // Integrate the irradiance with cosine-weighted samples instead of SH9.
+  bool sampled = false;
+
+  const char* input = nullptr;
+  const char* output = nullptr;
+};
+
+inline void print_usage() {
+  printf(
+    "usage: prefilter [options] env.hdr out_dir\n"
+    "  -n, --size N        GGX and Charlie cube map size (256)\n"
+    "  --lambertian N      Lambertian cube map size (64)\n"
+    "  --lut N             BRDF LUT size (256)\n"
+    "  -s, --samples N     samples per cube map texel (1024)\n"
+    "  --lut-samples N     samples per LUT texel (512)\n"
+    "  -j, --threads N     worker threads (all cores)\n"
+    "  --sampled           sample the irradiance instead of using SH9\n"
+  );
+}
+
+// Return 0 to run, 1 on error, and -1 to exit cleanly.
+inline int parse_options(int argc, char** argv, options_t& options) {
+  for(int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    auto is = [&](const char* a, const char* b = nullptr) {
+      return !strcmp(arg, a) || (b && !strcmp(arg, b));
+    };
+
+    if(is("-h", "--help")) {
+      print_usage();
+      return -1;
+    }
+
+    if(is("--sampled")) {
+      options.sampled = true;
+      continue;
+    }
+
+    if('-' != arg[0]) {
+      if(!options.input)
+        options.input = arg;
+      else if(!options.output)
+        options.output = arg;
+      else {
+        fprintf(stderr, "unexpected argument %s\n", arg);
+        return 1;
+      }
+      continue;
+    }
+
+    if(i + 1 == argc) {
+      fprintf(stderr, "missing value for %s\n", arg);
+      return 1;
+    }
+    const char* value = argv[++i];
+
+    if(is("-n", "--size"))
+      options.size = atoi(value);
+    else if(is("--lambertian"))
+      options.lambertian_size = atoi(value);
+    else if(is("--lut"))
+      options.lut_size = atoi(value);
+    else if(is("-s", "--samples"))
+      options.samples = atoi(value);
+    else if(is("--lut-samples"))
+      options.lut_samples = atoi(value);
+    else if(is("-j", "--threads"))
+      options.num_threads = atoi(value);
+    else {
+      fprintf(stderr, "unknown option %s\n", arg);
+      return 1;
+    }
+  }
+
+  if(!options.input || !options.output) {
+    fprintf(stderr, "missing input or output\n");
+    return 1;
+  }
+
+  if(options.size <= 0 || (options.size & (options.size - 1)) ||
+    options.lambertian_size <= 0 || options.lut_size <= 0) {
+    fprintf(stderr, "sizes must be positive and the cube size a power of 2\n");
+    return 1;
+  }
+
+  if(options.samples <= 0 || options.lut_samples <= 0 ||
+    options.num_threads <= 0) {
+    fprintf(stderr, "invalid samples or threads\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+// Run func(item) for items [0, count) on the pool and wait.
+template<typename func_t>
+void parallel_for(block_pool_t& pool, int count, func_t func) {
+  std::vector<int> items(count);
+  std::iota(items.begin(), items.end(), 0);
+  pool.execute(items, 1, [&](int tid, int level, int item) {
+    func(tid, item);
+    return true;
+  });
+  pool.wait();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Cube maps.
+
+// The direction through (u, v) in [-1, 1] on a face, in GL face order
+// +X, -X, +Y, -Y, +Z, -Z. v increases down the face, as t does in GL.
+inline vec3 face_direction(int face, float u, float v) {
+  switch(face) {
+    case 0:  return vec3( 1, -v, -u);
+    case 1:  return vec3(-1, -v,  u);
+    case 2:  return vec3( u,  1,  v);
+    case 3:  return vec3( u, -1, -v);
+    case 4:  return vec3( u, -v,  1);
+    default: return vec3(-u, -v, -1);
+  }
+}
+
+// The face each direction hits and its texture coordinates in [0, 1] on
+// that face. This inverts face_direction a packet at a time.
+inline void direction_face(pvec3 d, pint& face, pfloat& s, pfloat& t) {
+  pfloat ax = abs(d.x), ay = abs(d.y), az = abs(d.z);
+  pmask x_major = (ax >= ay) & (ax >= az);
+  pmask y_major = ~x_major & (ay >= az);
+
+  pmask x_pos = d.x > 0.f;
+  pmask y_pos = d.y > 0.f;
+  pmask z_pos = d.z > 0.f;
+
+  face = select(x_major, select(x_pos, pint(0), pint(1)),
+    select(y_major, select(y_pos, pint(2), pint(3)),
+      select(z_pos, pint(4), pint(5))));
+
+  pfloat ma = select(x_major, ax, select(y_major, ay, az));
+  pfloat sc = select(x_major, select(x_pos, 0.f - d.z, d.z),
+    select(z_pos | y_major, d.x, 0.f - d.x));
+  pfloat tc = select(y_major, select(y_pos, d.z, 0.f - d.z), 0.f - d.y);
+
+  pfloat inv = 1.f / ma;
+  s = .5f * (sc * inv + 1.f);
+  t = .5f * (tc * inv + 1.f);
+}
+
+// An RGB cube map and its mip chain. The faces of a level are stored one
+// after another.
+struct cube_map_t {
+  cube_map_t(int size, int levels);
+
+  int level_size(int level) const { return std::max(1, size >> level); }
+  size_t face_texels(int level) const {
+    return (size_t)level_size(level) * level_size(level);
+  }
+
+  vec3* face(int level, int f) {
+    return texels.data() + offsets[level] + f * face_texels(level);
+  }
+  const vec3* face(int level, int f) const {
+    return texels.data() + offsets[level] + f * face_texels(level);
+  }
+
+  // Bilinear inside one face, clamped to its edges. Trilinear between the
+  // two nearest levels.
+  vec3 sample_face(int level, int f, float s, float t) const;
+  vec3 sample(int f, float s, float t, float lod) const;
+
+  // Fill each level after the first with 2x2 averages of the one above.
+  void build_mips(block_pool_t& pool);
+
+  int size, levels;
+  std::vector<size_t> offsets;
+  std::vector<vec3> texels;
+};
+
+cube_map_t::cube_map_t(int size, int levels) : size(size), levels(levels) {
+  size_t count = 0;
+  for(int level = 0; level < levels; ++level) {
+    offsets.push_back(count);
+    count += 6 * face_texels(level);
+  }
+  texels.resize(count);
+}
+
+vec3 cube_map_t::sample_face(int level, int f, float s, float t) const {
+  int n = level_size(level);
+  float x = clamp(s * n - .5f, 0.f, n - 1.f);
+  float y = clamp(t * n - .5f, 0.f, n - 1.f);
+  int x0 = (int)x, y0 = (int)y;
+  int x1 = std::min(x0 + 1, n - 1), y1 = std::min(y0 + 1, n - 1);
+  float fx = x - x0, fy = y - y0;
+
+  const vec3* p = face(level, f);
+  vec3 a = p[n * y0 + x0] + fx * (p[n * y0 + x1] - p[n * y0 + x0]);
+  vec3 b = p[n * y1 + x0] + fx * (p[n * y1 + x1] - p[n * y1 + x0]);
+  return a + fy * (b - a);
+}
+
+vec3 cube_map_t::sample(int f, float s, float t, float lod) const {
+  lod = clamp(lod, 0.f, levels - 1.f);
+  int l0 = (int)lod;
+  float fl = lod - l0;
+  vec3 a = sample_face(l0, f, s, t);
+  if(!fl)
+    return a;
+  vec3 b = sample_face(l0 + 1, f, s, t);
+  return a + fl * (b - a);
+}
+
+void cube_map_t::build_mips(block_pool_t& pool) {
+  for(int level = 1; level < levels; ++level) {
+    int n = level_size(level);
+    int n2 = level_size(level - 1);
+    parallel_for(pool, 6 * n, [&](int tid, int row) {
+      int f = row / n, y = row % n;
+      const vec3* src = face(level - 1, f);
+      vec3* dest = face(level, f) + n * y;
+      for(int x = 0; x < n; ++x) {
+        int x0 = 2 * x, x1 = std::min(2 * x + 1, n2 - 1);
+        int y0 = 2 * y, y1 = std::min(2 * y + 1, n2 - 1);
+        dest[x] = .25f * (src[n2 * y0 + x0] + src[n2 * y0 + x1] +
+          src[n2 * y1 + x0] + src[n2 * y1 + x1]);
+      }
+    });
+  }
+}
+
+// Resample the panorama into level 0 of cube with bilinear filtering. The
+// top row of the panorama is +Y and its center looks down -Z.
+void load_equirect(block_pool_t& pool, const float* rgb, int width,
+  int height, cube_map_t& cube) {
+
+  int n = cube.size;
+  parallel_for(pool, 6 * n, [&](int tid, int row) {
+    int f = row / n, y = row % n;
+    vec3* dest = cube.face(0, f) + n * y;
+    for(int x = 0; x < n; ++x) {
+      vec3 d = normalize(face_direction(f, (2 * x + 1.f) / n - 1,
+        (2 * y + 1.f) / n - 1));
+      float u = .5f + atan2(d.x, -d.z) / (2 * M_PIf32);
+      float v = acos(clamp(d.y, -1.f, 1.f)) / M_PIf32;
+
+      float px = u * width - .5f;
+      float py = clamp(v * height - .5f, 0.f, height - 1.f);
+      int x0 = (int)floor(px);
+      int y0 = (int)py;
+      int y1 = std::min(y0 + 1, height - 1);
+      float fx = px - x0, fy = py - y0;
+      int x1 = (x0 + 1 + width) % width;
+      x0 = (x0 + width) % width;
+
+      auto texel = [&](int x, int y) {
+        const float* p = rgb + 3 * ((size_t)width * y + x);
+        return vec3(p[0], p[1], p[2]);
+      };
+      vec3 a = texel(x0, y0) + fx * (texel(x1, y0) - texel(x0, y0));
+      vec3 b = texel(x0, y1) + fx * (texel(x1, y1) - texel(x0, y1));
+      dest[x] = a + fy * (b - a);
+    }
+  });
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Importance sampling.
+
+enum distribution_t {
+  distribution_lambertian,
+  distribution_ggx,
+  distribution_charlie,
+};
+
+inline vec2 hammersley(uint32_t i, uint32_t count) {
+  uint32_t bits = i;
+  bits = (bits << 16) | (bits >> 16);
+  bits = ((bits & 0x55555555) << 1) | ((bits & 0xAAAAAAAA) >> 1);
+  bits = ((bits & 0x33333333) << 2) | ((bits & 0xCCCCCCCC) >> 2);
+  bits = ((bits & 0x0F0F0F0F) << 4) | ((bits & 0xF0F0F0F0) >> 4);
+  bits = ((bits & 0x00FF00FF) << 8) | ((bits & 0xFF00FF00) >> 8);
+  return vec2((float)i / count, bits * 2.3283064365386963e-10f);
+}
+
+// The half vector of a sample, with N = V = +Z. Returns its pdf.
+inline float sample_half(distribution_t distribution, float roughness,
+  vec2 xi, vec3& h) {
+
+  float alpha = roughness * roughness;
+  float cos_theta, pdf;
+  if(distribution_ggx == distribution) {
+    cos_theta = sqrt((1 - xi.y) / (1 + (alpha * alpha - 1) * xi.y));
+    pdf = D_GGX(cos_theta, alpha) * cos_theta;
+  } else {
+    // Invert the CDF of D_Charlie(h) * NdotH, which is sin^(1/alpha + 2).
+    float sin_theta = pow(xi.y, alpha / (2 * alpha + 1));
+    cos_theta = sqrt(1 - sin_theta * sin_theta);
+    pdf = D_Charlie(roughness, cos_theta) * cos_theta;
+  }
+
+  float sin_theta = sqrt(1 - cos_theta * cos_theta);
+  float phi = 2 * M_PIf32 * xi.x;
+  h = vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+  return pdf;
+}
+
+// Light directions in the tangent frame of a normal that is also the view
+// direction, with the weight and source level of each. Lanes past count
+// have zero weight.
+struct sample_table_t {
+  std::vector<pvec3> dirs;
+  std::vector<pfloat> weights;
+  std::vector<pfloat> lods;
+  int count = 0;
+
+  void push(vec3 dir, float weight, float lod);
+};
+
+void sample_table_t::push(vec3 dir, float weight, float lod) {
+  int lane = count % packet_width;
+  if(!lane) {
+    dirs.push_back(pvec3(vec3(0, 0, 1)));
+    weights.push_back(0.f);
+    lods.push_back(0.f);
+  }
+  dirs.back().set(lane, dir);
+  weights.back()[lane] = weight;
+  lods.back()[lane] = lod;
+  ++count;
+}
+
+// Draw count directions and keep those above the horizon. texel_sa is the
+// solid angle of a level 0 source texel.
+void draw_samples(sample_table_t& table, distribution_t distribution,
+  float roughness, int count, float texel_sa, float min_lod) {
+
+  for(int i = 0; i < count; ++i) {
+    vec2 xi = hammersley(i, count);
+    vec3 l;
+    float pdf, weight;
+    if(distribution_lambertian == distribution) {
+      // Cosine-weighted directions. Every sample has the same weight.
+      float cos_theta = sqrt(1 - xi.y);
+      float sin_theta = sqrt(xi.y);
+      float phi = 2 * M_PIf32 * xi.x;
+      l = vec3(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+      pdf = cos_theta / M_PIf32;
+      weight = 1;
+
+    } else {
+      // Reflect V = N about the half vector. The pdf of L is the pdf of H
+      // over 4 VdotH. The split-sum estimate weights each sample by NdotL.
+      vec3 h;
+      pdf = sample_half(distribution, roughness, xi, h) / (4 * h.z);
+      l = vec3(2 * h.z * h.x, 2 * h.z * h.y, 2 * h.z * h.z - 1);
+      weight = l.z;
+    }
+
+    if(weight <= 0 || pdf <= 0)
+      continue;
+
+    // Filtered importance sampling: read the level whose texels cover the
+    // sample's share of the sphere.
+    float sample_sa = 1 / (count * pdf);
+    float lod = .5f * log2(sample_sa / texel_sa) + 1;
+    table.push(l, weight, std::max(lod, min_lod));
+  }
+}
+
+// min_lod keeps the samples from reading a finer level than the output
+// texel covers.
+sample_table_t make_sample_table(distribution_t distribution,
+  float roughness, int samples, const cube_map_t& source, float min_lod) {
+
+  sample_table_t table;
+  if(distribution_lambertian != distribution && !roughness) {
+    // A mirror reads the source along the normal.
+    table.push(vec3(0, 0, 1), 1, min_lod);
+    return table;
+  }
+
+  float texel_sa = 4 * M_PIf32 / (6.f * source.size * source.size);
+
+  // With N = V, most Charlie half vectors reflect below the horizon. Draw
+  // more of them until at least half the requested samples land.
+  int count = samples;
+  while(true) {
+    draw_samples(table, distribution, roughness, count, texel_sa, min_lod);
+    if(2 * table.count >= samples || count >= 16 * samples)
+      break;
+    table = sample_table_t();
+    count *= 2;
+  }
+
+  if(!table.count)
+    table.push(vec3(0, 0, 1), 1, min_lod);
+
+  return table;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Output.
+
+// Clamps to the finite non-negative range, which is all these maps hold.
+inline uint16_t to_half(float f) {
+  f = std::isfinite(f) ? std::min(std::max(f, 0.f), 65504.f) : 0;
+  uint32_t x;
+  memcpy(&x, &f, 4);
+  int exp = (int)(x >> 23) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+
+  if(exp <= 0) {
+    // Denormal or zero.
+    if(exp < -10)
+      return 0;
+    mant |= 0x800000;
+    int shift = 14 - exp;
+    uint32_t h = mant >> shift;
+    return h + ((mant >> (shift - 1)) & 1);
+  }
+
+  // Rounding may carry into the exponent, which is still correct.
+  uint32_t h = (exp << 10) | (mant >> 13);
+  return h + ((mant >> 12) & 1);
+}
+
+inline void store_texel(uint16_t* dest, vec3 c, float a = 1) {
+  dest[0] = to_half(c.x);
+  dest[1] = to_half(c.y);
+  dest[2] = to_half(c.z);
+  dest[3] = to_half(a);
+}
+
+// Convolve source with table into one level of an RGBA half float cube.
+// Returns the number of samples taken.
+size_t filter_level(block_pool_t& pool, const cube_map_t& source,
+  const sample_table_t& table, int n, uint16_t* dest) {
+
+  parallel_for(pool, 6 * n, [&](int tid, int row) {
+    int f = row / n, y = row % n;
+    for(int x = 0; x < n; ++x) {
+      vec3 normal = normalize(face_direction(f, (2 * x + 1.f) / n - 1,
+        (2 * y + 1.f) / n - 1));
+      vec3 up = std::abs(normal.z) < .999f ? vec3(0, 0, 1) : vec3(1, 0, 0);
+      vec3 tangent = normalize(cross(up, normal));
+      vec3 bitangent = cross(normal, tangent);
+      pvec3 T(tangent), B(bitangent), N(normal);
+
+      // Rotate and project a packet of samples at once, then gather.
+      vec3 sum(0);
+      pfloat weight(0.f);
+      for(int p = 0; p < table.dirs.size(); ++p) {
+        const pvec3& d = table.dirs[p];
+        pvec3 l = T * d.x + B * d.y + N * d.z;
+        pint face;
+        pfloat s, t;
+        direction_face(l, face, s, t);
+
+        const pfloat& w = table.weights[p];
+        for(int lane = 0; lane < packet_width; ++lane) {
+          if(w[lane] > 0)
+            sum += w[lane] * source.sample(face[lane], s[lane], t[lane],
+              table.lods[p][lane]);
+        }
+        weight += w;
+      }
+
+      float total = 0;
+      for(int lane = 0; lane < packet_width; ++lane)
+        total += weight[lane];
+      store_texel(dest + 4 * ((size_t)n * row + x), sum / total);
+    }
+  });
+
+  return (size_t)6 * n * n * table.count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Spherical harmonics.
+
+struct sh9_t {
+  vec3 c[9];
+};
+
+// Project level of source onto the first 9 real SH basis functions. Each
+// row is weighted by texel solid angle a packet of texels at a time.
+sh9_t project_sh9(block_pool_t& pool, const cube_map_t& source, int level) {
+  int n = source.level_size(level);
+  std::vector<double> sums(27 * pool.num_threads());
+
+  parallel_for(pool, 6 * n, [&](int tid, int row) {
+    int f = row / n, y = row % n;
+    const vec3* src = source.face(level, f) + n * y;
+    float v = (2 * y + 1.f) / n - 1;
+
+    pfloat acc[27];
+    for(pfloat& a : acc)
+      a = 0.f;
+
+    for(int x0 = 0; x0 < n; x0 += packet_width) {
+      pvec3 d;
+      pfloat r, g, b, valid;
+      for(int lane = 0; lane < packet_width; ++lane) {
+        int x = std::min(x0 + lane, n - 1);
+        d.set(lane, face_direction(f, (2 * x + 1.f) / n - 1, v));
+        r[lane] = src[x].x;
+        g[lane] = src[x].y;
+        b[lane] = src[x].z;
+        valid[lane] = x0 + lane < n;
+      }
+
+      // The solid angle of a texel is (2/n)^2 / |d|^3 for d on the face.
+      pfloat len2 = dot(d, d);
+      pfloat inv_len = rsqrt(len2);
+      pfloat sa = valid * (4.f / (n * n)) * inv_len * inv_len * inv_len;
+      pfloat x1 = d.x * inv_len, y1 = d.y * inv_len, z1 = d.z * inv_len;
+
+      pfloat basis[9] {
+        pfloat(.282095f),
+        .488603f * y1,
+        .488603f * z1,
+        .488603f * x1,
+        1.092548f * x1 * y1,
+        1.092548f * y1 * z1,
+        .315392f * (3.f * z1 * z1 - 1.f),
+        1.092548f * x1 * z1,
+        .546274f * (x1 * x1 - y1 * y1),
+      };
+
+      for(int k = 0; k < 9; ++k) {
+        pfloat w = basis[k] * sa;
+        acc[3 * k + 0] += w * r;
+        acc[3 * k + 1] += w * g;
+        acc[3 * k + 2] += w * b;
+      }
+    }
+
+    double* sum = sums.data() + 27 * tid;
+    for(int i = 0; i < 27; ++i) {
+      for(int lane = 0; lane < packet_width; ++lane)
+        sum[i] += acc[i][lane];
+    }
+  });
+
+  sh9_t sh { };
+  for(int k = 0; k < 9; ++k) {
+    double c[3] { };
+    for(int tid = 0; tid < pool.num_threads(); ++tid) {
+      for(int i = 0; i < 3; ++i)
+        c[i] += sums[27 * tid + 3 * k + i];
+    }
+    sh.c[k] = vec3(c[0], c[1], c[2]);
+  }
+  return sh;
+}
+
+// The irradiance over pi at n, with the clamped cosine convolved into the
+// bands (Ramamoorthi and Hanrahan 2001).
+inline vec3 eval_sh9_irradiance(const sh9_t& sh, vec3 n) {
+  const float a0 = 1, a1 = 2.f / 3, a2 = .25f;
+  return
+    a0 * .282095f * sh.c[0] +
+    a1 * .488603f * (n.y * sh.c[1] + n.z * sh.c[2] + n.x * sh.c[3]) +
+    a2 * (1.092548f * (n.x * n.y * sh.c[4] + n.y * n.z * sh.c[5] +
+      n.x * n.z * sh.c[7]) +
+      .315392f * (3 * n.z * n.z - 1) * sh.c[6] +
+      .546274f * (n.x * n.x - n.y * n.y) * sh.c[8]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// BRDF lookup tables, indexed by (NdotV, roughness).
+
+// GGX: the scale and bias on F0 of the split-sum specular (Karis 2013).
+// Charlie: the directional albedo of the sheen lobe.
+size_t integrate_lut(block_pool_t& pool, distribution_t distribution,
+  int n, int samples, uint16_t* dest) {
+
+  parallel_for(pool, n, [&](int tid, int y) {
+    float roughness = (y + .5f) / n;
+    float alpha = roughness * roughness;
+    for(int x = 0; x < n; ++x) {
+      float NdotV = (x + .5f) / n;
+      vec3 v(sqrt(1 - NdotV * NdotV), 0, NdotV);
+
+      float a = 0, b = 0;
+      for(int i = 0; i < samples; ++i) {
+        vec3 h;
+        float pdf = sample_half(distribution, roughness,
+          hammersley(i, samples), h);
+        float VdotH = dot(v, h);
+        vec3 l = 2 * VdotH * h - v;
+        float NdotL = l.z, NdotH = h.z;
+        if(NdotL <= 0 || VdotH <= 0 || pdf <= 0)
+          continue;
+
+        if(distribution_ggx == distribution) {
+          // V_GGX folds in 1 / (4 NdotL NdotV).
+          float g_vis = V_GGX(NdotL, NdotV, alpha) * 4 * NdotL * VdotH /
+            NdotH;
+          float fc = pow(1 - VdotH, 5);
+          a += (1 - fc) * g_vis;
+          b += fc * g_vis;
+
+        } else {
+          // f * NdotL / pdf(L), with pdf(L) = pdf(H) / (4 VdotH).
+          float f = D_Charlie(roughness, NdotH) * V_Ashikhmin(NdotL, NdotV);
+          a += f * NdotL * 4 * VdotH / pdf;
+        }
+      }
+
+      uint16_t* texel = dest + 4 * ((size_t)n * y + x);
+      if(distribution_ggx == distribution)
+        store_texel(texel, vec3(a / samples, b / samples, 0));
+      else
+        store_texel(texel, vec3(0, 0, a / samples));
+    }
+  });
+
+  return (size_t)n * n * samples;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// KTX2 output.
+
+// Write RGBA16F levels as KTX2. levels[l] holds the faces of level l one
+// after another. The data is stored smallest level first, as the spec asks.
+bool write_ktx2(const std::string& path, int width, int height, int faces,
+  const std::vector<std::vector<uint16_t>>& levels) {
+
+  int num_levels = levels.size();
+
+  // A basic data format descriptor for R16G16B16A16_SFLOAT.
+  uint32_t dfd[23] { };
+  dfd[0] = sizeof(dfd);
+  dfd[2] = 2 | (88 << 16);            // version 2, 88 byte block
+  dfd[3] = 1 | (1 << 8) | (1 << 16);  // RGBSDA, BT709, linear
+  dfd[5] = 8;                         // bytes in plane 0
+  for(int c = 0; c < 4; ++c) {
+    uint32_t* sample = dfd + 7 + 4 * c;
+    uint32_t channel = 3 == c ? 15 : c;
+    sample[0] = (16 * c) | (15 << 16) | ((0xc0 | channel) << 24);
+    sample[2] = 0xbf800000;           // -1.0f
+    sample[3] = 0x3f800000;           // 1.0f
+  }
+
+  ktx2_header_t header { };
+  memcpy(header.identifier, ktx2_identifier, 12);
+  header.vkFormat = 97;
+  header.typeSize = 2;
+  header.width = width;
+  header.height = height;
+  header.faceCount = faces;
+  header.levelCount = num_levels;
+  header.dfdByteOffset = sizeof(header) + sizeof(ktx2_level_t) * num_levels;
+  header.dfdByteLength = sizeof(dfd);
+
+  std::vector<ktx2_level_t> index(num_levels);
+  uint64_t offset = header.dfdByteOffset + sizeof(dfd);
+  for(int level = num_levels - 1; level >= 0; --level) {
+    uint64_t size = 2 * levels[level].size();
+    offset = (offset + 7) & ~7;
+    index[level] = { offset, size, size };
+    offset += size;
+  }
+
+  FILE* f = fopen(path.c_str(), "wb");
+  if(!f) {
+    fprintf(stderr, "cannot open file %s\n", path.c_str());
+    return false;
+  }
+
+  bool ok = 1 == fwrite(&header, sizeof(header), 1, f);
+  ok &= num_levels == fwrite(index.data(), sizeof(ktx2_level_t), num_levels,
+    f);
+  ok &= 1 == fwrite(dfd, sizeof(dfd), 1, f);
+  for(int level = num_levels - 1; level >= 0; --level) {
+    const char zeros[8] { };
+    size_t pad = index[level].byteOffset - ftell(f);
+    if(pad)
+      ok &= 1 == fwrite(zeros, pad, 1, f);
+    ok &= 1 == fwrite(levels[level].data(), index[level].byteLength, 1, f);
+  }
+
+  ok &= !fclose(f);
+  if(!ok)
+    fprintf(stderr, "cannot write file %s\n", path.c_str());
+  return ok;
+}
+
+inline void print_pass(const char* name, size_t samples, double ms) {
+  printf("  %-11s %8.1f ms %12zu samples %9.1f Msamples/s\n", name, ms,
+    samples, samples / 1.0e3 / ms);
+}
+
+int main(int argc, char** argv) {
+  options_t options;
+  if(int result = parse_options(argc, argv, options)) {
+    if(result > 0)
+      print_usage();
+    return std::max(result, 0);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  int width, height, comp;
+  float* rgb = stbi_loadf(options.input, &width, &height, &comp, 3);
+  if(!rgb) {
+    fprintf(stderr, "cannot load %s: %s\n", options.input,
+      stbi_failure_reason());
+    return 1;
+  }
+  printf("loaded %s (%dx%d) in %.1f ms\n", options.input, width, height,
+    elapsed_ms(start));
+
+  block_pool_t pool(options.num_threads);
+
+  // Resample the panorama at about its own resolution, so the filters see
+  // all of its detail, and build the mips the samples read from.
+  auto t0 = std::chrono::steady_clock::now();
+  int source_size = options.size;
+  while(source_size < 2048 && 2 * source_size <= width / 4)
+    source_size *= 2;
+  int source_levels = (int)log2(source_size) + 1;
+  cube_map_t source(source_size, source_levels);
+  load_equirect(pool, rgb, width, height, source);
+  stbi_image_free(rgb);
+  source.build_mips(pool);
+  printf("  %-11s %8.1f ms (%d cube)\n", "source", elapsed_ms(t0),
+    source_size);
+
+  // GGX and Charlie map roughness linearly onto the mip levels.
+  int n = options.size;
+  int num_levels = (int)log2(n) + 1;
+  std::vector<std::vector<uint16_t>> ggx(num_levels), charlie(num_levels);
+  size_t total_samples = 0;
+  for(distribution_t d : { distribution_ggx, distribution_charlie }) {
+    std::vector<std::vector<uint16_t>>& levels =
+      distribution_ggx == d ? ggx : charlie;
+
+    auto t0 = std::chrono::steady_clock::now();
+    size_t samples = 0;
+    for(int level = 0; level < num_levels; ++level) {
+      int size = std::max(1, n >> level);
+      float roughness = num_levels > 1 ? (float)level / (num_levels - 1) : 0;
+      float min_lod = log2((float)source_size / size);
+      sample_table_t table = make_sample_table(d, roughness,
+        options.samples, source, min_lod);
+
+      levels[level].resize(4 * 6 * size * size);
+      samples += filter_level(pool, source, table, size,
+        levels[level].data());
+    }
+    print_pass(distribution_ggx == d ? "ggx" : "charlie", samples,
+      elapsed_ms(t0));
+    total_samples += samples;
+  }
+
+  // The Lambertian map is smooth, so it gets one small level.
+  std::vector<std::vector<uint16_t>> lambertian(1);
+  {
+    auto t0 = std::chrono::steady_clock::now();
+    int size = options.lambertian_size;
+    lambertian[0].resize(4 * 6 * size * size);
+    if(options.sampled) {
+      sample_table_t table = make_sample_table(distribution_lambertian, 1,
+        options.samples, source, 0);
+      size_t samples = filter_level(pool, source, table, size,
+        lambertian[0].data());
+      print_pass("lambertian", samples, elapsed_ms(t0));
+      total_samples += samples;
+
+    } else {
+      // Project a level of about 64 texels, which holds far more detail
+      // than 9 coefficients can.
+      int level = std::max(0, source_levels - 7);
+      sh9_t sh = project_sh9(pool, source, level);
+      for(int f = 0; f < 6; ++f) {
+        for(int y = 0; y < size; ++y) {
+          for(int x = 0; x < size; ++x) {
+            vec3 normal = normalize(face_direction(f,
+              (2 * x + 1.f) / size - 1, (2 * y + 1.f) / size - 1));
+            store_texel(lambertian[0].data() +
+              4 * (((size_t)f * size + y) * size + x),
+              eval_sh9_irradiance(sh, normal));
+          }
+        }
+      }
+      printf("  %-11s %8.1f ms (SH9)\n", "lambertian", elapsed_ms(t0));
+    }
+  }
+
+  std::vector<std::vector<uint16_t>> lut_ggx(1), lut_charlie(1);
+  int lut_size = options.lut_size;
+  for(distribution_t d : { distribution_ggx, distribution_charlie }) {
+    std::vector<uint16_t>& lut = (distribution_ggx == d ? lut_ggx :
+      lut_charlie)[0];
+    lut.resize(4 * lut_size * lut_size);
+
+    auto t0 = std::chrono::steady_clock::now();
+    size_t samples = integrate_lut(pool, d, lut_size, options.lut_samples,
+      lut.data());
+    print_pass(distribution_ggx == d ? "lut_ggx" : "lut_charlie", samples,
+      elapsed_ms(t0));
+    total_samples += samples;
+  }
+
+  std::string out = options.output;
+  for(const char* dir : { "", "/ggx", "/lambertian", "/charlie" })
+    mkdir((out + dir).c_str(), 0755);
+
+  bool ok = write_ktx2(out + "/ggx/specular.ktx2", n, n, 6, ggx);
+  ok &= write_ktx2(out + "/lambertian/diffuse.ktx2",
+    options.lambertian_size, options.lambertian_size, 6, lambertian);
+  ok &= write_ktx2(out + "/charlie/sheen.ktx2", n, n, 6, charlie);
+  ok &= write_ktx2(out + "/lut_ggx.ktx2", lut_size, lut_size, 1, lut_ggx);
+  ok &= write_ktx2(out + "/lut_charlie.ktx2", lut_size, lut_size, 1,
+    lut_charlie);
+  if(!ok)
+    return 1;
+
+  double ms = elapsed_ms(start);
+  printf("wrote %s in %.1f ms, %.1f Msamples/s overall on %d threads\n",
+    options.output, ms, total_samples / 1.0e3 / ms, options.num_threads);
+  return 0;
+}
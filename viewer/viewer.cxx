@@ -6,6 +6,9 @@
 
 #include "appglfw.hxx"
 #include <vector>
+#include <string>
+#include <mutex>
+#include <numeric>
 #include <iostream>
 #include <type_traits>
 #include <cassert>
@@ -16,60 +19,13 @@
 
 #include "brdf.hxx"
 #include "tonemapping.hxx"
+#include "material.hxx"
+#include "block_pool.hxx"
+#include "asset_stream.hxx"
+#include "baked.hxx"
+#include "ktx2_gl.hxx"
 
 
-// PBR metallic roughness
-struct pbrMetallicRoughness_t {
-  // baseColorTexture
-  // metallicRoughnessTexture
-  vec4 baseColorFactor;
-  float metallicFactor;
-  float roughnessFactor;
-  float padding0, padding1;
-};
-
-// KHR_materials_pbrSpecularGlossiness
-struct KHR_materials_pbrSpecularGlossiness_t {
-  // diffuseTexture
-  // specularGlossinessTexture
-  vec4 diffuseFactor;
-  vec3 specularFactor;
-  float glossinessFactor;
-};
-
-// KHR_materials_clearcoat
-struct KHR_materials_clearcoat_t {
-  // clearcoatTexture
-  // clearcoatRoughnessTexture
-  // clearcoatNormalTexture
-  float clearcoatFactor;
-  float clearcoatRoughnessFactor;
-  float padding0, padding1;
-};
-
-// KHR_materials_transmission 
-struct KHR_materials_transmission_t {
-  // transmissionTexture
-  float transmissionFactor;
-  float ior;
-  float padding0, padding1;
-};
-
-struct material_uniform_t {
-  // Textures:
-  // normalTexture
-  // occlusionTexture
-  // emissiveTexture
-  vec3 emissiveFactor;
-  float alphaCutoff;
-
-  // Material models
-  pbrMetallicRoughness_t pbrMetallicRoughness;
-  KHR_materials_pbrSpecularGlossiness_t pbrSpecularGlossiness;
-  KHR_materials_clearcoat_t clearcoat;
-  KHR_materials_transmission_t transmission;
-};
-
 enum light_type_t {
   light_type_directional,
   light_type_point,
@@ -613,128 +569,35 @@ struct env_paths_t {
   const char* CharlieEnv;
 };
 
-GLuint create_hdr_cubemap(const char* path) {
-  const uint8_t ktx2_version[12] {
-    0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
-  };
-
-  struct ktx2_header_t {
-    char identifier[12];
-    uint32_t vkFormat;
-    uint32_t typeSize;
-    uint32_t width;
-    uint32_t height;
-    uint32_t pixelDepth;
-    uint32_t layerCount;
-    uint32_t faceCount;
-    uint32_t levelCount;
-    uint32_t supercompressionScheme;
-
-    // Index 
-    uint32_t dfdByteOffset;
-    uint32_t dfdByteLength;
-    uint32_t kvdByteOffset;
-    uint32_t kvdByteLength;
-    uint64_t sgdByteOffset;
-    uint64_t sgdByteLength;
-
-    struct indexing_t {
-      uint64_t byteOffset;
-      uint64_t byteLength;
-      uint64_t uncompressedByteLength;
-    };
-    indexing_t levels[1];   // levelCount elements.
-  };
-    
-  int fd = open(path, O_RDONLY);
-  if(-1 == fd) {
-    printf("cannot open file %s\n", path);
-    exit(1);
-  }
-
-  struct stat statbuf;
-  if(-1 == fstat(fd, &statbuf)) {
-    printf("cannot stat file %s\n", path);
-    exit(1);
-  }
-
-  if(statbuf.st_size < sizeof(ktx2_header_t)) {
-    printf("file %s is too small to be a ktx2 file", path);
-    exit(1);
-  }
-
-  const char* data = (const char*)mmap(nullptr, statbuf.st_size, PROT_READ, 
-    MAP_PRIVATE, fd, 0);
-  const ktx2_header_t& header = *(const ktx2_header_t*)data;
-
-  if(memcmp(header.identifier, ktx2_version, 12)) {
-    printf("file %s has the wrong KTX2 identifier", path);
-    exit(1);
-  }
-
-  if(6 != header.faceCount) {
-    printf("file %s does not hold a cube map", path);
-    exit(1);
-  }
-
-  GLenum format, iformat;
-  switch(header.vkFormat) {
-    case 97:
-      format = GL_HALF_FLOAT;
-      iformat = GL_RGBA16F;
-      break;
+// The cube maps stream in through loader, so they are only complete after
+// enough calls to loader.update.
+env_map_t load_env_map(env_paths_t paths, ktx2_loader_t& loader) {
+  env_map_t map { };
 
-    case 109:
-      format = GL_FLOAT;
-      iformat = GL_RGBA32F;
-      break;
+  // The LUTs are PNGs, or KTX2 files written by the prefilter tool.
+  auto load_lut = [&](const char* path) {
+    size_t len = strlen(path);
+    if(len < 5 || strcmp(path + len - 5, ".ktx2"))
+      return load_texture(path);
 
-    default:
-      printf("cube map in %s is not encoded in a supported format", path);
+    GLuint texture = loader.load(path);
+    if(!texture)
       exit(1);
-  }
-
-  // Construct the cube map and all of its face-layers.
-  GLuint cubemap;
-  glCreateTextures(GL_TEXTURE_CUBE_MAP, 1, &cubemap);
-  glTextureStorage2D(cubemap, header.levelCount, iformat, header.width,
-    header.height);
-
-  // The file is encoded by levels.
-  for(int level = 0; level < header.levelCount; ++level) {
-    ktx2_header_t::indexing_t indexing = header.levels[level];
-
-    // Find the mip map level dimensions.
-    uint32_t width = header.width >> level;
-    uint32_t height = header.height >> level;
+    return texture;
+  };
+  map.GGXLut = load_lut(paths.GGXLut);
+  map.CharlieLut = load_lut(paths.CharlieLut);
 
-    // Upload all six levels at once.
-    const char* level_data = data + indexing.byteOffset;
-    glTextureSubImage3D(cubemap, level, 0, 0, 0, width, height, 6, GL_RGBA, 
-      GL_HALF_FLOAT, level_data);
+  const char* cube_paths[] {
+    paths.GGXEnv, paths.LambertianEnv, paths.CharlieEnv
+  };
+  GLuint* cubes[] { &map.GGXEnv, &map.LambertianEnv, &map.CharlieEnv };
+  for(int i = 0; i < 3; ++i) {
+    if(!(*cubes[i] = loader.load(cube_paths[i])))
+      exit(1);
   }
 
-  munmap((void*)data, statbuf.st_size);
-  close(fd);
-
-  glTextureParameteri(cubemap, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTextureParameteri(cubemap, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-  glTextureParameteri(cubemap, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTextureParameteri(cubemap, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  
-  return cubemap;
-}
-
-env_map_t load_env_map(env_paths_t paths) {
-  env_map_t map { };
-
-  map.GGXLut = load_texture(paths.GGXLut);
-  map.GGXEnv = create_hdr_cubemap(paths.GGXEnv);
-
-  map.LambertianEnv = create_hdr_cubemap(paths.LambertianEnv);
-
-  map.CharlieLut = load_texture(paths.CharlieLut);
-  map.CharlieEnv = create_hdr_cubemap(paths.CharlieEnv);
+  loader.start();
   return map;
 }
 
@@ -769,54 +632,6 @@ int find_buffer_index(const cgltf_data* data, const cgltf_buffer* buffer) {
   return buffer - data->buffers;
 }
 
-struct texture_view_t {
-  // Index of the texture in the gltf stream.
-  int index = -1;
-
-  // Index of the TEXCOORD_n in the vertex attribute stream. 
-  int texcoord = 0;
-
-  // The scalar multiplied applied to each normal vector of the normal
-  // texture.
-  // Also strength for occlusionTextureInfo.
-  float scale = 1.f;
-
-  explicit operator bool() const noexcept { return -1 != index; }
-};
-
-struct material_textures_t {
-  // Core:
-  texture_view_t normal;
-  texture_view_t occlusion;
-  texture_view_t emissive;
-
-  // pbrMetallicRoughness
-  texture_view_t baseColor;
-  texture_view_t metallicRoughness;
-
-  // KHR_materials_pbrSpecularGlossiness
-  texture_view_t diffuse;
-  texture_view_t specularGlossiness;
-
-  // KHR_materials_clearcoat
-  texture_view_t clearcoat;
-  texture_view_t clearcoatRoughness;
-  texture_view_t clearcoatNormal;
-
-  // KHR_materials_transmission
-  texture_view_t transmission;
-};
-
-struct material_t {
-  bool has_pbr_metallic_roughness;
-  bool has_pbr_specular_glossiness;
-  bool has_clearcoat;
-  bool has_transmission;
-
-  material_uniform_t uniform;
-  material_textures_t textures;
-};
-
 // Binary search in the array of animation keyframe times. 
 // This searches the input accessor of the animation sampler.
 std::pair<int, float> find_animation_interpolate(
@@ -928,24 +743,39 @@ struct mesh_t {
 };
 
 // Create array buffers for storing vertex data.
+//
+// Loading is staged. The constructor parses the glTF, reads its buffers and
+// starts decoding the images on a thread pool. update() then streams the
+// buffers and mip levels to the GPU a bounded amount per frame. Images are
+// bound as 1x1 placeholders until their smallest level lands, and each mesh
+// is created once all the buffers it reads from have landed.
+//
+// A path ending in .bake is a model written by the bake tool. It's mapped
+// and uploaded in the constructor, since it needs no parsing or decoding.
 struct model_t {
   model_t(const char* path);
   ~model_t();
   
   GLuint load_buffer(const cgltf_buffer* buffer);
-  GLuint load_image(const cgltf_image* image, const char* data_path);
+  void decode_image(int index);
   sampler_t load_sampler(const cgltf_sampler* sampler);
+  sampler_t load_sampler(bake_sampler_t sampler);
   texture_t load_texture(const cgltf_texture* texture);
-  material_t load_material(const cgltf_material* material);
-  texture_view_t load_texture_view(const cgltf_texture_view& view);
   prim_t load_prim(const cgltf_primitive* prim);
   mesh_t load_mesh(const cgltf_mesh* mesh);
 
+  void load_baked(const char* path);
+  prim_t load_baked_prim(const bake_prim_t& prim);
+
   void bind_texture(sampler_index_t sampler_index, texture_view_t view);
   void bind_material(material_t& material);
 
   void render_primitive(mesh_t& mesh, prim_t& prim);
 
+  // Upload the next part of the model. Call once per frame before drawing.
+  void update();
+  bool is_loaded() const;
+
   std::vector<mesh_t> meshes;
   std::vector<GLuint> buffers;
   std::vector<GLuint> images;
@@ -956,9 +786,61 @@ struct model_t {
   std::vector<light_t> lights;
 
   cgltf_data* data = nullptr;
+  std::string path;
+
+  // Loading state.
+  std::chrono::steady_clock::time_point start;
+  block_pool_t pool;
+  staging_ring_t ring;
+  upload_queue_t uploads;
+
+  // The workers push decoded images here, or null when an image fails.
+  std::mutex decoded_mutex;
+  std::vector<std::unique_ptr<decoded_image_t>> decoded;
+
+  // The textures created for the decoded images, or 0.
+  std::vector<GLuint> image_textures;
+  GLuint placeholder_color = 0;
+  GLuint placeholder_normal = 0;
+
+  // For each buffer the meshes that read it, and for each mesh the number
+  // of its buffers still in flight.
+  std::vector<std::vector<int>> buffer_meshes;
+  std::vector<int> mesh_pending;
+
+  // Images back from the pool, including those that failed.
+  int images_decoded = 0;
+  int images_failed = 0;
+  int levels_pending = 0;
+  int buffers_pending = 0;
+  double decode_ms = 0;
+  double upload_ms = 0;
 };
 
-model_t::model_t(const char* path) {
+// Leave a core for the main thread, which owns the GL context.
+int num_decode_threads() {
+  return std::max(1, (int)std::thread::hardware_concurrency() - 1);
+}
+
+GLuint create_placeholder(uint32_t rgba) {
+  GLuint texture;
+  glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+  glTextureStorage2D(texture, 1, GL_RGBA8, 1, 1);
+  glTextureSubImage2D(texture, 0, 0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE,
+    &rgba);
+  return texture;
+}
+
+model_t::model_t(const char* path) : path(path),
+  start(std::chrono::steady_clock::now()), pool(num_decode_threads()),
+  ring(16 << 20, 3) {
+
+  size_t len = strlen(path);
+  if(len >= 5 && !strcmp(path + len - 5, ".bake")) {
+    load_baked(path);
+    return;
+  }
+
   cgltf_options options { };
 
   printf("Parsing %s...\n", path);
@@ -967,24 +849,48 @@ model_t::model_t(const char* path) {
     std::cerr<< enum_to_string(result)<< "\n";
     exit(1);
   }
+  double parse_ms = elapsed_ms(start);
 
   result = cgltf_load_buffers(&options, data, path);
   if(cgltf_result_success != result) {
     std::cerr<< enum_to_string(result)<< "\n";
     exit(1);
   }
+  printf("Parsed in %.1f ms, read buffers in %.1f ms\n", parse_ms,
+    elapsed_ms(start) - parse_ms);
+
+  // Start decoding the images. update() uploads them as they finish.
+  std::vector<int> image_list(data->images_count);
+  std::iota(image_list.begin(), image_list.end(), 0);
+  pool.execute(image_list, 1, [this](int tid, int level, int index) {
+    decode_image(index);
+    return true;
+  });
+
+  // Bind placeholders until the images arrive. Normal maps get a flat
+  // normal so the lighting is right in the meantime.
+  placeholder_color = create_placeholder(0xffffffff);
+  placeholder_normal = create_placeholder(0xffff8080);
+  images.assign(data->images_count, placeholder_color);
+  image_textures.assign(data->images_count, 0);
+  for(int i = 0; i < data->materials_count; ++i) {
+    const cgltf_material& material = data->materials[i];
+    for(const cgltf_texture_view* view : { &material.normal_texture,
+      &material.clearcoat.clearcoat_normal_texture }) {
+      if(view->texture && view->texture->image)
+        images[find_image_index(data, view->texture->image)] =
+          placeholder_normal;
+    }
+  }
 
-  // Load the buffers.
+  // Create the buffers and queue their contents.
   buffers.resize(data->buffers_count);
   for(int i = 0; i < data->buffers_count; ++i) {
     buffers[i] = load_buffer(data->buffers + i);
+    uploads.push_buffer(i, buffers[i], data->buffers[i].data,
+      data->buffers[i].size);
   }
-
-  // Load the images.
-  images.resize(data->images_count);
-  for(int i = 0; i < data->images_count; ++i) {
-    images[i] = load_image(data->images + i, path);
-  }
+  buffers_pending = data->buffers_count;
 
   // Load the textures.
   textures.resize(data->textures_count);
@@ -1001,66 +907,163 @@ model_t::model_t(const char* path) {
   // Load the materials.
   materials.resize(data->materials_count);
   for(int i = 0; i < data->materials_count; ++i) {
-    materials[i] = load_material(data->materials + i);
+    materials[i] = load_material(data, data->materials + i);
   }
 
-  // Load the meshes.
+  // Find the buffers each mesh reads. A mesh with no buffers in flight is
+  // loaded now and the rest are loaded by update().
+  meshes.resize(data->meshes_count);
+  buffer_meshes.resize(data->buffers_count);
+  mesh_pending.resize(data->meshes_count);
   for(int i = 0; i < data->meshes_count; ++i) {
-    meshes.push_back(load_mesh(data->meshes + i));
+    std::vector<int> mesh_buffers;
+    const cgltf_mesh& mesh = data->meshes[i];
+    for(int p = 0; p < mesh.primitives_count; ++p) {
+      const cgltf_primitive& prim = mesh.primitives[p];
+      if(prim.indices)
+        mesh_buffers.push_back(find_buffer_index(data,
+          prim.indices->buffer_view->buffer));
+      for(int a = 0; a < prim.attributes_count; ++a)
+        mesh_buffers.push_back(find_buffer_index(data,
+          prim.attributes[a].data->buffer_view->buffer));
+    }
+
+    std::sort(mesh_buffers.begin(), mesh_buffers.end());
+    mesh_buffers.erase(std::unique(mesh_buffers.begin(), mesh_buffers.end()),
+      mesh_buffers.end());
+    for(int buffer : mesh_buffers)
+      buffer_meshes[buffer].push_back(i);
+
+    mesh_pending[i] = mesh_buffers.size();
+    if(!mesh_pending[i])
+      meshes[i] = load_mesh(data->meshes + i);
   }
 }
 
 model_t::~model_t() {
+  // Stop the decoders before freeing the glTF they read from.
+  pool.cancel();
+  pool.wait();
+
   for(mesh_t& mesh : meshes) {
     for(prim_t& prim : mesh.primitives)
       glDeleteVertexArrays(1, &prim.vao);
   }
 
   glDeleteBuffers(buffers.size(), buffers.data());
-  glDeleteTextures(images.size(), images.data());
+  glDeleteTextures(image_textures.size(), image_textures.data());
+  glDeleteTextures(1, &placeholder_color);
+  glDeleteTextures(1, &placeholder_normal);
   cgltf_free(data);
 }
 
 GLuint model_t::load_buffer(const cgltf_buffer* buffer) {
+  // The contents arrive from the staging ring, so the buffer needs no
+  // client storage.
   GLuint buffer2;
   glCreateBuffers(1, &buffer2);
-  glNamedBufferStorage(buffer2, buffer->size, buffer->data, 
-    GL_DYNAMIC_STORAGE_BIT);
+  glNamedBufferStorage(buffer2, buffer->size, nullptr, 0);
 
-  printf("Loaded buffer with %zu bytes\n", buffer->size);
+  printf("Loading buffer with %zu bytes\n", buffer->size);
   return buffer2;
 }
 
-GLuint model_t::load_image(const cgltf_image* image, const char* base) {
-  char path[260];
+// Runs on the pool.
+void model_t::decode_image(int index) {
+  std::unique_ptr<decoded_image_t> image = decode_gltf_image(data, index,
+    path.c_str());
 
-  const char* s0 = strrchr(base, '/');
-  const char* s1 = strrchr(base, '\\');
-  const char* slash = s0 ? (s1 && s1 > s0 ? s1 : s0) : s1;
+  std::lock_guard<std::mutex> lock(decoded_mutex);
+  decoded.push_back(std::move(image));
+}
 
-  if(slash) {
-    size_t prefix = slash - base + 1;
-    strncpy(path, base, prefix);
-    strcpy(path + prefix, image->uri);
+void model_t::update() {
+  if(is_loaded())
+    return;
 
-  } else {
-    strcpy(path, image->uri);
+  auto update_start = std::chrono::steady_clock::now();
+
+  // Take the images decoded since the last frame.
+  std::vector<std::unique_ptr<decoded_image_t>> decoded2;
+  {
+    std::lock_guard<std::mutex> lock(decoded_mutex);
+    decoded2.swap(decoded);
   }
 
-  return ::load_texture(path);
+  for(auto& image : decoded2) {
+    if(!image) {
+      // Keep the placeholder.
+      ++images_failed;
+      continue;
+    }
+
+    GLuint texture;
+    glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+    glTextureStorage2D(texture, image->levels, GL_RGBA8, image->width,
+      image->height);
+    image_textures[image->index] = texture;
+
+    decode_ms += image->decode_ms;
+    levels_pending += image->levels;
+    uploads.push_image(std::move(image), texture);
+  }
+
+  if(decoded2.size()) {
+    images_decoded += decoded2.size();
+    if(images_decoded == data->images_count)
+      printf("Decoded %d images after %.1f ms (%.1f ms on %d threads)\n",
+        images_decoded - images_failed, elapsed_ms(start), decode_ms,
+        pool.num_threads());
+  }
+
+  uploads.pump(ring, [&](int index) {
+    // Create the meshes that were waiting on this buffer.
+    for(int mesh : buffer_meshes[index]) {
+      if(!--mesh_pending[mesh])
+        meshes[mesh] = load_mesh(data->meshes + mesh);
+    }
+
+    if(!--buffers_pending)
+      printf("Uploaded buffers after %.1f ms\n", elapsed_ms(start));
+
+  }, [&](int index, int level) {
+    // Swap out the placeholder once the texture is sampleable.
+    images[index] = image_textures[index];
+    --levels_pending;
+  });
+
+  if(!ring.empty())
+    ring.next();
+  upload_ms += elapsed_ms(update_start);
+
+  if(is_loaded())
+    printf("Loaded all assets after %.1f ms (%.1f ms of uploads)\n",
+      elapsed_ms(start), upload_ms);
+}
+
+bool model_t::is_loaded() const {
+  return !data || !buffers_pending && !levels_pending &&
+    images_decoded == data->images_count;
 }
 
 sampler_t model_t::load_sampler(const cgltf_sampler* sampler) {
+  return load_sampler(bake_sampler_t {
+    sampler->mag_filter, sampler->min_filter,
+    sampler->wrap_s, sampler->wrap_t
+  });
+}
+
+sampler_t model_t::load_sampler(bake_sampler_t sampler) {
   sampler_t sampler2 { };
 
-  sampler2.mag_filter = sampler->mag_filter ? sampler->mag_filter :
+  sampler2.mag_filter = sampler.mag_filter ? sampler.mag_filter :
     GL_LINEAR;
   
-  sampler2.min_filter = sampler->min_filter ? sampler->min_filter :
+  sampler2.min_filter = sampler.min_filter ? sampler.min_filter :
     GL_LINEAR_MIPMAP_LINEAR;
 
-  sampler2.wrap_s = sampler->wrap_s;
-  sampler2.wrap_t = sampler->wrap_t;
+  sampler2.wrap_s = sampler.wrap_s;
+  sampler2.wrap_t = sampler.wrap_t;
   return sampler2;
 }
 
@@ -1071,107 +1074,66 @@ texture_t model_t::load_texture(const cgltf_texture* texture) {
   };
 }
 
+// The shader location of a glTF attribute, or -1 if the shaders don't read
+// it.
+int find_vattrib_index(cgltf_attribute_type type, int index) {
+  switch(type) {
+    case cgltf_attribute_type_position:
+      return vattrib_position;
 
-material_t model_t::load_material(const cgltf_material* material) {
-  material_t material2 { };
+    case cgltf_attribute_type_normal:
+      return vattrib_normal;
 
-  // Core terms.
-  material2.uniform.emissiveFactor = vec3(
-    material->emissive_factor[0],
-    material->emissive_factor[1],
-    material->emissive_factor[2]
-  );
-  material2.uniform.alphaCutoff = material->alpha_cutoff;
+    case cgltf_attribute_type_texcoord:
+      return vattrib_texcoord0 + 3 * index;
 
-  material2.textures.normal = load_texture_view(material->normal_texture);
-  material2.textures.occlusion = load_texture_view(material->occlusion_texture);
-  material2.textures.emissive = load_texture_view(material->emissive_texture);
+    case cgltf_attribute_type_joints:
+      return vattrib_joints0 + 3 * index;
 
-  if(material->has_pbr_metallic_roughness) {
-    material2.has_pbr_metallic_roughness = true;
+    case cgltf_attribute_type_weights:
+      return vattrib_weights0 + 3 * index;
 
-    material2.uniform.pbrMetallicRoughness.baseColorFactor = vec4(
-      material->pbr_metallic_roughness.base_color_factor[0],
-      material->pbr_metallic_roughness.base_color_factor[1],
-      material->pbr_metallic_roughness.base_color_factor[2],
-      material->pbr_metallic_roughness.base_color_factor[3]
-    );
-    material2.uniform.pbrMetallicRoughness.metallicFactor = 
-      material->pbr_metallic_roughness.metallic_factor;
-    material2.uniform.pbrMetallicRoughness.roughnessFactor = 
-      material->pbr_metallic_roughness.roughness_factor;
-
-    material2.textures.baseColor = load_texture_view(
-      material->pbr_metallic_roughness.base_color_texture);
-    material2.textures.metallicRoughness = load_texture_view(
-      material->pbr_metallic_roughness.metallic_roughness_texture
-    );
+    default:
+      return -1;
   }
+}
 
-  if(material->has_pbr_specular_glossiness) {
-    material2.has_pbr_specular_glossiness = true;
-
-    material2.uniform.pbrSpecularGlossiness.diffuseFactor = vec4(
-      material->pbr_specular_glossiness.diffuse_factor[0],
-      material->pbr_specular_glossiness.diffuse_factor[1],
-      material->pbr_specular_glossiness.diffuse_factor[2],
-      material->pbr_specular_glossiness.diffuse_factor[3]
-    );
-    material2.uniform.pbrSpecularGlossiness.specularFactor = vec3(
-      material->pbr_specular_glossiness.specular_factor[0],
-      material->pbr_specular_glossiness.specular_factor[1],
-      material->pbr_specular_glossiness.specular_factor[2]
-    );
-    material2.uniform.pbrSpecularGlossiness.glossinessFactor = 
-      material->pbr_specular_glossiness.glossiness_factor;
-
-    material2.textures.diffuse = load_texture_view(
-      material->pbr_specular_glossiness.diffuse_texture
-    );
-    material2.textures.specularGlossiness = load_texture_view(
-      material->pbr_specular_glossiness.specular_glossiness_texture
-    );
+// Set the format of attribute location attribindex, read from binding
+// attribindex at relative offset offset.
+void set_vattrib_format(GLuint vao, int attribindex, cgltf_type components,
+  cgltf_component_type component_type, bool normalized, int offset) {
+
+  // Enable the vertex attribute location.
+  glEnableVertexArrayAttrib(vao, attribindex);
+
+  // Get the attribute size and type.
+  GLenum type = GL_NONE;
+  int size = 0;
+  switch(components) {
+    case cgltf_type_scalar:  size = 1;  break;
+    case cgltf_type_vec2:    size = 2;  break;
+    case cgltf_type_vec3:    size = 3;  break;
+    case cgltf_type_vec4:    size = 4;  break;
+    default:                            break;
   }
 
-  if(material->has_clearcoat) {
-    material2.has_clearcoat = true;
-
-    material2.uniform.clearcoat.clearcoatFactor = 
-      material->clearcoat.clearcoat_factor;
-    material2.uniform.clearcoat.clearcoatRoughnessFactor = 
-      material->clearcoat.clearcoat_roughness_factor;
-
-    material2.textures.clearcoat = load_texture_view(
-      material->clearcoat.clearcoat_texture
-    );
-    material2.textures.clearcoatRoughness = load_texture_view(
-      material->clearcoat.clearcoat_roughness_texture
-    );
-    material2.textures.clearcoatNormal = load_texture_view(
-      material->clearcoat.clearcoat_normal_texture
-    );
+  switch(component_type) {
+    case cgltf_component_type_r_8:   type = GL_BYTE;           break;
+    case cgltf_component_type_r_8u:  type = GL_UNSIGNED_BYTE;  break;
+    case cgltf_component_type_r_16:  type = GL_SHORT;          break;
+    case cgltf_component_type_r_16u: type = GL_UNSIGNED_SHORT; break;
+    case cgltf_component_type_r_32u: type = GL_UNSIGNED_INT;   break;
+    case cgltf_component_type_r_32f: type = GL_FLOAT;          break;
+    default:                                                   break;
   }
 
-  if(material->has_transmission) {
-    material2.has_transmission = true;
-
-    material2.uniform.transmission.transmissionFactor = 
-      material->transmission.transmission_factor;
+  if(normalized || GL_FLOAT == type) {
+    glVertexArrayAttribFormat(vao, attribindex, size, type, normalized,
+      offset);
 
-    material2.textures.transmission = load_texture_view(
-      material->transmission.transmission_texture
-    );
+  } else {
+    glVertexArrayAttribIFormat(vao, attribindex, size, type, offset);
   }
-
-  return material2;
-}
-
-texture_view_t model_t::load_texture_view(const cgltf_texture_view& view) {
-  texture_view_t view2;
-  view2.index = find_texture_index(data, view.texture);
-  view2.texcoord = view2.texcoord;
-  view2.scale = view2.scale;
-  return view2;
 }
 
 prim_t model_t::load_prim(const cgltf_primitive* prim) {
@@ -1217,68 +1179,19 @@ prim_t model_t::load_prim(const cgltf_primitive* prim) {
     const cgltf_buffer_view* view = accessor->buffer_view;
 
     // Get the attribute location.
-    vattrib_index_t attribindex;
-    switch(attrib->type) {
-      case cgltf_attribute_type_position:
-        attribindex = vattrib_position;
-        break;
-
-      case cgltf_attribute_type_normal:
-        attribindex = vattrib_normal;
-        break;
-
-      case cgltf_attribute_type_texcoord:
-        attribindex = (vattrib_index_t)(vattrib_texcoord0 + 3 * attrib->index);
-        break;
-
-      case cgltf_attribute_type_joints:
-        attribindex = (vattrib_index_t)(vattrib_joints0 + 3 * attrib->index);
-        break;
-
-      case cgltf_attribute_type_weights:
-        attribindex = (vattrib_index_t)(vattrib_weights0 + 3 * attrib->index);
-        break;
-    }
+    int attribindex = find_vattrib_index(attrib->type, attrib->index);
+    if(-1 == attribindex)
+      continue;
 
     // Use one binding per attribute. 
     GLuint buffer = buffers[find_buffer_index(data, view->buffer)];
     glVertexArrayVertexBuffer(prim2.vao, attribindex, buffer, 
       view->offset + accessor->offset, accessor->stride);
 
-    // Enable the vertex attribute location.
-    glEnableVertexArrayAttrib(prim2.vao, attribindex);
-
-    // Get the attribute size and type.
-    GLenum type = GL_NONE;
-    int size = 0;
-    switch(accessor->type) {
-      case cgltf_type_scalar:  size = 1;  break;
-      case cgltf_type_vec2:    size = 2;  break;
-      case cgltf_type_vec3:    size = 3;  break;
-      case cgltf_type_vec4:    size = 4;  break;
-      default:                            break;
-    }
-
-    switch(accessor->component_type) {
-      case cgltf_component_type_r_8:   type = GL_BYTE;           break;
-      case cgltf_component_type_r_8u:  type = GL_UNSIGNED_BYTE;  break;
-      case cgltf_component_type_r_16:  type = GL_SHORT;          break;
-      case cgltf_component_type_r_16u: type = GL_UNSIGNED_SHORT; break;
-      case cgltf_component_type_r_32u: type = GL_UNSIGNED_INT;   break;
-      case cgltf_component_type_r_32f: type = GL_FLOAT;          break;
-      default:                                                   break;
-    }
-
     // Associate the buffer view with the attribute location.
     glVertexArrayAttribBinding(prim2.vao, attribindex, attribindex);
-
-    if(accessor->normalized || GL_FLOAT == type) {
-      glVertexArrayAttribFormat(prim2.vao, attribindex, size, type, 
-        accessor->normalized, 0);
-
-    } else {
-      glVertexArrayAttribIFormat(prim2.vao, attribindex, size, type, 0);
-    }
+    set_vattrib_format(prim2.vao, attribindex, accessor->type,
+      accessor->component_type, accessor->normalized, 0);
   }
 
   return prim2;
@@ -1292,6 +1205,126 @@ mesh_t model_t::load_mesh(const cgltf_mesh* mesh) {
   return mesh2;
 }
 
+void model_t::load_baked(const char* path) {
+  baked_file_t file;
+  if(!file.open(path))
+    exit(1);
+
+  double map_ms = elapsed_ms(start);
+
+  // Upload all vertices and indices as one buffer.
+  buffers.resize(1);
+  glCreateBuffers(1, &buffers[0]);
+  size_t geometry_size = file.section_size(bake_section_geometry);
+  glNamedBufferStorage(buffers[0], std::max<size_t>(1, geometry_size),
+    geometry_size ? file.section_data(bake_section_geometry) : nullptr, 0);
+
+  // Upload the mip chains.
+  int count;
+  const bake_image_t* images2 = file.section<bake_image_t>(
+    bake_section_images, count);
+  const char* pixels = file.section_data(bake_section_pixels);
+  size_t pixels_size = file.section_size(bake_section_pixels);
+  images.resize(count);
+  image_textures.resize(count);
+  for(int i = 0; i < count; ++i) {
+    const bake_image_t& image = images2[i];
+    if(image.levels < 1 || image.levels > bake_max_levels) {
+      fprintf(stderr, "%s: image %d has %d levels\n", path, i, image.levels);
+      exit(1);
+    }
+
+    GLuint texture;
+    glCreateTextures(GL_TEXTURE_2D, 1, &texture);
+    glTextureStorage2D(texture, image.levels, GL_RGBA8, image.width,
+      image.height);
+    for(int level = 0; level < image.levels; ++level) {
+      int width = std::max(1, image.width >> level);
+      int height = std::max(1, image.height >> level);
+      if(image.offsets[level] + 4 * (size_t)width * height > pixels_size) {
+        fprintf(stderr, "%s: image %d is out of bounds\n", path, i);
+        exit(1);
+      }
+      glTextureSubImage2D(texture, level, 0, 0, width, height, GL_RGBA,
+        GL_UNSIGNED_BYTE, pixels + image.offsets[level]);
+    }
+    images[i] = image_textures[i] = texture;
+  }
+
+  const bake_sampler_t* samplers2 = file.section<bake_sampler_t>(
+    bake_section_samplers, count);
+  samplers.resize(count);
+  for(int i = 0; i < count; ++i)
+    samplers[i] = load_sampler(samplers2[i]);
+
+  const bake_texture_t* textures2 = file.section<bake_texture_t>(
+    bake_section_textures, count);
+  textures.resize(count);
+  for(int i = 0; i < count; ++i)
+    textures[i] = { textures2[i].image, textures2[i].sampler };
+
+  const material_t* materials2 = file.section<material_t>(
+    bake_section_materials, count);
+  materials.assign(materials2, materials2 + count);
+
+  int num_prims;
+  const bake_prim_t* prims = file.section<bake_prim_t>(bake_section_prims,
+    num_prims);
+  const bake_mesh_t* meshes2 = file.section<bake_mesh_t>(bake_section_meshes,
+    count);
+  meshes.resize(count);
+  for(int i = 0; i < count; ++i) {
+    const bake_mesh_t& mesh = meshes2[i];
+    if(mesh.first_prim < 0 || mesh.prim_count < 0 ||
+      mesh.first_prim + mesh.prim_count > num_prims) {
+      fprintf(stderr, "%s: mesh %d is out of bounds\n", path, i);
+      exit(1);
+    }
+
+    for(int p = 0; p < mesh.prim_count; ++p)
+      meshes[i].primitives.push_back(
+        load_baked_prim(prims[mesh.first_prim + p]));
+  }
+
+  double ms = elapsed_ms(start);
+  printf("Loaded %s: %.1f MB in %.1f ms (%.1f ms to map, %.0f MB/s)\n",
+    path, file.size / 1.0e6, ms, map_ms, file.size / 1.0e3 / ms);
+}
+
+prim_t model_t::load_baked_prim(const bake_prim_t& prim) {
+  prim_t prim2 { };
+  prim2.material = prim.material;
+  prim2.offset = prim.index_offset;
+  prim2.count = prim.index_count;
+  prim2.elements_type = 2 == prim.index_size ?
+    GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+  prim2.min = vec3(prim.min[0], prim.min[1], prim.min[2]);
+  prim2.max = vec3(prim.max[0], prim.max[1], prim.max[2]);
+
+  glCreateVertexArrays(1, &prim2.vao);
+  glVertexArrayElementBuffer(prim2.vao, buffers[0]);
+
+  // The attributes are interleaved in binding 0.
+  glVertexArrayVertexBuffer(prim2.vao, 0, buffers[0], prim.vertex_offset,
+    prim.stride);
+
+  for(int a = 0; a < std::min<int>(prim.attrib_count, bake_max_attribs);
+    ++a) {
+    const bake_attrib_t& attrib = prim.attribs[a];
+    int attribindex = find_vattrib_index(
+      (cgltf_attribute_type)attrib.type, attrib.index);
+    if(-1 == attribindex)
+      continue;
+
+    glVertexArrayAttribBinding(prim2.vao, attribindex, 0);
+    set_vattrib_format(prim2.vao, attribindex, (cgltf_type)attrib.components,
+      (cgltf_component_type)attrib.component_type, attrib.normalized,
+      attrib.offset);
+  }
+
+  return prim2;
+}
+
 void model_t::bind_texture(sampler_index_t sampler_index, 
   texture_view_t view) {
 
@@ -1366,6 +1399,9 @@ struct myapp_t : app_t {
   model_t model;
   env_map_t env_map;
 
+  // Inflates and streams the environment cube maps.
+  ktx2_loader_t env_loader { 2 };
+
   GLuint program;
   GLuint skybox;
 
@@ -1373,6 +1409,8 @@ struct myapp_t : app_t {
   GLuint ubo;
 
   GLuint skybox_vao;
+
+  bool first_frame = true;
 };
 
 
@@ -1384,7 +1422,7 @@ myapp_t::myapp_t(const char* gltf_path, env_paths_t env_paths) :
   camera.yaw = radians(-100.f);
 
   // Load the environment maps.
-  env_map = load_env_map(env_paths);
+  env_map = load_env_map(env_paths, env_loader);
 
   // Compile the shaders.
   GLuint vs = glCreateShader(GL_VERTEX_SHADER);
@@ -1463,6 +1501,10 @@ myapp_t::myapp_t(const char* gltf_path, env_paths_t env_paths) :
 }
 
 void myapp_t::display() {
+  // Stream in more of the model and the environment.
+  model.update();
+  env_loader.update(16 << 20);
+
   const float bg[4] { 0 };
   glClearBufferfv(GL_COLOR, 0, bg);
   glClear(GL_DEPTH_BUFFER_BIT);
@@ -1539,13 +1581,19 @@ void myapp_t::display() {
   glUseProgram(skybox);
   glBindVertexArray(skybox_vao);
   glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
+
+  if(first_frame) {
+    printf("First frame after %.1f ms%s\n", elapsed_ms(model.start),
+      model.is_loaded() ? "" : " with assets still loading");
+    first_frame = false;
+  }
 }
 
 int main(int argc, char** argv) {
   glfwInit();
   gl3wInit();
 
-  const char* path = (2 == argc) ? 
+  const char* path = (argc >= 2) ?
     argv[1] :
     "../assets/DamagedHelmet/glTF/DamagedHelmet.gltf";
 
@@ -1557,6 +1605,22 @@ int main(int argc, char** argv) {
     "../assets/helipad/charlie/sheen.ktx2",
   };
 
+  // An environment directory written by the prefilter tool.
+  std::string env_files[5];
+  if(3 == argc) {
+    const char* names[5] {
+      "/lut_ggx.ktx2", "/ggx/specular.ktx2", "/lambertian/diffuse.ktx2",
+      "/lut_charlie.ktx2", "/charlie/sheen.ktx2"
+    };
+    for(int i = 0; i < 5; ++i)
+      env_files[i] = argv[2] + std::string(names[i]);
+
+    env_paths = {
+      env_files[0].c_str(), env_files[1].c_str(), env_files[2].c_str(),
+      env_files[3].c_str(), env_files[4].c_str()
+    };
+  }
+
   myapp_t myapp(path, env_paths);
   myapp.loop();
   return 0;